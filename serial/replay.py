@@ -0,0 +1,308 @@
+#!/usr/bin/env python3
+# replay.py
+# Python 3.8+
+# Requires: aiohttp, pyserial-asyncio
+# pip install aiohttp pyserial-asyncio
+#
+# Module(StampS3)でキャプチャした通信（config.hのCAPTURE_MODE）を実機で再生し、
+# 応答の内容と時間を記録と比べる。
+#  - Coreの代わりに、記録したrx行を記録どおりの間隔（--speedで倍速、0は応答を待って次を送る）でUARTに送る
+#  - Ollamaの代わりに、記録したreq/status/resを返すHTTPサーバーを立てる
+#    （secrets.hのHOST_IPをこのPCに、HOST_OLLAMA_PORTを--http-portにしたファームウェアで再生する）
+#  - ModuleからのUART出力を記録したtx行と比べ、内容の差分と応答時間のずれを表示する
+#
+# 例:
+#   python3 replay.py capture.log --port /dev/ttyUSB0 --speed 1
+#   python3 replay.py capture.log --port /dev/ttyUSB0 --speed 0 --max-drift-ms 200
+
+import asyncio
+import argparse
+import collections
+import difflib
+import json
+import logging
+import re
+import sys
+import time
+from aiohttp import web
+import serial_asyncio
+
+logging.basicConfig(level=logging.INFO, format="%(asctime)s %(levelname)s: %(message)s")
+
+CAPTURE_PREFIX = "[CAP] "
+# "llm_12345" のようにModuleが起動からの時間で作るwork_id。再生ごとに変わるので対応表で置き換える
+WORK_ID_PATTERN = re.compile(r"^[a-z]+_\d+$")
+
+
+def load_capture(path):
+    """キャプチャ（USBシリアルのログまたはsys.capture_dumpの出力）を読み、記録の一覧を返す"""
+    sessions = [[]]
+    last_t = -1
+    with open(path, encoding="utf-8", errors="replace") as f:
+        for raw in f:
+            index = raw.find(CAPTURE_PREFIX)
+            line = raw[index + len(CAPTURE_PREFIX):] if index >= 0 else raw
+            try:
+                record = json.loads(line)
+            except ValueError:
+                # ほかのログや、リングの先頭で切れた行は読み飛ばす
+                continue
+            if not isinstance(record, dict) or "t" not in record or "c" not in record:
+                continue
+            # 時刻が戻ったら再起動したとみなし、最後の起動の分だけを使う
+            if record["t"] < last_t:
+                sessions.append([])
+            last_t = record["t"]
+            sessions[-1].append(record)
+    if len(sessions) > 1:
+        logging.warning("capture contains %d boots, replaying the last one", len(sessions))
+    return sessions[-1]
+
+
+def split_capture(records):
+    """rx行、tx行、HTTPのやりとりに分ける"""
+    rx, tx, exchanges = [], [], []
+    for record in records:
+        channel = record["c"]
+        data = record.get("d", "")
+        if channel == "rx":
+            rx.append((record["t"], data))
+        elif channel == "tx":
+            tx.append((record["t"], data))
+        elif channel == "req":
+            method, _, path = record.get("p", "POST /").partition(" ")
+            exchanges.append({"t": record["t"], "method": method, "path": path, "body": data,
+                              "status": 200, "lines": []})
+        elif channel == "status" and exchanges:
+            exchanges[-1]["status"] = int(data) if data.lstrip("-").isdigit() else 500
+        elif channel == "res" and exchanges:
+            exchanges[-1]["lines"].append((record["t"], data))
+    return rx, tx, exchanges
+
+
+def work_id_of(line):
+    try:
+        work_id = json.loads(line).get("work_id")
+    except (ValueError, AttributeError):
+        return None
+    return work_id if isinstance(work_id, str) and WORK_ID_PATTERN.match(work_id) else None
+
+
+class Replay:
+    def __init__(self, args, rx, tx, exchanges):
+        self.args = args
+        self.speed = args.speed
+        self.rx = rx
+        self.tx = [(t, d) for t, d in tx if not rx or t >= rx[0][0]]  # 起動時の出力は比べない
+        self.exchanges = collections.deque(exchanges)
+        self.base_t = rx[0][0] if rx else 0
+        self.start = None
+        self.sent = []                  # rx行を送った時刻[s]
+        self.received = []              # (受信時刻[s], 行)
+        self.received_event = asyncio.Event()
+        self.work_ids = {}              # 記録したwork_id -> 再生中のwork_id
+        self.recorded_work_ids = {work_id_of(d) for _, d in self.tx} - {None}
+        self.request_mismatches = 0
+
+    def now(self):
+        return time.monotonic() - self.start
+
+    def scaled(self, delta_us):
+        return 0.0 if self.speed <= 0 else delta_us / 1e6 / self.speed
+
+    def map_line(self, line):
+        for recorded, actual in self.work_ids.items():
+            line = line.replace(recorded, actual)
+        return line
+
+    def unmap_line(self, line):
+        for recorded, actual in self.work_ids.items():
+            line = line.replace(actual, recorded)
+        return line
+
+    # ---- Ollamaの代わり ----
+
+    async def handle_http(self, request):
+        body = (await request.read()).decode("utf-8", errors="replace")
+        if not self.exchanges:
+            logging.error("http: unexpected request %s %s", request.method, request.path)
+            return web.Response(status=500, text="no more recorded exchanges")
+        exchange = self.exchanges.popleft()
+        recorded = "%s %s" % (exchange["method"], exchange["path"])
+        actual = "%s %s" % (request.method, request.path)
+        # VLMは画像の手前までしか記録していないので前方一致で比べる
+        if actual != recorded or not body.startswith(exchange["body"]):
+            self.request_mismatches += 1
+            logging.warning("http: request differs from capture (%s)", recorded)
+            for line in difflib.unified_diff([recorded] + exchange["body"].split(","), [actual] + body.split(","),
+                                             "captured", "replayed", lineterm="", n=1):
+                logging.warning("  %s", line)
+
+        lines = exchange["lines"]
+        if request.method == "GET" or len(lines) <= 1 and exchange["status"] != 200:
+            await asyncio.sleep(self.scaled(lines[0][0] - exchange["t"]) if lines else 0)
+            return web.Response(status=exchange["status"], text=lines[0][1] if lines else "",
+                                content_type="application/json")
+
+        response = web.StreamResponse(status=exchange["status"])
+        response.content_type = "application/x-ndjson"
+        await response.prepare(request)
+        previous_t = exchange["t"]
+        for t, line in lines:
+            # 記録した行の間隔で返す（先に送られたリクエストは、応答を読み始めるまで相手のバッファにたまる）
+            await asyncio.sleep(self.scaled(t - previous_t))
+            previous_t = t
+            await response.write((line + "\n").encode("utf-8"))
+        await response.write_eof()
+        return response
+
+    # ---- Coreの代わり ----
+
+    async def read_serial(self, reader):
+        while True:
+            try:
+                raw = await reader.readuntil(b"\n")
+            except asyncio.IncompleteReadError:
+                logging.info("serial: EOF")
+                return
+            line = raw.decode("utf-8", errors="replace").strip()
+            if not line or self.start is None:
+                continue
+            index = len(self.received)
+            self.received.append((self.now(), line))
+            # 記録と同じ位置の行から、新しく作られたwork_idを対応づける
+            if index < len(self.tx):
+                recorded_id = work_id_of(self.tx[index][1])
+                actual_id = work_id_of(line)
+                if recorded_id and actual_id and recorded_id not in self.work_ids:
+                    self.work_ids[recorded_id] = actual_id
+                    if recorded_id != actual_id:
+                        logging.info("work_id %s -> %s", recorded_id, actual_id)
+            self.received_event.set()
+
+    async def wait_received(self, count, timeout):
+        deadline = time.monotonic() + timeout
+        while len(self.received) < count:
+            remaining = deadline - time.monotonic()
+            if remaining <= 0:
+                return False
+            self.received_event.clear()
+            try:
+                await asyncio.wait_for(self.received_event.wait(), remaining)
+            except asyncio.TimeoutError:
+                return False
+        return True
+
+    async def send_rx(self, writer):
+        self.start = time.monotonic()
+        for t, line in self.rx:
+            # この行より前に記録されたtx行
+            expected = sum(1 for tx_t, _ in self.tx if tx_t < t)
+            if self.speed <= 0:
+                await self.wait_received(expected, self.args.timeout)
+            else:
+                await asyncio.sleep(max(0.0, self.scaled(t - self.base_t) - self.now()))
+            # まだ対応が分からないwork_idを使う行は、setupの応答が届くまで待つ
+            if any(work_id in line and work_id not in self.work_ids for work_id in self.recorded_work_ids):
+                await self.wait_received(expected, self.args.timeout)
+            self.sent.append(self.now())
+            writer.write((self.map_line(line) + "\n").encode("utf-8"))
+            await writer.drain()
+        await self.wait_received(len(self.tx), self.args.timeout)
+        # 記録より多く出力していないか、少しだけ待って確かめる
+        await asyncio.sleep(1.0)
+
+    # ---- 結果 ----
+
+    def report(self):
+        ok = True
+        recorded = [d for _, d in self.tx]
+        replayed = [self.unmap_line(d) for _, d in self.received]
+        diff = list(difflib.unified_diff(recorded, replayed, "captured", "replayed", lineterm=""))
+        if diff:
+            ok = False
+            print("=== UART output differs from capture ===")
+            for line in diff:
+                print(line)
+        else:
+            print("UART output matches capture (%d lines)" % len(recorded))
+
+        if self.request_mismatches:
+            ok = False
+            print("HTTP requests differing from capture: %d" % self.request_mismatches)
+        if self.exchanges:
+            ok = False
+            print("HTTP exchanges never requested: %d" % len(self.exchanges))
+
+        # rx行ごとに、最初の応答までの時間を比べる
+        print("=== response latency (ms): captured%s / replayed ===" %
+              ("" if self.speed in (0, 1) else " / %g" % self.speed))
+        drifts = []
+        received_times = [t for t, _ in self.received]
+        for (t, line), sent in zip(self.rx, self.sent):
+            recorded_next = next((tx_t for tx_t, _ in self.tx if tx_t >= t), None)
+            index = sum(1 for tx_t, _ in self.tx if tx_t < t)
+            if recorded_next is None or index >= len(received_times):
+                continue
+            captured_ms = (recorded_next - t) / 1000.0 / (self.speed if self.speed > 0 else 1)
+            replayed_ms = (received_times[index] - sent) * 1000.0
+            drifts.append(replayed_ms - captured_ms)
+            print("%8.1f %8.1f  %s" % (captured_ms, replayed_ms, line[:80]))
+        if drifts:
+            worst = max(drifts, key=abs)
+            print("latency drift: mean %+.1f ms, worst %+.1f ms" % (sum(drifts) / len(drifts), worst))
+            if self.args.max_drift_ms is not None and abs(worst) > self.args.max_drift_ms:
+                ok = False
+                print("latency drift exceeds %.1f ms" % self.args.max_drift_ms)
+        return ok
+
+
+async def run(args):
+    rx, tx, exchanges = split_capture(load_capture(args.capture))
+    logging.info("capture: %d rx, %d tx, %d http exchanges", len(rx), len(tx), len(exchanges))
+    replay = Replay(args, rx, tx, exchanges)
+
+    app = web.Application()
+    app.add_routes([web.route("*", "/{tail:.*}", replay.handle_http)])
+    runner = web.AppRunner(app)
+    await runner.setup()
+    await web.TCPSite(runner, args.http_host, args.http_port).start()
+    logging.info("mock backend on %s:%d", args.http_host, args.http_port)
+
+    reader, writer = await serial_asyncio.open_serial_connection(url=args.port, baudrate=args.baud)
+    logging.info("serial opened %s @ %d", args.port, args.baud)
+    read_task = asyncio.create_task(replay.read_serial(reader))
+    try:
+        await replay.send_rx(writer)
+    finally:
+        read_task.cancel()
+        writer.close()
+        await runner.cleanup()
+    return replay.report()
+
+
+def parse_args():
+    p = argparse.ArgumentParser(description="Replay a Module capture against the firmware and diff the results")
+    p.add_argument("capture", help="Capture file (USB serial log with [CAP] lines, or sys.capture_dump output)")
+    p.add_argument("--port", "-p", required=True, help="Serial device connected to the Module UART (e.g. /dev/ttyUSB0)")
+    p.add_argument("--baud", "-b", type=int, default=115200, help="Serial baudrate")
+    p.add_argument("--speed", type=float, default=1.0,
+                   help="Replay speed (1: recorded timing, 2: twice as fast, 0: send next frame as soon as answered)")
+    p.add_argument("--http-host", default="0.0.0.0", help="Host for the mock Ollama server")
+    p.add_argument("--http-port", type=int, default=11434, help="Port for the mock Ollama server")
+    p.add_argument("--timeout", type=float, default=30.0, help="Seconds to wait for an expected output line")
+    p.add_argument("--max-drift-ms", type=float, default=None, help="Fail if a response latency drifts more than this")
+    return p.parse_args()
+
+
+def main():
+    args = parse_args()
+    try:
+        ok = asyncio.run(run(args))
+    except KeyboardInterrupt:
+        ok = False
+    sys.exit(0 if ok else 1)
+
+
+if __name__ == "__main__":
+    main()
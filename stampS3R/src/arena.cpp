@@ -0,0 +1,161 @@
+#include "arena.h"
+
+namespace {
+
+// 8バイト境界で切り出す
+constexpr size_t ARENA_ALIGNMENT = 8;
+// 同時に持てるブロックの数。超えた分はヒープから確保する
+constexpr uint8_t ARENA_MAX_BLOCKS = 16;
+
+struct ArenaBlock
+{
+    size_t offset; // 領域の先頭
+    bool freed;    // 上に残っているブロックがあるうちに解放された
+};
+
+struct RequestArena
+{
+    size_t used;
+    ArenaBlock blocks[ARENA_MAX_BLOCKS]; // 確保した順に積む
+    uint8_t depth;
+    size_t high_water;
+    uint32_t fallbacks; // アリーナに入りきらずヒープから確保した回数
+};
+
+alignas(ARENA_ALIGNMENT) uint8_t arena_buffer[REQUEST_ARENA_SIZE];
+RequestArena arena = {};
+
+size_t alignSize(const size_t size)
+{
+    return (size + ARENA_ALIGNMENT - 1) & ~(ARENA_ALIGNMENT - 1);
+}
+
+bool inArena(const void *ptr)
+{
+    const uint8_t *p = static_cast<const uint8_t *>(ptr);
+    return p >= arena_buffer && p < arena_buffer + REQUEST_ARENA_SIZE;
+}
+
+// ptrのブロックの位置。見つからなければ-1
+int findBlock(const void *ptr)
+{
+    for (int i = arena.depth - 1; i >= 0; i--)
+    {
+        if (arena_buffer + arena.blocks[i].offset == ptr)
+        {
+            return i;
+        }
+    }
+    return -1;
+}
+
+void updateHighWater()
+{
+    if (arena.used > arena.high_water)
+    {
+        arena.high_water = arena.used;
+    }
+}
+
+// 一番上から解放済みのブロックを外し、usedを残ったブロックの終わりまで戻す
+void popFreedBlocks()
+{
+    while (arena.depth > 0 && arena.blocks[arena.depth - 1].freed)
+    {
+        arena.depth--;
+        arena.used = arena.blocks[arena.depth].offset;
+    }
+}
+
+} // namespace
+
+void *requestArenaAllocate(const size_t size)
+{
+    const size_t aligned = alignSize(size);
+    if (arena.depth == ARENA_MAX_BLOCKS || aligned > REQUEST_ARENA_SIZE - arena.used)
+    {
+        arena.fallbacks++;
+        return malloc(size);
+    }
+    ArenaBlock &block = arena.blocks[arena.depth++];
+    block.offset = arena.used;
+    block.freed = false;
+    arena.used += aligned;
+    updateHighWater();
+    return arena_buffer + block.offset;
+}
+
+void requestArenaFree(void *ptr)
+{
+    if (ptr == nullptr)
+    {
+        return;
+    }
+    if (!inArena(ptr))
+    {
+        free(ptr);
+        return;
+    }
+    // 一番上のブロックならその場で戻す。下のブロックは印をつけ、上が解放されたときにまとめて戻す
+    // ストリームの1行ごとのドキュメントのように、確保と解放が入れ子になっていれば同じ領域を使い回せる
+    const int index = findBlock(ptr);
+    if (index < 0)
+    {
+        return;
+    }
+    arena.blocks[index].freed = true;
+    popFreedBlocks();
+}
+
+void requestArenaReset()
+{
+    arena.used = 0;
+    arena.depth = 0;
+}
+
+void *ArenaAllocator::reallocate(void *ptr, size_t new_size)
+{
+    if (ptr == nullptr)
+    {
+        return requestArenaAllocate(new_size);
+    }
+    if (!inArena(ptr))
+    {
+        return realloc(ptr, new_size);
+    }
+    const int index = findBlock(ptr);
+    if (index < 0)
+    {
+        return nullptr;
+    }
+    const size_t offset = arena.blocks[index].offset;
+    const size_t aligned = alignSize(new_size);
+    // 一番上のブロックならその場で伸び縮みさせる
+    if (index == arena.depth - 1 && aligned <= REQUEST_ARENA_SIZE - offset)
+    {
+        arena.used = offset + aligned;
+        updateHighWater();
+        return ptr;
+    }
+    // 元の大きさは次のブロックの先頭（一番上ならused）までの長さ
+    const size_t old_size = (index + 1 < arena.depth ? arena.blocks[index + 1].offset : arena.used) - offset;
+    void *moved = requestArenaAllocate(new_size);
+    if (moved != nullptr)
+    {
+        memcpy(moved, ptr, new_size < old_size ? new_size : old_size);
+        requestArenaFree(ptr);
+    }
+    return moved;
+}
+
+void requestArenaReport()
+{
+    if (!ENABLE_PERF_LOG)
+    {
+        return;
+    }
+    Serial.printf("[PERF] {\"name\":\"request_arena\",\"size\":%lu,\"high_water\":%lu,\"fallbacks\":%lu}\n",
+                  static_cast<unsigned long>(REQUEST_ARENA_SIZE),
+                  static_cast<unsigned long>(arena.high_water),
+                  static_cast<unsigned long>(arena.fallbacks));
+}
@@ -0,0 +1,153 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include "config.h"
+#include <Arduino.h>
+#include <ArduinoJson.h>
+
+// リクエスト単位のアリーナ
+// 1回の推論の間に作っては捨てるJSONドキュメントを固定の領域から切り出し、推論の終わりにまとめて解放する
+// ヒープを細切れにしないので、長時間動かしても大きな領域を確保できなくなることがない
+// loop()のタスクからのみ使う（TTSのタスクからは使わない）
+
+// sizeバイトを確保する。アリーナが足りないか、確保中のブロックが多すぎればヒープから確保する
+void *requestArenaAllocate(const size_t size);
+// 最後に確保した領域ならその場で戻す。それより下の領域は、上の領域がすべて解放されたときにまとめて戻る
+// （ヒープから確保した分はfree）
+void requestArenaFree(void *ptr);
+// 全体を解放する。O(1)
+void requestArenaReset();
+// 使用量の最大値などをシリアルに出力する
+void requestArenaReport();
+
+// ArduinoJsonのアロケータ
+struct ArenaAllocator
+{
+    void *allocate(size_t size)
+    {
+        return requestArenaAllocate(size);
+    }
+    void deallocate(void *ptr)
+    {
+        requestArenaFree(ptr);
+    }
+    void *reallocate(void *ptr, size_t new_size);
+};
+
+// ArduinoJson v6は1つのドキュメントを1つのブロックに確保するので、確保と解放が積み重なる順になる
+// v7は文字列などごとに確保するのでこの前提が崩れる（platformio.iniでv6に固定している）
+#if ARDUINOJSON_VERSION_MAJOR != 6
+#error "ArenaJsonDocument needs ArduinoJson v6 (bblanchon/ArduinoJson@^6.21)"
+#endif
+
+// DynamicJsonDocumentの代わりに使う。ドキュメントの寿命は推論の中に収めること
+typedef BasicJsonDocument<ArenaAllocator> ArenaJsonDocument;
+
+// 容量固定の文字列。ヒープを使わずにJSONの行などを組み立てる
+// 容量を超えた分は捨て、overflowed()で分かるようにする
+template <size_t Capacity>
+class FixedString
+{
+public:
+    FixedString() : length_(0), overflowed_(false)
+    {
+        buffer_[0] = '\0';
+    }
+
+    void clear()
+    {
+        length_ = 0;
+        overflowed_ = false;
+        buffer_[0] = '\0';
+    }
+
+    FixedString &append(const char *text, size_t length)
+    {
+        if (length > Capacity - 1 - length_)
+        {
+            length = Capacity - 1 - length_;
+            overflowed_ = true;
+        }
+        memcpy(buffer_ + length_, text, length);
+        length_ += length;
+        buffer_[length_] = '\0';
+        return *this;
+    }
+
+    FixedString &append(const char *text)
+    {
+        return append(text, strlen(text));
+    }
+
+    FixedString &append(const String &text)
+    {
+        return append(text.c_str(), text.length());
+    }
+
+    FixedString &appendUnsigned(const uint32_t value)
+    {
+        char digits[11];
+        const int length = snprintf(digits, sizeof(digits), "%lu", static_cast<unsigned long>(value));
+        return append(digits, length);
+    }
+
+    // JSONの文字列の中身としてエスケープして追加する
+    FixedString &appendJsonEscaped(const String &text)
+    {
+        for (size_t i = 0; i < text.length(); i++)
+        {
+            const char c = text[i];
+            switch (c)
+            {
+            case '\\':
+                append("\\\\", 2);
+                break;
+            case '"':
+                append("\\\"", 2);
+                break;
+            case '\n':
+                append("\\n", 2);
+                break;
+            case '\r':
+                append("\\r", 2);
+                break;
+            case '\t':
+                append("\\t", 2);
+                break;
+            default:
+                if (static_cast<uint8_t>(c) < 0x20)
+                {
+                    char escaped[7];
+                    snprintf(escaped, sizeof(escaped), "\\u%04x", static_cast<unsigned>(c));
+                    append(escaped, 6);
+                }
+                else
+                {
+                    append(&c, 1);
+                }
+                break;
+            }
+        }
+        return *this;
+    }
+
+    const char *c_str() const
+    {
+        return buffer_;
+    }
+    size_t length() const
+    {
+        return length_;
+    }
+    bool overflowed() const
+    {
+        return overflowed_;
+    }
+
+private:
+    char buffer_[Capacity];
+    size_t length_;
+    bool overflowed_;
+};
+
+#endif // ARENA_H
@@ -0,0 +1,527 @@
+#include "asr.h"
+#include "codec.h"
+#include "power.h"
+
+#if USE_WIFI_FOR_LLM_COMMUNICATION
+
+#include "secrets.h"
+#include "http_stream.h"
+
+// whisper.cpp の examples/server（/inference）のポート。secrets.hで上書きできる
+#ifndef HOST_WHISPER_PORT
+#define HOST_WHISPER_PORT 8080
+#endif
+
+namespace {
+
+// whisper.cppのサーバーは16kHzモノラルのWAVを受け付ける
+constexpr uint32_t ASR_SAMPLE_RATE = 16000;
+// この長さごとに区切って認識し、途中結果を返す（最後の区切りは無音で埋める）
+constexpr uint32_t ASR_SEGMENT_SAMPLES = ASR_SAMPLE_RATE * 3;
+constexpr size_t ASR_BLOCK_SAMPLES = 512;
+constexpr size_t ASR_RESPONSE_SIZE = 1024;
+constexpr unsigned long ASR_CONNECT_TIMEOUT_MS = 2000;
+constexpr unsigned long ASR_RESPONSE_TIMEOUT_MS = 15000;
+// 音声フレームがこの時間届かなければ話し終わったとみなす
+constexpr unsigned long ASR_AUDIO_IDLE_TIMEOUT_MS = 3000;
+const char ASR_BOUNDARY[] = "AnythingLLMModuleAsrBoundary";
+
+enum AsrSegmentState
+{
+    ASR_SEGMENT_IDLE = 0,
+    ASR_SEGMENT_UPLOADING = 1, // 音声を送信中
+    ASR_SEGMENT_WAITING = 2,   // 送信済みで認識結果待ち
+    ASR_SEGMENT_FAILED = 3     // 送信に失敗した。順番が来たらエラーを返して空ける
+};
+
+struct AsrSegment
+{
+    AsrSegmentState state;
+    WiFiClient client;
+    HttpStream http;
+    uint32_t samples_written;
+    uint16_t index;
+};
+
+struct AsrSession
+{
+    bool active;
+    String work_id;
+    AsrConfig config;
+    AdpcmState adpcm;
+    int16_t last_sample; // 8kHz→16kHzの補間用
+    // 区切りNの認識中に区切りN+1を送れるよう、2本の接続を交互に使う
+    AsrSegment segments[2];
+    int8_t uploading; // 送信中のsegmentsの添字（-1: なし）
+    uint16_t next_segment_index;
+    uint16_t next_result_index;
+    bool finish_sent;
+    unsigned long last_audio_time;
+};
+
+AsrSession asr_session;
+uint8_t asr_decode_buffer[JSON_BUFFER_SIZE];
+int16_t asr_samples[ASR_BLOCK_SAMPLES];
+int16_t asr_upsampled[ASR_BLOCK_SAMPLES * 2];
+char asr_response[ASR_RESPONSE_SIZE];
+uint16_t host_whisper_port = String(HOST_WHISPER_PORT).toInt();
+
+void sendTranscript(const String &text, const bool finish)
+{
+    ResponseMsg_t response_msg;
+    response_msg.request_id = "asr_inference";
+    response_msg.work_id = asr_session.work_id;
+    response_msg.object = "asr.utf-8.stream";
+    response_msg.error.code = 0;
+    response_msg.error.message = "";
+    response_msg.inference_data.delta = text;
+    response_msg.inference_data.index = asr_session.next_result_index;
+    response_msg.inference_data.finish = finish;
+    sendToM5(response_msg);
+    if (finish)
+    {
+        asr_session.finish_sent = true;
+    }
+}
+
+// 区切りの認識の失敗。どの区切りの結果が欠けたかをメッセージに入れる
+void sendAsrError(const uint16_t index)
+{
+    char message[48];
+    snprintf(message, sizeof(message), "ASR inference failed (segment %u)", static_cast<unsigned>(index));
+    ResponseMsg_t response_msg;
+    response_msg.request_id = "asr_inference";
+    response_msg.work_id = asr_session.work_id;
+    response_msg.object = "None";
+    response_msg.error.code = 1;
+    response_msg.error.message = message;
+    sendToM5(response_msg);
+}
+
+void writeLe32(uint8_t *out, const uint32_t value)
+{
+    out[0] = value & 0xFF;
+    out[1] = (value >> 8) & 0xFF;
+    out[2] = (value >> 16) & 0xFF;
+    out[3] = (value >> 24) & 0xFF;
+}
+
+void writeLe16(uint8_t *out, const uint16_t value)
+{
+    out[0] = value & 0xFF;
+    out[1] = (value >> 8) & 0xFF;
+}
+
+// 区切りの長さは固定なので、データ長を含めたWAVヘッダを先に送れる
+void buildWavHeader(uint8_t *header)
+{
+    const uint32_t data_bytes = ASR_SEGMENT_SAMPLES * 2;
+    memcpy(header, "RIFF", 4);
+    writeLe32(header + 4, 36 + data_bytes);
+    memcpy(header + 8, "WAVEfmt ", 8);
+    writeLe32(header + 16, 16);
+    writeLe16(header + 20, 1); // PCM
+    writeLe16(header + 22, 1); // モノラル
+    writeLe32(header + 24, ASR_SAMPLE_RATE);
+    writeLe32(header + 28, ASR_SAMPLE_RATE * 2);
+    writeLe16(header + 32, 2);
+    writeLe16(header + 34, 16);
+    memcpy(header + 36, "data", 4);
+    writeLe32(header + 40, data_bytes);
+}
+
+bool writeChunk(AsrSegment &segment, const void *data, const size_t length)
+{
+    return httpStreamWriteChunk(segment.http, static_cast<const uint8_t *>(data), length);
+}
+
+void closeSegment(AsrSegment &segment)
+{
+    if (segment.state == ASR_SEGMENT_UPLOADING || segment.state == ASR_SEGMENT_WAITING)
+    {
+        httpStreamClose(segment.http);
+    }
+    segment.state = ASR_SEGMENT_IDLE;
+}
+
+// indexを割り当てた後の失敗。前の区切りの結果より先にエラーを返さないよう、順番が来るまでスロットを残す
+void failSegment(AsrSegment &segment)
+{
+    closeSegment(segment);
+    segment.state = ASR_SEGMENT_FAILED;
+}
+
+// 送信に失敗した区切りの番が来たので、エラーを返して次の区切りに進む
+void collectFailure(AsrSegment &segment)
+{
+    Serial.printf("[ASR] Segment %u failed to upload\n", segment.index);
+    segment.state = ASR_SEGMENT_IDLE;
+    sendAsrError(segment.index);
+    asr_session.next_result_index++;
+}
+
+// 認識結果を受け取ってCoreへ返す
+bool collectResult(AsrSegment &segment, const bool finish)
+{
+    const int status = httpStreamReadResponseHeader(segment.http, ASR_RESPONSE_TIMEOUT_MS);
+    size_t length = 0;
+    const unsigned long start = millis();
+    while (status == 200 && length < ASR_RESPONSE_SIZE - 1 && millis() - start < ASR_RESPONSE_TIMEOUT_MS)
+    {
+        const int n = httpStreamRead(segment.http, reinterpret_cast<uint8_t *>(asr_response) + length,
+                                     ASR_RESPONSE_SIZE - 1 - length, ASR_RESPONSE_TIMEOUT_MS);
+        if (n < 0)
+        {
+            break;
+        }
+        length += n;
+    }
+    closeSegment(segment);
+
+    StaticJsonDocument<256> filter;
+    filter["text"] = true;
+    StaticJsonDocument<ASR_RESPONSE_SIZE> doc;
+    if (status != 200 || deserializeJson(doc, asr_response, length, DeserializationOption::Filter(filter)))
+    {
+        Serial.printf("[ASR] Segment %u failed (HTTP %d)\n", segment.index, status);
+        sendAsrError(segment.index);
+        asr_session.next_result_index++;
+        return false;
+    }
+    String text = doc["text"] | "";
+    text.trim();
+    Serial.printf("[ASR] Segment %u: ", segment.index);
+    Serial.println(text);
+    sendTranscript(text, finish);
+    asr_session.next_result_index++;
+    return true;
+}
+
+// 次に返すべき区切りの結果を集める。blockingでなければ届いているときだけ
+void pollResults(const bool blocking, const bool finish_last)
+{
+    for (uint8_t n = 0; n < 2; n++)
+    {
+        AsrSegment *next = nullptr;
+        bool more_pending = false;
+        for (uint8_t i = 0; i < 2; i++)
+        {
+            AsrSegment &segment = asr_session.segments[i];
+            if (segment.state != ASR_SEGMENT_WAITING && segment.state != ASR_SEGMENT_FAILED)
+            {
+                continue;
+            }
+            if (segment.index == asr_session.next_result_index)
+            {
+                next = &segment;
+            }
+            else
+            {
+                more_pending = true;
+            }
+        }
+        if (next == nullptr)
+        {
+            return;
+        }
+        if (next->state == ASR_SEGMENT_FAILED)
+        {
+            collectFailure(*next);
+            continue;
+        }
+        if (!blocking && next->client.available() <= 0)
+        {
+            return;
+        }
+        collectResult(*next, finish_last && !more_pending && asr_session.uploading < 0);
+    }
+}
+
+int8_t idleSlot()
+{
+    for (int8_t i = 0; i < 2; i++)
+    {
+        if (asr_session.segments[i].state == ASR_SEGMENT_IDLE)
+        {
+            return i;
+        }
+    }
+    return -1;
+}
+
+bool startSegment()
+{
+    // 空いている接続がなければ、前の区切りの結果を待つ。結果待ちの接続は決して使い回さない
+    int8_t slot = idleSlot();
+    if (slot < 0)
+    {
+        pollResults(true, false);
+        slot = idleSlot();
+    }
+    if (slot < 0)
+    {
+        Serial.println("[ASR] No free connection for the next segment");
+        return false;
+    }
+
+    AsrSegment &segment = asr_session.segments[slot];
+    String head;
+    head.reserve(384);
+    head += "--";
+    head += ASR_BOUNDARY;
+    head += "\r\nContent-Disposition: form-data; name=\"response_format\"\r\n\r\njson\r\n";
+    if (asr_session.config.language.length() > 0)
+    {
+        head += "--";
+        head += ASR_BOUNDARY;
+        head += "\r\nContent-Disposition: form-data; name=\"language\"\r\n\r\n";
+        head += asr_session.config.language;
+        head += "\r\n";
+    }
+    head += "--";
+    head += ASR_BOUNDARY;
+    head += "\r\nContent-Disposition: form-data; name=\"file\"; filename=\"segment.wav\"\r\nContent-Type: audio/wav\r\n\r\n";
+    uint8_t wav_header[44];
+    buildWavHeader(wav_header);
+    const String content_type = String("multipart/form-data; boundary=") + ASR_BOUNDARY;
+
+    if (!httpStreamConnect(segment.http, segment.client, HOST_IP, host_whisper_port, ASR_CONNECT_TIMEOUT_MS) ||
+        !httpStreamBeginChunkedRequest(segment.http, "POST", "/inference", content_type.c_str()) ||
+        !writeChunk(segment, head.c_str(), head.length()) ||
+        !writeChunk(segment, wav_header, sizeof(wav_header)))
+    {
+        Serial.println("[ASR] Failed to start segment upload");
+        httpStreamClose(segment.http);
+        return false;
+    }
+    segment.state = ASR_SEGMENT_UPLOADING;
+    segment.samples_written = 0;
+    segment.index = asr_session.next_segment_index++;
+    asr_session.uploading = slot;
+    return true;
+}
+
+bool endSegment()
+{
+    AsrSegment &segment = asr_session.segments[asr_session.uploading];
+    asr_session.uploading = -1;
+    String tail = String("\r\n--") + ASR_BOUNDARY + "--\r\n";
+    if (!writeChunk(segment, tail.c_str(), tail.length()) || !httpStreamEndChunkedRequest(segment.http))
+    {
+        failSegment(segment);
+        return false;
+    }
+    segment.state = ASR_SEGMENT_WAITING;
+    return true;
+}
+
+// 16kHzのサンプルを区切りに書き込む。区切りが埋まったら送信を終えて次の区切りへ
+bool writeSamples(const int16_t *samples, size_t count)
+{
+    while (count > 0)
+    {
+        if (asr_session.uploading < 0 && !startSegment())
+        {
+            return false;
+        }
+        AsrSegment &segment = asr_session.segments[asr_session.uploading];
+        size_t n = ASR_SEGMENT_SAMPLES - segment.samples_written;
+        if (n > count)
+        {
+            n = count;
+        }
+        if (!writeChunk(segment, samples, n * sizeof(int16_t)))
+        {
+            asr_session.uploading = -1;
+            failSegment(segment);
+            return false;
+        }
+        segment.samples_written += n;
+        samples += n;
+        count -= n;
+        if (segment.samples_written == ASR_SEGMENT_SAMPLES && !endSegment())
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Coreのサンプルレートから16kHzにして書き込む（8kHzは線形補間で2倍にする）
+bool feedSamples(const int16_t *samples, const size_t count)
+{
+    if (asr_session.config.sample_rate != 8000)
+    {
+        return writeSamples(samples, count);
+    }
+    for (size_t i = 0; i < count; i++)
+    {
+        asr_upsampled[i * 2] = static_cast<int16_t>((static_cast<int32_t>(asr_session.last_sample) + samples[i]) / 2);
+        asr_upsampled[i * 2 + 1] = samples[i];
+        asr_session.last_sample = samples[i];
+    }
+    return writeSamples(asr_upsampled, count * 2);
+}
+
+// 話し終わり: 送信中の区切りを無音で埋めて閉じ、残りの結果をすべて返す
+void finishSession()
+{
+    bool ok = true;
+    if (asr_session.uploading >= 0)
+    {
+        // 無音で埋める
+        memset(asr_samples, 0, sizeof(asr_samples));
+        while (ok && asr_session.uploading >= 0)
+        {
+            const uint32_t remaining = ASR_SEGMENT_SAMPLES - asr_session.segments[asr_session.uploading].samples_written;
+            ok = writeSamples(asr_samples, remaining < ASR_BLOCK_SAMPLES ? remaining : ASR_BLOCK_SAMPLES);
+        }
+    }
+    asr_session.finish_sent = false;
+    pollResults(true, true);
+    // 最後の結果にfinishをつけられなかった場合（結果がない・失敗した）は空のfinishを送る
+    if (!asr_session.finish_sent)
+    {
+        sendTranscript("", true);
+    }
+    asr_session.next_segment_index = asr_session.next_result_index;
+    adpcmReset(asr_session.adpcm);
+    asr_session.last_sample = 0;
+    powerOnActivity();
+}
+
+void resetSession()
+{
+    for (uint8_t i = 0; i < 2; i++)
+    {
+        closeSegment(asr_session.segments[i]);
+    }
+    asr_session.active = false;
+    asr_session.work_id = "";
+    asr_session.uploading = -1;
+    asr_session.next_segment_index = 0;
+    asr_session.next_result_index = 0;
+    asr_session.last_sample = 0;
+    adpcmReset(asr_session.adpcm);
+}
+
+} // namespace
+
+void parseAsrConfig(JsonVariantConst data, AsrConfig &config)
+{
+    config.sample_rate = data["sample_rate"] | ASR_SAMPLE_RATE;
+    config.adpcm = strcmp(data["encoding"] | "adpcm", "pcm") != 0;
+    config.language = data["language"] | "";
+}
+
+AsrStatus asr_setup(const String &work_id, const AsrConfig &config)
+{
+    resetSession();
+    if (config.sample_rate != 16000 && config.sample_rate != 8000)
+    {
+        Serial.printf("[ASR] Unsupported sample rate: %lu\n", static_cast<unsigned long>(config.sample_rate));
+        return ASR_NOT_OK;
+    }
+    asr_session.active = true;
+    asr_session.work_id = work_id;
+    asr_session.config = config;
+    asr_session.last_audio_time = millis();
+    return ASR_OK;
+}
+
+AsrStatus asr_append_audio(const String &work_id, const char *base64, const size_t length, const bool finish)
+{
+    if (!asr_session.active || asr_session.work_id != work_id || length > JSON_BUFFER_SIZE)
+    {
+        return ASR_NOT_OK;
+    }
+    asr_session.last_audio_time = millis();
+
+    const int decoded = base64Decode(base64, length, asr_decode_buffer);
+    if (decoded < 0)
+    {
+        Serial.println("[ASR] Invalid base64 audio");
+        return ASR_NOT_OK;
+    }
+    bool ok = true;
+    if (asr_session.config.adpcm)
+    {
+        // 1バイト = 2サンプル
+        for (int offset = 0; ok && offset < decoded; offset += ASR_BLOCK_SAMPLES / 2)
+        {
+            int bytes = decoded - offset;
+            if (bytes > static_cast<int>(ASR_BLOCK_SAMPLES / 2))
+            {
+                bytes = ASR_BLOCK_SAMPLES / 2;
+            }
+            adpcmDecode(asr_session.adpcm, asr_decode_buffer + offset, bytes, asr_samples);
+            ok = feedSamples(asr_samples, bytes * 2);
+        }
+    }
+    else
+    {
+        for (int offset = 0; ok && offset + 1 < decoded; offset += ASR_BLOCK_SAMPLES * 2)
+        {
+            int bytes = decoded - offset;
+            if (bytes > static_cast<int>(ASR_BLOCK_SAMPLES * 2))
+            {
+                bytes = ASR_BLOCK_SAMPLES * 2;
+            }
+            memcpy(asr_samples, asr_decode_buffer + offset, bytes & ~1);
+            ok = feedSamples(asr_samples, bytes / 2);
+        }
+    }
+    if (!ok)
+    {
+        // 最後のフレームなら、失敗した区切りのエラーと残りの結果、finishを返して締める
+        if (finish)
+        {
+            finishSession();
+        }
+        return ASR_NOT_OK;
+    }
+    if (finish)
+    {
+        finishSession();
+    }
+    else
+    {
+        pollResults(false, false);
+    }
+    return ASR_OK;
+}
+
+void asr_exit(const String &work_id)
+{
+    if (asr_session.work_id == work_id)
+    {
+        resetSession();
+    }
+}
+
+void asr_poll()
+{
+    if (!asr_session.active)
+    {
+        return;
+    }
+    pollResults(false, false);
+    // 送信中か認識の結果を待っている間は省電力に入らない（音声のフレームが止まってもWhisperの応答を待つ）
+    bool pending = asr_session.uploading >= 0;
+    for (uint8_t i = 0; i < 2; i++)
+    {
+        pending = pending || asr_session.segments[i].state == ASR_SEGMENT_WAITING;
+    }
+    if (pending)
+    {
+        powerOnActivity();
+    }
+    // finishが来ないまま音声が途切れたら、そこで話し終わったとみなす
+    if (asr_session.uploading >= 0 && millis() - asr_session.last_audio_time > ASR_AUDIO_IDLE_TIMEOUT_MS)
+    {
+        Serial.println("[ASR] Audio idle, finishing");
+        finishSession();
+    }
+}
+
+#endif // USE_WIFI_FOR_LLM_COMMUNICATION
@@ -0,0 +1,34 @@
+#ifndef ASR_H
+#define ASR_H
+
+#include "common.h"
+
+enum AsrStatus
+{
+    ASR_OK = 0,
+    ASR_NOT_OK = 1
+};
+
+// asr.setupのdata
+struct AsrConfig
+{
+    uint32_t sample_rate; // Coreから届く音声のサンプルレート（16000 または 8000）
+    bool adpcm;           // true: IMA ADPCM、false: 16bit PCM（リトルエンディアン）
+    String language;      // 空ならサーバーの既定値
+};
+
+void parseAsrConfig(JsonVariantConst data, AsrConfig &config);
+
+// 音声認識のセッションを始める（前のセッションは破棄する）
+AsrStatus asr_setup(const String &work_id, const AsrConfig &config);
+
+// base64の音声フレームを受け取り、区切りごとにwhisper.cpp互換サーバーへ送る
+// 認識結果は区切りごとに asr.utf-8.stream でCoreへ返し、finishで最後の結果を返す
+AsrStatus asr_append_audio(const String &work_id, const char *base64, const size_t length, const bool finish);
+
+void asr_exit(const String &work_id);
+
+// loop()から呼ぶ。届いた認識結果を返し、音声が途切れたセッションを締める
+void asr_poll();
+
+#endif // ASR_H
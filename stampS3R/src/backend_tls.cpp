@@ -0,0 +1,415 @@
+#include "backend_tls.h"
+
+#if USE_WIFI_FOR_LLM_COMMUNICATION && HOST_OLLAMA_TLS
+
+#include "WiFi.h"
+#include "perf.h"
+#include "metrics.h"
+#include <lwip/sockets.h>
+#include <errno.h>
+#include "mbedtls/ssl.h"
+#include "mbedtls/net_sockets.h"
+#include "mbedtls/ctr_drbg.h"
+#include "mbedtls/entropy.h"
+#include "mbedtls/x509_crt.h"
+#include "mbedtls/error.h"
+
+// mbedtls 3.x では構造体のメンバーが MBEDTLS_PRIVATE() で隠されている
+#ifdef MBEDTLS_PRIVATE
+#define TLS_SESSION_FIELD(session, field) (session).MBEDTLS_PRIVATE(field)
+#else
+#define TLS_SESSION_FIELD(session, field) (session).field
+#endif
+
+namespace {
+
+// ストリーミング中の推論、先に送っておく次のプロンプト、要約・埋め込みの3本まで
+constexpr size_t TLS_POOL_SIZE = 3;
+// これより長く使っていない接続は、プロキシに切られている可能性が高いので捨てる
+constexpr unsigned long TLS_IDLE_MAX_MS = 30000;
+// mbedtls_ssl_read/handshake が1回で受信を待つ時間
+constexpr uint32_t TLS_READ_TIMEOUT_MS = 100;
+constexpr uint32_t TLS_WRITE_TIMEOUT_MS = 5000;
+
+// S3のAESアクセラレータで処理できるAES-GCMを優先する（サーバーが対応していなければ接続できない）
+const int TLS_CIPHERSUITES[] = {
+    MBEDTLS_TLS_ECDHE_ECDSA_WITH_AES_128_GCM_SHA256,
+    MBEDTLS_TLS_ECDHE_RSA_WITH_AES_128_GCM_SHA256,
+    MBEDTLS_TLS_ECDHE_ECDSA_WITH_AES_256_GCM_SHA384,
+    MBEDTLS_TLS_ECDHE_RSA_WITH_AES_256_GCM_SHA384,
+    0
+};
+
+struct TlsShared {
+    bool initialized;
+    bool ok;
+    mbedtls_ssl_config conf;
+    mbedtls_x509_crt ca;
+    mbedtls_entropy_context entropy;
+    mbedtls_ctr_drbg_context drbg;
+    // 最後にハンドシェイクしたセッション。次の接続はこれで再開する
+    mbedtls_ssl_session session;
+    bool has_session;
+};
+
+TlsShared shared;
+
+} // namespace
+
+struct BackendTls {
+    bool in_use;
+    bool connected; // TCPとTLSのセッションが張られている
+    WiFiClient client;
+    int fd;
+    mbedtls_ssl_context ssl;
+    unsigned long idle_since;
+    uint32_t handshake_us; // この接続のハンドシェイクの時間。プールから使い回したら0
+    bool resumed;          // ハンドシェイクで前回のセッションを再開できた
+};
+
+namespace {
+
+BackendTls pool[TLS_POOL_SIZE];
+
+void printTlsError(const char* what, const int ret) {
+    char message[96];
+    mbedtls_strerror(ret, message, sizeof(message));
+    Serial.printf("[TLS] %s failed: -0x%04x %s\n", what, static_cast<unsigned>(-ret), message);
+}
+
+int tlsSend(void* ctx, const unsigned char* buf, size_t len) {
+    const int fd = *static_cast<int*>(ctx);
+    const int n = send(fd, buf, len, 0);
+    if (n < 0) {
+        return (errno == EAGAIN || errno == EWOULDBLOCK) ? MBEDTLS_ERR_SSL_WANT_WRITE : MBEDTLS_ERR_NET_SEND_FAILED;
+    }
+    return n;
+}
+
+int tlsRecvTimeout(void* ctx, unsigned char* buf, size_t len, uint32_t timeout_ms) {
+    const int fd = *static_cast<int*>(ctx);
+    fd_set read_fds;
+    FD_ZERO(&read_fds);
+    FD_SET(fd, &read_fds);
+    struct timeval timeout;
+    timeout.tv_sec = timeout_ms / 1000;
+    timeout.tv_usec = (timeout_ms % 1000) * 1000;
+    const int ready = select(fd + 1, &read_fds, nullptr, nullptr, &timeout);
+    if (ready == 0) {
+        return MBEDTLS_ERR_SSL_TIMEOUT;
+    }
+    if (ready < 0) {
+        return MBEDTLS_ERR_NET_RECV_FAILED;
+    }
+    const int n = recv(fd, buf, len, 0);
+    if (n < 0) {
+        return (errno == EAGAIN || errno == EWOULDBLOCK) ? MBEDTLS_ERR_SSL_WANT_READ : MBEDTLS_ERR_NET_RECV_FAILED;
+    }
+    // 0は相手の切断（mbedtlsがEOFとして扱う）
+    return n;
+}
+
+bool initShared() {
+    if (shared.initialized) {
+        return shared.ok;
+    }
+    shared.initialized = true;
+    mbedtls_ssl_config_init(&shared.conf);
+    mbedtls_x509_crt_init(&shared.ca);
+    mbedtls_entropy_init(&shared.entropy);
+    mbedtls_ctr_drbg_init(&shared.drbg);
+    mbedtls_ssl_session_init(&shared.session);
+
+    int ret = mbedtls_ctr_drbg_seed(&shared.drbg, mbedtls_entropy_func, &shared.entropy, nullptr, 0);
+    if (ret != 0) {
+        printTlsError("ctr_drbg_seed", ret);
+        return false;
+    }
+    ret = mbedtls_ssl_config_defaults(&shared.conf, MBEDTLS_SSL_IS_CLIENT, MBEDTLS_SSL_TRANSPORT_STREAM,
+                                      MBEDTLS_SSL_PRESET_DEFAULT);
+    if (ret != 0) {
+        printTlsError("ssl_config_defaults", ret);
+        return false;
+    }
+    const char* ca_cert = HOST_OLLAMA_CA_CERT;
+    if (ca_cert != nullptr) {
+        // PEMは終端のNULまで含めた長さを渡す
+        ret = mbedtls_x509_crt_parse(&shared.ca, reinterpret_cast<const unsigned char*>(ca_cert), strlen(ca_cert) + 1);
+        if (ret != 0) {
+            printTlsError("x509_crt_parse", ret);
+            return false;
+        }
+        mbedtls_ssl_conf_ca_chain(&shared.conf, &shared.ca, nullptr);
+        mbedtls_ssl_conf_authmode(&shared.conf, MBEDTLS_SSL_VERIFY_REQUIRED);
+    } else if (HOST_OLLAMA_TLS_INSECURE) {
+        Serial.println("[TLS] HOST_OLLAMA_TLS_INSECURE is set, server certificate is not verified");
+        mbedtls_ssl_conf_authmode(&shared.conf, MBEDTLS_SSL_VERIFY_NONE);
+    } else {
+        // 検証できない相手には接続しない
+        Serial.println("[TLS] HOST_OLLAMA_CA_CERT is not set, refusing to connect");
+        return false;
+    }
+    mbedtls_ssl_conf_rng(&shared.conf, mbedtls_ctr_drbg_random, &shared.drbg);
+    mbedtls_ssl_conf_read_timeout(&shared.conf, TLS_READ_TIMEOUT_MS);
+    mbedtls_ssl_conf_session_tickets(&shared.conf, MBEDTLS_SSL_SESSION_TICKETS_ENABLED);
+    mbedtls_ssl_conf_ciphersuites(&shared.conf, TLS_CIPHERSUITES);
+    shared.ok = true;
+    return true;
+}
+
+void closeEntry(BackendTls& entry) {
+    if (entry.connected) {
+        mbedtls_ssl_close_notify(&entry.ssl);
+        mbedtls_ssl_free(&entry.ssl);
+        entry.client.stop();
+        entry.connected = false;
+    }
+    entry.in_use = false;
+}
+
+// 使っていない間に相手が閉じていないか（close_notifyやFINが届いていれば受信可能になっている）
+bool isIdleAlive(BackendTls& entry) {
+    if (millis() - entry.idle_since > TLS_IDLE_MAX_MS || !entry.client.connected()) {
+        return false;
+    }
+    fd_set read_fds;
+    FD_ZERO(&read_fds);
+    FD_SET(entry.fd, &read_fds);
+    struct timeval timeout = {0, 0};
+    return select(entry.fd + 1, &read_fds, nullptr, nullptr, &timeout) == 0;
+}
+
+bool handshake(BackendTls& entry, const uint32_t timeout_ms) {
+    mbedtls_ssl_init(&entry.ssl);
+    int ret = mbedtls_ssl_setup(&entry.ssl, &shared.conf);
+    if (ret == 0) {
+        ret = mbedtls_ssl_set_hostname(&entry.ssl, HOST_OLLAMA_TLS_NAME);
+    }
+    if (ret != 0) {
+        printTlsError("ssl_setup", ret);
+        mbedtls_ssl_free(&entry.ssl);
+        return false;
+    }
+    mbedtls_ssl_set_bio(&entry.ssl, &entry.fd, tlsSend, nullptr, tlsRecvTimeout);
+    if (shared.has_session) {
+        mbedtls_ssl_set_session(&entry.ssl, &shared.session);
+    }
+
+    const uint32_t start = micros();
+    const unsigned long start_ms = millis();
+    while ((ret = mbedtls_ssl_handshake(&entry.ssl)) != 0) {
+        if (ret != MBEDTLS_ERR_SSL_WANT_READ && ret != MBEDTLS_ERR_SSL_WANT_WRITE && ret != MBEDTLS_ERR_SSL_TIMEOUT) {
+            printTlsError("Handshake", ret);
+            break;
+        }
+        if (millis() - start_ms >= timeout_ms) {
+            Serial.println("[TLS] Handshake timeout");
+            break;
+        }
+    }
+    if (ret != 0) {
+        mbedtls_ssl_free(&entry.ssl);
+        return false;
+    }
+    const uint32_t elapsed = micros() - start;
+
+    // 再開したセッションは開始時刻とマスターシークレットを引き継ぐ。フルハンドシェイクではどちらも新しくなる
+    // 開始時刻は秒単位なので、同じ秒のうちにフルハンドシェイクしても一致する。再開かどうかはマスターシークレットで決める
+    mbedtls_ssl_session session;
+    mbedtls_ssl_session_init(&session);
+    bool resumed = false;
+    if (mbedtls_ssl_get_session(&entry.ssl, &session) == 0) {
+        if (shared.has_session) {
+            resumed = memcmp(TLS_SESSION_FIELD(session, master), TLS_SESSION_FIELD(shared.session, master),
+                             sizeof(TLS_SESSION_FIELD(session, master))) == 0;
+#if defined(MBEDTLS_HAVE_TIME)
+            if (TLS_SESSION_FIELD(session, start) == TLS_SESSION_FIELD(shared.session, start)) {
+                Serial.printf("[TLS] Session start %lld matches the previous session (%s)\n",
+                              static_cast<long long>(TLS_SESSION_FIELD(session, start)),
+                              resumed ? "resumed" : "new master secret, full handshake in the same second");
+            }
+#endif
+        }
+        mbedtls_ssl_session_free(&shared.session);
+        shared.session = session;
+        shared.has_session = true;
+    } else {
+        mbedtls_ssl_session_free(&session);
+    }
+
+    entry.handshake_us = elapsed;
+    entry.resumed = resumed;
+    Serial.printf("[TLS] Handshake %lu ms (%s, %s)\n", static_cast<unsigned long>(elapsed / 1000),
+                  resumed ? "resumed" : "full", mbedtls_ssl_get_ciphersuite(&entry.ssl));
+    perfRecord(PERF_TLS_HANDSHAKE, elapsed, resumed ? 1 : 0);
+    metricsRecordTlsHandshake(resumed, elapsed);
+    return true;
+}
+
+} // namespace
+
+BackendTls* backendTlsOpen(const char* host, const uint16_t port, const uint32_t timeout_ms) {
+    if (!initShared()) {
+        return nullptr;
+    }
+    // 1. 応答を読み終えて残してある接続を使い回す
+    for (size_t i = 0; i < TLS_POOL_SIZE; i++) {
+        BackendTls& entry = pool[i];
+        if (entry.in_use || !entry.connected) {
+            continue;
+        }
+        if (!isIdleAlive(entry)) {
+            closeEntry(entry);
+            continue;
+        }
+        entry.in_use = true;
+        entry.handshake_us = 0;
+        metricsRecordTlsReuse();
+        return &entry;
+    }
+
+    // 2. 空いている枠で新しく接続する
+    BackendTls* free_entry = nullptr;
+    for (size_t i = 0; i < TLS_POOL_SIZE; i++) {
+        if (!pool[i].in_use && !pool[i].connected) {
+            free_entry = &pool[i];
+            break;
+        }
+    }
+    if (free_entry == nullptr) {
+        Serial.println("[TLS] All connections are in use");
+        return nullptr;
+    }
+    BackendTls& entry = *free_entry;
+    if (!entry.client.connect(host, port, timeout_ms)) {
+        Serial.printf("[TLS] Connect to %s:%u failed\n", host, port);
+        metricsRecordBackendConnectFailure();
+        return nullptr;
+    }
+    // トークンは小さなレコードで届くので、Nagleで遅延させない
+    entry.client.setNoDelay(true);
+    entry.fd = entry.client.fd();
+    if (!handshake(entry, timeout_ms)) {
+        entry.client.stop();
+        metricsRecordBackendConnectFailure();
+        return nullptr;
+    }
+    entry.connected = true;
+    entry.in_use = true;
+    return &entry;
+}
+
+void backendTlsRelease(BackendTls* tls, const bool reusable) {
+    if (tls == nullptr) {
+        return;
+    }
+    if (reusable && tls->connected) {
+        tls->in_use = false;
+        tls->idle_since = millis();
+        return;
+    }
+    closeEntry(*tls);
+}
+
+bool backendTlsWrite(BackendTls* tls, const uint8_t* data, const size_t length) {
+    size_t written = 0;
+    const unsigned long start = millis();
+    while (written < length) {
+        const int ret = mbedtls_ssl_write(&tls->ssl, data + written, length - written);
+        if (ret > 0) {
+            written += ret;
+            continue;
+        }
+        if ((ret != MBEDTLS_ERR_SSL_WANT_READ && ret != MBEDTLS_ERR_SSL_WANT_WRITE) ||
+            millis() - start >= TLS_WRITE_TIMEOUT_MS) {
+            printTlsError("Write", ret);
+            return false;
+        }
+    }
+    return true;
+}
+
+int backendTlsRead(BackendTls* tls, uint8_t* buffer, const size_t size) {
+    const int ret = mbedtls_ssl_read(&tls->ssl, buffer, size);
+    if (ret > 0) {
+        return ret;
+    }
+    // レコードの途中までしか届いていない
+    if (ret == MBEDTLS_ERR_SSL_WANT_READ || ret == MBEDTLS_ERR_SSL_WANT_WRITE || ret == MBEDTLS_ERR_SSL_TIMEOUT) {
+        return 0;
+    }
+    // 0とclose_notifyは相手の切断
+    if (ret != 0 && ret != MBEDTLS_ERR_SSL_PEER_CLOSE_NOTIFY) {
+        printTlsError("Read", ret);
+    }
+    return -1;
+}
+
+int backendTlsWaitReadable(BackendTls* tls, const uint32_t timeout_ms) {
+    // 復号済みでmbedtlsの中に残っている分はソケットを見ても分からないので先に確認する
+    if (mbedtls_ssl_get_bytes_avail(&tls->ssl) > 0) {
+        return 1;
+    }
+    fd_set read_fds;
+    FD_ZERO(&read_fds);
+    FD_SET(tls->fd, &read_fds);
+    struct timeval timeout;
+    timeout.tv_sec = timeout_ms / 1000;
+    timeout.tv_usec = (timeout_ms % 1000) * 1000;
+    const int result = select(tls->fd + 1, &read_fds, nullptr, nullptr, &timeout);
+    if (result < 0) {
+        return -1;
+    }
+    return result > 0 ? 1 : 0;
+}
+
+bool backendTlsCheckResumption(const char* host, const uint16_t port, const uint32_t timeout_ms) {
+    // 2本目は1本目を返す前に開くので、新しい接続で1本目のセッションを再開しようとする
+    BackendTls* first = backendTlsOpen(host, port, timeout_ms);
+    BackendTls* second = first ? backendTlsOpen(host, port, timeout_ms) : nullptr;
+    bool resumed = false;
+    if (second == nullptr) {
+        Serial.println("[TLS] Resumption check failed: could not open two connections");
+    } else if (first->handshake_us == 0 || second->handshake_us == 0) {
+        Serial.println("[TLS] Resumption check skipped: pooled connections were reused");
+    } else {
+        resumed = second->resumed;
+        Serial.printf("[TLS] Resumption check: first %lu ms (%s), second %lu ms (%s)\n",
+                      static_cast<unsigned long>(first->handshake_us / 1000), first->resumed ? "resumed" : "full",
+                      static_cast<unsigned long>(second->handshake_us / 1000), resumed ? "resumed" : "full");
+        if (!resumed) {
+            Serial.println("[TLS] Session was not resumed, check that the proxy issues session tickets");
+        }
+    }
+    // どちらもプールに残し、最初のリクエストで使う
+    backendTlsRelease(first, true);
+    backendTlsRelease(second, true);
+    return resumed;
+}
+
+#else
+
+BackendTls* backendTlsOpen(const char* host, const uint16_t port, const uint32_t timeout_ms) {
+    return nullptr;
+}
+
+void backendTlsRelease(BackendTls* tls, const bool reusable) {
+}
+
+bool backendTlsWrite(BackendTls* tls, const uint8_t* data, const size_t length) {
+    return false;
+}
+
+int backendTlsRead(BackendTls* tls, uint8_t* buffer, const size_t size) {
+    return -1;
+}
+
+int backendTlsWaitReadable(BackendTls* tls, const uint32_t timeout_ms) {
+    return -1;
+}
+
+bool backendTlsCheckResumption(const char* host, const uint16_t port, const uint32_t timeout_ms) {
+    return false;
+}
+
+#endif
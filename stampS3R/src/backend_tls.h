@@ -0,0 +1,57 @@
+#ifndef BACKEND_TLS_H
+#define BACKEND_TLS_H
+
+#include "config.h"
+#include <Arduino.h>
+
+#if USE_WIFI_FOR_LLM_COMMUNICATION
+#include "secrets.h"
+#endif
+
+// OllamaをTLSの逆プロキシ（nginx、caddyなど）の後ろに置くときは、secrets.hでtrueにする
+#ifndef HOST_OLLAMA_TLS
+#define HOST_OLLAMA_TLS false
+#endif
+// サーバー証明書を検証するCA証明書（PEM文字列）。自己署名ならその証明書。nullptrなら接続しない
+#ifndef HOST_OLLAMA_CA_CERT
+#define HOST_OLLAMA_CA_CERT nullptr
+#endif
+// trueにすると、HOST_OLLAMA_CA_CERTがないときに証明書を検証せずに接続する（手元での試験用）
+#ifndef HOST_OLLAMA_TLS_INSECURE
+#define HOST_OLLAMA_TLS_INSECURE false
+#endif
+// trueにすると、起動時に2本続けて接続し、2本目が1本目のセッションを再開できたかとハンドシェイクの時間をログに出す
+#ifndef HOST_OLLAMA_TLS_CHECK_RESUMPTION
+#define HOST_OLLAMA_TLS_CHECK_RESUMPTION false
+#endif
+// SNIと証明書の検証に使うホスト名。証明書のCN/SANがIPアドレスでなければ合わせる
+#ifndef HOST_OLLAMA_TLS_NAME
+#define HOST_OLLAMA_TLS_NAME HOST_IP
+#endif
+
+// Ollamaへの接続のTLS（mbedtlsをWiFiClientのソケットの上で直接使う）
+// AES-GCMの暗号スイートを優先し、AES・SHA・RSA（MPI）はESP-IDFのmbedtlsの設定でS3のアクセラレータを使う
+// ハンドシェイクを省くために、
+//   - 応答を最後まで読んだ接続はプールに戻して、次のリクエストで使い回す（Connection: keep-alive）
+//   - 新しく接続するときは前回のセッション（チケット）で再開する
+// プールはloop()からだけ使う
+
+struct BackendTls;
+
+// プールの空いている接続を返す。なければ接続してハンドシェイクする。失敗したらnullptr
+BackendTls* backendTlsOpen(const char* host, const uint16_t port, const uint32_t timeout_ms);
+// 使い終わった接続を返す。reusableなら次のリクエストのためにプールに残し、そうでなければ閉じる
+void backendTlsRelease(BackendTls* tls, const bool reusable);
+
+// すべて送れたらtrue
+bool backendTlsWrite(BackendTls* tls, const uint8_t* data, const size_t length);
+// 復号済みのデータを読む。読んだバイト数、まだ何もなければ0、切断やエラーは-1を返す
+int backendTlsRead(BackendTls* tls, uint8_t* buffer, const size_t size);
+// 受信可能になるまで待つ。1: 受信可能（データまたは切断）、0: タイムアウト、-1: エラー
+int backendTlsWaitReadable(BackendTls* tls, const uint32_t timeout_ms);
+
+// 2本の接続を続けて開き、2本目がセッションを再開できたか確かめる（[TLS] Resumption check のログ）
+// 開いた接続はプールに残す。再開できたらtrue
+bool backendTlsCheckResumption(const char* host, const uint16_t port, const uint32_t timeout_ms);
+
+#endif // BACKEND_TLS_H
@@ -0,0 +1,179 @@
+#include "cache_search.h"
+#include <math.h>
+
+float cacheQuantize(const float *input, const size_t dims, int8_t *out, const size_t padded_dims)
+{
+    float max_abs = 0;
+    for (size_t i = 0; i < dims; i++)
+    {
+        max_abs = fmaxf(max_abs, fabsf(input[i]));
+    }
+    const float scale = max_abs > 0 ? 127.0f / max_abs : 0;
+    int32_t sum = 0;
+    for (size_t i = 0; i < padded_dims; i++)
+    {
+        out[i] = i < dims ? static_cast<int8_t>(lroundf(input[i] * scale)) : 0;
+        sum += out[i] * out[i];
+    }
+    return sqrtf(static_cast<float>(sum));
+}
+
+int32_t cacheDotProductScalar(const int8_t *a, const int8_t *b, const size_t length)
+{
+    int32_t sum0 = 0;
+    int32_t sum1 = 0;
+    int32_t sum2 = 0;
+    int32_t sum3 = 0;
+    for (size_t i = 0; i < length; i += 4)
+    {
+        sum0 += a[i] * b[i];
+        sum1 += a[i + 1] * b[i + 1];
+        sum2 += a[i + 2] * b[i + 2];
+        sum3 += a[i + 3] * b[i + 3];
+    }
+    return sum0 + sum1 + sum2 + sum3;
+}
+
+namespace {
+
+bool pie_enabled = CACHE_SEARCH_HAS_PIE;
+
+#if CACHE_SEARCH_HAS_PIE
+// 16要素ずつ積和してACCX（40bit）に足し込む。int8の4096次元でも32bitに収まる
+// ee.vld.128.ipはアドレスの下位4bitを無視するので、a・bは16バイト境界でなければならない
+// q0・q1・ACCXはコンパイラが使わない。ループはloop命令を使わず分岐で回す（コンパイラのループのレジスタを壊さない）
+int32_t dotProductPie(const int8_t *a, const int8_t *b, const size_t length)
+{
+    int32_t blocks = length / 16;
+    int32_t result;
+    const int32_t shift = 0;
+    asm volatile("ee.zero.accx\n"
+                 "1:\n"
+                 "ee.vld.128.ip q0, %[a], 16\n"
+                 "ee.vld.128.ip q1, %[b], 16\n"
+                 "ee.vmulas.s8.accx q0, q1\n"
+                 "addi %[blocks], %[blocks], -1\n"
+                 "bnez %[blocks], 1b\n"
+                 "ee.srs.accx %[result], %[shift], 0\n"
+                 : [result] "=r"(result), [a] "+r"(a), [b] "+r"(b), [blocks] "+r"(blocks)
+                 : [shift] "r"(shift)
+                 : "memory");
+    return result;
+}
+#endif
+
+bool pieUsable(const int8_t *a, const int8_t *b, const size_t length)
+{
+    return pie_enabled && length >= 16 && length % 16 == 0 &&
+           ((reinterpret_cast<uintptr_t>(a) | reinterpret_cast<uintptr_t>(b)) & 15) == 0;
+}
+
+constexpr size_t CHECK_MAX_LENGTH = 1024;
+constexpr size_t CHECK_LENGTHS[] = {16, 32, 48, 384, 768, 1024};
+constexpr size_t CHECK_TIMING_LENGTH = 768;
+constexpr uint32_t CHECK_TIMING_REPEATS = 256;
+
+void fillCheckVector(int8_t *out, const size_t length, uint32_t &state, const int8_t edge)
+{
+    for (size_t i = 0; i < length; i++)
+    {
+        state = state * 1664525u + 1013904223u;
+        // 8要素に1つは境界の値にする
+        out[i] = (state >> 29) == 0 ? edge : static_cast<int8_t>(state >> 24);
+    }
+}
+
+} // namespace
+
+int32_t cacheDotProduct(const int8_t *a, const int8_t *b, const size_t length)
+{
+#if CACHE_SEARCH_HAS_PIE
+    if (pieUsable(a, b, length))
+    {
+        return dotProductPie(a, b, length);
+    }
+#endif
+    return cacheDotProductScalar(a, b, length);
+}
+
+CacheDotProductCheck cacheCheckDotProduct()
+{
+    alignas(16) static int8_t a[CHECK_MAX_LENGTH];
+    alignas(16) static int8_t b[CHECK_MAX_LENGTH];
+    CacheDotProductCheck check = {"scalar", true, 0, 0};
+    uint32_t state = 0x6D2B79F5;
+    for (const int8_t edge : {static_cast<int8_t>(-128), static_cast<int8_t>(127)})
+    {
+        for (const size_t length : CHECK_LENGTHS)
+        {
+            fillCheckVector(a, length, state, edge);
+            fillCheckVector(b, length, state, -128);
+            if (cacheDotProduct(a, b, length) != cacheDotProductScalar(a, b, length))
+            {
+                check.ok = false;
+            }
+        }
+    }
+    if (!check.ok)
+    {
+        pie_enabled = false;
+    }
+    check.kernel = pieUsable(a, b, CHECK_TIMING_LENGTH) ? "pie" : "scalar";
+
+    // 1回の内積はmicrosの分解能より短いので、まとめて測る
+    int32_t sink = 0;
+    uint32_t start_us = micros();
+    for (uint32_t i = 0; i < CHECK_TIMING_REPEATS; i++)
+    {
+        a[i] = static_cast<int8_t>(i);
+        sink += cacheDotProductScalar(a, b, CHECK_TIMING_LENGTH);
+    }
+    check.scalar_ns = (micros() - start_us) * 1000 / CHECK_TIMING_REPEATS;
+    start_us = micros();
+    for (uint32_t i = 0; i < CHECK_TIMING_REPEATS; i++)
+    {
+        a[i] = static_cast<int8_t>(i);
+        sink += cacheDotProduct(a, b, CHECK_TIMING_LENGTH);
+    }
+    check.kernel_ns = (micros() - start_us) * 1000 / CHECK_TIMING_REPEATS;
+    // 測った計算を外に出されないようにする
+    a[0] = static_cast<int8_t>(sink);
+    return check;
+}
+
+CacheSearchResult cacheSearch(const CacheEntry *entries, const int8_t *vectors, const size_t slots,
+                              const size_t padded_dims, const uint32_t context_hash, const int8_t *query,
+                              const float query_norm)
+{
+    CacheSearchResult result = {-1, -1, 0};
+    for (size_t slot = 0; slot < slots; slot++)
+    {
+        const CacheEntry &entry = entries[slot];
+        if (entry.sequence == 0 || entry.context_hash != context_hash || entry.norm <= 0)
+        {
+            continue;
+        }
+        result.scanned++;
+        const float similarity =
+            cacheDotProduct(query, vectors + slot * padded_dims, padded_dims) / (query_norm * entry.norm);
+        if (similarity > result.similarity)
+        {
+            result.similarity = similarity;
+            result.slot = slot;
+        }
+    }
+    return result;
+}
+
+size_t cacheVictimSlot(const CacheEntry *entries, const size_t slots)
+{
+    size_t slot = 0;
+    for (size_t i = 0; i < slots; i++)
+    {
+        if (entries[i].sequence < entries[slot].sequence)
+        {
+            slot = i;
+        }
+    }
+    return slot;
+}
@@ -0,0 +1,68 @@
+#ifndef CACHE_SEARCH_H
+#define CACHE_SEARCH_H
+
+#include "config.h"
+#include <Arduino.h>
+
+// セマンティックキャッシュの表の検索（ハードウェアを使わないのでホストでもビルドできる）
+// 表は枠ごとの CacheEntry と、int8にしたベクトル（枠ごとにpadded_dimsバイト）からなる
+// ESP32-S3ではベクトル命令（PIE）で16要素ずつ内積を計算する。表とクエリを16バイト境界に置くこと
+
+#if SEMANTIC_CACHE_USE_PIE && defined(CONFIG_IDF_TARGET_ESP32S3)
+#define CACHE_SEARCH_HAS_PIE 1
+#else
+#define CACHE_SEARCH_HAS_PIE 0
+#endif
+
+struct CacheEntry
+{
+    uint32_t context_hash; // モデル・システムプロンプト・ベクトルのモデルのハッシュ
+    uint32_t sequence;     // 最後に使った順（0: 空き）
+    float norm;            // int8ベクトルの大きさ
+    uint16_t answer_length;
+    uint16_t reserved;
+};
+
+struct CacheSearchResult
+{
+    int slot;         // 一番似ている枠。なければ-1
+    float similarity; // そのコサイン類似度（なければ-1）
+    size_t scanned;   // 比べた枠の数
+};
+
+// ベクトルの次元数を16の倍数にそろえる
+inline size_t cachePaddedDims(const size_t dims)
+{
+    return (dims + 15) & ~static_cast<size_t>(15);
+}
+
+// 最大の絶対値が127になるようにint8にし、その大きさを返す。コサイン類似度だけを使うので倍率は保存しない
+// dimsからpadded_dimsまでは0で埋める
+float cacheQuantize(const float *input, const size_t dims, int8_t *out, const size_t padded_dims);
+
+// int8ベクトルの内積（通常の計算）。lengthは4の倍数
+int32_t cacheDotProductScalar(const int8_t *a, const int8_t *b, const size_t length);
+// int8ベクトルの内積。PIEが使えて、lengthが16の倍数でa・bが16バイト境界ならPIEで計算する
+int32_t cacheDotProduct(const int8_t *a, const int8_t *b, const size_t length);
+
+struct CacheDotProductCheck
+{
+    const char *kernel;  // 確かめた後に使う計算（"pie" か "scalar"）
+    bool ok;             // PIEの結果が通常の計算と一致した（PIEがなければtrue）
+    uint32_t scalar_ns;  // 768次元の内積1回あたりの時間
+    uint32_t kernel_ns;
+};
+
+// 境界の値（-128・127）を含む乱数のベクトルで、PIEの内積を通常の計算と比べる
+// 一致しなければ以後は通常の計算を使う
+CacheDotProductCheck cacheCheckDotProduct();
+
+// context_hashが同じ使用中の枠から、queryに一番似ているものを探す
+CacheSearchResult cacheSearch(const CacheEntry *entries, const int8_t *vectors, const size_t slots,
+                              const size_t padded_dims, const uint32_t context_hash, const int8_t *query,
+                              const float query_norm);
+
+// 次に保存する枠（空きか、一番長く使われていないもの）
+size_t cacheVictimSlot(const CacheEntry *entries, const size_t slots);
+
+#endif // CACHE_SEARCH_H
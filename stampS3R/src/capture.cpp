@@ -0,0 +1,324 @@
+#include "capture.h"
+#include <SPIFFS.h>
+
+namespace {
+
+const char *const CHANNEL_NAMES[] = {"rx", "tx", "req", "status", "res"};
+
+SemaphoreHandle_t captureMutex()
+{
+    // TTSの合成タスクからも記録するので、1件ずつ排他する
+    static SemaphoreHandle_t mutex = xSemaphoreCreateMutex();
+    return mutex;
+}
+
+#if CAPTURE_MODE != CAPTURE_MODE_OFF
+
+// micros()は約71分で一周するので、64bitに伸ばす
+uint64_t captureTimeUs()
+{
+    static uint32_t last_us = 0;
+    static uint64_t wraps = 0;
+    const uint32_t now = micros();
+    if (now < last_us)
+    {
+        wraps += 1ULL << 32;
+    }
+    last_us = now;
+    return wraps + now;
+}
+
+// 1件の記録を組み立てる先。記録は必ず1回の書き込みで出す（ほかのログと行が混ざらないように）
+struct RecordWriter
+{
+    char *out;
+    size_t capacity;
+    size_t length;
+    bool truncated;
+};
+
+// 閉じの "}\n" と truncated の印のために残しておくバイト数
+constexpr size_t RECORD_TAIL_RESERVE = 24;
+
+void recordWrite(RecordWriter &writer, const char *data, const size_t length)
+{
+    if (writer.truncated || writer.length + length > writer.capacity - RECORD_TAIL_RESERVE)
+    {
+        writer.truncated = true;
+        return;
+    }
+    memcpy(writer.out + writer.length, data, length);
+    writer.length += length;
+}
+
+void recordWrite(RecordWriter &writer, const char *text)
+{
+    recordWrite(writer, text, strlen(text));
+}
+
+// JSONの文字列の中身としてエスケープして書く。入りきらなければそこで切る
+void recordWriteEscaped(RecordWriter &writer, const char *data, const size_t length)
+{
+    for (size_t i = 0; i < length && !writer.truncated; i++)
+    {
+        const char c = data[i];
+        char escaped[7];
+        switch (c)
+        {
+        case '\\':
+            recordWrite(writer, "\\\\", 2);
+            break;
+        case '"':
+            recordWrite(writer, "\\\"", 2);
+            break;
+        case '\n':
+            recordWrite(writer, "\\n", 2);
+            break;
+        case '\r':
+            recordWrite(writer, "\\r", 2);
+            break;
+        case '\t':
+            recordWrite(writer, "\\t", 2);
+            break;
+        default:
+            if (static_cast<uint8_t>(c) < 0x20)
+            {
+                recordWrite(writer, escaped, snprintf(escaped, sizeof(escaped), "\\u%04x", static_cast<unsigned>(c)));
+            }
+            else
+            {
+                recordWrite(writer, &c, 1);
+            }
+            break;
+        }
+    }
+}
+
+void buildRecord(RecordWriter &writer, const CaptureChannel channel, const char *data, const size_t length,
+                 const char *path)
+{
+    char head[48];
+    snprintf(head, sizeof(head), "{\"t\":%llu,\"c\":\"%s\"", static_cast<unsigned long long>(captureTimeUs()),
+             CHANNEL_NAMES[channel]);
+    if (CAPTURE_MODE == CAPTURE_MODE_USB)
+    {
+        recordWrite(writer, "[CAP] ");
+    }
+    recordWrite(writer, head);
+    if (path != nullptr)
+    {
+        recordWrite(writer, ",\"p\":\"");
+        recordWriteEscaped(writer, path, strlen(path));
+        recordWrite(writer, "\"");
+    }
+    recordWrite(writer, ",\"d\":\"");
+    recordWriteEscaped(writer, data, length);
+    // 切れた記録も1行のJSONとして読めるように閉じる（replay.pyはリクエストの本文を前方一致で比べる）
+    const char *tail = writer.truncated ? "\",\"truncated\":true}\n" : "\"}\n";
+    const size_t tail_length = strlen(tail);
+    memcpy(writer.out + writer.length, tail, tail_length);
+    writer.length += tail_length;
+}
+
+#endif
+
+#if CAPTURE_MODE == CAPTURE_MODE_SPIFFS
+
+const char *const CAPTURE_PATHS[] = {"/cap0.jsonl", "/cap1.jsonl"};
+constexpr unsigned long CAPTURE_FLUSH_INTERVAL_MS = 1000;
+
+// 記録はRAMの2つのバッファに交互にためる。書き込みはcapturePoll()だけが行い、記録する側（sendToM5やTTSのタスク）は待たせない
+// 使っていない方のバッファに中身があれば、それが書き出し待ち
+// ファイルが上限に達したらもう一方を空にして書き継ぐ
+struct CaptureRing
+{
+    bool initialized;
+    bool mounted;
+    uint8_t current;
+    size_t current_size;
+    char buffers[2][CAPTURE_BUFFER_SIZE];
+    size_t buffered[2];
+    uint8_t active;         // 記録を追加しているバッファ
+    uint32_t dropped;       // 両方のバッファが埋まっていて捨てた記録の数
+    unsigned long last_flush_ms;
+};
+
+CaptureRing capture_ring;
+
+void initRing()
+{
+    if (capture_ring.initialized)
+    {
+        return;
+    }
+    capture_ring.initialized = true;
+    capture_ring.mounted = SPIFFS.begin(true);
+    if (!capture_ring.mounted)
+    {
+        Serial.println("[CAP] SPIFFS mount failed");
+        return;
+    }
+    // 起動ごとに新しく記録する
+    SPIFFS.remove(CAPTURE_PATHS[1]);
+    File file = SPIFFS.open(CAPTURE_PATHS[0], FILE_WRITE);
+    file.close();
+    capture_ring.current = 0;
+    capture_ring.current_size = 0;
+}
+
+// 書き出し待ちのバッファをファイルに書く（captureMutexの外で呼ぶ。記録する側はもう一方のバッファを使う）
+void writeBuffer(const uint8_t index)
+{
+    const size_t length = capture_ring.buffered[index];
+    if (capture_ring.mounted)
+    {
+        File file = SPIFFS.open(CAPTURE_PATHS[capture_ring.current], FILE_APPEND);
+        if (file)
+        {
+            file.write(reinterpret_cast<const uint8_t *>(capture_ring.buffers[index]), length);
+            file.close();
+        }
+        capture_ring.current_size += length;
+        if (capture_ring.current_size >= CAPTURE_FILE_SIZE)
+        {
+            capture_ring.current ^= 1;
+            capture_ring.current_size = 0;
+            File next = SPIFFS.open(CAPTURE_PATHS[capture_ring.current], FILE_WRITE);
+            next.close();
+        }
+    }
+    capture_ring.last_flush_ms = millis();
+}
+
+// forceなら、追加中のバッファも入れ替えて書き出す
+void flushRing(const bool force)
+{
+    xSemaphoreTake(captureMutex(), portMAX_DELAY);
+    const uint8_t idle = capture_ring.active ^ 1;
+    if (capture_ring.buffered[idle] == 0 && capture_ring.buffered[capture_ring.active] > 0 &&
+        (force || millis() - capture_ring.last_flush_ms >= CAPTURE_FLUSH_INTERVAL_MS))
+    {
+        capture_ring.active = idle;
+    }
+    const uint8_t pending = capture_ring.active ^ 1;
+    const uint32_t dropped = capture_ring.dropped;
+    capture_ring.dropped = 0;
+    xSemaphoreGive(captureMutex());
+
+    if (dropped > 0)
+    {
+        Serial.printf("[CAP] Dropped %lu records (buffers full)\n", static_cast<unsigned long>(dropped));
+    }
+    if (capture_ring.buffered[pending] == 0)
+    {
+        return;
+    }
+    writeBuffer(pending);
+    xSemaphoreTake(captureMutex(), portMAX_DELAY);
+    capture_ring.buffered[pending] = 0;
+    xSemaphoreGive(captureMutex());
+}
+
+// 記録をバッファに追加する（captureMutexの中で呼ぶ）。書き出しはcapturePoll()に任せ、ここではファイルに触らない
+// 半分を超えたら空いている方のバッファに切り替える。両方埋まっていれば、入る分だけ書いて切る（入らなければ捨てる）
+void sinkRecord(const CaptureChannel channel, const char *data, const size_t length, const char *path)
+{
+    if (capture_ring.buffered[capture_ring.active] > CAPTURE_BUFFER_SIZE / 2 &&
+        capture_ring.buffered[capture_ring.active ^ 1] == 0)
+    {
+        capture_ring.active ^= 1;
+    }
+    const uint8_t index = capture_ring.active;
+    if (CAPTURE_BUFFER_SIZE - capture_ring.buffered[index] < RECORD_TAIL_RESERVE * 4)
+    {
+        capture_ring.dropped++;
+        return;
+    }
+    RecordWriter writer = {capture_ring.buffers[index] + capture_ring.buffered[index],
+                           CAPTURE_BUFFER_SIZE - capture_ring.buffered[index], 0, false};
+    buildRecord(writer, channel, data, length, path);
+    capture_ring.buffered[index] += writer.length;
+}
+
+#elif CAPTURE_MODE == CAPTURE_MODE_USB
+
+char capture_record[CAPTURE_BUFFER_SIZE];
+
+void sinkRecord(const CaptureChannel channel, const char *data, const size_t length, const char *path)
+{
+    RecordWriter writer = {capture_record, sizeof(capture_record), 0, false};
+    buildRecord(writer, channel, data, length, path);
+    Serial.write(reinterpret_cast<const uint8_t *>(capture_record), writer.length);
+}
+
+#else
+
+void sinkRecord(const CaptureChannel channel, const char *data, const size_t length, const char *path)
+{
+}
+
+#endif
+
+} // namespace
+
+void captureRecord(const CaptureChannel channel, const char *data, const size_t length, const char *path)
+{
+    if (CAPTURE_MODE == CAPTURE_MODE_OFF)
+    {
+        return;
+    }
+    xSemaphoreTake(captureMutex(), portMAX_DELAY);
+#if CAPTURE_MODE == CAPTURE_MODE_SPIFFS
+    initRing();
+#endif
+    sinkRecord(channel, data, length, path);
+    xSemaphoreGive(captureMutex());
+}
+
+void captureRecord(const CaptureChannel channel, const String &data, const char *path)
+{
+    captureRecord(channel, data.c_str(), data.length(), path);
+}
+
+void capturePoll()
+{
+#if CAPTURE_MODE == CAPTURE_MODE_SPIFFS
+    flushRing(false);
+#endif
+}
+
+void captureDump()
+{
+#if CAPTURE_MODE == CAPTURE_MODE_SPIFFS
+    xSemaphoreTake(captureMutex(), portMAX_DELAY);
+    initRing();
+    xSemaphoreGive(captureMutex());
+    // 書き出し待ちと追加中のバッファを両方書く
+    flushRing(true);
+    flushRing(true);
+    xSemaphoreTake(captureMutex(), portMAX_DELAY);
+    if (capture_ring.mounted)
+    {
+        // 古い方のファイルから。先頭の行は前のファイルの続きのことがある（replay.pyは読み飛ばす）
+        for (uint8_t i = 1; i <= 2; i++)
+        {
+            File file = SPIFFS.open(CAPTURE_PATHS[(capture_ring.current + i) % 2], FILE_READ);
+            if (!file)
+            {
+                continue;
+            }
+            while (file.available())
+            {
+                const String line = file.readStringUntil('\n');
+                Serial.print("[CAP] ");
+                Serial.println(line);
+            }
+            file.close();
+        }
+    }
+    xSemaphoreGive(captureMutex());
+    Serial.println("[CAP] Dump finished");
+#else
+    Serial.println("[CAP] Nothing to dump (CAPTURE_MODE is not SPIFFS)");
+#endif
+}
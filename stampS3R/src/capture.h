@@ -0,0 +1,38 @@
+#ifndef CAPTURE_H
+#define CAPTURE_H
+
+#include "config.h"
+#include <Arduino.h>
+
+// UARTのフレームとバックエンドとのHTTPのやりとりを、µs単位の時刻つきで記録する
+// 記録した通信は serial/replay.py で実機に流し直し、応答の内容と時間を比べる
+//
+// 1件を1行のJSONで記録する
+//   {"t":<µs>,"c":"<種類>","p":"<パス>","d":"<内容>"}
+//   c: rx=Coreから受信した行, tx=Coreへ送った行,
+//      req=バックエンドへのリクエスト（pにメソッドとパス）, status=応答のステータスコード, res=応答の本文（ストリームは1行ずつ）
+
+enum CaptureChannel
+{
+    CAPTURE_UART_RX = 0,
+    CAPTURE_UART_TX = 1,
+    CAPTURE_HTTP_REQUEST = 2,
+    CAPTURE_HTTP_STATUS = 3,
+    CAPTURE_HTTP_RESPONSE = 4
+};
+
+#define CAPTURE_MODE_OFF 0
+#define CAPTURE_MODE_USB 1
+#define CAPTURE_MODE_SPIFFS 2
+
+// 1件記録する。pathはHTTPのリクエストのみ（"POST /api/generate" など）
+void captureRecord(const CaptureChannel channel, const char *data, const size_t length, const char *path = nullptr);
+void captureRecord(const CaptureChannel channel, const String &data, const char *path = nullptr);
+
+// SPIFFSに書いていない分を書き出す。loop()と推論の受信の合間に呼ぶ（ためている途中のバッファは1秒に1回まで）
+void capturePoll();
+
+// SPIFFSのリングに残っている記録を古い順にUSBシリアルへ出力する
+void captureDump();
+
+#endif // CAPTURE_H
@@ -0,0 +1,489 @@
+#include "chat_history.h"
+
+#if USE_WIFI_FOR_LLM_COMMUNICATION
+
+#include "secrets.h"
+#include "http_stream.h"
+#include "use_wifi.h"
+#include "prompt_queue.h"
+#include "arena.h"
+#include "power.h"
+
+namespace {
+
+// 予算を超えたら、この割合まで一度に落とす（毎回少しずつ落とすとバックエンドのプロンプトのキャッシュが毎回外れる）
+constexpr float HISTORY_COMPACT_RATIO = 0.5f;
+// 1トークンあたりのバイト数の初期値（日本語はおよそ1文字1トークン）。回答とeval_countから学習する
+constexpr float DEFAULT_BYTES_PER_TOKEN = 3.0f;
+// 1メッセージあたりのテンプレートのトークン数の目安
+constexpr uint32_t MESSAGE_OVERHEAD_TOKENS = 4;
+// 要約を待っている発話のバイト数の上限。超えた分は古い方から捨てる
+constexpr size_t PENDING_MAX_BYTES = 4096;
+
+// 要約のリクエスト
+constexpr unsigned long SUMMARY_IDLE_MS = 2000; // 最後の推論からこれだけ空いたら始める
+constexpr unsigned long SUMMARY_TIMEOUT_MS = 60000;
+constexpr unsigned long SUMMARY_CONNECT_TIMEOUT_MS = 2000;
+constexpr uint16_t SUMMARY_MAX_TOKENS = 160;
+constexpr size_t SUMMARY_BODY_MAX_BYTES = 8192;
+
+struct ChatTurn
+{
+    String user;
+    String assistant;
+};
+
+struct ChatHistory
+{
+    String work_id;
+    ChatTurn turns[CHAT_HISTORY_MAX_TURNS]; // headから古い順
+    size_t head;
+    size_t count;
+    String summary;          // 落とした発話の要約
+    String pending;          // 落としたが、まだ要約に入れていない発話
+    float bytes_per_token;
+    uint32_t context_tokens; // 直近の推論で履歴が占めていたトークン数
+    uint32_t last_used;
+};
+
+struct SummaryRequest
+{
+    bool active;
+    ChatHistory *history;
+    size_t pending_used; // 要約に渡したpendingのバイト数
+    WiFiClient client;
+    HttpStream http;
+    bool header_read;
+    String body;
+    unsigned long started_ms;
+};
+
+ChatHistory chat_histories[MAX_LLM_WORKS];
+uint32_t chat_history_counter = 0;
+SummaryRequest summary_request;
+unsigned long last_inference_ms = 0;
+char summary_read_buffer[512];
+
+ChatTurn &turnAt(ChatHistory &history, const size_t offset)
+{
+    return history.turns[(history.head + offset) % CHAT_HISTORY_MAX_TURNS];
+}
+
+const ChatTurn &turnAt(const ChatHistory &history, const size_t offset)
+{
+    return history.turns[(history.head + offset) % CHAT_HISTORY_MAX_TURNS];
+}
+
+void resetHistory(ChatHistory &history)
+{
+    history.work_id = "";
+    for (size_t i = 0; i < CHAT_HISTORY_MAX_TURNS; i++)
+    {
+        history.turns[i].user = "";
+        history.turns[i].assistant = "";
+    }
+    history.head = 0;
+    history.count = 0;
+    history.summary = "";
+    history.pending = "";
+    history.bytes_per_token = DEFAULT_BYTES_PER_TOKEN;
+    history.context_tokens = 0;
+    history.last_used = 0;
+}
+
+ChatHistory *findHistory(const String &work_id)
+{
+    for (size_t i = 0; i < MAX_LLM_WORKS; i++)
+    {
+        if (chat_histories[i].work_id.length() > 0 && chat_histories[i].work_id == work_id)
+        {
+            return &chat_histories[i];
+        }
+    }
+    return nullptr;
+}
+
+// なければ空いている枠（なければ一番長く使っていない枠）に作る
+ChatHistory &historyFor(const LlmWorkConfig &config)
+{
+    ChatHistory *history = findHistory(config.work_id);
+    if (history == nullptr)
+    {
+        size_t slot = 0;
+        for (size_t i = 0; i < MAX_LLM_WORKS; i++)
+        {
+            if (chat_histories[i].work_id.length() == 0)
+            {
+                slot = i;
+                break;
+            }
+            if (chat_histories[i].last_used < chat_histories[slot].last_used)
+            {
+                slot = i;
+            }
+        }
+        history = &chat_histories[slot];
+        if (summary_request.active && summary_request.history == history)
+        {
+            httpStreamClose(summary_request.http);
+            summary_request.active = false;
+        }
+        resetHistory(*history);
+        history->work_id = config.work_id;
+    }
+    history->last_used = ++chat_history_counter;
+    return *history;
+}
+
+uint32_t estimateTokens(const ChatHistory &history, const size_t bytes)
+{
+    return static_cast<uint32_t>(bytes / history.bytes_per_token) + MESSAGE_OVERHEAD_TOKENS;
+}
+
+// 今の履歴を送ったときのトークン数の推定
+uint32_t estimateContext(const ChatHistory &history, const LlmWorkConfig &config)
+{
+    uint32_t tokens = estimateTokens(history, config.system_prompt.length() + history.summary.length());
+    for (size_t i = 0; i < history.count; i++)
+    {
+        const ChatTurn &turn = turnAt(history, i);
+        tokens += estimateTokens(history, turn.user.length()) + estimateTokens(history, turn.assistant.length());
+    }
+    return tokens;
+}
+
+void abortSummary()
+{
+    if (summary_request.active)
+    {
+        Serial.println("[HISTORY] Summary postponed");
+        httpStreamClose(summary_request.http);
+        summary_request.active = false;
+        summary_request.body = "";
+    }
+}
+
+// 一番古い発話を要約待ちに移す
+void dropOldestTurn(ChatHistory &history, const LlmWorkConfig &config)
+{
+    ChatTurn &turn = turnAt(history, 0);
+    if (config.history == LLM_HISTORY_SUMMARIZE)
+    {
+        history.pending += "user: ";
+        history.pending += turn.user;
+        history.pending += "\nassistant: ";
+        history.pending += turn.assistant;
+        history.pending += "\n";
+        if (history.pending.length() > PENDING_MAX_BYTES)
+        {
+            // 行の途中で切らないよう、次の改行の後から残す
+            int cut = history.pending.indexOf('\n', history.pending.length() - PENDING_MAX_BYTES);
+            history.pending.remove(0, cut < 0 ? history.pending.length() : cut + 1);
+        }
+    }
+    turn.user = "";
+    turn.assistant = "";
+    history.head = (history.head + 1) % CHAT_HISTORY_MAX_TURNS;
+    history.count--;
+}
+
+// 推定をバックエンドの数え方に合わせて補正しながら、target以下になるまで古い発話を落とす
+void compactHistory(ChatHistory &history, const LlmWorkConfig &config, const uint32_t target, const uint32_t extra)
+{
+    const uint32_t estimated = estimateContext(history, config);
+    const float scale = estimated > 0 && history.context_tokens > estimated
+                            ? static_cast<float>(history.context_tokens) / estimated
+                            : 1.0f;
+    const uint32_t before = history.count;
+    while (history.count > 0 && estimateContext(history, config) * scale + extra > target)
+    {
+        dropOldestTurn(history, config);
+    }
+    history.context_tokens = static_cast<uint32_t>(estimateContext(history, config) * scale);
+    Serial.printf("[HISTORY] %s: dropped %u turns, ~%lu tokens left (%u turns)\n", config.work_id.c_str(),
+                  static_cast<unsigned>(before - history.count), static_cast<unsigned long>(history.context_tokens),
+                  static_cast<unsigned>(history.count));
+}
+
+bool startSummary(ChatHistory &history, const LlmWorkConfig &config)
+{
+    String prompt;
+    prompt.reserve(256 + history.summary.length() + history.pending.length());
+    prompt = "Summarize the conversation below in a few sentences, in the language it is written in. "
+             "Keep names, facts, decisions and open questions that later turns may refer to. "
+             "Reply with the summary only.\n\n";
+    if (history.summary.length() > 0)
+    {
+        prompt += "[Earlier summary]\n";
+        prompt += history.summary;
+        prompt += "\n\n";
+    }
+    prompt += "[Conversation]\n";
+    prompt += history.pending;
+
+    ArenaJsonDocument request_doc(512 + prompt.length());
+    request_doc["model"] = config.model;
+    request_doc["prompt"] = prompt;
+    request_doc["stream"] = false;
+    applyLlmWorkOptions(config, request_doc, 0);
+    // 思考するモデルでは、思考だけでnum_predictを使い切ってしまう
+    request_doc["think"] = false;
+    request_doc["options"]["num_predict"] = SUMMARY_MAX_TOKENS;
+    String request_body;
+    serializeJson(request_doc, request_body);
+
+    summary_request.history = &history;
+    summary_request.pending_used = history.pending.length();
+    summary_request.header_read = false;
+    summary_request.body = "";
+    summary_request.started_ms = millis();
+    if (!httpStreamConnectBackend(summary_request.http, summary_request.client, SUMMARY_CONNECT_TIMEOUT_MS) ||
+        !httpStreamSendRequest(summary_request.http, "POST", "/api/generate", request_body))
+    {
+        httpStreamClose(summary_request.http);
+        return false;
+    }
+    Serial.printf("[HISTORY] Summarizing %u bytes for %s\n", static_cast<unsigned>(summary_request.pending_used),
+                  config.work_id.c_str());
+    summary_request.active = true;
+    return true;
+}
+
+void finishSummary()
+{
+    summary_request.active = false;
+    httpStreamClose(summary_request.http);
+    ChatHistory &history = *summary_request.history;
+
+    StaticJsonDocument<32> filter;
+    filter["response"] = true;
+    ArenaJsonDocument response_doc(summary_request.body.length() + 256);
+    const DeserializationError error =
+        deserializeJson(response_doc, summary_request.body, DeserializationOption::Filter(filter));
+    summary_request.body = "";
+    // thinkを無視して応答に <think> を書くモデルもある
+    String summary = stripThinkText(response_doc["response"] | "");
+    summary.trim();
+    if (error || summary.length() == 0)
+    {
+        // 要約できなかった発話はそのまま忘れる（同じリクエストを繰り返さない）
+        Serial.println("[HISTORY] Summary failed, dropping pending turns");
+    }
+    else
+    {
+        history.summary = summary;
+        Serial.printf("[HISTORY] Summary updated for %s (%u bytes)\n", history.work_id.c_str(),
+                      static_cast<unsigned>(history.summary.length()));
+    }
+    history.pending.remove(0, summary_request.pending_used);
+}
+
+void pollSummary()
+{
+    if (millis() - summary_request.started_ms > SUMMARY_TIMEOUT_MS)
+    {
+        Serial.println("[HISTORY] Summary timed out");
+        abortSummary();
+        summary_request.history->pending = "";
+        return;
+    }
+    if (!summary_request.header_read)
+    {
+        // stream:falseなのでヘッダは要約ができてからまとめて届く
+        if (httpStreamWaitReadable(summary_request.http, 0) <= 0)
+        {
+            return;
+        }
+        const int status = httpStreamReadResponseHeader(summary_request.http, SUMMARY_CONNECT_TIMEOUT_MS);
+        if (status != 200)
+        {
+            Serial.printf("[HISTORY] Summary HTTP %d\n", status);
+            abortSummary();
+            summary_request.history->pending = "";
+            return;
+        }
+        summary_request.header_read = true;
+    }
+    while (true)
+    {
+        const int n = httpStreamRead(summary_request.http, reinterpret_cast<uint8_t *>(summary_read_buffer),
+                                     sizeof(summary_read_buffer), 0);
+        if (n < 0)
+        {
+            finishSummary();
+            return;
+        }
+        if (n == 0)
+        {
+            return;
+        }
+        if (summary_request.body.length() + n <= SUMMARY_BODY_MAX_BYTES)
+        {
+            summary_request.body.concat(summary_read_buffer, n);
+        }
+    }
+}
+
+} // namespace
+
+void chatHistoryFit(const LlmWorkConfig &config, const String &prompt)
+{
+    // 要約のリクエストがバックエンドで推論の前に並ばないようにする
+    abortSummary();
+    last_inference_ms = millis();
+    ChatHistory &history = historyFor(config);
+    const uint32_t budget = llmContextBudget(config);
+    const uint32_t prompt_tokens = estimateTokens(history, prompt.length());
+    if (history.context_tokens + prompt_tokens > budget)
+    {
+        compactHistory(history, config, budget * HISTORY_COMPACT_RATIO, prompt_tokens);
+    }
+}
+
+void chatHistoryAppendMessages(const LlmWorkConfig &config, JsonArray messages)
+{
+    ChatHistory &history = historyFor(config);
+    if (config.system_prompt.length() > 0 || history.summary.length() > 0)
+    {
+        String system = config.system_prompt;
+        if (history.summary.length() > 0)
+        {
+            if (system.length() > 0)
+            {
+                system += "\n\n";
+            }
+            system += "Summary of the earlier conversation: ";
+            system += history.summary;
+        }
+        JsonObject system_message = messages.createNestedObject();
+        system_message["role"] = "system";
+        system_message["content"] = system;
+    }
+    for (size_t i = 0; i < history.count; i++)
+    {
+        ChatTurn &turn = turnAt(history, i);
+        JsonObject user_message = messages.createNestedObject();
+        user_message["role"] = "user";
+        user_message["content"] = turn.user;
+        JsonObject assistant_message = messages.createNestedObject();
+        assistant_message["role"] = "assistant";
+        assistant_message["content"] = turn.assistant;
+    }
+}
+
+size_t chatHistoryBytes(const LlmWorkConfig &config)
+{
+    ChatHistory *history = findHistory(config.work_id);
+    if (history == nullptr)
+    {
+        return config.system_prompt.length();
+    }
+    size_t bytes = config.system_prompt.length() + history->summary.length() + 64;
+    for (size_t i = 0; i < history->count; i++)
+    {
+        ChatTurn &turn = turnAt(*history, i);
+        // 各メッセージのroleやキーの分も見込む
+        bytes += turn.user.length() + turn.assistant.length() + 96;
+    }
+    return bytes;
+}
+
+void chatHistoryRecordTurn(const LlmWorkConfig &config, const String &prompt, const String &answer,
+                           const uint32_t prompt_eval_count, const uint32_t eval_count)
+{
+    last_inference_ms = millis();
+    ChatHistory &history = historyFor(config);
+    if (eval_count > 0 && answer.length() > 0)
+    {
+        const float bytes_per_token = static_cast<float>(answer.length()) / eval_count;
+        history.bytes_per_token = history.bytes_per_token * 0.7f + bytes_per_token * 0.3f;
+    }
+    if (history.count == CHAT_HISTORY_MAX_TURNS)
+    {
+        dropOldestTurn(history, config);
+    }
+    ChatTurn &turn = turnAt(history, history.count++);
+    turn.user = prompt;
+    turn.assistant = answer;
+
+    // prompt_eval_countはこの発話までの履歴全体のトークン数。バックエンドがプロンプトのキャッシュを使うと
+    // 新しく評価した分しか数えないことがあるので、推定より明らかに少なければ推定を使う
+    const uint32_t estimated = estimateContext(history, config);
+    const uint32_t reported = prompt_eval_count + eval_count;
+    history.context_tokens = reported * 2 >= estimated ? reported : estimated;
+
+    const uint32_t budget = llmContextBudget(config);
+    Serial.printf("[HISTORY] %s: %lu/%lu tokens, %u turns\n", config.work_id.c_str(),
+                  static_cast<unsigned long>(history.context_tokens), static_cast<unsigned long>(budget),
+                  static_cast<unsigned>(history.count));
+    if (history.context_tokens > budget)
+    {
+        compactHistory(history, config, budget * HISTORY_COMPACT_RATIO, 0);
+    }
+}
+
+void releaseChatHistory(const String &work_id)
+{
+    ChatHistory *history = findHistory(work_id);
+    if (history == nullptr)
+    {
+        return;
+    }
+    if (summary_request.active && summary_request.history == history)
+    {
+        abortSummary();
+    }
+    resetHistory(*history);
+}
+
+void clearChatHistories()
+{
+    abortSummary();
+    for (size_t i = 0; i < MAX_LLM_WORKS; i++)
+    {
+        resetHistory(chat_histories[i]);
+    }
+}
+
+void chatHistoryPoll()
+{
+    if (summary_request.active)
+    {
+        // 要約は推論より優先度が低いので、プロンプトが届いたら譲る
+        if (promptQueueDepth() > 0)
+        {
+            abortSummary();
+            return;
+        }
+        // 要約の生成を待つ間も省電力に入らない（モデムスリープだと応答の受信が遅れる）
+        powerOnActivity();
+        pollSummary();
+        return;
+    }
+    if (promptQueueDepth() > 0 || millis() - last_inference_ms < SUMMARY_IDLE_MS)
+    {
+        return;
+    }
+    for (size_t i = 0; i < MAX_LLM_WORKS; i++)
+    {
+        ChatHistory &history = chat_histories[i];
+        if (history.work_id.length() == 0 || history.pending.length() == 0)
+        {
+            continue;
+        }
+        const LlmWorkConfig *config = findLlmWork(history.work_id);
+        if (config == nullptr || config->history != LLM_HISTORY_SUMMARIZE)
+        {
+            history.pending = "";
+            continue;
+        }
+        if (!startSummary(history, *config))
+        {
+            // 接続できなければ次の空き時間にやり直す
+            last_inference_ms = millis();
+        }
+        return;
+    }
+}
+
+#endif // USE_WIFI_FOR_LLM_COMMUNICATION
@@ -0,0 +1,32 @@
+#ifndef CHAT_HISTORY_H
+#define CHAT_HISTORY_H
+
+#include "common.h"
+#include "llm_work.h"
+
+// work_idごとの会話の履歴（llm.setupで"history"を指定したもの）
+// 履歴は /api/chat のmessagesとして毎回送るので、長くなるほどプロンプトの評価に時間がかかる
+// doneの統計（prompt_eval_count, eval_count）でトークン数を追い、予算（llmContextBudget）を超えたら
+// 古い発話をまとめて落とす。落とした発話は、推論していない間にバックエンドで要約してシステムプロンプトに足す
+
+// 1つのwork_idで覚えておく発話（ユーザーと回答の組）の数
+constexpr size_t CHAT_HISTORY_MAX_TURNS = 16;
+
+// 推論の前に呼ぶ。これから送るプロンプトを足すと予算を超えるなら、先に古い発話を落とす
+void chatHistoryFit(const LlmWorkConfig &config, const String &prompt);
+// /api/chat のmessagesに、システムプロンプト（要約つき）とこれまでの発話を追加する
+void chatHistoryAppendMessages(const LlmWorkConfig &config, JsonArray messages);
+// chatHistoryAppendMessagesで追加する文字列のバイト数（JSONドキュメントの確保用）
+size_t chatHistoryBytes(const LlmWorkConfig &config);
+// doneまで受信できたら呼ぶ。発話を追加し、doneの統計でトークン数と1トークンあたりのバイト数を更新する
+void chatHistoryRecordTurn(const LlmWorkConfig &config, const String &prompt, const String &answer,
+                           const uint32_t prompt_eval_count, const uint32_t eval_count);
+
+void releaseChatHistory(const String &work_id);
+void clearChatHistories();
+
+// loop()から推論の前に呼ぶ。しばらく推論していなければ、落とした発話の要約をバックエンドに作らせる
+// プロンプトが届いたら要約のリクエストは中止し、また空いたときにやり直す
+void chatHistoryPoll();
+
+#endif // CHAT_HISTORY_H
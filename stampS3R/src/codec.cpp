@@ -0,0 +1,197 @@
+#include "codec.h"
+
+namespace {
+
+const char BASE64_CHARS[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+int8_t base64Value(const char c)
+{
+    if (c >= 'A' && c <= 'Z') return c - 'A';
+    if (c >= 'a' && c <= 'z') return c - 'a' + 26;
+    if (c >= '0' && c <= '9') return c - '0' + 52;
+    if (c == '+') return 62;
+    if (c == '/') return 63;
+    return -1;
+}
+
+const int16_t ADPCM_STEP_TABLE[89] = {
+    7, 8, 9, 10, 11, 12, 13, 14, 16, 17, 19, 21, 23, 25, 28, 31, 34, 37, 41, 45,
+    50, 55, 60, 66, 73, 80, 88, 97, 107, 118, 130, 143, 157, 173, 190, 209, 230,
+    253, 279, 307, 337, 371, 408, 449, 494, 544, 598, 658, 724, 796, 876, 963,
+    1060, 1166, 1282, 1411, 1552, 1707, 1878, 2066, 2272, 2499, 2749, 3024, 3327,
+    3660, 4026, 4428, 4871, 5358, 5894, 6484, 7132, 7845, 8630, 9493, 10442, 11487,
+    12635, 13899, 15289, 16818, 18500, 20350, 22385, 24623, 27086, 29794, 32767};
+
+const int8_t ADPCM_INDEX_TABLE[16] = {-1, -1, -1, -1, 2, 4, 6, 8, -1, -1, -1, -1, 2, 4, 6, 8};
+
+int16_t adpcmDecodeNibble(AdpcmState &state, const uint8_t nibble)
+{
+    const int32_t step = ADPCM_STEP_TABLE[state.step_index];
+    int32_t diff = step >> 3;
+    if (nibble & 4) diff += step;
+    if (nibble & 2) diff += step >> 1;
+    if (nibble & 1) diff += step >> 2;
+    int32_t predictor = state.predictor + ((nibble & 8) ? -diff : diff);
+    if (predictor > 32767) predictor = 32767;
+    if (predictor < -32768) predictor = -32768;
+    state.predictor = static_cast<int16_t>(predictor);
+
+    int16_t index = state.step_index + ADPCM_INDEX_TABLE[nibble];
+    if (index < 0) index = 0;
+    if (index > 88) index = 88;
+    state.step_index = static_cast<uint8_t>(index);
+    return state.predictor;
+}
+
+uint8_t adpcmEncodeSample(AdpcmState &state, const int16_t sample)
+{
+    const int32_t step = ADPCM_STEP_TABLE[state.step_index];
+    int32_t diff = sample - state.predictor;
+    uint8_t nibble = 0;
+    if (diff < 0)
+    {
+        nibble = 8;
+        diff = -diff;
+    }
+    if (diff >= step)
+    {
+        nibble |= 4;
+        diff -= step;
+    }
+    if (diff >= (step >> 1))
+    {
+        nibble |= 2;
+        diff -= step >> 1;
+    }
+    if (diff >= (step >> 2))
+    {
+        nibble |= 1;
+    }
+    // デコーダと同じ計算で予測値を更新する
+    adpcmDecodeNibble(state, nibble);
+    return nibble;
+}
+
+} // namespace
+
+int base64Decode(const char *input, const size_t length, uint8_t *out)
+{
+    size_t written = 0;
+    uint32_t bits = 0;
+    uint8_t bit_count = 0;
+    for (size_t i = 0; i < length; i++)
+    {
+        const char c = input[i];
+        if (c == '=')
+        {
+            break;
+        }
+        const int8_t value = base64Value(c);
+        if (value < 0)
+        {
+            return -1;
+        }
+        bits = (bits << 6) | static_cast<uint32_t>(value);
+        bit_count += 6;
+        if (bit_count >= 8)
+        {
+            bit_count -= 8;
+            out[written++] = static_cast<uint8_t>(bits >> bit_count);
+        }
+    }
+    return static_cast<int>(written);
+}
+
+size_t base64Encode(const uint8_t *input, const size_t length, char *out)
+{
+    size_t written = 0;
+    size_t i = 0;
+    for (; i + 2 < length; i += 3)
+    {
+        const uint32_t bits = (input[i] << 16) | (input[i + 1] << 8) | input[i + 2];
+        out[written++] = BASE64_CHARS[(bits >> 18) & 0x3F];
+        out[written++] = BASE64_CHARS[(bits >> 12) & 0x3F];
+        out[written++] = BASE64_CHARS[(bits >> 6) & 0x3F];
+        out[written++] = BASE64_CHARS[bits & 0x3F];
+    }
+    if (i < length)
+    {
+        const uint32_t bits = (input[i] << 16) | (i + 1 < length ? input[i + 1] << 8 : 0);
+        out[written++] = BASE64_CHARS[(bits >> 18) & 0x3F];
+        out[written++] = BASE64_CHARS[(bits >> 12) & 0x3F];
+        out[written++] = i + 1 < length ? BASE64_CHARS[(bits >> 6) & 0x3F] : '=';
+        out[written++] = '=';
+    }
+    out[written] = '\0';
+    return written;
+}
+
+void adpcmReset(AdpcmState &state)
+{
+    state.predictor = 0;
+    state.step_index = 0;
+}
+
+void adpcmDecode(AdpcmState &state, const uint8_t *input, const size_t input_length, int16_t *out)
+{
+    for (size_t i = 0; i < input_length; i++)
+    {
+        out[i * 2] = adpcmDecodeNibble(state, input[i] & 0x0F);
+        out[i * 2 + 1] = adpcmDecodeNibble(state, input[i] >> 4);
+    }
+}
+
+void adpcmEncode(AdpcmState &state, const int16_t *input, const size_t sample_count, uint8_t *out)
+{
+    for (size_t i = 0; i + 1 < sample_count; i += 2)
+    {
+        const uint8_t low = adpcmEncodeSample(state, input[i]);
+        const uint8_t high = adpcmEncodeSample(state, input[i + 1]);
+        out[i / 2] = static_cast<uint8_t>(low | (high << 4));
+    }
+}
+
+uint16_t floatToHalf(const float value)
+{
+    uint32_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    const uint16_t sign = (bits >> 16) & 0x8000;
+    const uint32_t float_exponent = (bits >> 23) & 0xff;
+    uint32_t mantissa = bits & 0x7fffff;
+    if (float_exponent == 0xff)
+    {
+        // InfとNaN
+        return sign | 0x7c00 | (mantissa != 0 ? 0x200 : 0);
+    }
+    const int32_t exponent = static_cast<int32_t>(float_exponent) - 127 + 15;
+    if (exponent >= 31)
+    {
+        return sign | 0x7c00;
+    }
+    if (exponent <= 0)
+    {
+        // 半精度では非正規化数になる。小さすぎれば0
+        if (exponent < -10)
+        {
+            return sign;
+        }
+        mantissa |= 0x800000;
+        const uint32_t shift = 14 - exponent;
+        uint32_t half = mantissa >> shift;
+        const uint32_t rest = mantissa & ((1u << shift) - 1);
+        const uint32_t halfway = 1u << (shift - 1);
+        if (rest > halfway || (rest == halfway && (half & 1)))
+        {
+            half++;
+        }
+        return sign | half;
+    }
+    uint32_t half = (static_cast<uint32_t>(exponent) << 10) | (mantissa >> 13);
+    const uint32_t rest = mantissa & 0x1fff;
+    // 繰り上がりで指数が1つ増えても（最大ならInfになって）正しい
+    if (rest > 0x1000 || (rest == 0x1000 && (half & 1)))
+    {
+        half++;
+    }
+    return sign | half;
+}
@@ -0,0 +1,30 @@
+#ifndef CODEC_H
+#define CODEC_H
+
+#include <Arduino.h>
+
+// base64をデコードする。outには (length / 4) * 3 バイト以上の領域が必要
+// 不正な文字があれば-1、成功したらデコードしたバイト数を返す
+int base64Decode(const char *input, const size_t length, uint8_t *out);
+
+// base64にエンコードする（終端の'\0'つき）。outには ((length + 2) / 3) * 4 + 1 バイト以上の領域が必要
+size_t base64Encode(const uint8_t *input, const size_t length, char *out);
+
+// floatをIEEE 754の半精度（binary16）のビット列にする（最近接偶数への丸め）
+uint16_t floatToHalf(const float value);
+
+// IMA ADPCM（4bit、ブロックヘッダなしの連続ストリーム、1バイトに下位ニブルから2サンプル）
+// 状態はストリームの開始時にゼロで初期化し、両端で同じ順に処理する
+struct AdpcmState
+{
+    int16_t predictor;
+    uint8_t step_index;
+};
+
+void adpcmReset(AdpcmState &state);
+// input_lengthバイトを input_length * 2 サンプルにデコードする
+void adpcmDecode(AdpcmState &state, const uint8_t *input, const size_t input_length, int16_t *out);
+// sample_countサンプル（偶数）を sample_count / 2 バイトにエンコードする
+void adpcmEncode(AdpcmState &state, const int16_t *input, const size_t sample_count, uint8_t *out);
+
+#endif // CODEC_H
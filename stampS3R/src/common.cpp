@@ -1,4 +1,6 @@
 #include "common.h"
+#include "capture.h"
+#include "metrics.h"
 #include <M5Unified.h>
 #include <cstring>
 
@@ -50,30 +52,24 @@ void led_saySuccess_initialize() {
 
 namespace {
 
-char jsonBuffer[JSON_BUFFER_SIZE];
-size_t jsonBufferIndex = 0;
+JsonFrameScanner json_frame;
 unsigned long lastCharTime = 0;
-int openBraces = 0;
-bool inString = false;
-bool escaped = false;
 unsigned long parseErrorTime = 0;
 
 } // namespace
 
 void resetJsonBuffer()
 {
-    jsonBufferIndex = 0;
-    jsonBuffer[0] = '\0';
+    jsonFrameReset(json_frame);
     lastCharTime = 0;
-    openBraces = 0;
-    inString = false;
-    escaped = false;
     parseErrorTime = 0;
 }
 
-bool readJsonMessage(JsonDocument &doc)
+bool readJsonMessage(JsonDocument &doc, CommandFilterSelector select_filter)
 {
-    if (jsonBufferIndex > 0 && millis() - lastCharTime > JSON_TIMEOUT_MS)
+    const uint32_t perfStart = micros();
+
+    if (json_frame.length > 0 && millis() - lastCharTime > JSON_TIMEOUT_MS)
     {
         Serial.println("[JSON] Timeout, resetting buffer");
         resetJsonBuffer();
@@ -102,94 +98,36 @@ bool readJsonMessage(JsonDocument &doc)
             parseErrorTime = 0;
         }
 
-        if (c == '\n' || c == '\r')
-        {
-            resetJsonBuffer();
-            continue;
-        }
-
-        if (jsonBufferIndex >= JSON_BUFFER_SIZE - 1)
+        const JsonFrameStatus status = jsonFrameFeed(json_frame, c);
+        if (status == JSON_FRAME_OVERFLOW)
         {
             Serial.println("[JSON] Buffer overflow, resetting");
-            resetJsonBuffer();
             continue;
         }
-
-        if (escaped)
+        if (status != JSON_FRAME_COMPLETE)
         {
-            escaped = false;
-            jsonBuffer[jsonBufferIndex++] = c;
             continue;
         }
 
-        if (c == '\\')
-        {
-            escaped = true;
-            jsonBuffer[jsonBufferIndex++] = c;
-            continue;
-        }
+        char *start = jsonFrameText(json_frame);
+        captureRecord(CAPTURE_UART_RX, start, std::strlen(start));
+        const JsonDocument *filter = select_filter ? select_filter(start) : nullptr;
+        DeserializationError error = filter ? deserializeJson(doc, start, DeserializationOption::Filter(*filter))
+                                            : deserializeJson(doc, start);
 
-        if (c == '"')
+        if (error)
         {
-            inString = !inString;
-            jsonBuffer[jsonBufferIndex++] = c;
-            continue;
+            Serial.print("[JSON] Parse error: ");
+            Serial.println(error.c_str());
+            Serial.print("[JSON] Received: ");
+            Serial.println(start);
+            parseErrorTime = millis();
+            return false;
         }
 
-        jsonBuffer[jsonBufferIndex++] = c;
-
-        if (!inString)
-        {
-            if (c == '{')
-            {
-                openBraces++;
-            }
-            else if (c == '}')
-            {
-                openBraces--;
-
-                if (openBraces == 0)
-                {
-                    jsonBuffer[jsonBufferIndex] = '\0';
-
-                    char *start = jsonBuffer;
-                    while (*start == ' ' || *start == '\t')
-                    {
-                        start++;
-                    }
-                    char *end = jsonBuffer + jsonBufferIndex - 1;
-                    while (end > start && (*end == ' ' || *end == '\t' || *end == '\0'))
-                    {
-                        end--;
-                    }
-                    *(end + 1) = '\0';
-
-                    if (std::strlen(start) > 0)
-                    {
-                        DeserializationError error = deserializeJson(doc, start);
-
-                        if (error)
-                        {
-                            Serial.print("[JSON] Parse error: ");
-                            Serial.println(error.c_str());
-                            Serial.print("[JSON] Received: ");
-                            Serial.println(start);
-                            parseErrorTime = millis();
-                            return false;
-                        }
-
-                        resetJsonBuffer();
-                        return true;
-                    }
-
-                    resetJsonBuffer();
-                }
-                else if (openBraces < 0)
-                {
-                    resetJsonBuffer();
-                }
-            }
-        }
+        perfRecord(PERF_READ_JSON_MESSAGE, micros() - perfStart, json_frame.length);
+        resetJsonBuffer();
+        return true;
     }
 
     return false;
@@ -224,25 +162,42 @@ initSPIFFSResult initSPIFFS() {
   }
 }
 
-void sendToM5(const ResponseMsg_t& response_msg) {
-    String response_json = "{\"request_id\":\"" + response_msg.request_id + "\",\"work_id\":\"" + response_msg.work_id + "\",\"object\":\"" + response_msg.object + "\"";
-    
-    // inference_dataが空でない場合はdataフィールドを追加
-    if (response_msg.inference_data.delta.length() > 0 || response_msg.inference_data.finish) {
-        // deltaフィールドのエスケープ処理（JSONの特殊文字をエスケープ）
-        String delta_escaped = response_msg.inference_data.delta;
-        delta_escaped.replace("\\", "\\\\");
-        delta_escaped.replace("\"", "\\\"");
-        delta_escaped.replace("\n", "\\n");
-        delta_escaped.replace("\r", "\\r");
-        delta_escaped.replace("\t", "\\t");
-        
-        response_json += ",\"data\":{\"delta\":\"" + delta_escaped + "\",\"index\":" + String(response_msg.inference_data.index) + ",\"finish\":" + (response_msg.inference_data.finish ? "true" : "false") + "}";
+namespace {
+
+SemaphoreHandle_t sendMutex() {
+    // TTSの合成タスクからも送るので、行が混ざらないよう1行ずつ排他する
+    static SemaphoreHandle_t mutex = xSemaphoreCreateMutex();
+    return mutex;
+}
+
+// 返答の行（排他中のみ使う）
+ResponseJson response_json;
+
+} // namespace
+
+bool sendToM5(const ResponseMsg_t& response_msg) {
+    xSemaphoreTake(sendMutex(), portMAX_DELAY);
+    const uint32_t perfStart = micros();
+    const bool sent = buildResponseJson(response_json, response_msg);
+    perfRecord(PERF_SEND_TO_M5, micros() - perfStart, response_json.length());
+    if (!sent) {
+        Serial.println("[JSON] Response too long, not sent");
+    } else {
+        Serial2.println(response_json.c_str());
+        captureRecord(CAPTURE_UART_TX, response_json.c_str(), response_json.length());
+        metricsObserveUartBacklog();
+        Serial.print("[JSON] Sent to M5: ");
+        Serial.println(response_json.c_str());
     }
-    
-    response_json += ",\"error\":{\"code\":" + String(response_msg.error.code) + ",\"message\":\"" + response_msg.error.message + "\"}}";
-    Serial2.println(response_json);
-    Serial.print("[JSON] Sent to M5: ");
-    Serial.println(response_json);
+    xSemaphoreGive(sendMutex());
+    return sent;
+}
+
+void sendLineToM5(const char *line) {
+    xSemaphoreTake(sendMutex(), portMAX_DELAY);
+    Serial2.println(line);
+    captureRecord(CAPTURE_UART_TX, line, strlen(line));
+    metricsObserveUartBacklog();
+    xSemaphoreGive(sendMutex());
 }
    
\ No newline at end of file
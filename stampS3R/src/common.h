@@ -2,6 +2,8 @@
 #define COMMON_H
 
 #include "config.h"
+#include "perf.h"
+#include "protocol.h"
 #include <ArduinoJson.h>
 #include <FastLED.h>
 #include <SPIFFS.h>
@@ -24,6 +26,10 @@ enum SerialReceiveResult
     SERIAL_RECEIVE_FAILURE = 1
 };
 
+// Coreと接続するUART(Serial2)のピン
+#define M5_UART_RX_PIN 7
+#define M5_UART_TX_PIN 5
+
 // LED設定
 #define LED_NUM 1
 #define LED_PIN 21
@@ -59,30 +65,10 @@ initSPIFFSResult initSPIFFS();
 // 通信初期化関数
 initCommunicationResult init_communication();
 
-// 返答用のJSONの元になる構造体
-struct ResponseMsg_t_error
-{
-    uint16_t code;
-    String message;
-};
-
-struct ResponseMsg_t_inference_data
-{
-    String delta;
-    uint16_t index;
-    bool finish;
-};
-
-struct ResponseMsg_t
-{
-    String request_id;
-    String work_id;
-    String object;
-    ResponseMsg_t_error error;
-    ResponseMsg_t_inference_data inference_data;
-};
-
-void sendToM5(const ResponseMsg_t &response_msg);
+// 長すぎて送れなかったらfalse
+bool sendToM5(const ResponseMsg_t &response_msg);
+// Coreへ1行送る（複数のタスクから呼べる）
+void sendLineToM5(const char *line);
 
 enum sendToPCResult
 {
@@ -102,17 +88,27 @@ enum LLM_Status
 extern String using_model_name;
 extern String current_work_id;
 
+struct LlmWorkConfig;
+
 struct OllamaInferenceCommand
 {
     String model;
     String prompt;
+    String work_id;
+    String object;               // 返答のobject（空ならllm.utf-8.stream）
+    const LlmWorkConfig *config; // setupで指定された生成パラメータ（なければnullptr）
 };
 
-constexpr size_t JSON_BUFFER_SIZE = 2048;
+// sys.versionで返すバージョン
+constexpr const char *FIRMWARE_VERSION = "v1.0";
+
+// Coreへの送信バッファ。音声フレームを溜めてもLLMの応答が長く待たされない程度にする
+constexpr size_t M5_UART_TX_BUFFER_SIZE = 2048;
 constexpr unsigned long JSON_TIMEOUT_MS = 1000;
 constexpr unsigned long PARSE_ERROR_WAIT_MS = 50;
 
 void resetJsonBuffer();
-bool readJsonMessage(JsonDocument &doc);
+// select_filterを指定すると、フレームごとに選んだフィルタにあるフィールドだけをdocに展開する
+bool readJsonMessage(JsonDocument &doc, CommandFilterSelector select_filter = nullptr);
 
 #endif // COMMON_H
\ No newline at end of file
@@ -5,3 +5,79 @@
 #ifndef USE_WIFI_FOR_LLM_COMMUNICATION
 #define USE_WIFI_FOR_LLM_COMMUNICATION true
 #endif
+
+// true: ホットパスの処理時間を計測してシリアルにJSONで出力 (デフォルト: false)
+#ifndef ENABLE_PERF_LOG
+#define ENABLE_PERF_LOG false
+#endif
+
+// 省電力: 最後のコマンドからこの時間(ms)が経ったらCPUクロックを下げてWiFiをモデムスリープにする (デフォルト: 10000)
+#ifndef POWER_IDLE_TIMEOUT_MS
+#define POWER_IDLE_TIMEOUT_MS 10000
+#endif
+
+// 省電力: アイドル時にライトスリープしてUARTのRXピンで起床する (デフォルト: false)
+// WiFi接続はライトスリープ中に維持できないため、USE_WIFI_FOR_LLM_COMMUNICATIONがfalseのときのみ有効
+#ifndef POWER_IDLE_LIGHT_SLEEP
+#define POWER_IDLE_LIGHT_SLEEP false
+#endif
+
+// セマンティックキャッシュ（llm.setupのdataで"cache":trueにしたwork_idのみ）: プロンプトのベクトルを計算するモデル
+#ifndef SEMANTIC_CACHE_EMBED_MODEL
+#define SEMANTIC_CACHE_EMBED_MODEL "nomic-embed-text"
+#endif
+
+// セマンティックキャッシュ: この類似度（コサイン）以上なら保存した回答を返す (デフォルト: 0.92)
+#ifndef SEMANTIC_CACHE_THRESHOLD
+#define SEMANTIC_CACHE_THRESHOLD 0.92f
+#endif
+
+// セマンティックキャッシュ: SPIFFSに保存する回答の数 (デフォルト: 32)
+#ifndef SEMANTIC_CACHE_MAX_ENTRIES
+#define SEMANTIC_CACHE_MAX_ENTRIES 32
+#endif
+
+// セマンティックキャッシュ: ESP32-S3のベクトル命令（PIE）で内積を計算する。起動後の最初の検索で通常の計算と結果を比べ、違えば通常の計算に戻す (デフォルト: true)
+#ifndef SEMANTIC_CACHE_USE_PIE
+#define SEMANTIC_CACHE_USE_PIE true
+#endif
+
+// 1回の推論で使うJSONドキュメントを切り出す領域のバイト数。足りない分はヒープから確保する (デフォルト: 16384)
+#ifndef REQUEST_ARENA_SIZE
+#define REQUEST_ARENA_SIZE 16384
+#endif
+
+// 推論中に届いたプロンプトをwork_idごとにこの数まで待たせる。超えた分はエラーを返す (デフォルト: 4)
+#ifndef PROMPT_QUEUE_DEPTH
+#define PROMPT_QUEUE_DEPTH 4
+#endif
+
+// 通信のキャプチャ（serial/replay.pyで再生する）: 0=記録しない, 1=USBシリアルに"[CAP] "をつけて出力, 2=SPIFFSのリングに保存 (デフォルト: 0)
+#ifndef CAPTURE_MODE
+#define CAPTURE_MODE 0
+#endif
+
+// キャプチャ: SPIFFSのファイル1つあたりの上限バイト数。2つのファイルを交互に使う (デフォルト: 65536)
+#ifndef CAPTURE_FILE_SIZE
+#define CAPTURE_FILE_SIZE 65536
+#endif
+
+// キャプチャ: 1件の記録を組み立てるバッファと、SPIFFSに書く前にRAMにためるバッファ（2つ）のバイト数。これを超える記録は切って"truncated":trueをつける (デフォルト: 4096)
+#ifndef CAPTURE_BUFFER_SIZE
+#define CAPTURE_BUFFER_SIZE 4096
+#endif
+
+// WiFi接続時に、Prometheus形式の稼働統計を http://<ModuleのIP>:METRICS_HTTP_PORT/metrics で返す (デフォルト: false)
+#ifndef ENABLE_METRICS_SERVER
+#define ENABLE_METRICS_SERVER false
+#endif
+
+// /metricsを返すポート (デフォルト: 9100)
+#ifndef METRICS_HTTP_PORT
+#define METRICS_HTTP_PORT 9100
+#endif
+
+// 会話の履歴（llm.setupのdataで"history"を指定したwork_idのみ）に使うトークン数の上限。num_ctxを指定した場合はその3/4 (デフォルト: 1536)
+#ifndef LLM_CONTEXT_BUDGET
+#define LLM_CONTEXT_BUDGET 1536
+#endif
\ No newline at end of file
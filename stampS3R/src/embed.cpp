@@ -0,0 +1,173 @@
+#include "embed.h"
+#include "codec.h"
+#include "embedding.h"
+#include "power.h"
+
+#if USE_WIFI_FOR_LLM_COMMUNICATION
+
+namespace {
+
+struct EmbedSession
+{
+    bool active;
+    String work_id;
+    EmbedConfig config;
+};
+
+// Coreへ送るフレームの組み立て
+struct EmbedFrameWriter
+{
+    const String *work_id;
+    const String *request_id;
+    const char *object;
+    size_t total_bytes;
+    size_t sent_bytes;
+    size_t frame_length;
+    uint16_t index;
+};
+
+EmbedSession embed_session;
+uint8_t embed_frame[EMBED_FRAME_BYTES];
+char embed_base64[((EMBED_FRAME_BYTES + 2) / 3) * 4 + 1];
+
+void resetSession()
+{
+    embed_session.active = false;
+    embed_session.work_id = "";
+}
+
+void sendFrame(EmbedFrameWriter &writer)
+{
+    writer.sent_bytes += writer.frame_length;
+    base64Encode(embed_frame, writer.frame_length, embed_base64);
+    writer.frame_length = 0;
+
+    ResponseMsg_t response_msg;
+    response_msg.request_id = *writer.request_id;
+    response_msg.work_id = *writer.work_id;
+    response_msg.object = writer.object;
+    response_msg.error.code = 0;
+    response_msg.error.message = "";
+    response_msg.inference_data.delta = embed_base64;
+    response_msg.inference_data.index = writer.index++;
+    response_msg.inference_data.finish = writer.sent_bytes == writer.total_bytes;
+    sendToM5(response_msg);
+}
+
+void writeByte(EmbedFrameWriter &writer, const uint8_t value)
+{
+    embed_frame[writer.frame_length++] = value;
+    if (writer.frame_length == EMBED_FRAME_BYTES || writer.sent_bytes + writer.frame_length == writer.total_bytes)
+    {
+        sendFrame(writer);
+    }
+}
+
+void writeInt8(EmbedFrameWriter &writer, const float *vector, const size_t dims)
+{
+    float max_abs = 0;
+    for (size_t i = 0; i < dims; i++)
+    {
+        max_abs = fmaxf(max_abs, fabsf(vector[i]));
+    }
+    // 最大の絶対値が127になるようにする。scaleは元に戻すための倍率
+    const float scale = max_abs / 127.0f;
+    const float inverse = max_abs > 0 ? 127.0f / max_abs : 0;
+    uint32_t scale_bits;
+    memcpy(&scale_bits, &scale, sizeof(scale_bits));
+    for (size_t i = 0; i < sizeof(scale_bits); i++)
+    {
+        writeByte(writer, static_cast<uint8_t>(scale_bits >> (8 * i)));
+    }
+    for (size_t i = 0; i < dims; i++)
+    {
+        writeByte(writer, static_cast<uint8_t>(static_cast<int8_t>(lroundf(vector[i] * inverse))));
+    }
+}
+
+void writeFp16(EmbedFrameWriter &writer, const float *vector, const size_t dims)
+{
+    for (size_t i = 0; i < dims; i++)
+    {
+        const uint16_t half = floatToHalf(vector[i]);
+        writeByte(writer, static_cast<uint8_t>(half));
+        writeByte(writer, static_cast<uint8_t>(half >> 8));
+    }
+}
+
+} // namespace
+
+void parseEmbedConfig(JsonVariantConst data, EmbedConfig &config)
+{
+    config.model = data["model"] | SEMANTIC_CACHE_EMBED_MODEL;
+    config.format = strcmp(data["format"] | "int8", "fp16") == 0 ? EMBED_FORMAT_FP16 : EMBED_FORMAT_INT8;
+}
+
+EmbedStatus embed_setup(const String &work_id, const EmbedConfig &config)
+{
+    resetSession();
+    if (config.model.length() == 0)
+    {
+        return EMBED_NOT_OK;
+    }
+    embed_session.active = true;
+    embed_session.work_id = work_id;
+    embed_session.config = config;
+    return EMBED_OK;
+}
+
+EmbedStatus embed_inference(const String &work_id, const String &request_id, const String &text)
+{
+    if (!embed_session.active || embed_session.work_id != work_id || text.length() == 0)
+    {
+        return EMBED_NOT_OK;
+    }
+    powerOnActivity();
+    // ベクトルは推論のたびに確保して、使い終わったら解放する（16KBをずっと持たない）
+    float *vector = static_cast<float *>(malloc(EMBED_MAX_DIMS * sizeof(float)));
+    if (vector == nullptr)
+    {
+        Serial.println("[EMBED] Out of memory");
+        return EMBED_NOT_OK;
+    }
+    const uint32_t start = micros();
+    const int dims = fetchEmbedding(embed_session.config.model, text, vector, EMBED_MAX_DIMS);
+    if (dims <= 0)
+    {
+        free(vector);
+        return EMBED_NOT_OK;
+    }
+
+    const bool int8 = embed_session.config.format == EMBED_FORMAT_INT8;
+    EmbedFrameWriter writer;
+    writer.work_id = &work_id;
+    writer.request_id = &request_id;
+    writer.object = int8 ? "embed.int8.base64.stream" : "embed.fp16.base64.stream";
+    writer.total_bytes = int8 ? sizeof(float) + dims : dims * sizeof(uint16_t);
+    writer.sent_bytes = 0;
+    writer.frame_length = 0;
+    writer.index = 0;
+    if (int8)
+    {
+        writeInt8(writer, vector, dims);
+    }
+    else
+    {
+        writeFp16(writer, vector, dims);
+    }
+    free(vector);
+    Serial.printf("[EMBED] %d dims -> %u bytes in %u frames (%s), %lu ms\n", dims,
+                  static_cast<unsigned>(writer.total_bytes), static_cast<unsigned>(writer.index),
+                  int8 ? "int8" : "fp16", static_cast<unsigned long>((micros() - start) / 1000));
+    return EMBED_OK;
+}
+
+void embed_exit(const String &work_id)
+{
+    if (embed_session.work_id == work_id)
+    {
+        resetSession();
+    }
+}
+
+#endif // USE_WIFI_FOR_LLM_COMMUNICATION
@@ -0,0 +1,46 @@
+#ifndef EMBED_H
+#define EMBED_H
+
+#include "common.h"
+
+// embed: Coreから届いたテキストのベクトルをバックエンド（/api/embed）で計算して返す
+// ベクトルはJSONの数値の列ではなく、量子化したバイト列をbase64にしたフレームで返す
+//   int8: 先頭4バイトがfloat32（リトルエンディアン）のscale、続いて次元数分のint8。元の値は int8 * scale
+//   fp16: 次元数分のIEEE 754半精度（リトルエンディアン）
+// EMBED_FRAME_BYTESバイトごとに分けて、index（0から）とfinish（最後のフレームでtrue）をつける
+
+enum EmbedStatus
+{
+    EMBED_OK = 0,
+    EMBED_NOT_OK = 1
+};
+
+enum EmbedFormat
+{
+    EMBED_FORMAT_INT8 = 0,
+    EMBED_FORMAT_FP16 = 1
+};
+
+// 1フレームのバイト数（base64にする前）
+constexpr size_t EMBED_FRAME_BYTES = 768;
+// 受け取れる最大の次元数
+constexpr size_t EMBED_MAX_DIMS = 4096;
+
+// embed.setupのdata
+struct EmbedConfig
+{
+    String model;       // 空ならSEMANTIC_CACHE_EMBED_MODEL
+    EmbedFormat format; // "int8"（デフォルト）または "fp16"
+};
+
+void parseEmbedConfig(JsonVariantConst data, EmbedConfig &config);
+
+// 前のセッションは破棄する
+EmbedStatus embed_setup(const String &work_id, const EmbedConfig &config);
+
+// textのベクトルを計算し、embed.int8.base64.stream / embed.fp16.base64.stream のフレームでCoreへ返す
+EmbedStatus embed_inference(const String &work_id, const String &request_id, const String &text);
+
+void embed_exit(const String &work_id);
+
+#endif // EMBED_H
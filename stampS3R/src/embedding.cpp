@@ -0,0 +1,156 @@
+#include "embedding.h"
+
+namespace {
+
+enum EmbeddingParserState
+{
+    EMBED_FIND_KEY = 0, // "embeddings" を探す
+    EMBED_FIND_ARRAY = 1, // キーの後の [[ を探す
+    EMBED_NUMBERS = 2,
+    EMBED_DONE = 3
+};
+
+const char EMBEDDINGS_KEY[] = "\"embeddings\"";
+
+void finishNumber(EmbeddingParser &parser)
+{
+    if (parser.number_length == 0)
+    {
+        return;
+    }
+    parser.number[parser.number_length] = '\0';
+    if (parser.count < parser.capacity)
+    {
+        parser.out[parser.count] = strtof(parser.number, nullptr);
+    }
+    parser.count++;
+    parser.number_length = 0;
+}
+
+} // namespace
+
+void embeddingParserBegin(EmbeddingParser &parser, float *out, const size_t capacity)
+{
+    parser.state = EMBED_FIND_KEY;
+    parser.key_match = 0;
+    parser.depth = 0;
+    parser.number_length = 0;
+    parser.out = out;
+    parser.capacity = capacity;
+    parser.count = 0;
+}
+
+void embeddingParserFeed(EmbeddingParser &parser, const char *data, const size_t length)
+{
+    for (size_t i = 0; i < length && parser.state != EMBED_DONE; i++)
+    {
+        const char c = data[i];
+        switch (parser.state)
+        {
+        case EMBED_FIND_KEY:
+            if (c == EMBEDDINGS_KEY[parser.key_match])
+            {
+                parser.key_match++;
+                if (EMBEDDINGS_KEY[parser.key_match] == '\0')
+                {
+                    parser.state = EMBED_FIND_ARRAY;
+                }
+            }
+            else
+            {
+                parser.key_match = c == '"' ? 1 : 0;
+            }
+            break;
+        case EMBED_FIND_ARRAY:
+            if (c == '[' && ++parser.depth == 2)
+            {
+                parser.state = EMBED_NUMBERS;
+            }
+            break;
+        case EMBED_NUMBERS:
+            if ((c >= '0' && c <= '9') || c == '-' || c == '+' || c == '.' || c == 'e' || c == 'E')
+            {
+                if (parser.number_length < sizeof(parser.number) - 1)
+                {
+                    parser.number[parser.number_length++] = c;
+                }
+            }
+            else
+            {
+                finishNumber(parser);
+                if (c == ']')
+                {
+                    // 最初のベクトルだけ読む
+                    parser.state = EMBED_DONE;
+                }
+            }
+            break;
+        }
+    }
+}
+
+bool embeddingParserDone(const EmbeddingParser &parser)
+{
+    return parser.state == EMBED_DONE;
+}
+
+#if USE_WIFI_FOR_LLM_COMMUNICATION
+
+#include "secrets.h"
+#include "http_stream.h"
+#include "use_wifi.h"
+
+namespace {
+
+constexpr unsigned long EMBED_CONNECT_TIMEOUT_MS = 2000;
+constexpr unsigned long EMBED_RESPONSE_TIMEOUT_MS = 10000;
+char embed_read_buffer[1460];
+
+} // namespace
+
+int fetchEmbedding(const String &model, const String &text, float *out, const size_t capacity)
+{
+    DynamicJsonDocument requestDoc(256 + text.length());
+    requestDoc["model"] = model;
+    requestDoc["input"] = text;
+    String requestBody;
+    serializeJson(requestDoc, requestBody);
+
+    WiFiClient client;
+    HttpStream http;
+    if (!httpStreamConnectBackend(http, client, EMBED_CONNECT_TIMEOUT_MS) ||
+        !httpStreamSendRequest(http, "POST", "/api/embed", requestBody))
+    {
+        httpStreamClose(http);
+        return -1;
+    }
+    const int status = httpStreamReadResponseHeader(http, EMBED_RESPONSE_TIMEOUT_MS);
+    if (status != 200)
+    {
+        Serial.printf("[EMBED] HTTP %d\n", status);
+        httpStreamClose(http);
+        return -1;
+    }
+
+    EmbeddingParser parser;
+    embeddingParserBegin(parser, out, capacity);
+    while (!embeddingParserDone(parser))
+    {
+        const int n = httpStreamRead(http, reinterpret_cast<uint8_t *>(embed_read_buffer), sizeof(embed_read_buffer),
+                                     EMBED_RESPONSE_TIMEOUT_MS);
+        if (n <= 0)
+        {
+            break;
+        }
+        embeddingParserFeed(parser, embed_read_buffer, n);
+    }
+    httpStreamClose(http);
+    if (!embeddingParserDone(parser) || parser.count == 0 || parser.count > capacity)
+    {
+        Serial.printf("[EMBED] Invalid embedding (%lu values)\n", static_cast<unsigned long>(parser.count));
+        return -1;
+    }
+    return static_cast<int>(parser.count);
+}
+
+#endif // USE_WIFI_FOR_LLM_COMMUNICATION
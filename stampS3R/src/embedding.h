@@ -0,0 +1,27 @@
+#ifndef EMBEDDING_H
+#define EMBEDDING_H
+
+#include "common.h"
+
+// /api/embed の応答から最初のベクトルを読み取る
+// 数千個の数値をJsonDocumentに展開せず、受信したそばから1つずつ取り出す
+struct EmbeddingParser
+{
+    uint8_t state;
+    uint8_t key_match;   // "embeddings" のどこまで一致したか
+    uint8_t depth;       // キーの後の '[' の深さ
+    char number[32];
+    uint8_t number_length;
+    float *out;
+    size_t capacity;
+    size_t count;        // 読み取った要素数（capacityを超えた分も数える）
+};
+
+void embeddingParserBegin(EmbeddingParser &parser, float *out, const size_t capacity);
+void embeddingParserFeed(EmbeddingParser &parser, const char *data, const size_t length);
+bool embeddingParserDone(const EmbeddingParser &parser);
+
+// バックエンドでtextのベクトルを計算してoutに入れる。次元数、失敗したら-1を返す
+int fetchEmbedding(const String &model, const String &text, float *out, const size_t capacity);
+
+#endif // EMBEDDING_H
@@ -0,0 +1,347 @@
+#include "http_stream.h"
+#include "metrics.h"
+#include <lwip/sockets.h>
+#include <strings.h>
+
+#if USE_WIFI_FOR_LLM_COMMUNICATION
+
+extern uint16_t host_ollama_port;
+
+namespace {
+
+// keep-aliveの接続を閉じる前に、応答の残り（chunkedの終端など）を読み捨てる上限
+constexpr size_t HTTP_STREAM_DRAIN_MAX_BYTES = 512;
+constexpr uint32_t HTTP_STREAM_DRAIN_TIMEOUT_MS = 100;
+
+// 受信可能になるまで待つ。1: 受信可能（データまたは切断）、0: タイムアウト、-1: エラー
+int waitReadable(HttpStream& http, const uint32_t timeout_ms) {
+    if (http.tls) {
+        return backendTlsWaitReadable(http.tls, timeout_ms);
+    }
+    WiFiClient& client = *http.client;
+    // WiFiClient内部のバッファに残っている分はソケットを見ても分からないので先に確認する
+    if (client.available() > 0) {
+        return 1;
+    }
+    const int fd = client.fd();
+    if (fd < 0) {
+        return -1;
+    }
+    fd_set read_fds;
+    FD_ZERO(&read_fds);
+    FD_SET(fd, &read_fds);
+    struct timeval timeout;
+    timeout.tv_sec = timeout_ms / 1000;
+    timeout.tv_usec = (timeout_ms % 1000) * 1000;
+    const int result = select(fd + 1, &read_fds, nullptr, nullptr, &timeout);
+    if (result < 0) {
+        return -1;
+    }
+    return result > 0 ? 1 : 0;
+}
+
+// 受信済みのデータを読む。読んだバイト数、まだ何もなければ0、切断は-1を返す
+int readAvailable(HttpStream& http, uint8_t* buffer, const size_t size) {
+    if (http.tls) {
+        return backendTlsRead(http.tls, buffer, size);
+    }
+    WiFiClient& client = *http.client;
+    const int n = client.read(buffer, size);
+    if (n <= 0) {
+        // 受信可能なのに何も読めない = 相手が切断した
+        return client.connected() && client.available() > 0 ? 0 : -1;
+    }
+    return n;
+}
+
+bool writeAll(HttpStream& http, const uint8_t* data, const size_t length) {
+    if (http.tls) {
+        return backendTlsWrite(http.tls, data, length);
+    }
+    return http.client->write(data, length) == length;
+}
+
+// ヘッダの1行を読む（CRLFは含まない）。長すぎる行は切り詰める
+bool readHeaderLine(HttpStream& http, char* line, const size_t size, const uint32_t timeout_ms) {
+    size_t length = 0;
+    const unsigned long start = millis();
+    while (true) {
+        const unsigned long elapsed = millis() - start;
+        if (elapsed >= timeout_ms) {
+            return false;
+        }
+        if (waitReadable(http, timeout_ms - elapsed) <= 0) {
+            return false;
+        }
+        // ボディを読みすぎないよう1バイトずつ読む（ヘッダの間だけなので遅くはない）
+        uint8_t c;
+        const int n = readAvailable(http, &c, 1);
+        if (n < 0) {
+            return false;
+        }
+        if (n == 0) {
+            continue;
+        }
+        if (c == '\n') {
+            line[length] = '\0';
+            return true;
+        }
+        if (c != '\r' && length < size - 1) {
+            line[length++] = static_cast<char>(c);
+        }
+    }
+}
+
+uint8_t hexValue(const uint8_t c) {
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    return c - 'A' + 10;
+}
+
+// chunkedの枠（サイズ行とCRLF）を取り除き、本体だけをbufferの先頭に詰める
+size_t decodeChunked(HttpStream& http, uint8_t* buffer, const size_t length) {
+    size_t out = 0;
+    for (size_t i = 0; i < length; i++) {
+        const uint8_t c = buffer[i];
+        switch (http.chunk_state) {
+        case HTTP_CHUNK_SIZE:
+        case HTTP_CHUNK_EXTENSION:
+            if (c == '\n') {
+                http.chunk_state = http.chunk_remaining > 0 ? HTTP_CHUNK_DATA : HTTP_CHUNK_TRAILER;
+                http.trailer_line_empty = true;
+            } else if (http.chunk_state == HTTP_CHUNK_SIZE && isxdigit(c)) {
+                http.chunk_remaining = (http.chunk_remaining << 4) | hexValue(c);
+            } else if (c == ';') {
+                http.chunk_state = HTTP_CHUNK_EXTENSION;
+            }
+            break;
+        case HTTP_CHUNK_DATA: {
+            size_t n = length - i;
+            if (n > http.chunk_remaining) {
+                n = http.chunk_remaining;
+            }
+            memmove(buffer + out, buffer + i, n);
+            out += n;
+            i += n - 1;
+            http.chunk_remaining -= n;
+            if (http.chunk_remaining == 0) {
+                http.chunk_state = HTTP_CHUNK_DATA_END;
+            }
+            break;
+        }
+        case HTTP_CHUNK_DATA_END:
+            if (c == '\n') {
+                http.chunk_state = HTTP_CHUNK_SIZE;
+                http.chunk_remaining = 0;
+            }
+            break;
+        case HTTP_CHUNK_TRAILER:
+            if (c == '\n') {
+                if (http.trailer_line_empty) {
+                    http.chunk_state = HTTP_CHUNK_FINISHED;
+                }
+                http.trailer_line_empty = true;
+            } else if (c != '\r') {
+                http.trailer_line_empty = false;
+            }
+            break;
+        case HTTP_CHUNK_FINISHED:
+            break;
+        }
+    }
+    return out;
+}
+
+// リクエスト行とヘッダを送る。content_lengthが負ならchunked
+bool sendRequestHeader(HttpStream& http, const char* method, const char* path, const char* content_type, const int32_t content_length) {
+    String header;
+    header.reserve(160);
+    header += method;
+    header += " ";
+    header += path;
+    header += " HTTP/1.1\r\nHost: ";
+    header += http.host;
+    header += ":";
+    header += String(http.port);
+    header += "\r\nContent-Type: ";
+    header += content_type;
+    header += "\r\n";
+    if (content_length < 0) {
+        header += "Transfer-Encoding: chunked\r\n";
+    } else {
+        header += "Content-Length: ";
+        header += String(content_length);
+        header += "\r\n";
+    }
+    header += http.keep_alive ? "Connection: keep-alive\r\n\r\n" : "Connection: close\r\n\r\n";
+
+    return writeAll(http, reinterpret_cast<const uint8_t*>(header.c_str()), header.length());
+}
+
+// 応答を最後まで読んだか（この接続で次のリクエストを送れるか）
+bool responseFinished(const HttpStream& http) {
+    if (http.status_code < 0) {
+        return false;
+    }
+    if (http.chunked) {
+        return http.chunk_state == HTTP_CHUNK_FINISHED;
+    }
+    return http.content_remaining == 0;
+}
+
+void resetStream(HttpStream& http, const char* host, const uint16_t port) {
+    http.client = nullptr;
+    http.tls = nullptr;
+    http.keep_alive = false;
+    http.host = host;
+    http.port = port;
+    http.status_code = -1;
+    http.chunked = false;
+    http.content_remaining = -1;
+    http.chunk_state = HTTP_CHUNK_SIZE;
+    http.chunk_remaining = 0;
+    http.trailer_line_empty = true;
+}
+
+} // namespace
+
+bool httpStreamConnect(HttpStream& http, WiFiClient& client, const char* host, const uint16_t port, const uint32_t timeout_ms) {
+    resetStream(http, host, port);
+    http.client = &client;
+
+    if (!client.connect(host, port, timeout_ms)) {
+        Serial.printf("[HTTP] Connect to %s:%u failed\n", host, port);
+        metricsRecordBackendConnectFailure();
+        return false;
+    }
+    // トークンは小さなセグメントで届くので、Nagleで遅延させない
+    client.setNoDelay(true);
+    return true;
+}
+
+bool httpStreamConnectBackend(HttpStream& http, WiFiClient& client, const uint32_t timeout_ms) {
+    if (!HOST_OLLAMA_TLS) {
+        return httpStreamConnect(http, client, HOST_IP, host_ollama_port, timeout_ms);
+    }
+    resetStream(http, HOST_OLLAMA_TLS_NAME, host_ollama_port);
+    http.tls = backendTlsOpen(HOST_IP, host_ollama_port, timeout_ms);
+    http.keep_alive = true;
+    return http.tls != nullptr;
+}
+
+bool httpStreamSendRequest(HttpStream& http, const char* method, const char* path, const String& body) {
+    if (!sendRequestHeader(http, method, path, "application/json", body.length())) {
+        return false;
+    }
+    return body.length() == 0 || writeAll(http, reinterpret_cast<const uint8_t*>(body.c_str()), body.length());
+}
+
+bool httpStreamBeginChunkedRequest(HttpStream& http, const char* method, const char* path, const char* content_type) {
+    return sendRequestHeader(http, method, path, content_type, -1);
+}
+
+bool httpStreamWriteChunk(HttpStream& http, const uint8_t* data, const size_t length) {
+    if (length == 0) {
+        // 長さ0のチャンクは終端の意味になるので送らない
+        return true;
+    }
+    char size_line[12];
+    const int size_length = snprintf(size_line, sizeof(size_line), "%x\r\n", static_cast<unsigned>(length));
+    return writeAll(http, reinterpret_cast<const uint8_t*>(size_line), size_length) &&
+           writeAll(http, data, length) &&
+           writeAll(http, reinterpret_cast<const uint8_t*>("\r\n"), 2);
+}
+
+bool httpStreamEndChunkedRequest(HttpStream& http) {
+    return writeAll(http, reinterpret_cast<const uint8_t*>("0\r\n\r\n"), 5);
+}
+
+int httpStreamReadResponseHeader(HttpStream& http, const uint32_t timeout_ms) {
+    char line[HTTP_STREAM_HEADER_LINE_SIZE];
+    const unsigned long start = millis();
+
+    // ステータス行: "HTTP/1.1 200 OK"
+    if (!readHeaderLine(http, line, sizeof(line), timeout_ms)) {
+        return -1;
+    }
+    const char* code = strchr(line, ' ');
+    if (code == nullptr) {
+        return -1;
+    }
+    http.status_code = atoi(code + 1);
+
+    while (true) {
+        const unsigned long elapsed = millis() - start;
+        if (elapsed >= timeout_ms || !readHeaderLine(http, line, sizeof(line), timeout_ms - elapsed)) {
+            return -1;
+        }
+        if (line[0] == '\0') {
+            break;
+        }
+        if (strncasecmp(line, "Transfer-Encoding:", 18) == 0 && strcasestr(line + 18, "chunked") != nullptr) {
+            http.chunked = true;
+        } else if (strncasecmp(line, "Content-Length:", 15) == 0) {
+            http.content_remaining = atol(line + 15);
+        } else if (strncasecmp(line, "Connection:", 11) == 0 && strcasestr(line + 11, "close") != nullptr) {
+            http.keep_alive = false;
+        }
+    }
+    return http.status_code;
+}
+
+int httpStreamWaitReadable(HttpStream& http, const uint32_t timeout_ms) {
+    return waitReadable(http, timeout_ms);
+}
+
+int httpStreamRead(HttpStream& http, uint8_t* buffer, const size_t size, const uint32_t timeout_ms) {
+    if ((http.chunked && http.chunk_state == HTTP_CHUNK_FINISHED) ||
+        (!http.chunked && http.content_remaining == 0)) {
+        return -1;
+    }
+    const int ready = waitReadable(http, timeout_ms);
+    if (ready <= 0) {
+        return ready;
+    }
+
+    size_t to_read = size;
+    if (!http.chunked && http.content_remaining > 0 && static_cast<size_t>(http.content_remaining) < to_read) {
+        to_read = http.content_remaining;
+    }
+    const int n = readAvailable(http, buffer, to_read);
+    if (n <= 0) {
+        return n;
+    }
+    if (!http.chunked) {
+        if (http.content_remaining > 0) {
+            http.content_remaining -= n;
+        }
+        return n;
+    }
+    return static_cast<int>(decodeChunked(http, buffer, n));
+}
+
+void httpStreamClose(HttpStream& http) {
+    if (http.tls) {
+        // doneの行の後に届くchunkedの終端などを読み捨てて、次のリクエストに使えるようにする
+        if (http.keep_alive && http.status_code > 0 && !responseFinished(http)) {
+            uint8_t drain[64];
+            size_t drained = 0;
+            const unsigned long start = millis();
+            while (drained < HTTP_STREAM_DRAIN_MAX_BYTES && millis() - start < HTTP_STREAM_DRAIN_TIMEOUT_MS) {
+                const int n = httpStreamRead(http, drain, sizeof(drain), HTTP_STREAM_DRAIN_TIMEOUT_MS);
+                if (n < 0) {
+                    break;
+                }
+                drained += n;
+            }
+        }
+        backendTlsRelease(http.tls, http.keep_alive && responseFinished(http));
+        http.tls = nullptr;
+        return;
+    }
+    if (http.client) {
+        http.client->stop();
+    }
+}
+
+#endif // USE_WIFI_FOR_LLM_COMMUNICATION
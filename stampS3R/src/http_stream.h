@@ -0,0 +1,67 @@
+#ifndef HTTP_STREAM_H
+#define HTTP_STREAM_H
+
+#include "config.h"
+#include <Arduino.h>
+#include "WiFi.h"
+#include "backend_tls.h"
+
+// ストリーミング応答用の最小限のHTTP/1.1クライアント
+// HTTPClientと違い、ソケットの受信をselect()で待ち、受信済みのセグメントをまとめて読み出す
+// Transfer-Encoding: chunked の応答は読み出し時にデコードする
+// Ollamaへの接続はhttpStreamConnectBackendで張る。HOST_OLLAMA_TLSならTLSで、応答を読み終えた接続は使い回す
+
+constexpr size_t HTTP_STREAM_HEADER_LINE_SIZE = 256;
+
+enum HttpChunkState {
+    HTTP_CHUNK_SIZE = 0,      // チャンクサイズ行
+    HTTP_CHUNK_EXTENSION = 1, // チャンクサイズ行の ';' 以降
+    HTTP_CHUNK_DATA = 2,      // チャンク本体
+    HTTP_CHUNK_DATA_END = 3,  // チャンク本体の後の CRLF
+    HTTP_CHUNK_TRAILER = 4,   // 最後のチャンクの後のトレーラ
+    HTTP_CHUNK_FINISHED = 5
+};
+
+struct HttpStream {
+    WiFiClient* client;
+    BackendTls* tls;  // TLSのときはclientの代わりにこちらで読み書きする
+    bool keep_alive;  // 応答を読み終えたら接続を閉じずにプールに戻す
+    const char* host;
+    uint16_t port;
+    int status_code;
+    bool chunked;
+    int32_t content_remaining;  // Content-Lengthがある場合の残り。-1は不明（切断まで）
+    HttpChunkState chunk_state;
+    uint32_t chunk_remaining;
+    bool trailer_line_empty;
+};
+
+// 接続してTCP_NODELAYを設定する
+bool httpStreamConnect(HttpStream& http, WiFiClient& client, const char* host, const uint16_t port, const uint32_t timeout_ms);
+// Ollama（HOST_IP:host_ollama_port）に接続する。HOST_OLLAMA_TLSならプールのTLS接続を使い、clientは使わない
+bool httpStreamConnectBackend(HttpStream& http, WiFiClient& client, const uint32_t timeout_ms);
+
+// ボディ付きのリクエストを送る
+bool httpStreamSendRequest(HttpStream& http, const char* method, const char* path, const String& body);
+
+// ボディの長さが分からないリクエストを Transfer-Encoding: chunked で始める
+bool httpStreamBeginChunkedRequest(HttpStream& http, const char* method, const char* path, const char* content_type = "application/json");
+// ボディの一部を1チャンクとして送る
+bool httpStreamWriteChunk(HttpStream& http, const uint8_t* data, const size_t length);
+// 終端のチャンクを送ってリクエストを終える
+bool httpStreamEndChunkedRequest(HttpStream& http);
+
+// ステータス行とヘッダを読む。ステータスコード、タイムアウト・切断時は-1を返す
+int httpStreamReadResponseHeader(HttpStream& http, const uint32_t timeout_ms);
+
+// 受信可能になるまで待つ。1: 受信可能（データまたは切断）、0: タイムアウト、-1: エラー
+int httpStreamWaitReadable(HttpStream& http, const uint32_t timeout_ms);
+
+// 受信済みのボディをまとめて読み出す（chunkedはデコード済み）
+// 読んだバイト数、タイムアウトまでに何も来なければ0、ボディの終わりや切断は-1を返す
+int httpStreamRead(HttpStream& http, uint8_t* buffer, const size_t size, const uint32_t timeout_ms);
+
+// keep-aliveの接続は、応答を読み終えていればプールに戻し、途中なら閉じる
+void httpStreamClose(HttpStream& http);
+
+#endif // HTTP_STREAM_H
@@ -0,0 +1,319 @@
+#include "json_fields.h"
+
+namespace {
+
+enum JsonFieldsState
+{
+    JSON_FIELDS_ROOT = 0,        // ルートの { か [ を待つ（前の空白などは読み飛ばす）
+    JSON_FIELDS_KEY_WAIT = 1,    // メンバー名の " を待つ
+    JSON_FIELDS_KEY = 2,         // メンバー名
+    JSON_FIELDS_COLON = 3,       // メンバー名の後の :
+    JSON_FIELDS_VALUE_WAIT = 4,  // 値の始まりを待つ
+    JSON_FIELDS_VALUE = 5,       // 値
+    JSON_FIELDS_AFTER_VALUE = 6, // 値の後の , か閉じ括弧
+    JSON_FIELDS_DONE = 7
+};
+
+uint8_t hexDigit(const char c)
+{
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return 0;
+}
+
+uint32_t readHex4(const char *p)
+{
+    return (hexDigit(p[0]) << 12) | (hexDigit(p[1]) << 8) | (hexDigit(p[2]) << 4) | hexDigit(p[3]);
+}
+
+void appendUtf8(String &out, const uint32_t code_point)
+{
+    if (code_point < 0x80)
+    {
+        out += static_cast<char>(code_point);
+    }
+    else if (code_point < 0x800)
+    {
+        out += static_cast<char>(0xC0 | (code_point >> 6));
+        out += static_cast<char>(0x80 | (code_point & 0x3F));
+    }
+    else if (code_point < 0x10000)
+    {
+        out += static_cast<char>(0xE0 | (code_point >> 12));
+        out += static_cast<char>(0x80 | ((code_point >> 6) & 0x3F));
+        out += static_cast<char>(0x80 | (code_point & 0x3F));
+    }
+    else
+    {
+        out += static_cast<char>(0xF0 | (code_point >> 18));
+        out += static_cast<char>(0x80 | ((code_point >> 12) & 0x3F));
+        out += static_cast<char>(0x80 | ((code_point >> 6) & 0x3F));
+        out += static_cast<char>(0x80 | (code_point & 0x3F));
+    }
+}
+
+// JSONの文字列の中身（引用符の内側）のエスケープを戻す
+String unescapeJsonString(const char *text, const size_t length)
+{
+    String out;
+    out.reserve(length);
+    for (size_t i = 0; i < length; i++)
+    {
+        if (text[i] != '\\' || i + 1 >= length)
+        {
+            out += text[i];
+            continue;
+        }
+        const char c = text[++i];
+        switch (c)
+        {
+        case 'b': out += '\b'; break;
+        case 'f': out += '\f'; break;
+        case 'n': out += '\n'; break;
+        case 'r': out += '\r'; break;
+        case 't': out += '\t'; break;
+        case 'u':
+            if (i + 4 < length)
+            {
+                uint32_t code_point = readHex4(text + i + 1);
+                i += 4;
+                // サロゲートペア
+                if (code_point >= 0xD800 && code_point < 0xDC00 && i + 6 < length && text[i + 1] == '\\' &&
+                    text[i + 2] == 'u')
+                {
+                    const uint32_t low = readHex4(text + i + 3);
+                    if (low >= 0xDC00 && low < 0xE000)
+                    {
+                        code_point = 0x10000 + ((code_point - 0xD800) << 10) + (low - 0xDC00);
+                        i += 6;
+                    }
+                }
+                appendUtf8(out, code_point);
+            }
+            break;
+        default: // " \ /
+            out += c;
+            break;
+        }
+    }
+    return out;
+}
+
+JsonFieldType valueType(const String &value)
+{
+    switch (value[0])
+    {
+    case '"': return JSON_FIELD_STRING;
+    case '{': return JSON_FIELD_OBJECT;
+    case '[': return JSON_FIELD_ARRAY;
+    case 't':
+    case 'f': return JSON_FIELD_BOOLEAN;
+    case 'n': return JSON_FIELD_NULL;
+    default: return JSON_FIELD_NUMBER;
+    }
+}
+
+void emitValue(JsonFieldSplitter &splitter, JsonFieldCallback callback, void *context)
+{
+    if (splitter.value.length() > 0)
+    {
+        const String key = splitter.root_is_array ? String() : unescapeJsonString(splitter.key.c_str(), splitter.key.length());
+        JsonField field;
+        field.key = key.c_str();
+        field.type = valueType(splitter.value);
+        field.index = splitter.count++;
+        // 文字列は両端の引用符を除いた中身を戻す
+        const String text = field.type == JSON_FIELD_STRING
+                                ? unescapeJsonString(splitter.value.c_str() + 1, splitter.value.length() - 2)
+                                : String();
+        field.value = field.type == JSON_FIELD_STRING ? text.c_str() : splitter.value.c_str();
+        callback(context, field);
+    }
+    splitter.value = "";
+    splitter.state = JSON_FIELDS_AFTER_VALUE;
+}
+
+void afterValue(JsonFieldSplitter &splitter, const char c)
+{
+    if (c == ',')
+    {
+        splitter.state = splitter.root_is_array ? JSON_FIELDS_VALUE_WAIT : JSON_FIELDS_KEY_WAIT;
+    }
+    else if (c == '}' || c == ']')
+    {
+        splitter.state = JSON_FIELDS_DONE;
+    }
+}
+
+void feedValue(JsonFieldSplitter &splitter, const char c, JsonFieldCallback callback, void *context)
+{
+    if (splitter.in_string)
+    {
+        splitter.value += c;
+        if (splitter.escape)
+        {
+            splitter.escape = false;
+        }
+        else if (c == '\\')
+        {
+            splitter.escape = true;
+        }
+        else if (c == '"')
+        {
+            splitter.in_string = false;
+            if (splitter.depth == 0)
+            {
+                emitValue(splitter, callback, context);
+            }
+        }
+        return;
+    }
+    switch (c)
+    {
+    case '"':
+        splitter.value += c;
+        splitter.in_string = true;
+        break;
+    case '{':
+    case '[':
+        splitter.value += c;
+        splitter.depth++;
+        break;
+    case '}':
+    case ']':
+        if (splitter.depth == 0)
+        {
+            // 数値などの直後でルートが閉じた
+            emitValue(splitter, callback, context);
+            afterValue(splitter, c);
+            break;
+        }
+        splitter.value += c;
+        if (--splitter.depth == 0)
+        {
+            emitValue(splitter, callback, context);
+        }
+        break;
+    default:
+        if (splitter.depth == 0 && (c == ',' || isspace(static_cast<unsigned char>(c))))
+        {
+            // 数値・true・false・nullは区切りが来て初めて閉じたと分かる
+            emitValue(splitter, callback, context);
+            afterValue(splitter, c);
+        }
+        else if (splitter.depth > 0 || !isspace(static_cast<unsigned char>(c)))
+        {
+            splitter.value += c;
+        }
+        break;
+    }
+}
+
+} // namespace
+
+void jsonFieldsBegin(JsonFieldSplitter &splitter)
+{
+    splitter.state = JSON_FIELDS_ROOT;
+    splitter.root_is_array = false;
+    splitter.in_string = false;
+    splitter.escape = false;
+    splitter.depth = 0;
+    splitter.count = 0;
+    splitter.key = "";
+    splitter.value = "";
+}
+
+void jsonFieldsFeed(JsonFieldSplitter &splitter, const char *data, const size_t length, JsonFieldCallback callback,
+                    void *context)
+{
+    for (size_t i = 0; i < length && splitter.state != JSON_FIELDS_DONE; i++)
+    {
+        const char c = data[i];
+        switch (splitter.state)
+        {
+        case JSON_FIELDS_ROOT:
+            if (c == '{' || c == '[')
+            {
+                splitter.root_is_array = c == '[';
+                splitter.state = splitter.root_is_array ? JSON_FIELDS_VALUE_WAIT : JSON_FIELDS_KEY_WAIT;
+            }
+            break;
+        case JSON_FIELDS_KEY_WAIT:
+            if (c == '"')
+            {
+                splitter.key = "";
+                splitter.escape = false;
+                splitter.state = JSON_FIELDS_KEY;
+            }
+            else if (c == '}')
+            {
+                splitter.state = JSON_FIELDS_DONE;
+            }
+            break;
+        case JSON_FIELDS_KEY:
+            if (splitter.escape)
+            {
+                splitter.escape = false;
+            }
+            else if (c == '\\')
+            {
+                splitter.escape = true;
+            }
+            else if (c == '"')
+            {
+                splitter.state = JSON_FIELDS_COLON;
+                break;
+            }
+            splitter.key += c;
+            break;
+        case JSON_FIELDS_COLON:
+            if (c == ':')
+            {
+                splitter.state = JSON_FIELDS_VALUE_WAIT;
+            }
+            break;
+        case JSON_FIELDS_VALUE_WAIT:
+            if (isspace(static_cast<unsigned char>(c)) || (splitter.root_is_array && c == ','))
+            {
+                break;
+            }
+            if (splitter.root_is_array && c == ']')
+            {
+                splitter.state = JSON_FIELDS_DONE;
+                break;
+            }
+            splitter.value = "";
+            splitter.depth = 0;
+            splitter.in_string = false;
+            splitter.escape = false;
+            splitter.state = JSON_FIELDS_VALUE;
+            feedValue(splitter, c, callback, context);
+            break;
+        case JSON_FIELDS_VALUE:
+            feedValue(splitter, c, callback, context);
+            break;
+        case JSON_FIELDS_AFTER_VALUE:
+            afterValue(splitter, c);
+            break;
+        }
+    }
+}
+
+bool jsonFieldsDone(const JsonFieldSplitter &splitter)
+{
+    return splitter.state == JSON_FIELDS_DONE;
+}
+
+const char *jsonFieldObject(const JsonFieldType type)
+{
+    switch (type)
+    {
+    case JSON_FIELD_STRING: return "llm.json.string";
+    case JSON_FIELD_NUMBER: return "llm.json.number";
+    case JSON_FIELD_BOOLEAN: return "llm.json.boolean";
+    case JSON_FIELD_NULL: return "llm.json.null";
+    case JSON_FIELD_OBJECT: return "llm.json.object";
+    default: return "llm.json.array";
+    }
+}
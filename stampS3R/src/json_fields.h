@@ -0,0 +1,53 @@
+#ifndef JSON_FIELDS_H
+#define JSON_FIELDS_H
+
+#include "config.h"
+#include <Arduino.h>
+
+// 構造化出力（llm.setupのformat）で生成されるJSONを、トークンが届くたびに少しずつ読む
+// ルートのオブジェクトのメンバー、またはルートの配列の要素が閉じたところで1つずつ取り出す
+// 入れ子のオブジェクトや配列は、閉じるまでまとめて1つの値として扱う
+
+enum JsonFieldType
+{
+    JSON_FIELD_STRING = 0,
+    JSON_FIELD_NUMBER = 1,
+    JSON_FIELD_BOOLEAN = 2,
+    JSON_FIELD_NULL = 3,
+    JSON_FIELD_OBJECT = 4,
+    JSON_FIELD_ARRAY = 5
+};
+
+struct JsonField
+{
+    const char *key;   // メンバー名（エスケープを戻したもの）。配列の要素は空文字列
+    JsonFieldType type;
+    const char *value; // 文字列はエスケープを戻した中身、それ以外はJSONのテキストのまま
+    uint16_t index;    // 何番目のフィールドか（0から）
+};
+
+typedef void (*JsonFieldCallback)(void *context, const JsonField &field);
+
+struct JsonFieldSplitter
+{
+    uint8_t state;
+    bool root_is_array;
+    bool in_string;
+    bool escape;
+    uint16_t depth; // 値の中の括弧の深さ
+    uint16_t count; // 取り出したフィールドの数
+    String key;     // JSONの文字列のまま（引用符は含まない）
+    String value;
+};
+
+void jsonFieldsBegin(JsonFieldSplitter &splitter);
+// 生成されたテキストを渡す。閉じたフィールドごとにcallbackを呼ぶ
+void jsonFieldsFeed(JsonFieldSplitter &splitter, const char *data, const size_t length, JsonFieldCallback callback,
+                    void *context);
+// ルートのオブジェクト・配列が閉じたか
+bool jsonFieldsDone(const JsonFieldSplitter &splitter);
+
+// 型ごとのobject（"llm.json.string" など）
+const char *jsonFieldObject(const JsonFieldType type);
+
+#endif // JSON_FIELDS_H
@@ -0,0 +1,217 @@
+#include "llm_work.h"
+
+namespace {
+
+LlmWorkConfig llm_works[MAX_LLM_WORKS];
+uint32_t llm_work_order[MAX_LLM_WORKS];  // 登録順（上書きする枠を選ぶため）
+uint32_t llm_work_counter = 0;
+
+void resetLlmWorkConfig(LlmWorkConfig &config)
+{
+    config.work_id = "";
+    config.model = "";
+    config.system_prompt = "";
+    config.max_token_len = 0;
+    config.temperature = -1.0f;
+    config.top_p = -1.0f;
+    config.num_ctx = 0;
+    for (size_t i = 0; i < MAX_STOP_SEQUENCES; i++)
+    {
+        config.stop[i] = "";
+    }
+    config.stop_count = 0;
+    config.semantic_cache = false;
+    config.cache_threshold = SEMANTIC_CACHE_THRESHOLD;
+    config.cache_model = SEMANTIC_CACHE_EMBED_MODEL;
+    config.think = LLM_THINK_DEFAULT;
+    config.history = LLM_HISTORY_OFF;
+    config.context_budget = 0;
+    config.format = "";
+}
+
+LlmThinkMode parseThinkMode(JsonVariantConst value)
+{
+    if (value.is<bool>())
+    {
+        return value.as<bool>() ? LLM_THINK_DEFAULT : LLM_THINK_OFF;
+    }
+    const char *mode = value | "";
+    if (strcmp(mode, "strip") == 0)
+    {
+        return LLM_THINK_STRIP;
+    }
+    if (strcmp(mode, "heartbeat") == 0)
+    {
+        return LLM_THINK_HEARTBEAT;
+    }
+    return LLM_THINK_DEFAULT;
+}
+
+LlmHistoryMode parseHistoryMode(JsonVariantConst value)
+{
+    if (value.is<bool>())
+    {
+        return value.as<bool>() ? LLM_HISTORY_SUMMARIZE : LLM_HISTORY_OFF;
+    }
+    const char *mode = value | "";
+    if (strcmp(mode, "summary") == 0)
+    {
+        return LLM_HISTORY_SUMMARIZE;
+    }
+    if (strcmp(mode, "drop") == 0)
+    {
+        return LLM_HISTORY_DROP;
+    }
+    return LLM_HISTORY_OFF;
+}
+
+void addStopSequence(LlmWorkConfig &config, JsonVariantConst value)
+{
+    if (value.is<const char *>() && config.stop_count < MAX_STOP_SEQUENCES)
+    {
+        config.stop[config.stop_count++] = value.as<String>();
+    }
+}
+
+} // namespace
+
+void parseLlmWorkConfig(JsonVariantConst data, LlmWorkConfig &config)
+{
+    resetLlmWorkConfig(config);
+    if (data.is<const char *>())
+    {
+        config.model = data.as<String>();
+        return;
+    }
+    config.model = data["model"] | "";
+    config.system_prompt = data["prompt"] | "";
+    config.max_token_len = data["max_token_len"] | 0;
+    config.temperature = data["temperature"] | -1.0f;
+    config.top_p = data["top_p"] | -1.0f;
+    config.num_ctx = data["num_ctx"] | 0;
+    config.semantic_cache = data["cache"] | false;
+    config.cache_threshold = data["cache_threshold"] | SEMANTIC_CACHE_THRESHOLD;
+    config.cache_model = data["cache_model"] | SEMANTIC_CACHE_EMBED_MODEL;
+    config.think = parseThinkMode(data["think"]);
+    config.history = parseHistoryMode(data["history"]);
+    config.context_budget = data["context_budget"] | 0;
+    // formatはそのままバックエンドに渡すので、JSONのテキストで持つ
+    if (!data["format"].isNull())
+    {
+        serializeJson(data["format"], config.format);
+    }
+    // stopは文字列でも配列でもよい
+    if (data["stop"].is<JsonArrayConst>())
+    {
+        for (JsonVariantConst value : data["stop"].as<JsonArrayConst>())
+        {
+            addStopSequence(config, value);
+        }
+    }
+    else
+    {
+        addStopSequence(config, data["stop"]);
+    }
+}
+
+uint32_t llmContextBudget(const LlmWorkConfig &config)
+{
+    if (config.context_budget > 0)
+    {
+        return config.context_budget;
+    }
+    // 残りは回答とテンプレートの分
+    return config.num_ctx > 0 ? config.num_ctx * 3 / 4 : LLM_CONTEXT_BUDGET;
+}
+
+LlmWorkConfig *registerLlmWork(const LlmWorkConfig &config, String &evicted_work_id)
+{
+    size_t slot = 0;
+    for (size_t i = 0; i < MAX_LLM_WORKS; i++)
+    {
+        if (llm_works[i].work_id.length() == 0)
+        {
+            slot = i;
+            break;
+        }
+        if (llm_work_order[i] < llm_work_order[slot])
+        {
+            slot = i;
+        }
+    }
+    evicted_work_id = llm_works[slot].work_id;
+    if (evicted_work_id.length() > 0)
+    {
+        Serial.print("[LLM] Work slots full, dropping ");
+        Serial.println(evicted_work_id);
+    }
+    llm_works[slot] = config;
+    llm_work_order[slot] = ++llm_work_counter;
+    return &llm_works[slot];
+}
+
+LlmWorkConfig *findLlmWork(const String &work_id)
+{
+    for (size_t i = 0; i < MAX_LLM_WORKS; i++)
+    {
+        if (llm_works[i].work_id.length() > 0 && llm_works[i].work_id == work_id)
+        {
+            return &llm_works[i];
+        }
+    }
+    return nullptr;
+}
+
+void releaseLlmWork(const String &work_id)
+{
+    LlmWorkConfig *config = findLlmWork(work_id);
+    if (config)
+    {
+        resetLlmWorkConfig(*config);
+    }
+}
+
+void clearLlmWorks()
+{
+    for (size_t i = 0; i < MAX_LLM_WORKS; i++)
+    {
+        resetLlmWorkConfig(llm_works[i]);
+    }
+}
+
+void applyLlmWorkOptions(const LlmWorkConfig &config, JsonDocument &request, const uint32_t generated_tokens)
+{
+    if (config.think == LLM_THINK_OFF)
+    {
+        request["think"] = false;
+    }
+    JsonObject options = request.createNestedObject("options");
+    // 思考部分を取り除くときは、num_predictだと思考のトークンも数えられて回答が途中で切れる
+    // その場合はバックエンドに渡さず、回答のトークンだけをモジュール側で数えて打ち切る（use_wifi.cpp）
+    const bool strips_thinking = config.think == LLM_THINK_STRIP || config.think == LLM_THINK_HEARTBEAT;
+    if (config.max_token_len > 0 && !strips_thinking)
+    {
+        // 再開時は残りの分だけ
+        options["num_predict"] = generated_tokens < config.max_token_len ? config.max_token_len - generated_tokens : 1;
+    }
+    if (config.temperature >= 0)
+    {
+        options["temperature"] = config.temperature;
+    }
+    if (config.top_p >= 0)
+    {
+        options["top_p"] = config.top_p;
+    }
+    if (config.num_ctx > 0)
+    {
+        options["num_ctx"] = config.num_ctx;
+    }
+    if (config.stop_count > 0)
+    {
+        JsonArray stop = options.createNestedArray("stop");
+        for (uint8_t i = 0; i < config.stop_count; i++)
+        {
+            stop.add(config.stop[i]);
+        }
+    }
+}
@@ -0,0 +1,65 @@
+#ifndef LLM_WORK_H
+#define LLM_WORK_H
+
+#include "config.h"
+#include <Arduino.h>
+#include <ArduinoJson.h>
+
+constexpr size_t MAX_LLM_WORKS = 4;
+constexpr size_t MAX_STOP_SEQUENCES = 4;
+
+// 推論（思考）部分の扱い（data.think）
+enum LlmThinkMode
+{
+    LLM_THINK_DEFAULT = 0,  // 指定なし（バックエンドとモデルの既定のまま）
+    LLM_THINK_OFF = 1,      // false: バックエンドに "think": false を渡して思考させない
+    LLM_THINK_STRIP = 2,    // "strip": 思考部分をモジュールで取り除き、回答だけを送る
+    LLM_THINK_HEARTBEAT = 3 // "heartbeat": 取り除いて、代わりに llm.thinking で進み具合だけを送る
+};
+
+// 会話の履歴の扱い（data.history）
+enum LlmHistoryMode
+{
+    LLM_HISTORY_OFF = 0,       // 指定なし: 1回ごとに独立したプロンプトとして推論する
+    LLM_HISTORY_SUMMARIZE = 1, // true: 履歴を /api/chat で渡し、予算を超えたら古い発話を要約に置き換える
+    LLM_HISTORY_DROP = 2       // "drop": 予算を超えたら古い発話を捨てる
+};
+
+// llm.setupで受け取った生成パラメータ（work_idごと）
+struct LlmWorkConfig
+{
+    String work_id;
+    String model;
+    String system_prompt;  // data.prompt
+    uint16_t max_token_len; // 0: 制限なし
+    float temperature;      // 負: 指定なし（バックエンドの既定値）
+    float top_p;            // 負: 指定なし
+    uint32_t num_ctx;       // 0: 指定なし
+    String stop[MAX_STOP_SEQUENCES];
+    uint8_t stop_count;
+    bool semantic_cache;    // data.cache: 似たプロンプトには保存した回答を返す
+    float cache_threshold;  // data.cache_threshold
+    String cache_model;     // data.cache_model: ベクトルを計算するモデル
+    LlmThinkMode think;
+    LlmHistoryMode history;
+    uint32_t context_budget; // data.context_budget: 履歴に使うトークン数の上限。0: num_ctxの3/4（なければLLM_CONTEXT_BUDGET）
+    String format;           // data.format: 構造化出力（"json" またはJSONスキーマ）をJSONのテキストで。空: 指定なし
+};
+
+// setupのdataからパラメータを読み取る
+void parseLlmWorkConfig(JsonVariantConst data, LlmWorkConfig &config);
+
+// 空きがなければ一番古いものを上書きして登録する。上書きしたwork_idをevicted_work_idに返す（なければ空）
+// 呼び出し元は、そのwork_idの設定を指している待ちのプロンプトなどを捨てること
+LlmWorkConfig *registerLlmWork(const LlmWorkConfig &config, String &evicted_work_id);
+LlmWorkConfig *findLlmWork(const String &work_id);
+void releaseLlmWork(const String &work_id);
+void clearLlmWorks();
+
+// 履歴に使うトークン数の上限
+uint32_t llmContextBudget(const LlmWorkConfig &config);
+
+// Ollamaのoptions等（思考を止める場合は think も）をリクエストに追加する。generated_tokensは既に生成済みのトークン数（再開時）
+void applyLlmWorkOptions(const LlmWorkConfig &config, JsonDocument &request, const uint32_t generated_tokens);
+
+#endif // LLM_WORK_H
@@ -7,6 +7,16 @@
 #include <M5Unified.h>
 #include <ArduinoJson.h>
 #include "common.h"
+#include "power.h"
+#include "llm_work.h"
+#include "asr.h"
+#include "tts.h"
+#include "embed.h"
+#include "arena.h"
+#include "prompt_queue.h"
+#include "capture.h"
+#include "metrics.h"
+#include "chat_history.h"
 
 #if USE_WIFI_FOR_LLM_COMMUNICATION
 #include "use_wifi.h"
@@ -14,6 +24,557 @@
 #include "use_serial.h"
 #endif
 
+namespace
+{
+
+// コマンドのキー（work_idの種類 + "." + action）をFNV-1aでハッシュ化する
+// constexprなのでテーブルのキーはコンパイル時に計算される
+constexpr uint32_t FNV_OFFSET_BASIS = 2166136261u;
+constexpr uint32_t FNV_PRIME = 16777619u;
+
+constexpr uint32_t fnv1a(const char *str, const uint32_t hash = FNV_OFFSET_BASIS)
+{
+  return *str ? fnv1a(str + 1, (hash ^ static_cast<uint8_t>(*str)) * FNV_PRIME) : hash;
+}
+
+constexpr uint32_t commandKey(const char *work_type, const char *action)
+{
+  return fnv1a(action, fnv1a(".", fnv1a(work_type)));
+}
+
+// 実行時のキー計算。"llm_12345" のようなインスタンスのwork_idは '_' まで（"llm_"）をwork_idの種類とする
+uint32_t commandKeyOf(const char *work_id, const char *action)
+{
+  if (work_id == nullptr || action == nullptr)
+  {
+    return 0;
+  }
+  uint32_t hash = FNV_OFFSET_BASIS;
+  for (const char *p = work_id; *p; p++)
+  {
+    hash = (hash ^ static_cast<uint8_t>(*p)) * FNV_PRIME;
+    if (*p == '_')
+    {
+      break;
+    }
+  }
+  return fnv1a(action, fnv1a(".", hash));
+}
+
+uint32_t commandKeyOf(JsonVariantConst work_id, JsonVariantConst action)
+{
+  return commandKeyOf(work_id.as<const char *>(), action.as<const char *>());
+}
+
+typedef void (*CommandHandlerFunc)(JsonDocument &doc, ResponseMsg_t &response_msg);
+
+struct CommandHandler
+{
+  CommandHandlerFunc handler; // 表になければnullptr
+  CommandData data;           // 受信時に展開するdataの範囲
+  const char *work_type;      // ハッシュが一致したときに文字列でも照合する（衝突で別のハンドラを呼ばない）
+  const char *action;
+};
+
+void handleSysPing(JsonDocument &doc, ResponseMsg_t &response_msg)
+{
+  Serial.println("[JSON] System ping");
+  response_msg.object = "None";
+  sendToM5(response_msg);
+}
+
+void handleSysReset(JsonDocument &doc, ResponseMsg_t &response_msg)
+{
+  Serial.println("[JSON] System reset");
+  current_work_id = "";
+  clearLlmWorks();
+  promptQueueClear();
+  clearChatHistories();
+  response_msg.object = "None";
+  response_msg.request_id = "sys_reset";
+  sendToM5(response_msg);
+  delay(15);
+  response_msg.request_id = "0";
+  sendToM5(response_msg);
+}
+
+void handleSysReboot(JsonDocument &doc, ResponseMsg_t &response_msg)
+{
+  Serial.println("[JSON] System reboot");
+  response_msg.object = "None";
+  sendToM5(response_msg);
+  Serial2.flush();
+  delay(15);
+  ESP.restart();
+}
+
+void handleSysVersion(JsonDocument &doc, ResponseMsg_t &response_msg)
+{
+  Serial.println("[JSON] System version");
+  response_msg.object = "sys.version";
+  response_msg.data = FIRMWARE_VERSION;
+  sendToM5(response_msg);
+}
+
+// キャプチャの記録をUSBシリアルへ出力する（serial/replay.pyで再生する）
+void handleSysCaptureDump(JsonDocument &doc, ResponseMsg_t &response_msg)
+{
+  Serial.println("[JSON] System capture dump");
+  captureDump();
+  response_msg.object = "None";
+  sendToM5(response_msg);
+}
+
+// llm / vlm 共通のsetup。work_idの種類（"llm" や "vlm"）を頭につけたwork_idを返す
+void handleLlmSetup(JsonDocument &doc, ResponseMsg_t &response_msg)
+{
+  const String work_type = response_msg.work_id;
+  Serial.print("[JSON] Setup: ");
+  Serial.println(work_type);
+  // dataフィールドからモデル名と生成パラメータを取得
+  LlmWorkConfig config;
+  parseLlmWorkConfig(doc["data"], config);
+  const String &model_name = config.model;
+
+  if (model_name.length() == 0)
+  {
+    Serial.println("[JSON] Model name not specified in data field");
+    response_msg.error.code = 1;
+    response_msg.error.message = "Model name not specified";
+    sendToM5(response_msg);
+    return;
+  }
+
+  LLM_Status llm_status = llm_setup(model_name);
+  Serial.print("[JSON] LLM setup status: ");
+  Serial.println(llm_status);
+  if (llm_status != LLM_OLLAMA_OK)
+  {
+    response_msg.error.code = (llm_status == LLM_OLLAMA_NOT_FOUND) ? 2 : 1;
+    response_msg.error.message = (llm_status == LLM_OLLAMA_NOT_FOUND) ? "Model not found" : "LLM setup failed";
+    sendToM5(response_msg);
+    return;
+  }
+
+  // work_idを生成（例: "llm_12345"）
+  String generated_work_id = work_type + "_" + String(millis() % 100000);
+  response_msg.work_id = generated_work_id;
+  if (work_type == "llm")
+  {
+    current_work_id = generated_work_id;
+  }
+  config.work_id = generated_work_id;
+  String evicted_work_id;
+  registerLlmWork(config, evicted_work_id);
+  if (evicted_work_id.length() > 0)
+  {
+    // 上書きした枠を指している待ちのプロンプトが、別のwork_idの設定で推論しないようにする
+    promptQueueDropWork(evicted_work_id);
+    releaseChatHistory(evicted_work_id);
+    if (current_work_id == evicted_work_id)
+    {
+      current_work_id = "";
+    }
+  }
+  Serial.printf("[JSON] LLM setup options: max_token_len=%u, stop=%u, system_prompt=%u chars\n",
+                config.max_token_len, config.stop_count, config.system_prompt.length());
+  response_msg.object = work_type + ".setup";
+  response_msg.request_id = work_type + "_setup";
+  Serial.print("[JSON] LLM setup response: ");
+  Serial.print("request_id=");
+  Serial.print(response_msg.request_id);
+  Serial.print(", work_id=");
+  Serial.print(response_msg.work_id);
+  Serial.print(", object=");
+  Serial.print(response_msg.object);
+  Serial.print(", error.code=");
+  Serial.print(response_msg.error.code);
+  Serial.println();
+
+  sendToM5(response_msg);
+
+  // PCに送る（適当に受信したJSONをそのまま送る）
+  String json_str;
+  serializeJson(doc, json_str);
+  sendToPC(json_str);
+}
+
+void buildInferenceCommand(const String &work_id, const String &prompt, const char *object, OllamaInferenceCommand &command)
+{
+  command.work_id = work_id;
+  command.object = object;
+  command.config = findLlmWork(work_id);
+  // setupの記録がないwork_idは最後にsetupしたモデルで推論する
+  command.model = command.config ? command.config->model : using_model_name;
+  command.prompt = prompt;
+}
+
+void handleLlmInference(JsonDocument &doc, ResponseMsg_t &response_msg)
+{
+  Serial.println("[JSON] LLM inference");
+  if (doc["object"] != "llm.utf-8.stream")
+  {
+    Serial.println("[JSON] Using non-streaming inference");
+    return;
+  }
+
+  Serial.println("[JSON] Using streaming inference");
+  OllamaInferenceCommand command;
+  buildInferenceCommand(response_msg.work_id, doc["data"]["delta"].as<String>(), "llm.utf-8.stream", command);
+
+  // 推論はloop()でキューから順に行う
+  if (promptQueuePush(command, response_msg.request_id) != PROMPT_QUEUE_OK)
+  {
+    response_msg.error.code = 1;
+    response_msg.error.message = "LLM queue full";
+    sendToM5(response_msg);
+  }
+}
+
+// VLM: object "vlm.jpeg.base64.stream" で画像をbase64のまま分割して送る
+// data: {"delta": base64の一部, "index": 0から連番, "finish": 最後のフレームでtrue, "prompt": index 0のときだけ}
+// object "vlm.utf-8.stream" はテキストだけの推論
+void handleVlmInference(JsonDocument &doc, ResponseMsg_t &response_msg)
+{
+  if (doc["object"] == "vlm.utf-8.stream")
+  {
+    OllamaInferenceCommand command;
+    buildInferenceCommand(response_msg.work_id, doc["data"]["delta"].as<String>(), "vlm.utf-8.stream", command);
+    if (llm_inference_streaming(command) != LLM_OLLAMA_OK)
+    {
+      response_msg.error.code = 1;
+      response_msg.error.message = "VLM inference failed";
+      sendToM5(response_msg);
+    }
+    return;
+  }
+  if (doc["object"] != "vlm.jpeg.base64.stream")
+  {
+    Serial.println("[JSON] Unsupported VLM object");
+    return;
+  }
+
+  JsonVariant data = doc["data"];
+  const uint16_t index = data["index"] | 0;
+  const bool finish = data["finish"] | false;
+  const char *delta = data["delta"] | "";
+
+  LLM_Status llm_status = LLM_OLLAMA_OK;
+  if (index == 0)
+  {
+    OllamaInferenceCommand command;
+    buildInferenceCommand(response_msg.work_id, data["prompt"] | "", "vlm.utf-8.stream", command);
+    llm_status = vlm_inference_begin(command);
+  }
+  if (llm_status == LLM_OLLAMA_OK)
+  {
+    llm_status = vlm_inference_append_image(index, delta, strlen(delta), finish);
+  }
+  if (llm_status == LLM_OLLAMA_OK && finish)
+  {
+    Serial.println("[JSON] VLM inference");
+    llm_status = vlm_inference_finish();
+  }
+  if (llm_status != LLM_OLLAMA_OK)
+  {
+    vlm_inference_abort();
+    response_msg.error.code = 1;
+    response_msg.error.message = "VLM inference failed";
+    sendToM5(response_msg);
+  }
+}
+
+void handleAsrSetup(JsonDocument &doc, ResponseMsg_t &response_msg)
+{
+  Serial.println("[JSON] ASR setup");
+  AsrConfig config;
+  parseAsrConfig(doc["data"], config);
+  String generated_work_id = "asr_" + String(millis() % 100000);
+  if (asr_setup(generated_work_id, config) != ASR_OK)
+  {
+    response_msg.error.code = 1;
+    response_msg.error.message = "ASR setup failed";
+    sendToM5(response_msg);
+    return;
+  }
+  response_msg.work_id = generated_work_id;
+  response_msg.object = "asr.setup";
+  response_msg.request_id = "asr_setup";
+  sendToM5(response_msg);
+}
+
+// ASR: object "asr.adpcm.base64.stream"（setupのencodingが"pcm"なら"asr.pcm.base64.stream"）で音声を送る
+// data: {"delta": base64の音声, "index": 連番, "finish": 話し終わりでtrue}
+void handleAsrInference(JsonDocument &doc, ResponseMsg_t &response_msg)
+{
+  const char *delta = doc["data"]["delta"] | "";
+  const bool finish = doc["data"]["finish"] | false;
+  if (asr_append_audio(response_msg.work_id, delta, strlen(delta), finish) != ASR_OK)
+  {
+    response_msg.error.code = 1;
+    response_msg.error.message = "ASR inference failed";
+    sendToM5(response_msg);
+  }
+}
+
+void handleTtsSetup(JsonDocument &doc, ResponseMsg_t &response_msg)
+{
+  Serial.println("[JSON] TTS setup");
+  TtsConfig config;
+  parseTtsConfig(doc["data"], config);
+  String generated_work_id = "tts_" + String(millis() % 100000);
+  if (tts_setup(generated_work_id, config) != TTS_OK)
+  {
+    response_msg.error.code = 1;
+    response_msg.error.message = "TTS setup failed";
+    sendToM5(response_msg);
+    return;
+  }
+  response_msg.work_id = generated_work_id;
+  response_msg.object = "tts.setup";
+  response_msg.request_id = "tts_setup";
+  sendToM5(response_msg);
+}
+
+// TTS: object "tts.utf-8.stream" で読み上げるテキストを送る
+// data: {"delta": テキスト, "index": 連番, "finish": 最後でtrue}
+void handleTtsInference(JsonDocument &doc, ResponseMsg_t &response_msg)
+{
+  const String text = doc["data"]["delta"] | "";
+  const bool finish = doc["data"]["finish"] | false;
+  if (tts_feed_text(response_msg.work_id, text, finish) != TTS_OK)
+  {
+    response_msg.error.code = 1;
+    response_msg.error.message = "TTS inference failed";
+    sendToM5(response_msg);
+  }
+}
+
+void handleEmbedSetup(JsonDocument &doc, ResponseMsg_t &response_msg)
+{
+  Serial.println("[JSON] Embed setup");
+  EmbedConfig config;
+  parseEmbedConfig(doc["data"], config);
+  String generated_work_id = "embed_" + String(millis() % 100000);
+  if (embed_setup(generated_work_id, config) != EMBED_OK)
+  {
+    response_msg.error.code = 1;
+    response_msg.error.message = "Embed setup failed";
+    sendToM5(response_msg);
+    return;
+  }
+  response_msg.work_id = generated_work_id;
+  response_msg.object = "embed.setup";
+  response_msg.request_id = "embed_setup";
+  sendToM5(response_msg);
+}
+
+// Embed: object "embed.utf-8" でテキストを送る
+// data: {"delta": テキスト, "index": 0, "finish": true}（dataがテキストそのものでもよい）
+// ベクトルはリクエストと同じrequest_idの embed.int8.base64.stream / embed.fp16.base64.stream で返る
+void handleEmbedInference(JsonDocument &doc, ResponseMsg_t &response_msg)
+{
+  const String text = doc["data"].is<const char *>() ? doc["data"].as<String>() : doc["data"]["delta"] | "";
+  if (embed_inference(response_msg.work_id, response_msg.request_id, text) != EMBED_OK)
+  {
+    response_msg.error.code = 1;
+    response_msg.error.message = "Embed inference failed";
+    sendToM5(response_msg);
+  }
+}
+
+void handleLlmExit(JsonDocument &doc, ResponseMsg_t &response_msg)
+{
+  Serial.println("[JSON] LLM exit");
+  if (current_work_id == response_msg.work_id)
+  {
+    current_work_id = "";
+  }
+  releaseLlmWork(response_msg.work_id);
+  promptQueueDropWork(response_msg.work_id);
+  releaseChatHistory(response_msg.work_id);
+  if (response_msg.work_id.startsWith("vlm_"))
+  {
+    vlm_inference_abort();
+  }
+  asr_exit(response_msg.work_id);
+  tts_exit(response_msg.work_id);
+  embed_exit(response_msg.work_id);
+  response_msg.object = "None";
+  sendToM5(response_msg);
+}
+
+// (work_id, action) -> ハンドラ の対応表。APIを増やすときはここに1行追加する
+// 引数はwork_idの種類、action、ハンドラ、受信時に展開するdataの範囲（embedのinferenceはdataが文字列のこともある）
+#define COMMAND_LIST(X) \
+  X("sys", "ping", handleSysPing, COMMAND_DATA_NONE)                \
+  X("sys", "reset", handleSysReset, COMMAND_DATA_NONE)              \
+  X("sys", "reboot", handleSysReboot, COMMAND_DATA_NONE)            \
+  X("sys", "version", handleSysVersion, COMMAND_DATA_NONE)          \
+  X("sys", "capture_dump", handleSysCaptureDump, COMMAND_DATA_NONE) \
+  X("llm", "setup", handleLlmSetup, COMMAND_DATA_ALL)               \
+  X("llm_", "inference", handleLlmInference, COMMAND_DATA_STREAM)   \
+  X("llm_", "exit", handleLlmExit, COMMAND_DATA_NONE)               \
+  X("vlm", "setup", handleLlmSetup, COMMAND_DATA_ALL)               \
+  X("vlm_", "inference", handleVlmInference, COMMAND_DATA_STREAM)   \
+  X("vlm_", "exit", handleLlmExit, COMMAND_DATA_NONE)               \
+  X("asr", "setup", handleAsrSetup, COMMAND_DATA_ALL)               \
+  X("asr_", "inference", handleAsrInference, COMMAND_DATA_STREAM)   \
+  X("asr_", "exit", handleLlmExit, COMMAND_DATA_NONE)               \
+  X("tts", "setup", handleTtsSetup, COMMAND_DATA_ALL)               \
+  X("tts_", "inference", handleTtsInference, COMMAND_DATA_STREAM)   \
+  X("tts_", "exit", handleLlmExit, COMMAND_DATA_NONE)               \
+  X("embed", "setup", handleEmbedSetup, COMMAND_DATA_ALL)           \
+  X("embed_", "inference", handleEmbedInference, COMMAND_DATA_ALL)  \
+  X("embed_", "exit", handleLlmExit, COMMAND_DATA_NONE)
+
+// キーで表を引く。caseのラベルはコンパイル時に計算した定数なので、コンパイラが二分探索か表引きにする
+// キーが衝突する行を足すと、caseの重複でコンパイルエラーになる
+CommandHandler findCommand(const uint32_t key)
+{
+  switch (key)
+  {
+#define COMMAND_CASE(work_type, action, handler, data) \
+  case commandKey(work_type, action):                  \
+    return CommandHandler{handler, data, work_type, action};
+    COMMAND_LIST(COMMAND_CASE)
+#undef COMMAND_CASE
+  default:
+    return CommandHandler{nullptr, COMMAND_DATA_NONE, nullptr, nullptr};
+  }
+}
+
+// work_idの種類（'_' まで、'_' がなければ全体）がwork_typeと一致するか
+bool workTypeMatches(const char *work_id, const char *work_type)
+{
+  const size_t length = strlen(work_type);
+  if (strncmp(work_id, work_type, length) != 0)
+  {
+    return false;
+  }
+  return work_type[length - 1] == '_' ? true : work_id[length] == '\0';
+}
+
+// ハッシュで候補を絞り、文字列が一致したときだけハンドラを返す
+CommandHandlerFunc findCommandHandler(JsonVariantConst work_id, JsonVariantConst action)
+{
+  const uint32_t key = commandKeyOf(work_id, action);
+  if (key == 0)
+  {
+    return nullptr;
+  }
+  const CommandHandler entry = findCommand(key);
+  if (entry.handler == nullptr || !workTypeMatches(work_id.as<const char *>(), entry.work_type) ||
+      strcmp(action.as<const char *>(), entry.action) != 0)
+  {
+    return nullptr;
+  }
+  return entry.handler;
+}
+
+// 受信JSONのうちハンドラが使うフィールドだけを展開するためのフィルタ（CommandDataごと）
+StaticJsonDocument<256> command_filters[COMMAND_DATA_KINDS];
+
+// パースする前にフレームのwork_idとactionを読み、そのコマンドが使うdataだけを展開するフィルタを選ぶ
+const JsonDocument *selectCommandFilter(const char *frame)
+{
+  char work_id[32];
+  char action[32];
+  if (!jsonFrameFindString(frame, "work_id", work_id, sizeof(work_id)) ||
+      !jsonFrameFindString(frame, "action", action, sizeof(action)))
+  {
+    // エスケープを含むなどで読めなければ、すべて展開してハンドラに任せる
+    return &command_filters[COMMAND_DATA_ALL];
+  }
+  const CommandHandler entry = findCommand(commandKeyOf(work_id, action));
+  return &command_filters[entry.handler ? entry.data : COMMAND_DATA_NONE];
+}
+
+// 受信用のJSONドキュメント（毎ループ確保しないように静的に持つ）
+StaticJsonDocument<JSON_BUFFER_SIZE> doc;
+// 推論中に受け取ったが、推論が終わるまで処理を待たせているコマンド（docに入っている）
+bool deferred_command = false;
+
+// 推論中でもその場で処理するコマンド。それ以外は推論が終わるまで待たせる
+// （VLMやASRなど、バックエンドとの通信やUARTの帯域を長く使うもの）
+constexpr uint32_t COMMANDS_DURING_INFERENCE[] = {
+    commandKey("sys", "ping"),
+    commandKey("sys", "version"),
+    commandKey("llm_", "inference"),
+    commandKey("llm_", "exit"),
+    commandKey("tts_", "inference"),
+};
+
+bool isAllowedDuringInference(const uint32_t key)
+{
+  for (const uint32_t allowed : COMMANDS_DURING_INFERENCE)
+  {
+    if (allowed == key)
+    {
+      return true;
+    }
+  }
+  return false;
+}
+
+// docに入っているコマンドを処理する
+void dispatchCommand()
+{
+  powerOnActivity();
+
+  // JSONのパース成功
+  Serial.println("[JSON] Parsed successfully:");
+
+  Serial.println("[JSON] Sending handshake: Hello");
+  sendLineToM5("Hello");
+
+  // JSONを整形して出力
+  serializeJsonPretty(doc, Serial);
+  Serial.println();
+
+  CommandHandlerFunc handler = findCommandHandler(doc["work_id"], doc["action"]);
+  if (handler)
+  {
+    // 返事用のJSONの元の構造体 をひとつ作る
+    ResponseMsg_t response_msg = {};
+    response_msg.request_id = doc["request_id"].as<String>();
+    response_msg.work_id = doc["work_id"].as<String>();
+    response_msg.error.code = 0;
+    response_msg.error.message = "";
+    handler(doc, response_msg);
+  }
+  else
+  {
+    Serial.println("[JSON] Unknown work_id/action");
+  }
+  // LEDで成功を表示
+  blinkLED(COLOR_OK, 1, 50);
+}
+
+// 推論の受信の合間に呼ばれる。届いたプロンプトはキューに積み、すぐ処理できないコマンドは待たせる
+void pollDuringInference()
+{
+  while (!deferred_command && readJsonMessage(doc, selectCommandFilter))
+  {
+    const uint32_t key = commandKeyOf(doc["work_id"], doc["action"]);
+    // 推論中のwork_idのexitは、設定や履歴を推論の途中で消さないよう、推論が終わるまで待たせる
+    if (!isAllowedDuringInference(key) ||
+        (key == commandKey("llm_", "exit") && promptQueueIsRunning(doc["work_id"].as<String>())))
+    {
+      Serial.println("[JSON] Deferred until inference ends");
+      deferred_command = true;
+      return;
+    }
+    dispatchCommand();
+  }
+  // 合成待ちのキューが空いたら、溜めておいた読み上げのテキストを積む
+  tts_poll();
+  // 長いストリームの間もキャプチャのバッファを書き出す（受信の合間なので、送信やTTSのタスクは待たせない）
+  capturePoll();
+}
+
+} // namespace
+
 void setup()
 {
   auto cfg = M5.config();
@@ -21,14 +582,26 @@ void setup()
 
   Serial.begin(9600);
   // Serial2.begin(115200, SERIAL_8N1, RX, TX) の順序
-  Serial2.begin(115200, SERIAL_8N1, 7, 5);
+  // 画像などの連続したフレームを処理中に取りこぼさないよう、受信バッファを大きめにとる
+  Serial2.setRxBufferSize(JSON_BUFFER_SIZE * 2);
+  // TTSの音声フレームを送りながらでも、送信待ちでloop()が止まらないようにする
+  Serial2.setTxBufferSize(M5_UART_TX_BUFFER_SIZE);
+  Serial2.begin(115200, SERIAL_8N1, M5_UART_RX_PIN, M5_UART_TX_PIN);
 
   initLED();
   led_sayStart_initialize();
   // initSPIFFS();
   init_communication();
+  initPowerGovernor();
+  initTts();
+  initMetricsServer();
   led_saySuccess_initialize();
 
+  for (size_t i = 0; i < COMMAND_DATA_KINDS; i++)
+  {
+    buildCommandFilter(command_filters[i], static_cast<CommandData>(i));
+  }
+
   Serial.println("[JSON] JSON reader initialized");
   resetJsonBuffer();
 }
@@ -36,171 +609,24 @@ void setup()
 void loop()
 {
   M5.update();
+  powerUpdate();
+  vlm_inference_poll();
+  asr_poll();
+  tts_poll();
 
-  // JSONドキュメントを動的に確保（必要に応じてサイズ調整）
-  StaticJsonDocument<JSON_BUFFER_SIZE> doc;
-
-  if (readJsonMessage(doc))
+  if (deferred_command || readJsonMessage(doc, selectCommandFilter))
   {
-    // JSONのパース成功
-    Serial.println("[JSON] Parsed successfully:");
-
-    Serial.println("[JSON] Sending handshake: Hello");
-    Serial2.println("Hello");
-
-    // JSONを整形して出力
-    serializeJsonPretty(doc, Serial);
-    Serial.println();
-
-    // 返事用のJSONの元の構造体 をひとつ作る
-    ResponseMsg_t response_msg = {};
-
-    if (doc.containsKey("work_id") && doc.containsKey("action"))
-    {
-      if (doc["work_id"] == "sys")
-      {
-        response_msg.request_id = doc["request_id"].as<String>();
-        response_msg.work_id = "sys";
-        if (doc["action"] == "ping")
-        {
-          Serial.println("[JSON] System ping");
-          response_msg.object = "None";
-          response_msg.error.code = 0;
-          response_msg.error.message = "";
-          sendToM5(response_msg);
-        }
-        else if (doc["action"] == "reset")
-        {
-          Serial.println("[JSON] System reset");
-          response_msg.object = "None";
-          response_msg.error.code = 0;
-          response_msg.error.message = "";
-          response_msg.request_id = "sys_reset";
-          response_msg.work_id = "sys";
-          sendToM5(response_msg);
-          delay(15);
-          response_msg.request_id = "0";
-          response_msg.work_id = "sys";
-          response_msg.object = "None";
-          response_msg.error.code = 0;
-          response_msg.error.message = "";
-          sendToM5(response_msg);
-        }
-        else if (doc["action"] == "reboot")
-        {
-          Serial.println("[JSON] System reboot");
-        }
-        else if (doc["action"] == "version")
-        {
-          Serial.println("[JSON] System version");
-        }
-      }
-      else if (doc["work_id"] == "llm")
-      {
-        response_msg.request_id = doc["request_id"].as<String>();
-        if (doc["action"] == "setup")
-        {
-          Serial.println("[JSON] LLM setup");
-          // dataフィールドからモデル名を取得
-          String model_name = "";
-          if (doc["data"].is<JsonObject>())
-          {
-            JsonObject data_obj = doc["data"];
-            if (data_obj["model"].is<String>())
-            {
-              model_name = data_obj["model"].as<String>();
-            }
-          }
-          else if (doc["data"].is<String>())
-          {
-            model_name = doc["data"].as<String>();
-          }
-
-          if (model_name.length() == 0)
-          {
-            Serial.println("[JSON] Model name not specified in data field");
-            response_msg.error.code = 1;
-            response_msg.error.message = "Model name not specified";
-            sendToM5(response_msg);
-          }
-          else
-          {
-            LLM_Status llm_status = llm_setup(model_name);
-            Serial.print("[JSON] LLM setup status: ");
-            Serial.println(llm_status);
-            if (llm_status != LLM_OLLAMA_OK)
-            {
-              response_msg.error.code = (llm_status == LLM_OLLAMA_NOT_FOUND) ? 2 : 1;
-              response_msg.error.message = (llm_status == LLM_OLLAMA_NOT_FOUND) ? "Model not found" : "LLM setup failed";
-              sendToM5(response_msg);
-            }
-            else
-            {
-              // work_idを生成（例: "llm_12345"）
-              String generated_work_id = "llm_" + String(millis() % 100000);
-              response_msg.work_id = generated_work_id;
-              current_work_id = generated_work_id;
-              response_msg.object = "llm.setup";
-              response_msg.error.code = 0;
-              response_msg.error.message = "";
-              response_msg.request_id = "llm_setup";
-              Serial.print("[JSON] LLM setup response: ");
-              Serial.print("request_id=");
-              Serial.print(response_msg.request_id);
-              Serial.print(", work_id=");
-              Serial.print(response_msg.work_id);
-              Serial.print(", object=");
-              Serial.print(response_msg.object);
-              Serial.print(", error.code=");
-              Serial.print(response_msg.error.code);
-              Serial.println();
-
-              sendToM5(response_msg);
-
-              // PCに送る（適当に受信したJSONをそのまま送る）
-              String json_str;
-              serializeJson(doc, json_str);
-              sendToPC(json_str);
-            }
-          }
-        }
-        else if (doc["action"] == "inference")
-        {
- 
-        }
-      }
-      else
-      {
-        if (doc["action"] == "inference" && doc["request_id"] == "llm_inference")
-        {
-          Serial.println("[JSON] LLM inference");
-          if (doc["object"] == "llm.utf-8.stream")
-          {
-            Serial.println("[JSON] Using streaming inference");
-            OllamaInferenceCommand command;
-            command.model = using_model_name;
-            command.prompt = doc["data"]["delta"].as<String>();
-
-            LLM_Status llm_status = llm_inference_streaming(command);
-            Serial.print("[JSON] LLM inference status: ");
-            Serial.println(llm_status);
-            if (llm_status != LLM_OLLAMA_OK)
-            {
-              response_msg.error.code = 1;
-              response_msg.error.message = "LLM inference failed";
-              sendToM5(response_msg);
-            }
-          }
-          else
-          {
-            Serial.println("[JSON] Using non-streaming inference");
-          }
-        }
-      }
-    }
-    // LEDで成功を表示
-    blinkLED(COLOR_OK, 1, 50);
+    deferred_command = false;
+    dispatchCommand();
   }
+  // 推論していない間に、履歴から落とした発話を要約する（プロンプトが届いていれば中止する）
+  chatHistoryPoll();
+  // キューの先頭のプロンプトを推論する（推論中に届いたコマンドはpollDuringInferenceで受け付ける）
+  promptQueueRun(pollDuringInference);
+
+  // このループで使ったJSONドキュメントの領域をまとめて解放する
+  requestArenaReset();
+  capturePoll();
 
   delay(10);
-}
+}
\ No newline at end of file
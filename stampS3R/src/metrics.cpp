@@ -0,0 +1,292 @@
+#include "metrics.h"
+#include "common.h"
+#include "arena.h"
+
+namespace {
+
+// ヒストグラムの上限値（le）。最後の+Infは別に数える
+constexpr size_t HISTOGRAM_BUCKET_NUM = 8;
+const float TTFT_BUCKETS_S[HISTOGRAM_BUCKET_NUM] = {0.1f, 0.25f, 0.5f, 1.0f, 2.0f, 5.0f, 10.0f, 30.0f};
+const float TPS_BUCKETS[HISTOGRAM_BUCKET_NUM] = {1.0f, 2.0f, 5.0f, 10.0f, 20.0f, 30.0f, 50.0f, 100.0f};
+
+struct Histogram
+{
+    uint32_t counts[HISTOGRAM_BUCKET_NUM + 1]; // 各区間の数（出力時に累積する）
+    uint32_t count;
+    double sum;
+};
+
+// 書き込みはloop()とTTSのタスク、読み出しは/metricsのタスクから行う
+// 32bitの整数の読み書きは分割されないので、値が1回分ずれることはあっても壊れはしない
+// double（ヒストグラムのsumとTLSの秒数）は分割されるので、読み書きともmetricsMutex()の中で行う
+struct Metrics
+{
+    uint32_t requests[METRICS_REQUEST_RESULT_NUM];
+    Histogram ttft;
+    Histogram tokens_per_second;
+    uint32_t tokens;
+    uint32_t stream_resumes;
+    uint32_t backend_connect_failures;
+    uint32_t tls_handshakes[2]; // [0]: フル、[1]: 再開
+    double tls_handshake_seconds[2];
+    uint32_t tls_reuses;
+    uint32_t wifi_retries;
+    uint32_t wifi_disconnects;
+    uint32_t uart_backlog_max;
+};
+
+Metrics metrics;
+
+SemaphoreHandle_t metricsMutex()
+{
+    static SemaphoreHandle_t mutex = xSemaphoreCreateMutex();
+    return mutex;
+}
+
+void observe(Histogram &histogram, const float *buckets, const float value)
+{
+    size_t i = 0;
+    while (i < HISTOGRAM_BUCKET_NUM && value > buckets[i])
+    {
+        i++;
+    }
+    histogram.counts[i]++;
+    histogram.count++;
+    histogram.sum += value;
+}
+
+} // namespace
+
+void metricsRecordRequest(const MetricsRequestResult result)
+{
+    if (result < METRICS_REQUEST_RESULT_NUM)
+    {
+        metrics.requests[result]++;
+    }
+}
+
+void metricsRecordStream(const uint32_t tokens, const uint32_t ttft_us, const uint32_t total_us)
+{
+    metrics.tokens += tokens;
+    if (tokens == 0)
+    {
+        return;
+    }
+    xSemaphoreTake(metricsMutex(), portMAX_DELAY);
+    observe(metrics.ttft, TTFT_BUCKETS_S, ttft_us / 1000000.0f);
+    const uint32_t generation_us = total_us - ttft_us;
+    if (generation_us > 0)
+    {
+        observe(metrics.tokens_per_second, TPS_BUCKETS, tokens * 1000000.0f / generation_us);
+    }
+    xSemaphoreGive(metricsMutex());
+}
+
+void metricsRecordStreamResume()
+{
+    metrics.stream_resumes++;
+}
+
+void metricsRecordBackendConnectFailure()
+{
+    metrics.backend_connect_failures++;
+}
+
+void metricsRecordTlsHandshake(const bool resumed, const uint32_t elapsed_us)
+{
+    xSemaphoreTake(metricsMutex(), portMAX_DELAY);
+    metrics.tls_handshakes[resumed ? 1 : 0]++;
+    metrics.tls_handshake_seconds[resumed ? 1 : 0] += elapsed_us / 1000000.0;
+    xSemaphoreGive(metricsMutex());
+}
+
+void metricsRecordTlsReuse()
+{
+    metrics.tls_reuses++;
+}
+
+void metricsRecordWifiRetry()
+{
+    metrics.wifi_retries++;
+}
+
+void metricsObserveUartBacklog()
+{
+    const size_t free_bytes = Serial2.availableForWrite();
+    const uint32_t backlog = free_bytes < M5_UART_TX_BUFFER_SIZE ? M5_UART_TX_BUFFER_SIZE - free_bytes : 0;
+    if (backlog > metrics.uart_backlog_max)
+    {
+        metrics.uart_backlog_max = backlog;
+    }
+}
+
+#if USE_WIFI_FOR_LLM_COMMUNICATION && ENABLE_METRICS_SERVER
+
+#include "WiFi.h"
+#include "prompt_queue.h"
+
+namespace {
+
+constexpr uint32_t METRICS_TASK_STACK_SIZE = 4096;
+constexpr uint32_t METRICS_POLL_INTERVAL_MS = 100;
+
+// /metricsの本文（/metricsのタスクだけが使う）
+FixedString<6144> metrics_body;
+
+void appendHelp(const char *name, const char *type, const char *help)
+{
+    metrics_body.append("# HELP ").append(name).append(" ").append(help).append("\n");
+    metrics_body.append("# TYPE ").append(name).append(" ").append(type).append("\n");
+}
+
+// %.17gはdoubleを丸めずに出す。整数（2^53未満）は小数点なしでそのまま出るので、カウンタの桁も落ちない
+void appendValue(const char *name, const char *labels, const double value)
+{
+    char line[128];
+    const int length = snprintf(line, sizeof(line), "%s%s %.17g\n", name, labels, value);
+    metrics_body.append(line, length);
+}
+
+void appendMetric(const char *name, const char *type, const char *help, const double value)
+{
+    appendHelp(name, type, help);
+    appendValue(name, "", value);
+}
+
+void appendHistogram(const char *name, const char *help, const Histogram &histogram, const float *buckets)
+{
+    appendHelp(name, "histogram", help);
+    char suffixed[64];
+    snprintf(suffixed, sizeof(suffixed), "%s_bucket", name);
+    char labels[32];
+    uint32_t cumulative = 0;
+    for (size_t i = 0; i < HISTOGRAM_BUCKET_NUM; i++)
+    {
+        cumulative += histogram.counts[i];
+        snprintf(labels, sizeof(labels), "{le=\"%g\"}", buckets[i]);
+        appendValue(suffixed, labels, cumulative);
+    }
+    appendValue(suffixed, "{le=\"+Inf\"}", histogram.count);
+    snprintf(suffixed, sizeof(suffixed), "%s_sum", name);
+    appendValue(suffixed, "", histogram.sum);
+    snprintf(suffixed, sizeof(suffixed), "%s_count", name);
+    appendValue(suffixed, "", histogram.count);
+}
+
+void buildMetrics()
+{
+    // doubleが書きかけの状態で読まないよう、まとめて写してから書き出す
+    xSemaphoreTake(metricsMutex(), portMAX_DELAY);
+    const Metrics snapshot = metrics;
+    xSemaphoreGive(metricsMutex());
+
+    metrics_body.clear();
+    appendHelp("module_llm_requests_total", "counter", "LLM inference requests by result.");
+    appendValue("module_llm_requests_total", "{result=\"ok\"}", snapshot.requests[METRICS_REQUEST_OK]);
+    appendValue("module_llm_requests_total", "{result=\"error\"}", snapshot.requests[METRICS_REQUEST_ERROR]);
+    appendValue("module_llm_requests_total", "{result=\"cached\"}", snapshot.requests[METRICS_REQUEST_CACHED]);
+    appendMetric("module_llm_tokens_total", "counter", "Tokens streamed from the backend.", snapshot.tokens);
+    appendHistogram("module_llm_ttft_seconds", "Time from request to first token.", snapshot.ttft, TTFT_BUCKETS_S);
+    appendHistogram("module_llm_tokens_per_second", "Generation speed after the first token.",
+                    snapshot.tokens_per_second, TPS_BUCKETS);
+    appendMetric("module_llm_stream_resumes_total", "counter", "Stalled streams resumed with a new request.",
+                 snapshot.stream_resumes);
+    appendMetric("module_backend_connect_failures_total", "counter", "Failed TCP connects to backends.",
+                 snapshot.backend_connect_failures);
+    appendHelp("module_backend_tls_handshakes_total", "counter", "TLS handshakes with the LLM backend by type.");
+    appendValue("module_backend_tls_handshakes_total", "{type=\"full\"}", snapshot.tls_handshakes[0]);
+    appendValue("module_backend_tls_handshakes_total", "{type=\"resumed\"}", snapshot.tls_handshakes[1]);
+    appendHelp("module_backend_tls_handshake_seconds_total", "counter", "Time spent in TLS handshakes by type.");
+    appendValue("module_backend_tls_handshake_seconds_total", "{type=\"full\"}", snapshot.tls_handshake_seconds[0]);
+    appendValue("module_backend_tls_handshake_seconds_total", "{type=\"resumed\"}", snapshot.tls_handshake_seconds[1]);
+    appendMetric("module_backend_tls_reused_total", "counter", "Requests sent on a kept-alive TLS connection.",
+                 snapshot.tls_reuses);
+    appendMetric("module_prompt_queue_depth", "gauge", "Prompts waiting behind the running inference.",
+                 promptQueueDepth());
+
+    const size_t free_bytes = Serial2.availableForWrite();
+    appendMetric("module_uart_tx_queue_bytes", "gauge", "Bytes waiting in the UART TX buffer to the Core.",
+                 free_bytes < M5_UART_TX_BUFFER_SIZE ? M5_UART_TX_BUFFER_SIZE - free_bytes : 0);
+    appendMetric("module_uart_tx_queue_max_bytes", "gauge", "Largest UART TX backlog seen after a send.",
+                 snapshot.uart_backlog_max);
+
+    appendMetric("module_heap_free_bytes", "gauge", "Free heap.", ESP.getFreeHeap());
+    appendMetric("module_heap_min_free_bytes", "gauge", "Lowest free heap since boot.", ESP.getMinFreeHeap());
+    appendMetric("module_heap_max_alloc_bytes", "gauge", "Largest allocatable heap block.", ESP.getMaxAllocHeap());
+
+    appendMetric("module_wifi_rssi_dbm", "gauge", "WiFi signal strength.", WiFi.RSSI());
+    appendMetric("module_wifi_connect_retries_total", "counter", "Waits while connecting to WiFi at boot.",
+                 snapshot.wifi_retries);
+    appendMetric("module_wifi_disconnects_total", "counter", "WiFi station disconnects.", snapshot.wifi_disconnects);
+    appendMetric("module_uptime_seconds", "gauge", "Seconds since boot.", millis() / 1000);
+}
+
+void onWifiDisconnected(arduino_event_id_t event)
+{
+    metrics.wifi_disconnects++;
+}
+
+// リクエスト行だけを見て、ヘッダは読み捨てる（読み出しはStreamの既定の1秒でタイムアウトする）
+void serveClient(WiFiClient &client)
+{
+    const String request_line = client.readStringUntil('\n');
+    while (client.connected())
+    {
+        const String header = client.readStringUntil('\n');
+        if (header.length() <= 1)
+        {
+            break;
+        }
+    }
+
+    if (!request_line.startsWith("GET /metrics"))
+    {
+        client.print("HTTP/1.1 404 Not Found\r\nContent-Length: 0\r\nConnection: close\r\n\r\n");
+        return;
+    }
+    buildMetrics();
+    if (metrics_body.overflowed())
+    {
+        Serial.println("[METRICS] Body truncated");
+    }
+    char header[128];
+    snprintf(header, sizeof(header),
+             "HTTP/1.1 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: %u\r\nConnection: close\r\n\r\n",
+             static_cast<unsigned>(metrics_body.length()));
+    client.print(header);
+    client.write(reinterpret_cast<const uint8_t *>(metrics_body.c_str()), metrics_body.length());
+}
+
+void metricsTask(void *parameter)
+{
+    WiFiServer server(METRICS_HTTP_PORT);
+    server.begin();
+    Serial.printf("[METRICS] Serving /metrics on port %u\n", static_cast<unsigned>(METRICS_HTTP_PORT));
+    while (true)
+    {
+        WiFiClient client = server.accept();
+        if (client)
+        {
+            serveClient(client);
+            client.stop();
+        }
+        vTaskDelay(pdMS_TO_TICKS(METRICS_POLL_INTERVAL_MS));
+    }
+}
+
+} // namespace
+
+void initMetricsServer()
+{
+    WiFi.onEvent(onWifiDisconnected, ARDUINO_EVENT_WIFI_STA_DISCONNECTED);
+    // 推論やUARTの処理を邪魔しないよう、コア0のアイドルと同じ優先度で動かす
+    xTaskCreatePinnedToCore(metricsTask, "metrics", METRICS_TASK_STACK_SIZE, nullptr, tskIDLE_PRIORITY, nullptr, 0);
+}
+
+#else
+
+void initMetricsServer()
+{
+}
+
+#endif
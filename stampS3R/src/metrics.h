@@ -0,0 +1,38 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include "config.h"
+#include <Arduino.h>
+
+// 複数のModuleを集中監視するための稼働統計
+// WiFi接続時はENABLE_METRICS_SERVERで、Prometheus形式の /metrics をMETRICS_HTTP_PORTで返す
+
+enum MetricsRequestResult
+{
+    METRICS_REQUEST_OK = 0,
+    METRICS_REQUEST_ERROR = 1,
+    METRICS_REQUEST_CACHED = 2, // セマンティックキャッシュから返した
+    METRICS_REQUEST_RESULT_NUM
+};
+
+// 推論1回の結果
+void metricsRecordRequest(const MetricsRequestResult result);
+// 推論ストリーム1回分の最初のトークンまでの時間とトークンの速度
+void metricsRecordStream(const uint32_t tokens, const uint32_t ttft_us, const uint32_t total_us);
+// 途切れたストリームの再開
+void metricsRecordStreamResume();
+// バックエンドへの接続の失敗
+void metricsRecordBackendConnectFailure();
+// バックエンドとのTLSハンドシェイク（resumed: セッションを再開できた）
+void metricsRecordTlsHandshake(const bool resumed, const uint32_t elapsed_us);
+// プールに残したTLS接続の使い回し
+void metricsRecordTlsReuse();
+// 起動時のWiFi接続の待ち回数
+void metricsRecordWifiRetry();
+// Coreへの送信後のUART送信バッファの使用量（最大値を残す）
+void metricsObserveUartBacklog();
+
+// /metrics を返すタスクを起動する（WiFi接続時、ENABLE_METRICS_SERVERがtrueのとき）
+void initMetricsServer();
+
+#endif // METRICS_H
@@ -0,0 +1,88 @@
+#include "perf.h"
+#include "arena.h"
+
+namespace {
+
+struct PerfCounter
+{
+    const char *name;
+    uint32_t count;
+    uint64_t total_us;
+    uint32_t max_us;
+    uint64_t total_bytes;
+};
+
+PerfCounter perfCounters[PERF_COUNTER_NUM] = {
+    {"readJsonMessage", 0, 0, 0, 0},
+    {"sendToM5", 0, 0, 0, 0},
+    {"stream_line_parse", 0, 0, 0, 0},
+    {"tags_parse", 0, 0, 0, 0},
+    {"cache_embed", 0, 0, 0, 0},
+    {"cache_search", 0, 0, 0, 0},
+    {"prompt_queue_wait", 0, 0, 0, 0},
+    {"tls_handshake", 0, 0, 0, 0},
+};
+
+} // namespace
+
+void perfRecord(const PerfCounterId id, const uint32_t elapsed_us, const size_t bytes)
+{
+    if (!ENABLE_PERF_LOG || id >= PERF_COUNTER_NUM)
+    {
+        return;
+    }
+    PerfCounter &counter = perfCounters[id];
+    counter.count++;
+    counter.total_us += elapsed_us;
+    counter.total_bytes += bytes;
+    if (elapsed_us > counter.max_us)
+    {
+        counter.max_us = elapsed_us;
+    }
+}
+
+void perfReportStream(const uint32_t tokens, const uint32_t ttft_us, const uint32_t total_us)
+{
+    if (!ENABLE_PERF_LOG)
+    {
+        return;
+    }
+    // 例: [PERF] {"name":"llm_inference_streaming","tokens":42,"ttft_us":812000,"total_us":3100000,"us_per_token":54500}
+    Serial.printf("[PERF] {\"name\":\"llm_inference_streaming\",\"tokens\":%lu,\"ttft_us\":%lu,\"total_us\":%lu,\"us_per_token\":%lu}\n",
+                  static_cast<unsigned long>(tokens),
+                  static_cast<unsigned long>(ttft_us),
+                  static_cast<unsigned long>(total_us),
+                  static_cast<unsigned long>(tokens > 0 ? (total_us - ttft_us) / tokens : 0));
+}
+
+void perfReport()
+{
+    if (!ENABLE_PERF_LOG)
+    {
+        return;
+    }
+    for (size_t i = 0; i < PERF_COUNTER_NUM; i++)
+    {
+        PerfCounter &counter = perfCounters[i];
+        if (counter.count == 0)
+        {
+            continue;
+        }
+        Serial.printf("[PERF] {\"name\":\"%s\",\"count\":%lu,\"avg_us\":%lu,\"max_us\":%lu,\"avg_bytes\":%lu}\n",
+                      counter.name,
+                      static_cast<unsigned long>(counter.count),
+                      static_cast<unsigned long>(counter.total_us / counter.count),
+                      static_cast<unsigned long>(counter.max_us),
+                      static_cast<unsigned long>(counter.total_bytes / counter.count));
+        counter.count = 0;
+        counter.total_us = 0;
+        counter.max_us = 0;
+        counter.total_bytes = 0;
+    }
+    requestArenaReport();
+    // ヒープの空き状況（断片化の目安）
+    Serial.printf("[PERF] {\"name\":\"heap\",\"free\":%lu,\"min_free\":%lu,\"max_alloc\":%lu}\n",
+                  static_cast<unsigned long>(ESP.getFreeHeap()),
+                  static_cast<unsigned long>(ESP.getMinFreeHeap()),
+                  static_cast<unsigned long>(ESP.getMaxAllocHeap()));
+}
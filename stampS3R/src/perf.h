@@ -0,0 +1,30 @@
+#ifndef PERF_H
+#define PERF_H
+
+#include "config.h"
+#include <Arduino.h>
+
+// 計測対象のホットパス
+enum PerfCounterId
+{
+    PERF_READ_JSON_MESSAGE = 0, // UARTからのフレーム走査とパース
+    PERF_SEND_TO_M5 = 1,        // 返答JSONの組み立てとエスケープ
+    PERF_STREAM_LINE_PARSE = 2, // ストリーム1行分のパース
+    PERF_TAGS_PARSE = 3,        // /api/tags のパース
+    PERF_CACHE_EMBED = 4,       // セマンティックキャッシュ: プロンプトのベクトル計算（バックエンド）
+    PERF_CACHE_SEARCH = 5,      // セマンティックキャッシュ: 類似度の検索（バイト数は走査したベクトルの合計）
+    PERF_PROMPT_QUEUE_WAIT = 6, // プロンプトがキューで待った時間（バイト数の欄は後ろに待っている数）
+    PERF_TLS_HANDSHAKE = 7,     // バックエンドとのTLSハンドシェイク（バイト数の欄は再開できたら1）
+    PERF_COUNTER_NUM
+};
+
+// 1回分の処理時間(us)と処理したバイト数を記録
+void perfRecord(const PerfCounterId id, const uint32_t elapsed_us, const size_t bytes);
+
+// 1回の推論ストリームの統計を出力
+void perfReportStream(const uint32_t tokens, const uint32_t ttft_us, const uint32_t total_us);
+
+// 集計結果をJSONでシリアルに出力してリセット
+void perfReport();
+
+#endif // PERF_H
@@ -0,0 +1,87 @@
+#include "power.h"
+#include "common.h"
+#include <esp_sleep.h>
+#include <driver/gpio.h>
+
+#if USE_WIFI_FOR_LLM_COMMUNICATION
+#include <esp_wifi.h>
+#endif
+
+namespace {
+
+// UARTとWiFiのためにAPB(80MHz)を保てる最低クロック
+constexpr uint32_t CPU_FREQ_ACTIVE_MHZ = 240;
+constexpr uint32_t CPU_FREQ_IDLE_MHZ = 80;
+
+PowerState power_state = POWER_IDLE;
+unsigned long last_activity_time = 0;
+
+void applyPowerState(const PowerState state) {
+    const uint32_t start = micros();
+    if (state == POWER_ACTIVE) {
+        setCpuFrequencyMhz(CPU_FREQ_ACTIVE_MHZ);
+#if USE_WIFI_FOR_LLM_COMMUNICATION
+        // モデムスリープ中はDTIM毎にしか受信しないため、トークン受信が数十〜数百ms遅れる
+        esp_wifi_set_ps(WIFI_PS_NONE);
+#endif
+    } else {
+#if USE_WIFI_FOR_LLM_COMMUNICATION
+        esp_wifi_set_ps(WIFI_PS_MAX_MODEM);
+#endif
+        setCpuFrequencyMhz(CPU_FREQ_IDLE_MHZ);
+    }
+    power_state = state;
+    Serial.printf("[POWER] %s (%lu MHz) in %lu us\n",
+                  state == POWER_ACTIVE ? "active" : "idle",
+                  static_cast<unsigned long>(getCpuFrequencyMhz()),
+                  static_cast<unsigned long>(micros() - start));
+}
+
+// UARTのRXピンがLowになる（スタートビット）と起床する。起床時の先頭の数バイトは失われることがある
+void enterLightSleep() {
+    if (!POWER_IDLE_LIGHT_SLEEP || USE_WIFI_FOR_LLM_COMMUNICATION) {
+        return;
+    }
+    if (Serial2.available()) {
+        return;
+    }
+    Serial.flush();
+    gpio_wakeup_enable(static_cast<gpio_num_t>(M5_UART_RX_PIN), GPIO_INTR_LOW_LEVEL);
+    esp_sleep_enable_gpio_wakeup();
+    const uint32_t start = micros();
+    esp_light_sleep_start();
+    Serial.printf("[POWER] woke from light sleep after %lu us\n", static_cast<unsigned long>(micros() - start));
+    powerOnActivity();
+}
+
+} // namespace
+
+void initPowerGovernor() {
+    last_activity_time = millis();
+    applyPowerState(POWER_ACTIVE);
+}
+
+void powerOnActivity() {
+    last_activity_time = millis();
+    if (power_state != POWER_ACTIVE) {
+        applyPowerState(POWER_ACTIVE);
+    }
+}
+
+void powerUpdate() {
+    if (Serial2.available()) {
+        powerOnActivity();
+        return;
+    }
+    if (millis() - last_activity_time < POWER_IDLE_TIMEOUT_MS) {
+        return;
+    }
+    if (power_state != POWER_IDLE) {
+        applyPowerState(POWER_IDLE);
+    }
+    enterLightSleep();
+}
+
+PowerState currentPowerState() {
+    return power_state;
+}
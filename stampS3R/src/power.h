@@ -0,0 +1,25 @@
+#ifndef POWER_H
+#define POWER_H
+
+#include "config.h"
+#include <Arduino.h>
+
+// 動作状態
+enum PowerState
+{
+    POWER_ACTIVE = 0, // CPU最大クロック、WiFi省電力なし（受信遅延最小）
+    POWER_IDLE = 1    // CPU低クロック、WiFiモデムスリープ
+};
+
+// 起動時に一度呼ぶ（ACTIVEから開始）
+void initPowerGovernor();
+
+// コマンド受信時やストリーム中に呼ぶ。IDLEならACTIVEに戻す
+void powerOnActivity();
+
+// loop()から毎回呼ぶ。POWER_IDLE_TIMEOUT_MSの間アクティビティがなければIDLEに落とす
+void powerUpdate();
+
+PowerState currentPowerState();
+
+#endif // POWER_H
@@ -0,0 +1,203 @@
+#include "prompt_queue.h"
+#include "llm_work.h"
+
+#if USE_WIFI_FOR_LLM_COMMUNICATION
+
+#include "use_wifi.h"
+
+namespace {
+
+struct QueuedPrompt
+{
+    bool active;     // falseはexitなどで捨てられた枠（先頭に来たら読み飛ばす）
+    bool dispatched; // リクエストを先に送ってある
+    OllamaInferenceCommand command;
+    String request_id;
+    unsigned long enqueued_ms;
+    WiFiClient client;
+    HttpStream http;
+};
+
+// 先頭から順に推論するリングバッファ。推論中のものは終わるまで先頭に残す
+QueuedPrompt prompt_queue[PROMPT_QUEUE_CAPACITY];
+size_t queue_head = 0;
+size_t queue_count = 0;
+bool queue_running = false;
+
+QueuedPrompt &entryAt(const size_t offset)
+{
+    return prompt_queue[(queue_head + offset) % PROMPT_QUEUE_CAPACITY];
+}
+
+void releaseEntry(QueuedPrompt &entry)
+{
+    if (entry.dispatched)
+    {
+        httpStreamClose(entry.http);
+    }
+    entry.active = false;
+    entry.dispatched = false;
+    entry.command.prompt = "";
+}
+
+// 先頭の捨てられた枠を詰める
+void popInactive()
+{
+    while (queue_count > 0 && !entryAt(0).active)
+    {
+        queue_head = (queue_head + 1) % PROMPT_QUEUE_CAPACITY;
+        queue_count--;
+    }
+}
+
+// 推論中のものの次に待っているプロンプト
+QueuedPrompt *nextWaiting()
+{
+    for (size_t i = queue_running ? 1 : 0; i < queue_count; i++)
+    {
+        QueuedPrompt &entry = entryAt(i);
+        if (entry.active)
+        {
+            return &entry;
+        }
+    }
+    return nullptr;
+}
+
+// 今の生成が終わりに近づいたら、次のプロンプトを先にバックエンドへ送る
+// セマンティックキャッシュを使うwork_idは、キャッシュを調べるまで送らない
+// 履歴を使うwork_idは、今の回答が同じwork_idの履歴に入るまで送らない
+void dispatchNext()
+{
+    QueuedPrompt *next = nextWaiting();
+    if (next == nullptr || next->dispatched)
+    {
+        return;
+    }
+    const LlmWorkConfig *config = next->command.config;
+    if (config && (config->semantic_cache ||
+                   (config->history != LLM_HISTORY_OFF && next->command.work_id == entryAt(0).command.work_id)))
+    {
+        return;
+    }
+    if (llm_inference_dispatch(next->command, next->client, next->http) == LLM_OLLAMA_OK)
+    {
+        next->dispatched = true;
+        Serial.print("[QUEUE] Dispatched ahead: ");
+        Serial.println(next->command.work_id);
+    }
+}
+
+} // namespace
+
+PromptQueueResult promptQueuePush(const OllamaInferenceCommand &command, const String &request_id)
+{
+    popInactive();
+    size_t same_work = 0;
+    for (size_t i = queue_running ? 1 : 0; i < queue_count; i++)
+    {
+        const QueuedPrompt &entry = entryAt(i);
+        if (entry.active && entry.command.work_id == command.work_id)
+        {
+            same_work++;
+        }
+    }
+    if (queue_count >= PROMPT_QUEUE_CAPACITY || same_work >= PROMPT_QUEUE_DEPTH)
+    {
+        Serial.print("[QUEUE] Full, rejecting prompt for ");
+        Serial.println(command.work_id);
+        return PROMPT_QUEUE_FULL;
+    }
+    QueuedPrompt &entry = entryAt(queue_count++);
+    entry.active = true;
+    entry.dispatched = false;
+    entry.command = command;
+    entry.request_id = request_id;
+    entry.enqueued_ms = millis();
+    Serial.printf("[QUEUE] Queued %s (depth %u)\n", command.work_id.c_str(), static_cast<unsigned>(promptQueueDepth()));
+    return PROMPT_QUEUE_OK;
+}
+
+void promptQueueDropWork(const String &work_id)
+{
+    for (size_t i = queue_running ? 1 : 0; i < queue_count; i++)
+    {
+        QueuedPrompt &entry = entryAt(i);
+        if (entry.active && entry.command.work_id == work_id)
+        {
+            releaseEntry(entry);
+        }
+    }
+    if (!queue_running)
+    {
+        popInactive();
+    }
+}
+
+void promptQueueClear()
+{
+    for (size_t i = queue_running ? 1 : 0; i < queue_count; i++)
+    {
+        releaseEntry(entryAt(i));
+    }
+    if (!queue_running)
+    {
+        popInactive();
+    }
+}
+
+bool promptQueueIsRunning(const String &work_id)
+{
+    return queue_running && entryAt(0).command.work_id == work_id;
+}
+
+size_t promptQueueDepth()
+{
+    size_t depth = 0;
+    for (size_t i = queue_running ? 1 : 0; i < queue_count; i++)
+    {
+        if (entryAt(i).active)
+        {
+            depth++;
+        }
+    }
+    return depth;
+}
+
+void promptQueueRun(PromptQueuePollFunc poll)
+{
+    popInactive();
+    if (queue_running || queue_count == 0)
+    {
+        return;
+    }
+    QueuedPrompt &entry = entryAt(0);
+    const unsigned long waited_ms = millis() - entry.enqueued_ms;
+    perfRecord(PERF_PROMPT_QUEUE_WAIT, waited_ms * 1000, promptQueueDepth() - 1);
+    Serial.printf("[QUEUE] Start %s (waited %lu ms, %u more queued%s)\n", entry.command.work_id.c_str(), waited_ms,
+                  static_cast<unsigned>(promptQueueDepth() - 1), entry.dispatched ? ", dispatched ahead" : "");
+
+    queue_running = true;
+    llm_set_stream_hooks(poll, dispatchNext);
+    const LLM_Status llm_status = llm_inference_streaming(entry.command, entry.dispatched ? &entry.http : nullptr);
+    llm_set_stream_hooks(nullptr, nullptr);
+    queue_running = false;
+
+    Serial.print("[JSON] LLM inference status: ");
+    Serial.println(llm_status);
+    if (llm_status != LLM_OLLAMA_OK)
+    {
+        ResponseMsg_t response_msg = {};
+        response_msg.request_id = entry.request_id;
+        response_msg.work_id = entry.command.work_id;
+        response_msg.error.code = 1;
+        response_msg.error.message = "LLM inference failed";
+        sendToM5(response_msg);
+    }
+    // 応答は受け取り済み（または失敗）なので、先に送った接続としては閉じない
+    entry.dispatched = false;
+    releaseEntry(entry);
+    popInactive();
+}
+
+#endif // USE_WIFI_FOR_LLM_COMMUNICATION
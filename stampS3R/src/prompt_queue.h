@@ -0,0 +1,34 @@
+#ifndef PROMPT_QUEUE_H
+#define PROMPT_QUEUE_H
+
+#include "common.h"
+
+// LLMのプロンプトのキュー
+// 推論中に届いたプロンプトを待たせておき、今の生成の終わりが近づいたら次のリクエストを先にバックエンドへ送る
+// max_token_lenがあるwork_idでは、バックエンドは今の回答の最後の数トークンと並行して次のプロンプトを評価できる
+// max_token_lenがなければdoneが届いてから送るので、省けるのは次のリクエストの接続と送信の時間だけ
+
+enum PromptQueueResult
+{
+    PROMPT_QUEUE_OK = 0,
+    PROMPT_QUEUE_FULL = 1
+};
+
+// 全体の枠数（work_idごとの上限はPROMPT_QUEUE_DEPTH）
+constexpr size_t PROMPT_QUEUE_CAPACITY = 8;
+
+typedef void (*PromptQueuePollFunc)();
+
+PromptQueueResult promptQueuePush(const OllamaInferenceCommand &command, const String &request_id);
+// work_idの待っているプロンプトを捨てる（推論中のものはそのまま）
+void promptQueueDropWork(const String &work_id);
+void promptQueueClear();
+// work_idのプロンプトを推論中か
+bool promptQueueIsRunning(const String &work_id);
+// 待っているプロンプトの数（推論中のものを除く）
+size_t promptQueueDepth();
+
+// loop()から呼ぶ。先頭のプロンプトを推論する。推論中はpollを呼んでCoreからのフレームを受け付ける
+void promptQueueRun(PromptQueuePollFunc poll);
+
+#endif // PROMPT_QUEUE_H
@@ -0,0 +1,293 @@
+#include "protocol.h"
+
+void jsonFrameReset(JsonFrameScanner &scanner)
+{
+    scanner.length = 0;
+    scanner.buffer[0] = '\0';
+    scanner.open_braces = 0;
+    scanner.in_string = false;
+    scanner.escaped = false;
+}
+
+JsonFrameStatus jsonFrameFeed(JsonFrameScanner &scanner, const char c)
+{
+    if (c == '\n' || c == '\r')
+    {
+        jsonFrameReset(scanner);
+        return JSON_FRAME_PENDING;
+    }
+    if (scanner.length >= JSON_BUFFER_SIZE - 1)
+    {
+        jsonFrameReset(scanner);
+        return JSON_FRAME_OVERFLOW;
+    }
+    scanner.buffer[scanner.length++] = c;
+
+    if (scanner.escaped)
+    {
+        scanner.escaped = false;
+        return JSON_FRAME_PENDING;
+    }
+    if (c == '\\')
+    {
+        scanner.escaped = true;
+        return JSON_FRAME_PENDING;
+    }
+    if (c == '"')
+    {
+        scanner.in_string = !scanner.in_string;
+        return JSON_FRAME_PENDING;
+    }
+    if (scanner.in_string)
+    {
+        return JSON_FRAME_PENDING;
+    }
+    if (c == '{')
+    {
+        scanner.open_braces++;
+    }
+    else if (c == '}' && --scanner.open_braces <= 0)
+    {
+        if (scanner.open_braces == 0)
+        {
+            scanner.buffer[scanner.length] = '\0';
+            return JSON_FRAME_COMPLETE;
+        }
+        jsonFrameReset(scanner);
+    }
+    return JSON_FRAME_PENDING;
+}
+
+char *jsonFrameText(JsonFrameScanner &scanner)
+{
+    // 最後は必ず } なので、後ろの空白はない
+    char *start = scanner.buffer;
+    while (*start == ' ' || *start == '\t')
+    {
+        start++;
+    }
+    return start;
+}
+
+bool jsonFrameFindString(const char *frame, const char *name, char *out, const size_t out_size)
+{
+    const size_t name_length = strlen(name);
+    int depth = 0;
+    bool expect_key = false;
+    const char *p = frame;
+    while (*p)
+    {
+        if (*p != '"')
+        {
+            if (*p == '{' || *p == '[')
+            {
+                depth++;
+                expect_key = depth == 1;
+            }
+            else if (*p == '}' || *p == ']')
+            {
+                depth--;
+            }
+            else if (*p == ',' && depth == 1)
+            {
+                expect_key = true;
+            }
+            p++;
+            continue;
+        }
+
+        // 文字列を読み飛ばす
+        const char *begin = ++p;
+        bool escaped = false;
+        while (*p && *p != '"')
+        {
+            if (*p == '\\' && *(p + 1))
+            {
+                escaped = true;
+                p++;
+            }
+            p++;
+        }
+        if (*p == '\0')
+        {
+            return false;
+        }
+        const size_t length = p - begin;
+        p++;
+        if (depth != 1 || !expect_key)
+        {
+            continue;
+        }
+        expect_key = false;
+        if (escaped)
+        {
+            // エスケープしたキーは同じ名前かどうか判断しない
+            return false;
+        }
+        if (length != name_length || strncmp(begin, name, length) != 0)
+        {
+            continue;
+        }
+
+        while (*p == ' ' || *p == '\t' || *p == ':')
+        {
+            p++;
+        }
+        if (*p != '"')
+        {
+            return false;
+        }
+        const char *value = ++p;
+        while (*p && *p != '"' && *p != '\\')
+        {
+            p++;
+        }
+        const size_t value_length = p - value;
+        if (*p != '"' || value_length >= out_size)
+        {
+            return false;
+        }
+        memcpy(out, value, value_length);
+        out[value_length] = '\0';
+        return true;
+    }
+    return false;
+}
+
+void buildCommandFilter(JsonDocument &filter, const CommandData data)
+{
+    filter["request_id"] = true;
+    filter["work_id"] = true;
+    filter["action"] = true;
+    filter["object"] = true;
+    if (data == COMMAND_DATA_STREAM)
+    {
+        filter["data"]["delta"] = true;
+        filter["data"]["index"] = true;
+        filter["data"]["finish"] = true;
+        filter["data"]["prompt"] = true;
+    }
+    else if (data == COMMAND_DATA_ALL)
+    {
+        filter["data"] = true;
+    }
+}
+
+bool buildResponseJson(ResponseJson &out, const ResponseMsg_t &response_msg)
+{
+    out.clear();
+    out.append("{\"request_id\":\"").append(response_msg.request_id);
+    out.append("\",\"work_id\":\"").append(response_msg.work_id);
+    out.append("\",\"object\":\"").append(response_msg.object).append("\"");
+
+    // inference_dataが空でない場合はdataフィールドを追加
+    if (response_msg.inference_data.delta.length() > 0 || response_msg.inference_data.finish ||
+        response_msg.inference_data.key.length() > 0)
+    {
+        out.append(",\"data\":{");
+        if (response_msg.inference_data.key.length() > 0)
+        {
+            out.append("\"key\":\"").appendJsonEscaped(response_msg.inference_data.key).append("\",");
+        }
+        out.append("\"delta\":\"").appendJsonEscaped(response_msg.inference_data.delta);
+        out.append("\",\"index\":").appendUnsigned(response_msg.inference_data.index);
+        out.append(",\"finish\":").append(response_msg.inference_data.finish ? "true" : "false").append("}");
+    }
+    else if (response_msg.data.length() > 0)
+    {
+        out.append(",\"data\":\"").appendJsonEscaped(response_msg.data).append("\"");
+    }
+
+    out.append(",\"error\":{\"code\":").appendUnsigned(response_msg.error.code);
+    out.append(",\"message\":\"").appendJsonEscaped(response_msg.error.message).append("\"}}");
+    return !out.overflowed();
+}
+
+size_t streamLineDocSize(const size_t length)
+{
+    size_t size = length * 2;
+    if (size < 2048) size = 2048;
+    if (size > 8192) size = 8192; // 最大8KB
+    return size;
+}
+
+namespace {
+
+// ストリームの行のうち使うフィールド。/api/generate のdoneの行にあるcontext（トークンの配列）などは展開しない
+const JsonDocument &streamLineFilter()
+{
+    static StaticJsonDocument<256> filter;
+    if (filter.isNull())
+    {
+        filter["response"] = true;
+        filter["thinking"] = true;
+        filter["message"]["content"] = true;
+        filter["message"]["thinking"] = true;
+        filter["done"] = true;
+        filter["prompt_eval_count"] = true;
+        filter["eval_count"] = true;
+        filter["eval_duration"] = true;
+    }
+    return filter;
+}
+
+} // namespace
+
+DeserializationError parseStreamLine(JsonDocument &doc, const char *line, const size_t length, StreamLine &parsed)
+{
+    const DeserializationError error =
+        deserializeJson(doc, line, length, DeserializationOption::Filter(streamLineFilter()));
+    if (error)
+    {
+        return error;
+    }
+    // 思考に対応したバックエンドは、思考部分を thinking（/api/chat は message.thinking）に分けて返す
+    JsonVariant thinking = doc["thinking"];
+    if (!thinking.is<const char *>())
+    {
+        thinking = doc["message"]["thinking"];
+    }
+    parsed.thinking = thinking.as<const char *>();
+
+    // /api/generate は response、/api/chat は message.content に出力が入る
+    JsonVariant text = doc["response"];
+    if (!text.is<const char *>())
+    {
+        text = doc["message"]["content"];
+    }
+    parsed.text = text.as<const char *>();
+
+    parsed.done = doc["done"].is<bool>() && doc["done"].as<bool>();
+    parsed.prompt_eval_count = doc["prompt_eval_count"] | 0;
+    parsed.eval_count = doc["eval_count"] | 0;
+    parsed.eval_duration_ns = doc["eval_duration"] | 0ULL;
+    return error;
+}
+
+DeserializationError parseTags(JsonDocument &doc, const char *body, const size_t length)
+{
+    StaticJsonDocument<64> filter;
+    filter["models"][0]["name"] = true;
+    filter["models"][0]["model"] = true;
+    return deserializeJson(doc, body, length, DeserializationOption::Filter(filter));
+}
+
+TagsModelResult findTagsModel(const JsonDocument &doc, const char *model_name)
+{
+    JsonArrayConst models = doc["models"].as<JsonArrayConst>();
+    if (models.isNull())
+    {
+        return TAGS_NO_MODELS;
+    }
+    for (JsonObjectConst model : models)
+    {
+        // name または model フィールドをチェック
+        const char *name = model["name"].as<const char *>();
+        const char *id = model["model"].as<const char *>();
+        if ((name != nullptr && strcmp(name, model_name) == 0) || (id != nullptr && strcmp(id, model_name) == 0))
+        {
+            return TAGS_MODEL_FOUND;
+        }
+    }
+    return TAGS_MODEL_NOT_FOUND;
+}
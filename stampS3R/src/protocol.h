@@ -0,0 +1,116 @@
+#ifndef PROTOCOL_H
+#define PROTOCOL_H
+
+#include "arena.h"
+#include "config.h"
+#include <Arduino.h>
+#include <ArduinoJson.h>
+
+// Coreとのフレームと、バックエンドの応答の解析・組み立て
+// ハードウェアを使わないので、ホストでもビルドしてベンチマークできる（test/host/protocol_bench.cpp）
+
+constexpr size_t JSON_BUFFER_SIZE = 2048;
+
+// 返答用のJSONの元になる構造体
+struct ResponseMsg_t_error
+{
+    uint16_t code;
+    String message;
+};
+
+struct ResponseMsg_t_inference_data
+{
+    String key; // 構造化出力のフィールド名（空なら送らない）
+    String delta;
+    uint16_t index;
+    bool finish;
+};
+
+struct ResponseMsg_t
+{
+    String request_id;
+    String work_id;
+    String object;
+    String data; // 文字列のdata（sys.versionなど）。inference_dataが空のときのみ送る
+    ResponseMsg_t_error error;
+    ResponseMsg_t_inference_data inference_data;
+};
+
+// Coreからの1フレーム（ルートの{}）を1文字ずつ切り出す
+// 改行が来たら途中まで読んだ分は捨てる
+struct JsonFrameScanner
+{
+    char buffer[JSON_BUFFER_SIZE];
+    size_t length;
+    int open_braces;
+    bool in_string;
+    bool escaped;
+};
+
+enum JsonFrameStatus
+{
+    JSON_FRAME_PENDING = 0,  // フレームの途中
+    JSON_FRAME_COMPLETE = 1, // フレームが閉じた。jsonFrameTextで取り出す
+    JSON_FRAME_OVERFLOW = 2  // バッファに入りきらないので捨てた
+};
+
+void jsonFrameReset(JsonFrameScanner &scanner);
+JsonFrameStatus jsonFrameFeed(JsonFrameScanner &scanner, const char c);
+// 閉じたフレームの前の空白を除いたもの。次のjsonFrameFeedまで有効（deserializeJsonはこの領域をそのまま使う）
+char *jsonFrameText(JsonFrameScanner &scanner);
+
+// 閉じたフレームのルートにある文字列のメンバーを、パースせずにoutへコピーする
+// メンバーがない・文字列でない・エスケープを含む・outに入りきらないときはfalse
+bool jsonFrameFindString(const char *frame, const char *name, char *out, const size_t out_size);
+
+// コマンドのハンドラが使うdataの範囲
+enum CommandData
+{
+    COMMAND_DATA_NONE = 0,   // dataを使わない（sys・exit）
+    COMMAND_DATA_STREAM = 1, // data.delta・index・finish・promptだけ使う（ストリームのinference）
+    COMMAND_DATA_ALL = 2     // dataをすべて使う（setupなど）
+};
+constexpr size_t COMMAND_DATA_KINDS = 3;
+
+// 受信したコマンドのうちハンドラが使うフィールドだけを展開するためのフィルタを作る
+void buildCommandFilter(JsonDocument &filter, const CommandData data = COMMAND_DATA_ALL);
+
+// 閉じたフレームから、展開に使うフィルタを選ぶ。nullptrを返すとすべて展開する
+typedef const JsonDocument *(*CommandFilterSelector)(const char *frame);
+
+// Coreへの返答の1行。ヒープを使わずに組み立てる
+typedef FixedString<JSON_BUFFER_SIZE * 2> ResponseJson;
+
+// 長すぎて入りきらなければfalse
+bool buildResponseJson(ResponseJson &out, const ResponseMsg_t &response_msg);
+
+// ストリームの1行（/api/generate・/api/chat）から使う値
+struct StreamLine
+{
+    const char *thinking; // 思考部分（thinking、/api/chatはmessage.thinking）。なければnullptr
+    const char *text;     // 出力（response、/api/chatはmessage.content）。なければnullptr
+    bool done;
+    uint32_t prompt_eval_count; // 以下はdoneの行のみ
+    uint32_t eval_count;
+    uint64_t eval_duration_ns;
+};
+
+// 1行をパースするドキュメントの大きさ（行の長さの2倍程度、2KB〜8KB）
+size_t streamLineDocSize(const size_t length);
+// 使うフィールドだけを展開する。文字列はdocが持つので、docを使い終わるまでparsedを使う
+DeserializationError parseStreamLine(JsonDocument &doc, const char *line, const size_t length, StreamLine &parsed);
+
+// /api/tags の応答を読む。モデル名（name・model）だけを展開するので、モデルが多くてもdocに収まる
+constexpr size_t TAGS_DOC_SIZE = 4096;
+
+enum TagsModelResult
+{
+    TAGS_MODEL_FOUND = 0,
+    TAGS_MODEL_NOT_FOUND = 1,
+    TAGS_NO_MODELS = 2 // models配列がない
+};
+
+DeserializationError parseTags(JsonDocument &doc, const char *body, const size_t length);
+TagsModelResult findTagsModel(const JsonDocument &doc, const char *model_name);
+
+#endif // PROTOCOL_H
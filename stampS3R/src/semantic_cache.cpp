@@ -0,0 +1,299 @@
+#include "semantic_cache.h"
+#include "cache_search.h"
+#include "embedding.h"
+#include <SPIFFS.h>
+
+#if USE_WIFI_FOR_LLM_COMMUNICATION
+
+namespace {
+
+constexpr size_t CACHE_MAX_DIMS = 1024;
+constexpr size_t CACHE_MAX_ANSWER = 2048;
+constexpr uint32_t CACHE_MAGIC = 0x31434353; // "SCC1"
+const char CACHE_INDEX_PATH[] = "/semcache.bin";
+
+// /semcache.bin: ヘッダの後に、枠ごとに CacheEntry + ベクトル（padded_dimsバイト）が並ぶ
+// 回答は枠ごとに /sc<枠番号>.txt に保存する
+struct CacheFileHeader
+{
+    uint32_t magic;
+    uint16_t dims;
+    uint16_t slots;
+};
+
+struct SemanticCache
+{
+    bool loaded;
+    bool mounted;
+    uint16_t dims;
+    uint16_t padded_dims; // cachePaddedDims（16の倍数）
+    CacheEntry entries[SEMANTIC_CACHE_MAX_ENTRIES];
+    int8_t *vectors;      // SEMANTIC_CACHE_MAX_ENTRIES * padded_dims（PIEで読むので16バイト境界）
+    uint8_t *vectors_allocation;
+    uint32_t sequence;
+    // 直前のlookupで見つからなかったプロンプト（storeで使う）
+    bool query_valid;
+    uint32_t query_hash;
+    float query_norm;
+    uint32_t lookups;
+    uint32_t hits;
+};
+
+SemanticCache semantic_cache;
+float cache_embedding[CACHE_MAX_DIMS];
+alignas(16) int8_t cache_query[CACHE_MAX_DIMS];
+
+uint32_t hashString(const String &value, uint32_t hash)
+{
+    for (size_t i = 0; i < value.length(); i++)
+    {
+        hash = (hash ^ static_cast<uint8_t>(value[i])) * 16777619u;
+    }
+    // 区切り（"ab"+"c" と "a"+"bc" を区別する）
+    return (hash ^ 0xFF) * 16777619u;
+}
+
+uint32_t contextHash(const LlmWorkConfig &config)
+{
+    uint32_t hash = 2166136261u;
+    hash = hashString(config.model, hash);
+    hash = hashString(config.system_prompt, hash);
+    hash = hashString(config.cache_model, hash);
+    // 構造化出力のスキーマが違えば回答の形も違う
+    hash = hashString(config.format, hash);
+    // 思考部分を送るかどうかで保存する回答が変わる
+    return (hash ^ static_cast<uint8_t>(config.think)) * 16777619u;
+}
+
+int8_t *vectorAt(const size_t slot)
+{
+    return semantic_cache.vectors + slot * semantic_cache.padded_dims;
+}
+
+String answerPath(const size_t slot)
+{
+    return String("/sc") + String(static_cast<unsigned>(slot)) + ".txt";
+}
+
+size_t slotOffset(const size_t slot)
+{
+    return sizeof(CacheFileHeader) + slot * (sizeof(CacheEntry) + semantic_cache.padded_dims);
+}
+
+bool allocateVectors(const uint16_t dims)
+{
+    free(semantic_cache.vectors_allocation);
+    semantic_cache.vectors = nullptr;
+    semantic_cache.dims = dims;
+    semantic_cache.padded_dims = cachePaddedDims(dims);
+    semantic_cache.vectors_allocation =
+        static_cast<uint8_t *>(malloc(SEMANTIC_CACHE_MAX_ENTRIES * semantic_cache.padded_dims + 15));
+    if (semantic_cache.vectors_allocation == nullptr)
+    {
+        Serial.println("[CACHE] Out of memory");
+        semantic_cache.dims = 0;
+        return false;
+    }
+    semantic_cache.vectors =
+        reinterpret_cast<int8_t *>((reinterpret_cast<uintptr_t>(semantic_cache.vectors_allocation) + 15) & ~static_cast<uintptr_t>(15));
+    memset(semantic_cache.entries, 0, sizeof(semantic_cache.entries));
+    memset(semantic_cache.vectors, 0, SEMANTIC_CACHE_MAX_ENTRIES * semantic_cache.padded_dims);
+    return true;
+}
+
+// 空の表でファイルを作り直す
+bool createIndexFile()
+{
+    File file = SPIFFS.open(CACHE_INDEX_PATH, FILE_WRITE);
+    if (!file)
+    {
+        return false;
+    }
+    const CacheFileHeader header = {CACHE_MAGIC, semantic_cache.dims, SEMANTIC_CACHE_MAX_ENTRIES};
+    bool ok = file.write(reinterpret_cast<const uint8_t *>(&header), sizeof(header)) == sizeof(header);
+    for (size_t slot = 0; ok && slot < SEMANTIC_CACHE_MAX_ENTRIES; slot++)
+    {
+        ok = file.write(reinterpret_cast<const uint8_t *>(&semantic_cache.entries[slot]), sizeof(CacheEntry)) == sizeof(CacheEntry) &&
+             file.write(reinterpret_cast<const uint8_t *>(vectorAt(slot)), semantic_cache.padded_dims) == semantic_cache.padded_dims;
+    }
+    file.close();
+    return ok;
+}
+
+bool writeSlot(const size_t slot)
+{
+    File file = SPIFFS.open(CACHE_INDEX_PATH, "r+");
+    if (!file || !file.seek(slotOffset(slot)))
+    {
+        return false;
+    }
+    const bool ok =
+        file.write(reinterpret_cast<const uint8_t *>(&semantic_cache.entries[slot]), sizeof(CacheEntry)) == sizeof(CacheEntry) &&
+        file.write(reinterpret_cast<const uint8_t *>(vectorAt(slot)), semantic_cache.padded_dims) == semantic_cache.padded_dims;
+    file.close();
+    return ok;
+}
+
+// 初回だけSPIFFSをマウントして表を読み込む
+bool loadCache()
+{
+    if (semantic_cache.loaded)
+    {
+        return semantic_cache.mounted;
+    }
+    semantic_cache.loaded = true;
+    const CacheDotProductCheck check = cacheCheckDotProduct();
+    Serial.printf("[CACHE] Dot product: %s (%s), 768 dims: scalar %lu ns, used %lu ns\n", check.kernel,
+                  check.ok ? "matches scalar" : "PIE mismatch, using scalar", static_cast<unsigned long>(check.scalar_ns),
+                  static_cast<unsigned long>(check.kernel_ns));
+    semantic_cache.mounted = SPIFFS.begin(true);
+    if (!semantic_cache.mounted)
+    {
+        Serial.println("[CACHE] SPIFFS mount failed");
+        return false;
+    }
+    File file = SPIFFS.open(CACHE_INDEX_PATH, FILE_READ);
+    if (!file)
+    {
+        return true;
+    }
+    CacheFileHeader header;
+    bool ok = file.read(reinterpret_cast<uint8_t *>(&header), sizeof(header)) == sizeof(header) &&
+              header.magic == CACHE_MAGIC && header.slots == SEMANTIC_CACHE_MAX_ENTRIES &&
+              header.dims > 0 && header.dims <= CACHE_MAX_DIMS && allocateVectors(header.dims);
+    for (size_t slot = 0; ok && slot < SEMANTIC_CACHE_MAX_ENTRIES; slot++)
+    {
+        CacheEntry &entry = semantic_cache.entries[slot];
+        ok = file.read(reinterpret_cast<uint8_t *>(&entry), sizeof(entry)) == sizeof(entry) &&
+             file.read(reinterpret_cast<uint8_t *>(vectorAt(slot)), semantic_cache.padded_dims) == semantic_cache.padded_dims;
+        if (entry.sequence > semantic_cache.sequence)
+        {
+            semantic_cache.sequence = entry.sequence;
+        }
+    }
+    file.close();
+    if (!ok)
+    {
+        // 形式が違う（SEMANTIC_CACHE_MAX_ENTRIESを変えた等）ときは空から始める
+        Serial.println("[CACHE] Index file ignored");
+        if (semantic_cache.vectors != nullptr)
+        {
+            memset(semantic_cache.entries, 0, sizeof(semantic_cache.entries));
+        }
+        semantic_cache.sequence = 0;
+        return true;
+    }
+    Serial.printf("[CACHE] Loaded %u dims\n", semantic_cache.dims);
+    return true;
+}
+
+// ベクトルの次元数が変わったら（ベクトルのモデルを変えた等）表を作り直す
+bool ensureDims(const uint16_t dims)
+{
+    if (semantic_cache.vectors != nullptr && semantic_cache.dims == dims)
+    {
+        return true;
+    }
+    semantic_cache.sequence = 0;
+    return allocateVectors(dims) && createIndexFile();
+}
+
+} // namespace
+
+bool semanticCacheLookup(const LlmWorkConfig &config, const String &prompt, String &answer)
+{
+    semantic_cache.query_valid = false;
+    if (!loadCache())
+    {
+        return false;
+    }
+
+    const uint32_t embedStart = micros();
+    const int dims = fetchEmbedding(config.cache_model, prompt, cache_embedding, CACHE_MAX_DIMS);
+    perfRecord(PERF_CACHE_EMBED, micros() - embedStart, prompt.length());
+    if (dims <= 0 || !ensureDims(dims))
+    {
+        return false;
+    }
+    const uint32_t hash = contextHash(config);
+    const float query_norm = cacheQuantize(cache_embedding, dims, cache_query, semantic_cache.padded_dims);
+    if (query_norm <= 0)
+    {
+        return false;
+    }
+
+    const uint32_t searchStart = micros();
+    const CacheSearchResult found = cacheSearch(semantic_cache.entries, semantic_cache.vectors, SEMANTIC_CACHE_MAX_ENTRIES,
+                                                semantic_cache.padded_dims, hash, cache_query, query_norm);
+    const int best_slot = found.slot;
+    const float best_similarity = found.similarity;
+    perfRecord(PERF_CACHE_SEARCH, micros() - searchStart, found.scanned * semantic_cache.padded_dims);
+    semantic_cache.lookups++;
+
+    if (best_slot >= 0 && best_similarity >= config.cache_threshold)
+    {
+        File file = SPIFFS.open(answerPath(best_slot), FILE_READ);
+        bool found = false;
+        if (file)
+        {
+            answer = file.readString();
+            file.close();
+            found = answer.length() == semantic_cache.entries[best_slot].answer_length;
+        }
+        if (found)
+        {
+            semantic_cache.hits++;
+            semantic_cache.entries[best_slot].sequence = ++semantic_cache.sequence;
+            Serial.printf("[CACHE] Hit slot %d (similarity %.3f, %lu/%lu hits)\n", best_slot, best_similarity,
+                          static_cast<unsigned long>(semantic_cache.hits), static_cast<unsigned long>(semantic_cache.lookups));
+            return true;
+        }
+        Serial.printf("[CACHE] Answer for slot %d is missing\n", best_slot);
+        semantic_cache.entries[best_slot].sequence = 0;
+    }
+    Serial.printf("[CACHE] Miss (best similarity %.3f, %u entries scanned)\n", best_similarity, static_cast<unsigned>(found.scanned));
+    semantic_cache.query_valid = true;
+    semantic_cache.query_hash = hash;
+    semantic_cache.query_norm = query_norm;
+    return false;
+}
+
+void semanticCacheStore(const LlmWorkConfig &config, const String &answer)
+{
+    if (!semantic_cache.query_valid || semantic_cache.query_hash != contextHash(config) ||
+        answer.length() == 0 || answer.length() > CACHE_MAX_ANSWER)
+    {
+        semantic_cache.query_valid = false;
+        return;
+    }
+    semantic_cache.query_valid = false;
+
+    // 空きがなければ一番長く使われていないものを上書きする
+    const size_t slot = cacheVictimSlot(semantic_cache.entries, SEMANTIC_CACHE_MAX_ENTRIES);
+    File file = SPIFFS.open(answerPath(slot), FILE_WRITE);
+    if (!file)
+    {
+        return;
+    }
+    const bool written = file.write(reinterpret_cast<const uint8_t *>(answer.c_str()), answer.length()) == answer.length();
+    file.close();
+    if (!written)
+    {
+        return;
+    }
+    CacheEntry &entry = semantic_cache.entries[slot];
+    entry.context_hash = semantic_cache.query_hash;
+    entry.sequence = ++semantic_cache.sequence;
+    entry.norm = semantic_cache.query_norm;
+    entry.answer_length = answer.length();
+    entry.reserved = 0;
+    memcpy(vectorAt(slot), cache_query, semantic_cache.padded_dims);
+    if (!writeSlot(slot))
+    {
+        Serial.println("[CACHE] Failed to write index");
+        return;
+    }
+    Serial.printf("[CACHE] Stored slot %u\n", static_cast<unsigned>(slot));
+}
+
+#endif // USE_WIFI_FOR_LLM_COMMUNICATION
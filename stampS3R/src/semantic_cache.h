@@ -0,0 +1,18 @@
+#ifndef SEMANTIC_CACHE_H
+#define SEMANTIC_CACHE_H
+
+#include "common.h"
+#include "llm_work.h"
+
+// セマンティックキャッシュ
+// プロンプトのベクトルをバックエンド（/api/embed）で計算し、SPIFFSに保存したint8のベクトル表から
+// 同じモデル・システムプロンプトで似た質問を探す。類似度がしきい値以上なら保存した回答をそのまま返す
+
+// 似た質問の回答があればanswerに入れてtrueを返す
+// なければこのプロンプトのベクトルを覚えておき、次のsemanticCacheStoreで回答と一緒に保存する
+bool semanticCacheLookup(const LlmWorkConfig &config, const String &prompt, String &answer);
+
+// 直前にsemanticCacheLookupで見つからなかったプロンプトの回答を保存する
+void semanticCacheStore(const LlmWorkConfig &config, const String &answer);
+
+#endif // SEMANTIC_CACHE_H
@@ -0,0 +1,684 @@
+#include "tts.h"
+#include "codec.h"
+#include "power.h"
+
+#if USE_WIFI_FOR_LLM_COMMUNICATION
+
+#include "secrets.h"
+#include "http_stream.h"
+
+// piperのHTTPサーバー（python3 -m piper.http_server）のポート。secrets.hで上書きできる
+#ifndef HOST_TTS_PORT
+#define HOST_TTS_PORT 5000
+#endif
+
+namespace {
+
+// 1文の最大バイト数（'\0'を含む）。これを超える文は途中で区切る
+constexpr size_t TTS_MAX_SENTENCE = 384;
+// 短すぎる文は次の文とまとめて合成する（「1.」のような箇条書きの番号など）
+constexpr size_t TTS_MIN_SENTENCE = 12;
+constexpr size_t TTS_QUEUE_DEPTH = 4;
+// 合成待ちのキューが埋まっている間、文にする前のテキストを溜めておく大きさ
+// LLMの受信やUARTの処理からは待たずに積むだけにし、溢れたら古いテキストから捨てる
+constexpr size_t TTS_PENDING_SIZE = TTS_MAX_SENTENCE * 4;
+constexpr size_t TTS_WORK_ID_SIZE = 24;
+constexpr size_t TTS_VOICE_SIZE = 48;
+// 1フレームのサンプル数。Core側のI2SのDMAバッファ（512サンプル前後）に合わせる
+constexpr size_t TTS_FRAME_SAMPLES = 512;
+// UARTは115200bps（約11.5KB/s）しかないので、これを超えるサンプルレートは1/2に間引く
+constexpr uint32_t TTS_MAX_OUTPUT_SAMPLE_RATE = 12000;
+// UARTの送信バッファに溜めておく音声の上限。これ以上溜めるとLLMの応答などが待たされる
+constexpr size_t TTS_UART_MAX_BACKLOG = 512;
+constexpr size_t TTS_WAV_HEADER_MAX = 256;
+constexpr size_t TTS_READ_BUFFER_SIZE = 1460;
+constexpr unsigned long TTS_CONNECT_TIMEOUT_MS = 2000;
+constexpr unsigned long TTS_RESPONSE_TIMEOUT_MS = 15000;
+constexpr unsigned long TTS_READ_TIMEOUT_MS = 5000;
+constexpr uint32_t TTS_TASK_STACK_SIZE = 6144;
+
+// 合成タスクへ渡す1文
+struct TtsSentence
+{
+    uint32_t generation;
+    bool finish;
+    char work_id[TTS_WORK_ID_SIZE];
+    char voice[TTS_VOICE_SIZE];
+    char text[TTS_MAX_SENTENCE];
+};
+
+// loop()側: 文の区切りを待っているテキスト
+struct TtsSession
+{
+    bool active;
+    String work_id;
+    TtsConfig config;
+    char pending[TTS_PENDING_SIZE];
+    size_t pending_length;
+    bool finish_pending;  // finishを受け取ったが、最後の文をまだキューに積めていない
+    size_t finish_length; // pendingの先頭からこの長さまでが、finishで終わる発話
+};
+
+// 合成タスク側: Coreへ送る音声の状態
+struct TtsOutput
+{
+    uint32_t generation;
+    AdpcmState adpcm;
+    uint16_t index;
+    uint32_t sample_rate_sent;
+    int16_t frame[TTS_FRAME_SAMPLES];
+    size_t frame_length;
+};
+
+// 合成中の応答（WAV）の読み取り状態
+struct WavReader
+{
+    uint8_t header[TTS_WAV_HEADER_MAX];
+    size_t header_length;
+    bool in_data;
+    uint32_t sample_rate;
+    uint8_t decimation;
+    bool has_odd_byte;
+    uint8_t odd_byte;
+    bool has_pending_sample;
+    int16_t pending_sample;
+};
+
+TtsSession tts_session;
+TtsSentence tts_enqueue_sentence;
+TtsSentence tts_task_sentence;
+TtsOutput tts_output;
+WavReader tts_wav;
+uint8_t tts_read_buffer[TTS_READ_BUFFER_SIZE];
+uint8_t tts_adpcm_buffer[TTS_FRAME_SAMPLES / 2];
+char tts_base64_buffer[((TTS_FRAME_SAMPLES / 2 + 2) / 3) * 4 + 1];
+QueueHandle_t tts_queue = nullptr;
+// exitやsetupのたびに進める。古い世代の文や合成中の音声は捨てる
+volatile uint32_t tts_generation = 0;
+volatile bool tts_busy = false;
+uint16_t host_tts_port = String(HOST_TTS_PORT).toInt();
+
+void copyString(char *out, const size_t size, const String &value)
+{
+    strncpy(out, value.c_str(), size - 1);
+    out[size - 1] = '\0';
+}
+
+bool isAborted(const TtsSentence &sentence)
+{
+    return sentence.generation != tts_generation;
+}
+
+void sendTtsError(const TtsSentence &sentence, const char *message)
+{
+    ResponseMsg_t response_msg;
+    response_msg.request_id = "tts_inference";
+    response_msg.work_id = sentence.work_id;
+    response_msg.object = "None";
+    response_msg.error.code = 1;
+    response_msg.error.message = message;
+    sendToM5(response_msg);
+}
+
+// UARTの送信バッファに音声が溜まりすぎていれば、はけるまで待つ
+// 音声は合成の方が速いので、ここで待つことでLLMの応答などの小さなフレームを先に通す
+void waitUartBacklog(const TtsSentence &sentence)
+{
+    const size_t needed = TTS_UART_MAX_BACKLOG + sizeof(tts_base64_buffer);
+    while (!isAborted(sentence) && Serial2.availableForWrite() < M5_UART_TX_BUFFER_SIZE - needed)
+    {
+        vTaskDelay(pdMS_TO_TICKS(5));
+    }
+}
+
+void sendSampleRate(const TtsSentence &sentence, const uint32_t sample_rate)
+{
+    ResponseMsg_t response_msg;
+    response_msg.request_id = "tts_inference";
+    response_msg.work_id = sentence.work_id;
+    response_msg.object = "tts.sample_rate";
+    response_msg.data = String(sample_rate);
+    response_msg.error.code = 0;
+    response_msg.error.message = "";
+    sendToM5(response_msg);
+    tts_output.sample_rate_sent = sample_rate;
+}
+
+// 溜まったサンプルをADPCM + base64の1フレームにして送る
+void sendAudioFrame(const TtsSentence &sentence, const bool finish)
+{
+    if (tts_output.frame_length % 2 != 0)
+    {
+        // ADPCMは2サンプルで1バイトなので、最後のサンプルを繰り返して偶数にする
+        tts_output.frame[tts_output.frame_length] = tts_output.frame[tts_output.frame_length - 1];
+        tts_output.frame_length++;
+    }
+    adpcmEncode(tts_output.adpcm, tts_output.frame, tts_output.frame_length, tts_adpcm_buffer);
+    base64Encode(tts_adpcm_buffer, tts_output.frame_length / 2, tts_base64_buffer);
+    tts_output.frame_length = 0;
+
+    waitUartBacklog(sentence);
+    if (isAborted(sentence))
+    {
+        return;
+    }
+    ResponseMsg_t response_msg;
+    response_msg.request_id = "tts_inference";
+    response_msg.work_id = sentence.work_id;
+    response_msg.object = "tts.adpcm.base64.stream";
+    response_msg.error.code = 0;
+    response_msg.error.message = "";
+    response_msg.inference_data.delta = tts_base64_buffer;
+    response_msg.inference_data.index = tts_output.index++;
+    response_msg.inference_data.finish = finish;
+    sendToM5(response_msg);
+}
+
+void pushSample(const TtsSentence &sentence, const int16_t sample)
+{
+    tts_output.frame[tts_output.frame_length++] = sample;
+    if (tts_output.frame_length == TTS_FRAME_SAMPLES)
+    {
+        sendAudioFrame(sentence, false);
+    }
+}
+
+uint32_t readLe32(const uint8_t *in)
+{
+    return in[0] | (in[1] << 8) | (static_cast<uint32_t>(in[2]) << 16) | (static_cast<uint32_t>(in[3]) << 24);
+}
+
+uint16_t readLe16(const uint8_t *in)
+{
+    return in[0] | (in[1] << 8);
+}
+
+// WAVヘッダからfmtを読み、dataチャンクの開始位置を返す。足りなければ0、扱えない形式なら-1
+int parseWavHeader(WavReader &wav)
+{
+    if (wav.header_length < 12)
+    {
+        return 0;
+    }
+    if (memcmp(wav.header, "RIFF", 4) != 0 || memcmp(wav.header + 8, "WAVE", 4) != 0)
+    {
+        return -1;
+    }
+    size_t offset = 12;
+    while (offset + 8 <= wav.header_length)
+    {
+        const uint8_t *chunk = wav.header + offset;
+        const uint32_t chunk_size = readLe32(chunk + 4);
+        if (memcmp(chunk, "data", 4) == 0)
+        {
+            return wav.sample_rate > 0 ? static_cast<int>(offset + 8) : -1;
+        }
+        if (memcmp(chunk, "fmt ", 4) == 0)
+        {
+            if (offset + 24 > wav.header_length)
+            {
+                return 0;
+            }
+            // 16bitモノラルのPCMのみ（piperの出力はこの形式）
+            if (readLe16(chunk + 8) != 1 || readLe16(chunk + 10) != 1 || readLe16(chunk + 22) != 16)
+            {
+                return -1;
+            }
+            wav.sample_rate = readLe32(chunk + 12);
+        }
+        offset += 8 + chunk_size + (chunk_size & 1);
+    }
+    return 0;
+}
+
+// PCMのバイト列をサンプルにして、必要なら間引いてフレームに詰める
+void feedPcm(const TtsSentence &sentence, const uint8_t *data, size_t length)
+{
+    while (length > 0)
+    {
+        int16_t sample;
+        if (tts_wav.has_odd_byte)
+        {
+            sample = static_cast<int16_t>(tts_wav.odd_byte | (data[0] << 8));
+            tts_wav.has_odd_byte = false;
+            data++;
+            length--;
+        }
+        else if (length >= 2)
+        {
+            sample = static_cast<int16_t>(data[0] | (data[1] << 8));
+            data += 2;
+            length -= 2;
+        }
+        else
+        {
+            tts_wav.odd_byte = data[0];
+            tts_wav.has_odd_byte = true;
+            return;
+        }
+
+        if (tts_wav.decimation == 1)
+        {
+            pushSample(sentence, sample);
+        }
+        else if (tts_wav.has_pending_sample)
+        {
+            // 2サンプルの平均をとって1/2にする（簡易的なローパス）
+            pushSample(sentence, static_cast<int16_t>((static_cast<int32_t>(tts_wav.pending_sample) + sample) / 2));
+            tts_wav.has_pending_sample = false;
+        }
+        else
+        {
+            tts_wav.pending_sample = sample;
+            tts_wav.has_pending_sample = true;
+        }
+    }
+}
+
+// 応答のボディを処理する。WAVヘッダを読み終えるまではヘッダのバッファに溜める
+bool feedWav(const TtsSentence &sentence, const uint8_t *data, size_t length)
+{
+    if (tts_wav.in_data)
+    {
+        feedPcm(sentence, data, length);
+        return true;
+    }
+    size_t n = TTS_WAV_HEADER_MAX - tts_wav.header_length;
+    if (n > length)
+    {
+        n = length;
+    }
+    memcpy(tts_wav.header + tts_wav.header_length, data, n);
+    tts_wav.header_length += n;
+    const int data_offset = parseWavHeader(tts_wav);
+    if (data_offset < 0 || (data_offset == 0 && tts_wav.header_length == TTS_WAV_HEADER_MAX))
+    {
+        Serial.println("[TTS] Unsupported WAV format");
+        return false;
+    }
+    if (data_offset == 0)
+    {
+        return true;
+    }
+
+    tts_wav.in_data = true;
+    tts_wav.decimation = tts_wav.sample_rate > TTS_MAX_OUTPUT_SAMPLE_RATE ? 2 : 1;
+    const uint32_t output_rate = tts_wav.sample_rate / tts_wav.decimation;
+    if (output_rate != tts_output.sample_rate_sent)
+    {
+        // サンプルレートが変わる前の音声は先に送っておく
+        if (tts_output.frame_length > 0)
+        {
+            sendAudioFrame(sentence, false);
+        }
+        sendSampleRate(sentence, output_rate);
+    }
+    // ヘッダのバッファに入ったPCMの先頭部分
+    feedPcm(sentence, tts_wav.header + data_offset, tts_wav.header_length - data_offset);
+    feedPcm(sentence, data + n, length - n);
+    return true;
+}
+
+// 1文をpiperのサーバーで合成し、届いた音声から順にCoreへ送る
+bool synthesize(const TtsSentence &sentence)
+{
+    StaticJsonDocument<128> requestDoc;
+    requestDoc["text"] = sentence.text;
+    if (sentence.voice[0] != '\0')
+    {
+        requestDoc["voice"] = sentence.voice;
+    }
+    String requestBody;
+    serializeJson(requestDoc, requestBody);
+
+    WiFiClient client;
+    HttpStream http;
+    if (!httpStreamConnect(http, client, HOST_IP, host_tts_port, TTS_CONNECT_TIMEOUT_MS) ||
+        !httpStreamSendRequest(http, "POST", "/", requestBody))
+    {
+        httpStreamClose(http);
+        return false;
+    }
+    const int status = httpStreamReadResponseHeader(http, TTS_RESPONSE_TIMEOUT_MS);
+    if (status != 200)
+    {
+        Serial.printf("[TTS] HTTP %d\n", status);
+        httpStreamClose(http);
+        return false;
+    }
+
+    memset(&tts_wav, 0, sizeof(tts_wav));
+    bool ok = true;
+    while (ok && !isAborted(sentence))
+    {
+        const int n = httpStreamRead(http, tts_read_buffer, sizeof(tts_read_buffer), TTS_READ_TIMEOUT_MS);
+        if (n < 0)
+        {
+            break;
+        }
+        if (n == 0)
+        {
+            Serial.println("[TTS] Response timed out");
+            ok = false;
+            break;
+        }
+        ok = feedWav(sentence, tts_read_buffer, n);
+    }
+    httpStreamClose(http);
+    return ok && tts_wav.in_data;
+}
+
+// 読み上げるものがない文（記号や空白だけ）は合成しない
+bool hasSpeech(const char *text)
+{
+    for (; *text != '\0'; text++)
+    {
+        const uint8_t c = static_cast<uint8_t>(*text);
+        if (c >= 0x80 || isalnum(c))
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+void ttsTask(void *)
+{
+    for (;;)
+    {
+        if (xQueueReceive(tts_queue, &tts_task_sentence, portMAX_DELAY) != pdTRUE)
+        {
+            continue;
+        }
+        const TtsSentence &sentence = tts_task_sentence;
+        if (isAborted(sentence))
+        {
+            continue;
+        }
+        tts_busy = true;
+        if (sentence.generation != tts_output.generation)
+        {
+            tts_output.generation = sentence.generation;
+            tts_output.index = 0;
+            tts_output.frame_length = 0;
+            tts_output.sample_rate_sent = 0;
+            adpcmReset(tts_output.adpcm);
+        }
+        if (hasSpeech(sentence.text) && !synthesize(sentence) && !isAborted(sentence))
+        {
+            sendTtsError(sentence, "TTS inference failed");
+        }
+        if (sentence.finish && !isAborted(sentence))
+        {
+            // 残りの音声とfinishを送り、次の発話はADPCMの状態を初期化して始める
+            sendAudioFrame(sentence, true);
+            tts_output.index = 0;
+            tts_output.sample_rate_sent = 0;
+            adpcmReset(tts_output.adpcm);
+        }
+        tts_busy = uxQueueMessagesWaiting(tts_queue) > 0;
+    }
+}
+
+// キューが埋まっていればすぐにfalseを返す（呼び出し元は待たない）
+bool enqueueSentence(const char *text, const size_t length, const bool finish)
+{
+    TtsSentence &sentence = tts_enqueue_sentence;
+    sentence.generation = tts_generation;
+    sentence.finish = finish;
+    copyString(sentence.work_id, sizeof(sentence.work_id), tts_session.work_id);
+    copyString(sentence.voice, sizeof(sentence.voice), tts_session.config.voice);
+    memcpy(sentence.text, text, length);
+    sentence.text[length] = '\0';
+    if (xQueueSend(tts_queue, &sentence, 0) != pdTRUE)
+    {
+        return false;
+    }
+    tts_busy = true;
+    return true;
+}
+
+// 文末（。！？、改行、または空白が続く .!?）までの長さ。TTS_MIN_SENTENCE未満の文は次とまとめる
+size_t findSentenceEnd(const char *text, const size_t length)
+{
+    for (size_t i = 0; i < length; i++)
+    {
+        const uint8_t c = static_cast<uint8_t>(text[i]);
+        size_t end = 0;
+        if (c == '\n')
+        {
+            end = i + 1;
+        }
+        else if ((c == '.' || c == '!' || c == '?') && i + 1 < length && (text[i + 1] == ' ' || text[i + 1] == '\n'))
+        {
+            end = i + 1;
+        }
+        else if (i + 2 < length)
+        {
+            const uint8_t c1 = static_cast<uint8_t>(text[i + 1]);
+            const uint8_t c2 = static_cast<uint8_t>(text[i + 2]);
+            if ((c == 0xE3 && c1 == 0x80 && c2 == 0x82) ||              // 。
+                (c == 0xEF && c1 == 0xBC && (c2 == 0x81 || c2 == 0x9F))) // ！？
+            {
+                end = i + 3;
+            }
+        }
+        if (end >= TTS_MIN_SENTENCE)
+        {
+            return end;
+        }
+    }
+    return 0;
+}
+
+// UTF-8の文字の途中で切らない位置
+size_t utf8Boundary(const char *text, const size_t length)
+{
+    size_t lead = length;
+    while (lead > 0 && (static_cast<uint8_t>(text[lead - 1]) & 0xC0) == 0x80)
+    {
+        lead--;
+    }
+    if (lead == 0)
+    {
+        return length;
+    }
+    const uint8_t c = static_cast<uint8_t>(text[lead - 1]);
+    const size_t char_length = c >= 0xF0 ? 4 : c >= 0xE0 ? 3 : c >= 0xC0 ? 2 : 1;
+    return length - (lead - 1) >= char_length ? length : lead - 1;
+}
+
+void consumePending(const size_t length)
+{
+    memmove(tts_session.pending, tts_session.pending + length, tts_session.pending_length - length);
+    tts_session.pending_length -= length;
+    if (tts_session.finish_pending)
+    {
+        tts_session.finish_length -= length;
+    }
+}
+
+// 区切りまで届いた文を合成へ回す。キューが埋まっていれば積めるところまでで戻り、残りは次の呼び出しで積む
+// finishを受け取った発話は、区切りのない残りも最後の文（finish）として積む
+void flushSentences()
+{
+    for (;;)
+    {
+        const size_t limit = tts_session.finish_pending ? tts_session.finish_length : tts_session.pending_length;
+        const size_t window = limit < TTS_MAX_SENTENCE - 1 ? limit : TTS_MAX_SENTENCE - 1;
+        size_t end = findSentenceEnd(tts_session.pending, window);
+        if (end == 0)
+        {
+            if (window == TTS_MAX_SENTENCE - 1)
+            {
+                // 区切りのないまま1文の上限に達した
+                end = utf8Boundary(tts_session.pending, window);
+            }
+            else if (tts_session.finish_pending)
+            {
+                end = limit;
+            }
+            else
+            {
+                return;
+            }
+        }
+        const bool last = tts_session.finish_pending && end == limit;
+        if (!enqueueSentence(tts_session.pending, end, last))
+        {
+            return;
+        }
+        consumePending(end);
+        if (last)
+        {
+            tts_session.finish_pending = false;
+        }
+    }
+}
+
+// 溜めておけない分は古いテキストから捨てる（UTF-8の文字の途中からは始めない）
+void makeRoom(const size_t length)
+{
+    if (tts_session.pending_length + length <= TTS_PENDING_SIZE)
+    {
+        return;
+    }
+    size_t drop = tts_session.pending_length + length - TTS_PENDING_SIZE;
+    while (drop < tts_session.pending_length && (static_cast<uint8_t>(tts_session.pending[drop]) & 0xC0) == 0x80)
+    {
+        drop++;
+    }
+    Serial.printf("[TTS] Queue full, dropping %u bytes of text\n", static_cast<unsigned>(drop));
+    if (tts_session.finish_pending && drop >= tts_session.finish_length)
+    {
+        // 終わりまで捨てた発話のfinishは、空の最後の文として残す
+        tts_session.finish_length = drop;
+    }
+    consumePending(drop);
+}
+
+void appendText(const char *text, size_t length)
+{
+    while (length > 0)
+    {
+        size_t n = TTS_PENDING_SIZE - tts_session.pending_length;
+        if (n == 0)
+        {
+            flushSentences();
+            makeRoom(length < TTS_MAX_SENTENCE ? length : TTS_MAX_SENTENCE);
+            n = TTS_PENDING_SIZE - tts_session.pending_length;
+        }
+        if (n > length)
+        {
+            n = length;
+        }
+        memcpy(tts_session.pending + tts_session.pending_length, text, n);
+        tts_session.pending_length += n;
+        text += n;
+        length -= n;
+    }
+    flushSentences();
+}
+
+void feedText(const String &text, const bool finish)
+{
+    appendText(text.c_str(), text.length());
+    if (finish)
+    {
+        if (tts_session.finish_pending)
+        {
+            // 前の発話の最後の文がまだ積めていないので、この発話とまとめて1つの発話にする
+            Serial.println("[TTS] Previous finish still queued, merging utterances");
+        }
+        tts_session.finish_pending = true;
+        tts_session.finish_length = tts_session.pending_length;
+        flushSentences();
+    }
+}
+
+void resetSession()
+{
+    tts_generation++;
+    if (tts_queue != nullptr)
+    {
+        xQueueReset(tts_queue);
+    }
+    tts_session.active = false;
+    tts_session.work_id = "";
+    tts_session.config = TtsConfig();
+    tts_session.pending_length = 0;
+    tts_session.finish_pending = false;
+    tts_session.finish_length = 0;
+}
+
+} // namespace
+
+void parseTtsConfig(JsonVariantConst data, TtsConfig &config)
+{
+    config.voice = data["voice"] | "";
+    config.source_work_id = data["input"] | "";
+}
+
+void initTts()
+{
+    tts_queue = xQueueCreate(TTS_QUEUE_DEPTH, sizeof(TtsSentence));
+    // WiFiと同じコア0で動かし、loop()（コア1）のUART処理やLLMのストリーム受信と並行して合成する
+    xTaskCreatePinnedToCore(ttsTask, "tts", TTS_TASK_STACK_SIZE, nullptr, 1, nullptr, 0);
+}
+
+TtsStatus tts_setup(const String &work_id, const TtsConfig &config)
+{
+    resetSession();
+    if (tts_queue == nullptr)
+    {
+        return TTS_NOT_OK;
+    }
+    tts_session.active = true;
+    tts_session.work_id = work_id;
+    tts_session.config = config;
+    return TTS_OK;
+}
+
+TtsStatus tts_feed_text(const String &work_id, const String &text, const bool finish)
+{
+    if (!tts_session.active || tts_session.work_id != work_id)
+    {
+        return TTS_NOT_OK;
+    }
+    feedText(text, finish);
+    return TTS_OK;
+}
+
+void tts_on_llm_delta(const String &llm_work_id, const String &delta, const bool finish)
+{
+    if (!tts_session.active || tts_session.config.source_work_id.length() == 0 ||
+        tts_session.config.source_work_id != llm_work_id)
+    {
+        return;
+    }
+    feedText(delta, finish);
+}
+
+void tts_exit(const String &work_id)
+{
+    if (tts_session.work_id == work_id)
+    {
+        resetSession();
+    }
+}
+
+void tts_poll()
+{
+    // キューが空くのを待っているテキストを積む
+    if (tts_session.active && (tts_session.pending_length > 0 || tts_session.finish_pending))
+    {
+        flushSentences();
+    }
+    // 合成中は省電力に入らない（合成タスクからはクロックを変えない）
+    if (tts_busy)
+    {
+        powerOnActivity();
+    }
+}
+
+#endif // USE_WIFI_FOR_LLM_COMMUNICATION
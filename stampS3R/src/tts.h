@@ -0,0 +1,37 @@
+#ifndef TTS_H
+#define TTS_H
+
+#include "common.h"
+
+enum TtsStatus
+{
+    TTS_OK = 0,
+    TTS_NOT_OK = 1
+};
+
+// tts.setupのdata
+struct TtsConfig
+{
+    String voice;           // 空ならサーバーの既定の声
+    String source_work_id;  // data.input に llm のwork_idを指定すると、その出力を読み上げる
+};
+
+void parseTtsConfig(JsonVariantConst data, TtsConfig &config);
+
+// 読み上げ用のタスクを起動する。setup()で一度呼ぶ
+void initTts();
+
+TtsStatus tts_setup(const String &work_id, const TtsConfig &config);
+
+// 読み上げるテキストを渡す。文の区切りごとに合成し、finishで残りをすべて合成して終える
+TtsStatus tts_feed_text(const String &work_id, const String &text, const bool finish);
+
+// LLMの出力が届くたびに呼ぶ。読み上げ対象のwork_idなら文ごとに合成へ回す
+void tts_on_llm_delta(const String &llm_work_id, const String &delta, const bool finish);
+
+void tts_exit(const String &work_id);
+
+// loop()と推論の受信の合間に呼ぶ。キューが空くのを待っているテキストを積み、合成中は省電力に入らないようにする
+void tts_poll();
+
+#endif // TTS_H
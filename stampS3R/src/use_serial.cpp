@@ -27,7 +27,7 @@ sendToPCResult sendToPC(const String& sending_json) {
     return SEND_TO_PC_SUCCESS;
 }
 
-sendToPCResult sendToPCwithResponse(const String& sending_json, const bool multiple_response = false) {
+sendToPCResult sendToPCwithResponse(const String& sending_json, const bool multiple_response) {
     Serial.println(sending_json);
     return SEND_TO_PC_SUCCESS;
 }
@@ -1,4 +1,5 @@
 #include "use_wifi.h"
+#include "power.h"
 #include <M5Unified.h>
 
 #if USE_WIFI_FOR_LLM_COMMUNICATION
@@ -8,12 +9,27 @@ String wifi_ssid = WIFI_SSID;
 String wifi_password = WIFI_PASSWORD;
 String ap_ssid = AP_SSID;
 String ap_password = AP_PASSWORD;
-String host_ollama_url = String("http://") + String(HOST_IP) + ":" + String(HOST_OLLAMA_PORT);
+#include "backend_tls.h"
+String host_ollama_url = String(HOST_OLLAMA_TLS ? "https://" : "http://") + String(HOST_IP) + ":" + String(HOST_OLLAMA_PORT);
+// HOST_OLLAMA_PORTは数値でも文字列でもよい
+uint16_t host_ollama_port = String(HOST_OLLAMA_PORT).toInt();
 #include "WiFi.h"
 #include "HTTPClient.h"
+#include "http_stream.h"
+#include "llm_work.h"
+#include "tts.h"
+#include "semantic_cache.h"
+#include "arena.h"
+#include "capture.h"
+#include "metrics.h"
+#include "chat_history.h"
+#include "json_fields.h"
 #include <ArduinoJson.h>
 
 
+// 起動時のTLSのセッション再開の確認（HOST_OLLAMA_TLS_CHECK_RESUMPTION）の接続とハンドシェイクの待ち時間
+constexpr uint32_t TLS_CHECK_TIMEOUT_MS = 5000;
+
 initCommunicationResult init_communication() {
     led_sayNext_initialize();
     if (USE_STATION_MODE) {
@@ -25,6 +41,7 @@ initCommunicationResult init_communication() {
         blinkLED(COLOR_RUNNING, 1, 300);
         Serial.print(".");
         delay(700);
+        metricsRecordWifiRetry();
         if (millis() - startTime > 60000) {
             while (1) {
                 Serial.println("WiFi connection failed after 1 minute.");
@@ -48,6 +65,9 @@ initCommunicationResult init_communication() {
         Serial.print("AP IP address: ");
         Serial.println(WiFi.softAPIP().toString());
     }
+    if (HOST_OLLAMA_TLS && HOST_OLLAMA_TLS_CHECK_RESUMPTION) {
+        backendTlsCheckResumption(HOST_IP, host_ollama_port, TLS_CHECK_TIMEOUT_MS);
+    }
     return INIT_COMMUNICATION_SUCCESS;
 }
 
@@ -63,94 +83,95 @@ sendToPCResult sendToPC(const String& sending_json) {
     return httpCode == 200 ? SEND_TO_PC_SUCCESS : SEND_TO_PC_FAILURE;
 }
 
+namespace {
+
+constexpr uint32_t CONNECT_SETUP_TIMEOUT_MS = 3000;
+constexpr uint32_t SETUP_TIMEOUT_MS = 5000;
+
+// OllamaにGETして応答を最後まで読む。ステータスコード、接続できなければ-1を返す
+// HOST_OLLAMA_TLSなら推論と同じTLS接続のプールを使うので、setupでのハンドシェイクがそのまま推論に引き継がれる
+int ollamaGet(const char* path, String& body) {
+    WiFiClient client;
+    HttpStream http;
+    body = "";
+    captureRecord(CAPTURE_HTTP_REQUEST, "", 0, (String("GET ") + path).c_str());
+    int status = -1;
+    if (httpStreamConnectBackend(http, client, CONNECT_SETUP_TIMEOUT_MS) &&
+        httpStreamSendRequest(http, "GET", path, "")) {
+        status = httpStreamReadResponseHeader(http, SETUP_TIMEOUT_MS);
+    }
+    if (status > 0) {
+        uint8_t buffer[256];
+        int n;
+        while ((n = httpStreamRead(http, buffer, sizeof(buffer), SETUP_TIMEOUT_MS)) > 0) {
+            body.concat(reinterpret_cast<const char*>(buffer), n);
+        }
+    }
+    httpStreamClose(http);
+    captureRecord(CAPTURE_HTTP_STATUS, String(status));
+    if (CAPTURE_MODE != CAPTURE_MODE_OFF && status > 0) {
+        captureRecord(CAPTURE_HTTP_RESPONSE, body);
+    }
+    return status;
+}
+
+} // namespace
+
 LLM_Status llm_setup(const String& model_name) {
     // /api/version にGETしてみる
-    HTTPClient http;
-    http.begin(host_ollama_url + "/api/version");
-    http.setTimeout(5000);
-    http.setConnectTimeout(3000);
-    int httpCode = http.GET();
+    String response;
+    int httpCode = ollamaGet("/api/version", response);
 
     Serial.print("[JSON] LLM setup version status: ");
     Serial.println(httpCode);
 
-    http.end();
     // /api/tags をGET
-    http.begin(host_ollama_url + "/api/tags");
-    http.setTimeout(5000);
-    http.setConnectTimeout(3000);
-    httpCode = http.GET();
+    httpCode = ollamaGet("/api/tags", response);
     Serial.print("[JSON] LLM setup list status: ");
     Serial.println(httpCode);
     
     if (httpCode != 200) {
-        http.end();
         return LLM_OLLAMA_NOT_OK;
     }
     
-    // responseを読み取る
-    String response = http.getString();
     // Serial.print("[JSON] LLM setup list response: ");
     // Serial.println(response);
 
-    http.end();
-    
     // JSONをパースしてモデル名をチェック
     if (model_name.length() == 0) {
         Serial.println("[JSON] Model name is empty");
         return LLM_OLLAMA_NOT_OK;
     }
     
-    // ArduinoJsonでパース
-    StaticJsonDocument<4096> doc;
-    DeserializationError error = deserializeJson(doc, response);
+    // ArduinoJsonでパース（モデル名だけを展開する）
+    StaticJsonDocument<TAGS_DOC_SIZE> doc;
+    const uint32_t perfStart = micros();
+    DeserializationError error = parseTags(doc, response.c_str(), response.length());
+    const TagsModelResult found = error ? TAGS_NO_MODELS : findTagsModel(doc, model_name.c_str());
+    perfRecord(PERF_TAGS_PARSE, micros() - perfStart, response.length());
     
     if (error) {
         Serial.print("[JSON] Parse error: ");
         Serial.println(error.c_str());
-        // 確保したメモリを解放
-        doc.clear();
-        http.end();
         return LLM_OLLAMA_NOT_OK;
     }
     
     // models配列をチェック
-    if (!doc.containsKey("models") || !doc["models"].is<JsonArray>()) {
+    if (found == TAGS_NO_MODELS) {
         Serial.println("[JSON] No models array found");
         return LLM_OLLAMA_NOT_OK;
     }
     
-    JsonArray models = doc["models"];
-    bool model_found = false;
-    
-    for (JsonObject model : models) {
-        // name または model フィールドをチェック
-        if (model.containsKey("name") && model["name"].as<String>() == model_name) {
-            model_found = true;
-            Serial.print("[JSON] Model found: ");
-            Serial.println(model_name);
-            break;
-        }
-        if (model.containsKey("model") && model["model"].as<String>() == model_name) {
-            model_found = true;
-            Serial.print("[JSON] Model found: ");
-            Serial.println(model_name);
-            break;
-        }
-    }
-    
-    if (model_found) {
+    perfReport();
+
+    if (found == TAGS_MODEL_FOUND) {
         Serial.print("[JSON] Model found: ");
         Serial.println(model_name);
-        doc.clear();
-        http.end();
         using_model_name = model_name;
         return LLM_OLLAMA_OK;
     } else {
         Serial.print("[JSON] Model not found: ");
         Serial.println(model_name);
-        doc.clear();
-        http.end();
         return LLM_OLLAMA_NOT_FOUND;
     }
 }
@@ -159,184 +180,875 @@ LLM_Status llm_inference_no_streaming(const OllamaInferenceCommand& command) {
     return LLM_OLLAMA_OK;
 }
 
-LLM_Status llm_inference_streaming(const OllamaInferenceCommand& command) {
-    HTTPClient http;
-    String url = host_ollama_url + "/api/generate";
-    http.begin(url);
-    http.addHeader("Content-Type", "application/json");
-    http.setTimeout(10000);  // 10秒タイムアウト
-    http.setConnectTimeout(5000);  // 5秒接続タイムアウト
-    
-    // リクエストJSONを作成
-    StaticJsonDocument<512> requestDoc;
+namespace {
+
+// モデルごとの応答速度の推定値（指数移動平均）。ストリームのタイムアウトをここから決める
+struct ModelCadence {
+    String model;
+    float token_interval_ms;  // トークン間隔
+    float first_token_ms;     // リクエストから最初のトークンまで（プロンプト評価時間を含む）
+    bool valid;
+};
+
+constexpr size_t MAX_CADENCE_MODELS = 4;
+constexpr float CADENCE_EWMA_ALPHA = 0.3f;
+ModelCadence model_cadences[MAX_CADENCE_MODELS];
+size_t next_cadence_slot = 0;
+
+// 統計がまだないモデル用（モデルのロード時間を見込んで長め）
+constexpr unsigned long DEFAULT_FIRST_TOKEN_TIMEOUT_MS = 30000;
+constexpr unsigned long DEFAULT_TOKEN_IDLE_TIMEOUT_MS = 10000;
+// タイムアウトの上下限（統計から求めた値にも、再開で倍にした値にもかける）
+constexpr unsigned long MIN_FIRST_TOKEN_TIMEOUT_MS = 5000;
+constexpr unsigned long MAX_FIRST_TOKEN_TIMEOUT_MS = 60000;
+constexpr unsigned long MIN_TOKEN_IDLE_TIMEOUT_MS = 1000;
+constexpr unsigned long MAX_TOKEN_IDLE_TIMEOUT_MS = 10000;
+// トークン何個分止まったら切れたとみなすか
+constexpr float TOKEN_IDLE_INTERVALS = 8.0f;
+constexpr unsigned long CONNECT_TIMEOUT_MS = 2000;
+// ストリームの受信バッファ（TCPの1セグメント分）と1行の最大長
+constexpr size_t STREAM_READ_BUFFER_SIZE = 1460;
+constexpr size_t CACHE_REPLAY_CHUNK_SIZE = 128;
+// 構造化出力の1フレームに入れる値のバイト数。すべて \u00XX にエスケープされても送信バッファ（JSON_BUFFER_SIZE * 2）に収まる
+constexpr size_t JSON_FIELD_FRAME_BYTES = 512;
+constexpr size_t STREAM_OUTPUT_RESERVE = 1024;
+constexpr unsigned long THINK_HEARTBEAT_INTERVAL_MS = 1000;
+// max_token_lenまで残りこのトークン数になったら、次のプロンプトを先にバックエンドへ送る
+constexpr uint32_t PIPELINE_TAIL_TOKENS = 8;
+const char THINK_OPEN_TAG[] = "<think>";
+const char THINK_CLOSE_TAG[] = "</think>";
+constexpr size_t MAX_LINE_BUFFER = 4096;
+// 生成途中で切れたときに続きから再開する最大回数
+constexpr uint8_t MAX_STREAM_RESUME = 2;
+
+ModelCadence& findCadence(const String& model) {
+    for (size_t i = 0; i < MAX_CADENCE_MODELS; i++) {
+        if (model_cadences[i].model == model) {
+            return model_cadences[i];
+        }
+    }
+    ModelCadence& cadence = model_cadences[next_cadence_slot];
+    next_cadence_slot = (next_cadence_slot + 1) % MAX_CADENCE_MODELS;
+    cadence.model = model;
+    cadence.token_interval_ms = 0;
+    cadence.first_token_ms = 0;
+    cadence.valid = false;
+    return cadence;
+}
+
+void updateCadence(ModelCadence& cadence, const float token_interval_ms, const float first_token_ms) {
+    if (!cadence.valid) {
+        cadence.token_interval_ms = token_interval_ms;
+        cadence.first_token_ms = first_token_ms;
+        cadence.valid = true;
+        return;
+    }
+    cadence.token_interval_ms += CADENCE_EWMA_ALPHA * (token_interval_ms - cadence.token_interval_ms);
+    cadence.first_token_ms += CADENCE_EWMA_ALPHA * (first_token_ms - cadence.first_token_ms);
+}
+
+unsigned long clampTimeout(const float value_ms, const unsigned long min_ms, const unsigned long max_ms) {
+    if (value_ms < min_ms) return min_ms;
+    if (value_ms > max_ms) return max_ms;
+    return static_cast<unsigned long>(value_ms);
+}
+
+// attemptは再開の回数。再開するたびにタイムアウトを倍にする（モデルの再ロードなどで遅いだけの場合に備える）
+// 倍にした後で上限に収めるので、何回再開しても1回の待ち時間はMAX_*_TIMEOUT_MSを超えない
+unsigned long firstTokenTimeout(const ModelCadence& cadence, const uint8_t attempt) {
+    const float timeout = cadence.valid ? cadence.first_token_ms * 4.0f + 1000.0f : DEFAULT_FIRST_TOKEN_TIMEOUT_MS;
+    return clampTimeout(timeout * (1UL << attempt), MIN_FIRST_TOKEN_TIMEOUT_MS, MAX_FIRST_TOKEN_TIMEOUT_MS);
+}
+
+unsigned long tokenIdleTimeout(const ModelCadence& cadence, const uint8_t attempt) {
+    const float timeout = cadence.valid ? cadence.token_interval_ms * TOKEN_IDLE_INTERVALS + 300.0f : DEFAULT_TOKEN_IDLE_TIMEOUT_MS;
+    return clampTimeout(timeout * (1UL << attempt), MIN_TOKEN_IDLE_TIMEOUT_MS, MAX_TOKEN_IDLE_TIMEOUT_MS);
+}
+
+enum StreamResult {
+    STREAM_DONE = 0,     // doneまで受信できた
+    STREAM_STALLED = 1,  // 途中で止まった・切れた（再開できる）
+    STREAM_FAILED = 2    // HTTPエラーなど（再開しない）
+};
+
+// 1回の推論（再開を含む）の状態
+struct StreamState {
+    const OllamaInferenceCommand* command;
+    String output;  // ここまでにM5へ送った出力（再開時にアシスタントの発話として渡す）
+    bool done;
+    bool truncated;  // max_token_lenに達したのでモジュール側で打ち切った
+    uint32_t tokens;
+    uint32_t start_us;
+    uint32_t first_token_us;
+    unsigned long first_token_ms;  // 今回の接続で最初のトークンが来るまでの時間
+    uint32_t prompt_eval_count;    // doneの統計
+    uint32_t eval_count;
+    uint64_t eval_duration_ns;
+    // 思考部分（thinkingフィールドや <think>〜</think>）
+    uint32_t thinking_tokens;      // 受け取った思考部分のチャンク数（Coreには送らない）
+    bool in_think;                 // <think> の中
+    bool trim_after_think;         // </think> の直後の改行を読み飛ばす
+    String tag_carry;              // チャンクの境目で切れたタグの候補
+    bool heartbeat_open;           // llm.thinking を送ってまだfinishしていない
+    uint16_t heartbeat_index;
+    unsigned long last_heartbeat_ms;
+    // 構造化出力（formatあり）: 出力をJSONとして読み、閉じたフィールドごとに送る
+    bool structured;
+    JsonFieldSplitter fields;
+    bool fields_dropped; // 送れなかったフレームがある（llm.json.doneでエラーにする）
+};
+
+// 受信が進んでいるかの判定には、Coreに送らない思考部分も数える
+uint32_t streamProgress(const StreamState& state) {
+    return state.tokens + state.thinking_tokens;
+}
+
+LlmStreamHook stream_poll_hook = nullptr;
+LlmStreamHook stream_near_end_hook = nullptr;
+
+// 生成の終わりが近いか（doneが届いた、またはmax_token_lenの手前）
+// 終わりを前もって知れるのはmax_token_lenがあるときだけ。ないときはdoneの時点なので、先に送って省けるのは接続とリクエストの送信だけ
+// （最初のトークンで送ると、OLLAMA_NUM_PARALLELが2以上のバックエンドでは今の回答と並行して生成され、今の回答が遅くなる）
+bool streamNearEnd(const StreamState& state) {
+    const LlmWorkConfig* config = state.command->config;
+    return state.done || (config && config->max_token_len > 0 && state.tokens + PIPELINE_TAIL_TOKENS >= config->max_token_len);
+}
+
+String streamWorkId(const StreamState& state) {
+    String work_id = state.command->work_id;
+    if (work_id.length() == 0) {
+        work_id = current_work_id.length() > 0 ? current_work_id : ("llm_" + String(millis() % 100000));
+        if (current_work_id.length() == 0) {
+            current_work_id = work_id;
+        }
+    }
+    return work_id;
+}
+
+// textのoffsetから最大max_bytesバイトで区切る位置。UTF-8の文字の途中では区切らない
+size_t utf8ChunkEnd(const char* text, const size_t offset, const size_t length, const size_t max_bytes) {
+    size_t end = offset + max_bytes;
+    if (end >= length) {
+        return length;
+    }
+    while (end > offset && (static_cast<uint8_t>(text[end]) & 0xC0) == 0x80) {
+        end--;
+    }
+    return end;
+}
+
+// 閉じたフィールドを llm.json.<型> で送る。dataのkeyにメンバー名（配列の要素ならなし）、deltaに値
+// 長い値はJSON_FIELD_FRAME_BYTESごとに同じkeyとindexのフレームに分け、最後のフレームでfinishをtrueにする
+void sendJsonField(void* context, const JsonField& field) {
+    StreamState& state = *static_cast<StreamState*>(context);
+    ResponseMsg_t response_msg;
+    response_msg.request_id = "llm_inference";
+    response_msg.work_id = streamWorkId(state);
+    response_msg.object = jsonFieldObject(field.type);
+    response_msg.error.code = 0;
+    response_msg.error.message = "";
+    response_msg.inference_data.key = field.key;
+    response_msg.inference_data.index = field.index;
+    const String value = field.value;
+    size_t offset = 0;
+    do {
+        const size_t end = utf8ChunkEnd(value.c_str(), offset, value.length(), JSON_FIELD_FRAME_BYTES);
+        response_msg.inference_data.delta = value.substring(offset, end);
+        response_msg.inference_data.finish = end == value.length();
+        if (!sendToM5(response_msg)) {
+            state.fields_dropped = true;
+        }
+        offset = end;
+    } while (offset < value.length());
+}
+
+// 構造化出力ではテキストのdeltaは送らず、最後に llm.json.done（indexはフィールドの数）で終わりを知らせる
+void sendStructuredDelta(StreamState& state, const String& delta, const bool finish) {
+    jsonFieldsFeed(state.fields, delta.c_str(), delta.length(), sendJsonField, &state);
+    if (!finish) {
+        return;
+    }
+    ResponseMsg_t response_msg;
+    response_msg.request_id = "llm_inference";
+    response_msg.work_id = streamWorkId(state);
+    response_msg.object = "llm.json.done";
+    const bool complete = jsonFieldsDone(state.fields);
+    response_msg.error.code = complete && !state.fields_dropped ? 0 : 1;
+    response_msg.error.message = !complete ? "Incomplete JSON" : state.fields_dropped ? "JSON field not sent" : "";
+    response_msg.inference_data.delta = "";
+    response_msg.inference_data.index = state.fields.count;
+    response_msg.inference_data.finish = true;
+    sendToM5(response_msg);
+}
+
+void sendStreamDelta(StreamState& state, const String& delta, const bool finish) {
+    if (state.structured) {
+        sendStructuredDelta(state, delta, finish);
+        return;
+    }
+    ResponseMsg_t response_msg;
+    response_msg.request_id = "llm_inference";
+    const String work_id = streamWorkId(state);
+    response_msg.work_id = work_id;
+    response_msg.object = state.command->object.length() > 0 ? state.command->object : String("llm.utf-8.stream");
+    response_msg.error.code = 0;
+    response_msg.error.message = "";
+    response_msg.inference_data.delta = delta;
+    response_msg.inference_data.index = 0;
+    response_msg.inference_data.finish = finish;
+    sendToM5(response_msg);
+    // 読み上げ対象のwork_idなら、文の区切りごとに合成へ回す
+    tts_on_llm_delta(work_id, delta, finish);
+}
+
+LlmThinkMode thinkMode(const StreamState& state) {
+    return state.command->config ? state.command->config->think : LLM_THINK_DEFAULT;
+}
+
+// 思考中であることだけを llm.thinking で送る。deltaはここまでの思考部分のチャンク数
+void sendThinkingHeartbeat(StreamState& state, const bool finish) {
+    ResponseMsg_t response_msg;
+    response_msg.request_id = "llm_inference";
+    response_msg.work_id = streamWorkId(state);
+    response_msg.object = "llm.thinking";
+    response_msg.error.code = 0;
+    response_msg.error.message = "";
+    response_msg.inference_data.delta = String(state.thinking_tokens);
+    response_msg.inference_data.index = state.heartbeat_index++;
+    response_msg.inference_data.finish = finish;
+    sendToM5(response_msg);
+    state.heartbeat_open = !finish;
+    state.last_heartbeat_ms = millis();
+}
+
+void onThinking(StreamState& state) {
+    state.thinking_tokens++;
+    if (thinkMode(state) == LLM_THINK_HEARTBEAT &&
+        (!state.heartbeat_open || millis() - state.last_heartbeat_ms >= THINK_HEARTBEAT_INTERVAL_MS)) {
+        sendThinkingHeartbeat(state, false);
+    }
+}
+
+// 回答が始まったら思考の終わりを知らせる
+void endThinking(StreamState& state) {
+    if (state.heartbeat_open) {
+        sendThinkingHeartbeat(state, true);
+    }
+}
+
+// textの末尾が tag の先頭の何文字と一致するか（次のチャンクでタグが完成するかもしれない）
+size_t partialTagLength(const String& text, const size_t from, const char* tag) {
+    const size_t tagLength = strlen(tag);
+    for (size_t k = tagLength - 1; k > 0; k--) {
+        if (text.length() - from >= k && strncmp(text.c_str() + text.length() - k, tag, k) == 0) {
+            return k;
+        }
+    }
+    return 0;
+}
+
+// <think>〜</think> を取り除いた部分を返す。タグがチャンクをまたいでもよい
+String stripThinkTags(StreamState& state, const String& text) {
+    const String input = state.tag_carry + text;
+    state.tag_carry = "";
+    String visible;
+    size_t from = 0;
+    while (from < input.length()) {
+        const char* tag = state.in_think ? THINK_CLOSE_TAG : THINK_OPEN_TAG;
+        const int pos = input.indexOf(tag, from);
+        size_t end = pos >= 0 ? static_cast<size_t>(pos) : input.length() - partialTagLength(input, from, tag);
+        if (end > from) {
+            if (state.in_think) {
+                onThinking(state);
+            } else {
+                visible += input.substring(from, end);
+            }
+        }
+        if (pos < 0) {
+            state.tag_carry = input.substring(end);
+            break;
+        }
+        from = pos + strlen(tag);
+        state.in_think = !state.in_think;
+        if (!state.in_think) {
+            state.trim_after_think = true;
+        }
+    }
+    // </think> の後の改行は回答の一部ではない
+    if (state.trim_after_think) {
+        size_t skip = 0;
+        while (skip < visible.length() && isspace(static_cast<unsigned char>(visible[skip]))) {
+            skip++;
+        }
+        visible.remove(0, skip);
+        if (visible.length() > 0) {
+            state.trim_after_think = false;
+        }
+    }
+    return visible;
+}
+
+// 最初は /api/generate、再開時は /api/chat に途中までの出力をアシスタントの発話として渡して続きを生成させる
+// 履歴を使うwork_idは、常に /api/chat でこれまでの発話の後に今回のプロンプトを渡す
+String buildStreamRequest(const OllamaInferenceCommand& command, const StreamState& state, String& path) {
+    const LlmWorkConfig* config = command.config;
+    const bool useHistory = config && config->history != LLM_HISTORY_OFF;
+    const size_t systemLength = config ? config->system_prompt.length() : 0;
+    const size_t historyLength = useHistory ? chatHistoryBytes(*config) : systemLength;
+    const size_t formatLength = config ? config->format.length() : 0;
+    ArenaJsonDocument requestDoc(1024 + command.prompt.length() + state.output.length() + historyLength + formatLength);
     requestDoc["model"] = command.model;
-    requestDoc["prompt"] = command.prompt;
     requestDoc["stream"] = true;
-    // curl http://localhost:11434/api/generate -d '{
-    //     "model": "gemma3",
-    //     "prompt": "Why is the sky blue?"
-    //   }'
-    
+    if (config) {
+        applyLlmWorkOptions(*config, requestDoc, state.tokens);
+    }
+    // 構造化出力。再開時は途中までのJSONの続きを書かせるので、最初から書き直させる形式の制約はかけない
+    if (formatLength > 0 && state.output.length() == 0) {
+        requestDoc["format"] = serialized(config->format);
+    }
+    if (useHistory) {
+        path = "/api/chat";
+        JsonArray messages = requestDoc.createNestedArray("messages");
+        chatHistoryAppendMessages(*config, messages);
+        JsonObject user_message = messages.createNestedObject();
+        user_message["role"] = "user";
+        user_message["content"] = command.prompt;
+        if (state.output.length() > 0) {
+            JsonObject assistant_message = messages.createNestedObject();
+            assistant_message["role"] = "assistant";
+            assistant_message["content"] = state.output;
+        }
+    } else if (state.output.length() == 0) {
+        path = "/api/generate";
+        requestDoc["prompt"] = command.prompt;
+        if (systemLength > 0) {
+            requestDoc["system"] = config->system_prompt;
+        }
+        // curl http://localhost:11434/api/generate -d '{
+        //     "model": "gemma3",
+        //     "prompt": "Why is the sky blue?"
+        //   }'
+    } else {
+        path = "/api/chat";
+        JsonArray messages = requestDoc.createNestedArray("messages");
+        if (systemLength > 0) {
+            JsonObject system_message = messages.createNestedObject();
+            system_message["role"] = "system";
+            system_message["content"] = config->system_prompt;
+        }
+        JsonObject user_message = messages.createNestedObject();
+        user_message["role"] = "user";
+        user_message["content"] = command.prompt;
+        JsonObject assistant_message = messages.createNestedObject();
+        assistant_message["role"] = "assistant";
+        assistant_message["content"] = state.output;
+    }
     String requestJson;
     serializeJson(requestDoc, requestJson);
-    
+    return requestJson;
+}
+
+uint8_t stream_read_buffer[STREAM_READ_BUFFER_SIZE];
+char line_buffer[MAX_LINE_BUFFER + 1];
+
+// キャプチャにはメソッドとパスをつけてリクエストを残す
+void captureStreamRequest(const char* path, const String& body) {
+    if (CAPTURE_MODE == CAPTURE_MODE_OFF) {
+        return;
+    }
+    char method_path[64];
+    snprintf(method_path, sizeof(method_path), "POST %s", path);
+    captureRecord(CAPTURE_HTTP_REQUEST, body, method_path);
+}
+
+// 1行分のJSONを処理する。doneが来たらtrueを返す
+bool handleStreamLine(const char* line, const size_t length, StreamState& state) {
+    ArenaJsonDocument responseDoc(streamLineDocSize(length));
+    StreamLine parsed;
+    const uint32_t perfLineStart = micros();
+    DeserializationError error = parseStreamLine(responseDoc, line, length, parsed);
+    perfRecord(PERF_STREAM_LINE_PARSE, micros() - perfLineStart, length);
+
+    if (error) {
+        Serial.print("[JSON] Parse error: ");
+        Serial.println(error.c_str());
+        Serial.print("[JSON] Line buffer (first 200 chars): ");
+        Serial.write(line, length < 200 ? length : 200);
+        Serial.println();
+        return false;
+    }
+
+    if (parsed.thinking != nullptr && strlen(parsed.thinking) > 0) {
+        onThinking(state);
+    }
+
+    if (parsed.text != nullptr) {
+        String response_text = parsed.text;
+        const LlmThinkMode mode = thinkMode(state);
+        if (mode == LLM_THINK_STRIP || mode == LLM_THINK_HEARTBEAT) {
+            response_text = stripThinkTags(state, response_text);
+        }
+        if (response_text.length() > 0) {
+            endThinking(state);
+            if (state.tokens++ == 0) {
+                state.first_token_us = micros() - state.start_us;
+            }
+            Serial.print("[JSON] Stream chunk: ");
+            Serial.println(response_text);
+            state.output += response_text;
+            sendStreamDelta(state, response_text, false);
+        }
+    }
+
+    // num_predictはバックエンドによっては無視されるので、モジュール側でも上限で打ち切る
+    const LlmWorkConfig* config = state.command->config;
+    if (config && config->max_token_len > 0 && state.tokens >= config->max_token_len && !parsed.done) {
+        Serial.println("[JSON] Stream reached max_token_len, cutting");
+        state.done = true;
+        state.truncated = true;
+        sendStreamDelta(state, "", true);
+        return true;
+    }
+
+    // doneフィールドをチェック
+    if (parsed.done) {
+        Serial.println("[JSON] Stream done");
+        state.done = true;
+        state.prompt_eval_count = parsed.prompt_eval_count;
+        state.eval_count = parsed.eval_count;
+        state.eval_duration_ns = parsed.eval_duration_ns;
+        endThinking(state);
+        if (state.thinking_tokens > 0) {
+            Serial.printf("[JSON] Thinking: %lu chunks not sent to M5\n", static_cast<unsigned long>(state.thinking_tokens));
+        }
+        // タグの候補として持ち越していた文字はタグではなかった
+        if (!state.in_think && state.tag_carry.length() > 0) {
+            state.output += state.tag_carry;
+            sendStreamDelta(state, state.tag_carry, false);
+            state.tag_carry = "";
+        }
+        sendStreamDelta(state, "", true);
+        return true;
+    }
+    return false;
+}
+
+StreamResult receiveStream(HttpStream& http, StreamState& state, const unsigned long requestTime,
+                           const unsigned long first_token_timeout, const unsigned long token_idle_timeout);
+
+// 1回分のHTTPストリームを受信する
+StreamResult streamOnce(const OllamaInferenceCommand& command, StreamState& state, const ModelCadence& cadence, const uint8_t attempt) {
+    String path;
+    String requestJson = buildStreamRequest(command, state, path);
+    const unsigned long first_token_timeout = firstTokenTimeout(cadence, attempt);
+    const unsigned long token_idle_timeout = tokenIdleTimeout(cadence, attempt);
+
     Serial.print("[JSON] LLM inference streaming request: ");
     Serial.println(requestJson);
     Serial.print("[JSON] Request URL: ");
-    Serial.println(url);
-    
-    int httpCode = http.POST(requestJson);
-    
+    Serial.println(host_ollama_url + path);
+    Serial.printf("[JSON] Stream timeouts: first token %lu ms, idle %lu ms\n", first_token_timeout, token_idle_timeout);
+
+    const unsigned long requestTime = millis();
+
+    WiFiClient client;
+    HttpStream http;
+    captureStreamRequest(path.c_str(), requestJson);
+    if (!httpStreamConnectBackend(http, client, CONNECT_TIMEOUT_MS) ||
+        !httpStreamSendRequest(http, "POST", path.c_str(), requestJson)) {
+        Serial.println("[JSON] LLM inference streaming request failed");
+        httpStreamClose(http);
+        return STREAM_STALLED;
+    }
+    return receiveStream(http, state, requestTime, first_token_timeout, token_idle_timeout);
+}
+
+// リクエスト送信後の応答（ヘッダと改行区切りのJSON）を受信する
+StreamResult receiveStream(HttpStream& http, StreamState& state, const unsigned long requestTime,
+                           const unsigned long first_token_timeout, const unsigned long token_idle_timeout) {
+    const uint32_t tokensBefore = streamProgress(state);
+    // ヘッダは最初のトークンと一緒に届く
+    int httpCode = httpStreamReadResponseHeader(http, first_token_timeout);
+    captureRecord(CAPTURE_HTTP_STATUS, String(httpCode));
     if (httpCode != 200) {
         Serial.print("[JSON] LLM inference streaming HTTP error: ");
         Serial.println(httpCode);
-        Serial.print("[JSON] Error string: ");
-        Serial.println(http.errorToString(httpCode));
-        http.end();
-        return LLM_OLLAMA_NOT_OK;
-    }
-    
-    // ストリーミングレスポンスを読み取る
-    WiFiClient* stream = http.getStreamPtr();
-    if (!stream) {
-        Serial.println("[JSON] Failed to get stream");
-        http.end();
-        return LLM_OLLAMA_NOT_OK;
+        httpStreamClose(http);
+        // 接続エラーやタイムアウトは再開を試みる。サーバーからのエラー応答は再開しない
+        return httpCode < 0 ? STREAM_STALLED : STREAM_FAILED;
     }
-    
-    // 改行区切りのJSONを読み取るバッファ
-    String lineBuffer = "";
-    lineBuffer.reserve(2048);  // メモリを事前確保
-    bool done = false;
+
+    // 改行区切りのJSONを読み取る
+    size_t lineLength = 0;
+    bool lineOverflow = false;
+    bool nearEndNotified = false;
     unsigned long lastDataTime = millis();  // 最後にデータを受信した時刻
-    const unsigned long IDLE_TIMEOUT = 30000;  // 30秒アイドルタイムアウト（データが来ない時間）
-    const size_t MAX_LINE_BUFFER = 4096;  // 最大4KB
-    
-    while (!done) {
-        // アイドルタイムアウトチェック
-        if (millis() - lastDataTime > IDLE_TIMEOUT) {
-            Serial.println("[JSON] Stream idle timeout (no data for 30s)");
-            http.end();
-            return LLM_OLLAMA_NOT_OK;
+
+    while (!state.done) {
+        // 生成中に届いたCoreからのフレームを受け付ける
+        if (stream_poll_hook) {
+            stream_poll_hook();
         }
-        
-        // ストリームからデータを読み取る
-        bool dataReceived = false;
-        while (stream->available()) {
-            dataReceived = true;
-            char c = stream->read();
-            
-            if (c == '\n' || c == '\r') {
-                // 改行が来たらJSONをパース
-                if (lineBuffer.length() > 0) {
-                    // JSONドキュメントのサイズを動的に決定（行バッファの2倍程度）
-                    size_t docSize = lineBuffer.length() * 2;
-                    if (docSize < 2048) docSize = 2048;
-                    if (docSize > 8192) docSize = 8192;  // 最大8KB
-                    
-                    DynamicJsonDocument responseDoc(docSize);
-                    DeserializationError error = deserializeJson(responseDoc, lineBuffer);
-                    
-                    if (!error) {
-                        // responseフィールドを取得してUARTに送信
-                        if (responseDoc["response"].is<String>()) {
-                            String response_text = responseDoc["response"].as<String>();
-                            Serial.print("[JSON] Stream chunk: ");
-                            Serial.println(response_text);
-                            ResponseMsg_t_error error_val;
-                            error_val.code = 0;
-                            error_val.message = "";
-                            ResponseMsg_t_inference_data inference_data_val;
-                            inference_data_val.delta = response_text;
-                            inference_data_val.index = 0;
-                            inference_data_val.finish = false;
-                            ResponseMsg_t response_msg;
-                            response_msg.request_id = "llm_inference";
-                            String work_id = current_work_id.length() > 0 ? current_work_id : ("llm_" + String(millis() % 100000));
-                            response_msg.work_id = work_id;
-                            if (current_work_id.length() == 0) {
-                                current_work_id = work_id;
-                            }
-                            response_msg.object = "llm.utf-8.stream";
-                            response_msg.error = error_val;
-                            response_msg.inference_data = inference_data_val;
-                            sendToM5(response_msg);
-
-                        }
-                        
-                        // doneフィールドをチェック
-                        if (responseDoc["done"].is<bool>() && responseDoc["done"].as<bool>()) {
-                            done = true;
-                            Serial.println("[JSON] Stream done");
-                            // struct ResponseMsg_t_inference_data {
-                            //     String delta;
-                            //     uint16_t index;
-                            //     bool finish;
-                            // };
-                            
-                            // struct ResponseMsg_t {
-                            //     String request_id;
-                            //     String work_id;
-                            //     String object;
-                            //     ResponseMsg_t_error error;
-                            //     ResponseMsg_t_inference_data inference_data;
-                            //   };
-                            ResponseMsg_t_error error_val;
-                            error_val.code = 0;
-                            error_val.message = "";
-                            ResponseMsg_t_inference_data inference_data_val;
-                            inference_data_val.delta = "";
-                            inference_data_val.index = 0;
-                            inference_data_val.finish = true;
-                            ResponseMsg_t response_msg;
-                            response_msg.request_id = "llm_inference";
-                            String work_id = current_work_id.length() > 0 ? current_work_id : ("llm_" + String(millis() % 100000));
-                            response_msg.work_id = work_id;
-                            if (current_work_id.length() == 0) {
-                                current_work_id = work_id;
-                            }
-                            response_msg.object = "llm.utf-8.stream";
-                            response_msg.error = error_val;
-                            response_msg.inference_data = inference_data_val;
-                            sendToM5(response_msg);
-                            break;
-                        }
-                    } else {
-                        Serial.print("[JSON] Parse error: ");
-                        Serial.println(error.c_str());
-                        Serial.print("[JSON] Line buffer (first 200 chars): ");
-                        String preview = lineBuffer.substring(0, 200);
-                        Serial.println(preview);
-                    }
-                    
-                    lineBuffer = "";
-                    lineBuffer.reserve(2048);  // リセット後もメモリ確保
+        // 最初のトークンまではプロンプト評価時間、その後はトークン間隔から決めたタイムアウト
+        const bool waitingFirstToken = streamProgress(state) == tokensBefore;
+        const unsigned long idleTimeout = waitingFirstToken ? first_token_timeout : token_idle_timeout;
+        const unsigned long idle = millis() - lastDataTime;
+        if (idle >= idleTimeout) {
+            Serial.printf("[JSON] Stream idle timeout (no data for %lu ms)\n", idleTimeout);
+            httpStreamClose(http);
+            return STREAM_STALLED;
+        }
+
+        // データが届くまでソケットで待ち、届いた分をまとめて読む
+        const int received = httpStreamRead(http, stream_read_buffer, sizeof(stream_read_buffer), idleTimeout - idle);
+        if (received < 0) {
+            Serial.println("[JSON] Stream disconnected before done");
+            httpStreamClose(http);
+            return STREAM_STALLED;
+        }
+        if (received == 0) {
+            continue;
+        }
+        lastDataTime = millis();
+
+        for (int i = 0; i < received && !state.done; i++) {
+            const char c = static_cast<char>(stream_read_buffer[i]);
+            if (c != '\n' && c != '\r') {
+                // 長すぎる行は捨てる（Ollamaの1行はトークン1つ分なので通常は起きない）
+                if (lineLength < MAX_LINE_BUFFER) {
+                    line_buffer[lineLength++] = c;
+                } else if (!lineOverflow) {
+                    Serial.println("[JSON] Line buffer overflow, dropping line");
+                    lineOverflow = true;
                 }
-            } else {
-                lineBuffer += c;
-                
-                // バッファオーバーフロー対策：最初の方を削除して続行
-                if (lineBuffer.length() > MAX_LINE_BUFFER) {
-                    Serial.println("[JSON] Line buffer overflow, truncating...");
-                    // 後半の2048バイトを残す（最新のデータを優先）
-                    String truncated = lineBuffer.substring(lineBuffer.length() - 2048);
-                    lineBuffer = truncated;
+                continue;
+            }
+            // 改行が来たらJSONをパース
+            if (lineLength > 0 && !lineOverflow) {
+                captureRecord(CAPTURE_HTTP_RESPONSE, line_buffer, lineLength);
+                const uint32_t tokensBeforeLine = streamProgress(state);
+                handleStreamLine(line_buffer, lineLength, state);
+                if (tokensBeforeLine == tokensBefore && streamProgress(state) > tokensBefore) {
+                    state.first_token_ms = millis() - requestTime;
+                }
+                // 残りを受け取っている間に、次のプロンプトの評価をバックエンドで始めさせる
+                if (stream_near_end_hook && !nearEndNotified && streamNearEnd(state)) {
+                    nearEndNotified = true;
+                    stream_near_end_hook();
                 }
             }
+            lineLength = 0;
+            lineOverflow = false;
         }
-        
-        // データを受信した場合はタイムアウト時刻を更新
-        if (dataReceived) {
-            lastDataTime = millis();
+    }
+
+    httpStreamClose(http);
+    return STREAM_DONE;
+}
+
+void initStreamState(StreamState& state, const OllamaInferenceCommand& command) {
+    state.command = &command;
+    state.output = "";
+    // トークンごとに伸ばすので、再確保が繰り返されないよう先に確保しておく
+    state.output.reserve(STREAM_OUTPUT_RESERVE);
+    state.done = false;
+    state.truncated = false;
+    state.tokens = 0;
+    state.start_us = micros();
+    state.first_token_us = 0;
+    state.first_token_ms = 0;
+    state.prompt_eval_count = 0;
+    state.eval_count = 0;
+    state.eval_duration_ns = 0;
+    state.thinking_tokens = 0;
+    state.in_think = false;
+    state.trim_after_think = false;
+    state.tag_carry = "";
+    state.heartbeat_open = false;
+    state.heartbeat_index = 0;
+    state.last_heartbeat_ms = 0;
+    state.structured = command.config && command.config->format.length() > 0;
+    jsonFieldsBegin(state.fields);
+    state.fields_dropped = false;
+}
+
+// キャッシュした回答を生成時と同じ形（llm.utf-8.stream）で返す
+// 1フレームが大きくなりすぎないよう、UTF-8の文字の途中を避けて分割する
+void replayCachedAnswer(StreamState& state, const String& answer) {
+    const char* text = answer.c_str();
+    size_t offset = 0;
+    while (offset < answer.length()) {
+        const size_t end = utf8ChunkEnd(text, offset, answer.length(), CACHE_REPLAY_CHUNK_SIZE);
+        sendStreamDelta(state, answer.substring(offset, end), false);
+        offset = end;
+    }
+    sendStreamDelta(state, "", true);
+}
+
+// 次回のタイムアウトのために応答速度を学習する（トークン間隔はサーバーの統計を優先）
+void learnCadence(ModelCadence& cadence, const StreamState& state) {
+    float token_interval_ms = 0;
+    if (state.eval_count > 0) {
+        token_interval_ms = static_cast<float>(state.eval_duration_ns / state.eval_count) / 1000000.0f;
+    } else if (state.tokens > 1) {
+        token_interval_ms = static_cast<float>(micros() - state.start_us - state.first_token_us) / 1000.0f / (state.tokens - 1);
+    }
+    if (token_interval_ms > 0 && state.first_token_ms > 0) {
+        updateCadence(cadence, token_interval_ms, static_cast<float>(state.first_token_ms));
+    }
+}
+
+} // namespace
+
+void llm_set_stream_hooks(LlmStreamHook on_poll, LlmStreamHook on_near_end) {
+    stream_poll_hook = on_poll;
+    stream_near_end_hook = on_near_end;
+}
+
+// 揃ったテキスト（stream:falseの応答）から <think>〜</think> を取り除く。閉じていない <think> の後ろも思考として捨てる
+String stripThinkText(const String& text) {
+    OllamaInferenceCommand command;
+    command.config = nullptr;
+    StreamState state;
+    initStreamState(state, command);
+    String visible = stripThinkTags(state, text);
+    if (!state.in_think) {
+        visible += state.tag_carry;
+    }
+    return visible;
+}
+
+LLM_Status llm_inference_dispatch(const OllamaInferenceCommand& command, WiFiClient& client, HttpStream& http) {
+    StreamState state;
+    initStreamState(state, command);
+    if (command.config && command.config->history != LLM_HISTORY_OFF) {
+        chatHistoryFit(*command.config, command.prompt);
+    }
+    String path;
+    const String requestJson = buildStreamRequest(command, state, path);
+    captureStreamRequest(path.c_str(), requestJson);
+    if (!httpStreamConnectBackend(http, client, CONNECT_TIMEOUT_MS) ||
+        !httpStreamSendRequest(http, "POST", path.c_str(), requestJson)) {
+        Serial.println("[JSON] LLM inference dispatch failed");
+        httpStreamClose(http);
+        return LLM_OLLAMA_NOT_OK;
+    }
+    return LLM_OLLAMA_OK;
+}
+
+LLM_Status llm_inference_streaming(const OllamaInferenceCommand& command, HttpStream* dispatched) {
+    powerOnActivity();
+    ModelCadence& cadence = findCadence(command.model);
+    StreamState state;
+    initStreamState(state, command);
+
+    const LlmWorkConfig* config = command.config;
+    const bool useHistory = config && config->history != LLM_HISTORY_OFF;
+    // 履歴があると同じプロンプトでも答えが変わるので、キャッシュは使わない
+    const bool useCache = config && config->semantic_cache && !useHistory;
+    if (useHistory) {
+        chatHistoryFit(*config, command.prompt);
+    }
+    String cachedAnswer;
+    if (useCache && semanticCacheLookup(*config, command.prompt, cachedAnswer)) {
+        if (dispatched) {
+            httpStreamClose(*dispatched);
         }
-        
-        // 少し待機（CPU負荷軽減）
-        delay(10);
+        replayCachedAnswer(state, cachedAnswer);
+        metricsRecordRequest(METRICS_REQUEST_CACHED);
+        perfReport();
+        return LLM_OLLAMA_OK;
     }
-    
-    http.end();
+
+    StreamResult result = STREAM_FAILED;
+    for (uint8_t attempt = 0; attempt <= MAX_STREAM_RESUME; attempt++) {
+        if (attempt > 0) {
+            Serial.printf("[JSON] Resuming stream (attempt %u, %u chars so far)\n", attempt, state.output.length());
+            metricsRecordStreamResume();
+        }
+        state.first_token_ms = 0;
+        if (attempt == 0 && dispatched) {
+            // 先に送っておいたリクエストの応答を受け取る
+            result = receiveStream(*dispatched, state, millis(), firstTokenTimeout(cadence, 0), tokenIdleTimeout(cadence, 0));
+        } else {
+            result = streamOnce(command, state, cadence, attempt);
+        }
+        if (result != STREAM_STALLED) {
+            break;
+        }
+    }
+    // アイドル判定はストリーム終了から数える
+    powerOnActivity();
+
+    if (result != STREAM_DONE) {
+        metricsRecordRequest(METRICS_REQUEST_ERROR);
+        return LLM_OLLAMA_NOT_OK;
+    }
+
+    learnCadence(cadence, state);
+    if (useHistory) {
+        chatHistoryRecordTurn(*config, command.prompt, state.output, state.prompt_eval_count, state.eval_count);
+    }
+    // 打ち切った回答は途中までなので保存しない
+    if (useCache && !state.truncated) {
+        semanticCacheStore(*config, state.output);
+    }
+    const uint32_t total_us = micros() - state.start_us;
+    metricsRecordRequest(METRICS_REQUEST_OK);
+    metricsRecordStream(state.tokens, state.first_token_us, total_us);
+    perfReportStream(state.tokens, state.first_token_us, total_us);
+    perfReport();
     return LLM_OLLAMA_OK;
 }
 
+namespace {
+
+// 画像をアップロード中のVLMリクエスト
+// 画像はCoreからbase64のままフレーム単位で届くので、そのままchunkedのリクエストボディに流す
+struct VisionUpload {
+    bool active;
+    OllamaInferenceCommand command;
+    WiFiClient client;
+    HttpStream http;
+    unsigned long last_chunk_time;
+    size_t image_bytes;
+    uint16_t next_index; // 次に届くはずのフレームのindex
+};
+
+VisionUpload vision_upload;
+constexpr unsigned long VISION_UPLOAD_TIMEOUT_MS = 5000;
+
+// 末尾の '='（2個まで）は最後のフレームでだけ受け付ける。途中の '=' は画像が壊れているので拒否する
+bool isBase64(const char* data, const size_t length, const bool last) {
+    size_t padding = 0;
+    for (size_t i = 0; i < length; i++) {
+        const char c = data[i];
+        if (c == '=') {
+            padding++;
+        } else if (padding > 0 || (!isalnum(static_cast<unsigned char>(c)) && c != '+' && c != '/')) {
+            return false;
+        }
+    }
+    return padding == 0 || (last && padding <= 2);
+}
+
+bool writeVisionChunk(const char* data, const size_t length) {
+    return httpStreamWriteChunk(vision_upload.http, reinterpret_cast<const uint8_t*>(data), length);
+}
+
+} // namespace
+
+LLM_Status vlm_inference_begin(const OllamaInferenceCommand& command) {
+    vlm_inference_abort();
+    powerOnActivity();
+
+    // images以外を先に組み立て、最後の '}' を外して images 配列を開く
+    const LlmWorkConfig* config = command.config;
+    const size_t systemLength = config ? config->system_prompt.length() : 0;
+    ArenaJsonDocument requestDoc(1024 + command.prompt.length() + systemLength);
+    requestDoc["model"] = command.model;
+    requestDoc["stream"] = true;
+    requestDoc["prompt"] = command.prompt;
+    if (systemLength > 0) {
+        requestDoc["system"] = config->system_prompt;
+    }
+    if (config) {
+        applyLlmWorkOptions(*config, requestDoc, 0);
+    }
+    String head;
+    serializeJson(requestDoc, head);
+    head.remove(head.length() - 1);
+    head += ",\"images\":[\"";
+
+    vision_upload.command = command;
+    // 画像は記録しない（images配列の手前まで）
+    captureStreamRequest("/api/generate", head);
+    if (!httpStreamConnectBackend(vision_upload.http, vision_upload.client, CONNECT_TIMEOUT_MS) ||
+        !httpStreamBeginChunkedRequest(vision_upload.http, "POST", "/api/generate") ||
+        !writeVisionChunk(head.c_str(), head.length())) {
+        Serial.println("[JSON] VLM request failed");
+        httpStreamClose(vision_upload.http);
+        return LLM_OLLAMA_NOT_OK;
+    }
+    Serial.print("[JSON] VLM request started: ");
+    Serial.println(head);
+    vision_upload.active = true;
+    vision_upload.last_chunk_time = millis();
+    vision_upload.image_bytes = 0;
+    vision_upload.next_index = 0;
+    return LLM_OLLAMA_OK;
+}
+
+LLM_Status vlm_inference_append_image(const uint16_t index, const char* base64, const size_t length, const bool last) {
+    if (!vision_upload.active) {
+        return LLM_OLLAMA_NOT_OK;
+    }
+    // フレームが抜けたまま続けると、壊れた画像で推論してしまう
+    if (index != vision_upload.next_index) {
+        Serial.printf("[JSON] VLM image chunk %u out of order (expected %u)\n", static_cast<unsigned>(index),
+                      static_cast<unsigned>(vision_upload.next_index));
+        vlm_inference_abort();
+        return LLM_OLLAMA_NOT_OK;
+    }
+    // JSON文字列にそのまま入れるので、base64以外の文字は受け付けない
+    if (!isBase64(base64, length, last) || !writeVisionChunk(base64, length)) {
+        Serial.println("[JSON] VLM image chunk rejected");
+        vlm_inference_abort();
+        return LLM_OLLAMA_NOT_OK;
+    }
+    vision_upload.image_bytes += length;
+    vision_upload.last_chunk_time = millis();
+    vision_upload.next_index++;
+    return LLM_OLLAMA_OK;
+}
+
+LLM_Status vlm_inference_finish() {
+    if (!vision_upload.active) {
+        return LLM_OLLAMA_NOT_OK;
+    }
+    static const char tail[] = "\"]}";
+    if (!writeVisionChunk(tail, sizeof(tail) - 1) || !httpStreamEndChunkedRequest(vision_upload.http)) {
+        vlm_inference_abort();
+        return LLM_OLLAMA_NOT_OK;
+    }
+    Serial.printf("[JSON] VLM image uploaded (%u base64 bytes)\n", static_cast<unsigned>(vision_upload.image_bytes));
+    vision_upload.active = false;
+
+    // 画像は保持していないので、途中で切れても再開はしない
+    ModelCadence& cadence = findCadence(vision_upload.command.model);
+    StreamState state;
+    initStreamState(state, vision_upload.command);
+    StreamResult result = receiveStream(vision_upload.http, state, millis(),
+                                        firstTokenTimeout(cadence, 0), tokenIdleTimeout(cadence, 0));
+    httpStreamClose(vision_upload.http);
+    powerOnActivity();
+    if (result != STREAM_DONE) {
+        metricsRecordRequest(METRICS_REQUEST_ERROR);
+        return LLM_OLLAMA_NOT_OK;
+    }
+    learnCadence(cadence, state);
+    const uint32_t total_us = micros() - state.start_us;
+    metricsRecordRequest(METRICS_REQUEST_OK);
+    metricsRecordStream(state.tokens, state.first_token_us, total_us);
+    perfReportStream(state.tokens, state.first_token_us, total_us);
+    perfReport();
+    return LLM_OLLAMA_OK;
+}
+
+void vlm_inference_abort() {
+    if (vision_upload.active) {
+        Serial.println("[JSON] VLM upload aborted");
+        httpStreamClose(vision_upload.http);
+        vision_upload.active = false;
+    }
+}
+
+void vlm_inference_poll() {
+    if (vision_upload.active && millis() - vision_upload.last_chunk_time > VISION_UPLOAD_TIMEOUT_MS) {
+        Serial.println("[JSON] VLM upload timeout");
+        vlm_inference_abort();
+    }
+}
+
 
 #endif // USE_WIFI_FOR_LLM_COMMUNICATION
@@ -1,6 +1,10 @@
 #ifndef USE_WIFI_H
 #define USE_WIFI_H TRUE
 #include "common.h"
+#include "http_stream.h"
+
+// Ollamaのポート（secrets.hのHOST_OLLAMA_PORT）
+extern uint16_t host_ollama_port;
 
 initCommunicationResult init_communication();
 SerialSendResult send_data(const char* data);
@@ -11,7 +15,27 @@ sendToPCResult sendToPCwithResponse(const String& sending_json, const bool multi
 
 LLM_Status llm_setup(const String& model_name);
 LLM_Status llm_inference_no_streaming(const OllamaInferenceCommand& command);
-LLM_Status llm_inference_streaming(const OllamaInferenceCommand& command);
+// dispatchedがあれば、llm_inference_dispatchで先に送ったリクエストの応答を受け取る
+LLM_Status llm_inference_streaming(const OllamaInferenceCommand& command, HttpStream* dispatched = nullptr);
+// 推論のリクエストだけを先に送る（応答はllm_inference_streamingで受け取る）
+LLM_Status llm_inference_dispatch(const OllamaInferenceCommand& command, WiFiClient& client, HttpStream& http);
+
+// 応答全体から <think>〜</think> の思考部分を取り除く（思考を返すモデルの要約など）
+String stripThinkText(const String& text);
+
+// llm_inference_streamingの受信中に呼ぶ関数（nullptrで解除）
+// on_pollは受信の合間に、on_near_endは生成の終わりが近づいたときに1回呼ぶ
+typedef void (*LlmStreamHook)();
+void llm_set_stream_hooks(LlmStreamHook on_poll, LlmStreamHook on_near_end);
+
+// VLM: 画像（base64）をフレームごとにバックエンドへ流し、最後に応答をストリームで返す
+LLM_Status vlm_inference_begin(const OllamaInferenceCommand& command);
+// indexはフレームの番号（beginの後は0から）。抜けや重複があればアップロードを中止する。lastは最後のフレーム
+LLM_Status vlm_inference_append_image(const uint16_t index, const char* base64, const size_t length, const bool last);
+LLM_Status vlm_inference_finish();
+void vlm_inference_abort();
+// loop()から呼ぶ。画像のフレームが途切れたらアップロードを中止する
+void vlm_inference_poll();
 
 
 #endif
\ No newline at end of file
@@ -0,0 +1,383 @@
+// リクエスト単位のアリーナ（src/arena.cpp）の長時間試験
+// 推論1回分の確保と解放を、指定した日数分（既定3日）くり返す
+//   - リクエストのドキュメント（buildStreamRequestと同じく、履歴のメッセージつきで組み立ててシリアライズする）
+//   - ストリームの1行ごとのドキュメント（handleStreamLineと同じくparseStreamLineでパースし、値を確かめる）
+//     ときどきドキュメントの中でさらに1つ確保して先に解放する（入れ子）
+//   - 何推論かに1回、要約のリクエストと応答のドキュメント（startSummary・finishSummaryと同じ）
+//   - 何行かにまたがって生きる領域。下のものを先に解放することもある（順不同）
+//   - アリーナに入らない大きさの確保（ヒープに回る）と、縮めてから解放する領域
+// 推論の終わり（requestArenaResetの前）に戻っていない領域があれば失敗とする
+// 確保した領域には印を書き、解放の前に確かめる（他の確保に上書きされていないか）
+// パースした値が行の中身と違えば失敗とする（ドキュメントの領域が他の確保に上書きされた）
+// 1時間ごとに、アリーナの最大の空き領域（その1時間の最小値）とヒープに回った回数などを1行のJSONで標準出力に出す
+// 順不同に解放した領域は上の領域が戻るまで空かないので、アリーナが混んでヒープに回ることはある
+// ドキュメントの確保の仕方はArduinoJsonの版で変わるので、ファームウェアと同じ版（platformio.iniで固定）でビルドすること
+//
+// ビルドと実行（stampS3R/test/hostで。ArduinoJsonは pio run で取得したものを使う）
+//   g++ -std=gnu++11 -O2 -Wall -I shim -I ../../src -I ../../.pio/libdeps/m5stack-stamps3/ArduinoJson/src -o arena_soak arena_soak.cpp
+//   ./arena_soak [日数] [1時間あたりの推論回数（既定360）]
+
+#include "../../src/arena.cpp"
+#include "../../src/protocol.cpp"
+
+#include <string>
+#include <vector>
+
+namespace {
+
+// 再現できるよう固定の種の擬似乱数を使う
+uint32_t random_state = 0x2545F491;
+
+uint32_t nextRandom(const uint32_t limit)
+{
+    random_state ^= random_state << 13;
+    random_state ^= random_state >> 17;
+    random_state ^= random_state << 5;
+    return random_state % limit;
+}
+
+struct Block
+{
+    uint8_t *data;
+    size_t size;
+    uint8_t mark;
+};
+
+struct SoakStats
+{
+    uint64_t inferences;
+    uint64_t allocations;
+    uint32_t oversized;          // アリーナより大きいので、ヒープに回って当然の確保
+    uint32_t corrupted;          // 印が書き換わっていたブロック
+    uint32_t unreleased;         // 推論の終わりに領域が戻っていなかった回数
+    uint32_t mismatched;         // パースした値が行の中身と違った回数（パースの失敗を含む）
+    uint64_t documents;          // 作ったArenaJsonDocumentの数
+    size_t unreleased_bytes;
+    size_t peak_used;            // この1時間の使用量の最大値
+};
+
+SoakStats stats;
+uint8_t next_mark = 1;
+
+void trackUsed()
+{
+    if (arena.used > stats.peak_used)
+    {
+        stats.peak_used = arena.used;
+    }
+}
+
+Block allocateBlock(const size_t size)
+{
+    Block block = {static_cast<uint8_t *>(requestArenaAllocate(size)), size, next_mark++};
+    stats.allocations++;
+    if (size > REQUEST_ARENA_SIZE)
+    {
+        stats.oversized++;
+    }
+    memset(block.data, block.mark, block.size);
+    trackUsed();
+    return block;
+}
+
+bool blockIntact(const Block &block)
+{
+    for (size_t i = 0; i < block.size; i++)
+    {
+        if (block.data[i] != block.mark)
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+void freeBlock(Block &block)
+{
+    if (!blockIntact(block))
+    {
+        stats.corrupted++;
+    }
+    requestArenaFree(block.data);
+    block.data = nullptr;
+}
+
+// ArduinoJsonのshrinkToFitと同じく、使った分だけに縮める
+void shrinkBlock(Block &block, const size_t size)
+{
+    ArenaAllocator allocator;
+    block.data = static_cast<uint8_t *>(allocator.reallocate(block.data, size));
+    block.size = size;
+    trackUsed();
+}
+
+// ストリームの1行に入れるトークン。JSONの文字列のままのものと、パースした後のもの
+struct StreamToken
+{
+    const char *json;
+    const char *text;
+};
+
+const StreamToken STREAM_TOKENS[] = {
+    {"空", "空"},   {"が", "が"},     {"青く", "青く"}, {"見える", "見える"}, {"のは", "のは"}, {"、", "、"},
+    {"😊", "😊"},   {"\\n", "\n"},    {"\\\"", "\""},   {"Rayleigh", "Rayleigh"}, {" scattering", " scattering"},
+    {"\\u3002", "。"}};
+constexpr size_t STREAM_TOKEN_COUNT = sizeof(STREAM_TOKENS) / sizeof(STREAM_TOKENS[0]);
+
+// llm.setupで指定する生成パラメータ。ホストのArduinoJsonはArduinoのStringを扱わないので、applyLlmWorkOptionsと同じものを直接書く
+const char WORK_MODEL[] = "gemma3:4b";
+const char WORK_SYSTEM_PROMPT[] = "あなたは親切なアシスタントです。日本語で簡潔に答えてください。";
+const char *const WORK_STOP[] = {"<end>", "###"};
+
+void applyWorkOptions(JsonDocument &request, const uint32_t num_predict)
+{
+    JsonObject options = request.createNestedObject("options");
+    options["num_predict"] = num_predict;
+    options["temperature"] = 0.7f;
+    options["num_ctx"] = 4096;
+    JsonArray stop = options.createNestedArray("stop");
+    for (const char *sequence : WORK_STOP)
+    {
+        stop.add(sequence);
+    }
+}
+
+// 履歴の発話（chat_history.cppと同じく、古い順に）。ドキュメントにはコピーされる（Stringと同じ）
+std::vector<std::string> history_turns;
+
+// トークンを並べたテキスト。jsonがあれば、JSONの文字列の中身として書いたものも返す
+std::string randomText(const uint32_t tokens, std::string *json = nullptr)
+{
+    std::string text;
+    for (uint32_t i = 0; i < tokens; i++)
+    {
+        const StreamToken &token = STREAM_TOKENS[nextRandom(STREAM_TOKEN_COUNT)];
+        text += token.text;
+        if (json != nullptr)
+        {
+            *json += token.json;
+        }
+    }
+    return text;
+}
+
+// buildStreamRequestと同じく、リクエストのドキュメントを組み立ててシリアライズする
+void buildRequest(const std::string &prompt)
+{
+    size_t history_length = sizeof(WORK_SYSTEM_PROMPT);
+    for (const std::string &turn : history_turns)
+    {
+        history_length += turn.size();
+    }
+    ArenaJsonDocument request_doc(1024 + prompt.size() + history_length);
+    stats.documents++;
+    trackUsed();
+    request_doc["model"] = WORK_MODEL;
+    request_doc["stream"] = true;
+    applyWorkOptions(request_doc, 256);
+    JsonArray messages = request_doc.createNestedArray("messages");
+    JsonObject system_message = messages.createNestedObject();
+    system_message["role"] = "system";
+    system_message["content"] = WORK_SYSTEM_PROMPT;
+    for (size_t i = 0; i < history_turns.size(); i++)
+    {
+        JsonObject message = messages.createNestedObject();
+        message["role"] = i % 2 == 0 ? "user" : "assistant";
+        message["content"] = history_turns[i];
+    }
+    JsonObject user_message = messages.createNestedObject();
+    user_message["role"] = "user";
+    user_message["content"] = prompt;
+    std::string body;
+    serializeJson(request_doc, body);
+    if (request_doc.overflowed())
+    {
+        stats.mismatched++;
+    }
+}
+
+// handleStreamLineと同じく、1行を行の長さに合わせたドキュメントでパースする
+void parseLine(const std::string &line, const char *expected, const bool done)
+{
+    ArenaJsonDocument doc(streamLineDocSize(line.size()));
+    stats.documents++;
+    trackUsed();
+    StreamLine parsed;
+    const DeserializationError error = parseStreamLine(doc, line.c_str(), line.size(), parsed);
+    if (nextRandom(4) == 0)
+    {
+        Block field = allocateBlock(64 + nextRandom(512));
+        freeBlock(field);
+    }
+    if (error || parsed.done != done || parsed.text == nullptr || strcmp(parsed.text, expected) != 0)
+    {
+        stats.mismatched++;
+    }
+}
+
+std::string contextArray(const uint32_t count)
+{
+    std::string context = "[";
+    for (uint32_t i = 0; i < count; i++)
+    {
+        context += (i > 0 ? "," : "") + std::to_string(nextRandom(262144));
+    }
+    return context + "]";
+}
+
+// startSummary・finishSummaryと同じく、要約のリクエストを組み立て、応答から要約だけを取り出す
+void summarize()
+{
+    std::string pending;
+    for (const std::string &turn : history_turns)
+    {
+        pending += turn + "\n";
+    }
+    {
+        ArenaJsonDocument request_doc(512 + pending.size());
+        stats.documents++;
+        trackUsed();
+        request_doc["model"] = WORK_MODEL;
+        request_doc["prompt"] = pending;
+        request_doc["stream"] = false;
+        applyWorkOptions(request_doc, 256);
+        request_doc["think"] = false;
+        request_doc["options"]["num_predict"] = 160;
+        std::string body;
+        serializeJson(request_doc, body);
+        if (request_doc.overflowed())
+        {
+            stats.mismatched++;
+        }
+    }
+
+    std::string summary_json;
+    const std::string summary = randomText(20 + nextRandom(100), &summary_json);
+    const std::string response = "{\"model\":\"gemma3:4b\",\"created_at\":\"2025-11-20T10:00:00.000000Z\",\"response\":\"" +
+                                 summary_json + "\",\"done\":true,\"context\":" + contextArray(nextRandom(800)) +
+                                 ",\"eval_count\":160}";
+    StaticJsonDocument<32> filter;
+    filter["response"] = true;
+    ArenaJsonDocument response_doc(response.size() + 256);
+    stats.documents++;
+    trackUsed();
+    const DeserializationError error =
+        deserializeJson(response_doc, response.c_str(), response.size(), DeserializationOption::Filter(filter));
+    const char *parsed = response_doc["response"] | "";
+    if (error || summary != parsed)
+    {
+        stats.mismatched++;
+    }
+    history_turns.clear();
+}
+
+void runInference()
+{
+    const std::string prompt = randomText(5 + nextRandom(40));
+    buildRequest(prompt);
+
+    // 縮めてから解放する領域
+    Block request = allocateBlock(1024 + nextRandom(4096));
+    shrinkBlock(request, request.size / 2);
+    freeBlock(request);
+
+    std::vector<Block> long_lived;
+    std::string answer;
+    const uint32_t lines = 20 + nextRandom(400);
+    for (uint32_t line = 0; line < lines; line++)
+    {
+        // 2つまでにして、領域が戻っていれば推論の間ずっとアリーナに収まる大きさにする
+        if (long_lived.size() < 2 && nextRandom(40) == 0)
+        {
+            long_lived.push_back(allocateBlock(512 + nextRandom(1536)));
+        }
+        const StreamToken &token = STREAM_TOKENS[nextRandom(STREAM_TOKEN_COUNT)];
+        answer += token.text;
+        // /api/generate と /api/chat の行を混ぜる
+        const std::string text = std::string("\"") + token.json + "\"";
+        parseLine(nextRandom(2) == 0 ? "{\"model\":\"gemma3:4b\",\"created_at\":\"2025-11-20T10:00:00.000000Z\","
+                                       "\"response\":" + text + ",\"done\":false}"
+                                     : "{\"model\":\"gemma3:4b\",\"created_at\":\"2025-11-20T10:00:00.000000Z\","
+                                       "\"message\":{\"role\":\"assistant\",\"content\":" + text + "},\"done\":false}",
+                  token.text, false);
+        if (nextRandom(200) == 0)
+        {
+            Block large = allocateBlock(REQUEST_ARENA_SIZE + nextRandom(1024));
+            freeBlock(large);
+        }
+        if (!long_lived.empty() && nextRandom(30) == 0)
+        {
+            // 一番上とは限らないものを解放する
+            const size_t index = nextRandom(long_lived.size());
+            freeBlock(long_lived[index]);
+            long_lived.erase(long_lived.begin() + index);
+        }
+    }
+    // doneの行。/api/generate はトークンの配列（context）がつく
+    parseLine("{\"model\":\"gemma3:4b\",\"created_at\":\"2025-11-20T10:00:00.000000Z\",\"response\":\"\",\"done\":true,"
+              "\"context\":" + contextArray(nextRandom(1200)) + ",\"prompt_eval_count\":38,\"eval_count\":" +
+                  std::to_string(lines) + ",\"eval_duration\":8765432109}",
+              "", true);
+    while (!long_lived.empty())
+    {
+        freeBlock(long_lived.front());
+        long_lived.erase(long_lived.begin());
+    }
+
+    // chat_history.cppと同じく、要約を待つ発話が4KBを超えるか、ときどき要約する
+    history_turns.push_back(prompt);
+    history_turns.push_back(answer);
+    size_t history_bytes = 0;
+    for (const std::string &turn : history_turns)
+    {
+        history_bytes += turn.size();
+    }
+    if (history_bytes > 4096 || nextRandom(20) == 0)
+    {
+        summarize();
+    }
+
+    if (arena.used != 0 || arena.depth != 0)
+    {
+        stats.unreleased++;
+        stats.unreleased_bytes += arena.used;
+    }
+    requestArenaReset();
+    stats.inferences++;
+}
+
+} // namespace
+
+int main(int argc, char **argv)
+{
+    const uint32_t days = argc > 1 ? strtoul(argv[1], nullptr, 10) : 3;
+    const uint32_t per_hour = argc > 2 ? strtoul(argv[2], nullptr, 10) : 360;
+    const uint32_t start_us = micros();
+    for (uint32_t hour = 1; hour <= days * 24; hour++)
+    {
+        stats.peak_used = 0;
+        const uint32_t fallbacks_before = arena.fallbacks;
+        const uint32_t oversized_before = stats.oversized;
+        for (uint32_t i = 0; i < per_hour; i++)
+        {
+            runInference();
+        }
+        printf("{\"hour\":%lu,\"inferences\":%llu,\"largest_free_min\":%lu,\"high_water\":%lu,"
+               "\"fallbacks\":%lu,\"oversized\":%lu,\"unreleased\":%lu,\"corrupted\":%lu,\"mismatched\":%lu}\n",
+               static_cast<unsigned long>(hour), static_cast<unsigned long long>(stats.inferences),
+               static_cast<unsigned long>(REQUEST_ARENA_SIZE - stats.peak_used),
+               static_cast<unsigned long>(arena.high_water),
+               static_cast<unsigned long>(arena.fallbacks - fallbacks_before),
+               static_cast<unsigned long>(stats.oversized - oversized_before),
+               static_cast<unsigned long>(stats.unreleased), static_cast<unsigned long>(stats.corrupted),
+               static_cast<unsigned long>(stats.mismatched));
+    }
+    const bool ok = stats.unreleased == 0 && stats.corrupted == 0 && stats.mismatched == 0;
+    printf("{\"result\":\"%s\",\"days\":%lu,\"inferences\":%llu,\"documents\":%llu,\"allocations\":%llu,"
+           "\"unreleased_bytes\":%lu,\"elapsed_ms\":%lu}\n",
+           ok ? "ok" : "fail", static_cast<unsigned long>(days), static_cast<unsigned long long>(stats.inferences),
+           static_cast<unsigned long long>(stats.documents), static_cast<unsigned long long>(stats.allocations),
+           static_cast<unsigned long>(stats.unreleased_bytes),
+           static_cast<unsigned long>((micros() - start_us) / 1000));
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,238 @@
+// セマンティックキャッシュの検索（src/cache_search.cpp）のベンチマーク
+//   0. 内積の計算（PIEがあればPIE）を通常の計算と比べる。ファームウェアが最初の検索の前に行うものと同じ（cacheCheckDotProduct）
+//      一致しなければ終了コード1。PIEはESP32-S3のみなので、ホストでは通常の計算どうしを比べる
+//   1. 表の大きさ（枠の数）とベクトルの次元数ごとの検索時間。ベクトルは乱数
+//   2. ベクトルのファイルを渡したときは、サンプルのプロンプトを順に引いたときのしきい値ごとのヒット率
+//      ファームウェアと同じく、見つからなければSEMANTIC_CACHE_MAX_ENTRIES枠の表に保存する（一番長く使われていない枠を上書き）
+//      ファイルは embed_prompts.py で corpus/cache_prompts.tsv から作る
+// 結果は1行ずつのJSONで標準出力に出す。時間はホストのCPUのもので、実機の値は [PERF] の cache_search で見る
+//
+// ビルドと実行（stampS3R/test/hostで）
+//   g++ -std=gnu++11 -O2 -Wall -I shim -I ../../src -o cache_search_bench cache_search_bench.cpp
+//   ./cache_search_bench [cache_prompts.vec]
+
+#include "../../src/cache_search.cpp"
+#include "config.h"
+
+#include <string>
+#include <vector>
+
+namespace {
+
+constexpr uint32_t BENCH_CONTEXT_HASH = 0x12345678;
+constexpr size_t BENCH_DIMS[] = {384, 768, 1024};
+constexpr size_t BENCH_SLOTS[] = {8, 16, 32, 64, 128, 256};
+constexpr float BENCH_THRESHOLDS[] = {0.80f, 0.85f, 0.88f, 0.90f, 0.92f, 0.95f};
+// 1つの組み合わせでおよそこのバイト数を走査するまでくり返す
+constexpr size_t BENCH_BYTES_PER_CASE = 256u * 1024 * 1024;
+
+uint32_t random_state = 0x9E3779B9;
+// cacheCheckDotProductで確かめた内積の計算
+const char *dot_kernel = "scalar";
+
+uint32_t nextRandom()
+{
+    random_state ^= random_state << 13;
+    random_state ^= random_state >> 17;
+    random_state ^= random_state << 5;
+    return random_state;
+}
+
+void randomVector(std::vector<float> &vector)
+{
+    for (float &value : vector)
+    {
+        value = static_cast<float>(static_cast<int32_t>(nextRandom() % 2001) - 1000) / 1000.0f;
+    }
+}
+
+void benchSearch(const size_t dims, const size_t slots)
+{
+    const size_t padded_dims = cachePaddedDims(dims);
+    std::vector<CacheEntry> entries(slots);
+    std::vector<int8_t> vectors(slots * padded_dims);
+    std::vector<float> embedding(dims);
+    for (size_t slot = 0; slot < slots; slot++)
+    {
+        randomVector(embedding);
+        entries[slot].context_hash = BENCH_CONTEXT_HASH;
+        entries[slot].sequence = slot + 1;
+        entries[slot].norm = cacheQuantize(embedding.data(), dims, vectors.data() + slot * padded_dims, padded_dims);
+    }
+    std::vector<int8_t> query(padded_dims);
+    randomVector(embedding);
+    const float query_norm = cacheQuantize(embedding.data(), dims, query.data(), padded_dims);
+
+    const size_t repeats = BENCH_BYTES_PER_CASE / (slots * padded_dims) + 1;
+    int checksum = 0;
+    const unsigned long start_us = micros();
+    for (size_t i = 0; i < repeats; i++)
+    {
+        // 毎回1要素だけ変えて、検索を外に出されないようにする
+        query[i % dims] = static_cast<int8_t>(i);
+        checksum += cacheSearch(entries.data(), vectors.data(), slots, padded_dims, BENCH_CONTEXT_HASH, query.data(),
+                                query_norm)
+                        .slot;
+    }
+    const double elapsed_ns = (micros() - start_us) * 1000.0;
+    printf("{\"bench\":\"cache_search\",\"kernel\":\"%s\",\"dims\":%lu,\"slots\":%lu,\"repeats\":%lu,\"ns_per_search\":%.1f,"
+           "\"ns_per_slot\":%.2f,\"bytes_per_ns\":%.3f,\"checksum\":%d}\n",
+           dot_kernel, static_cast<unsigned long>(dims), static_cast<unsigned long>(slots),
+           static_cast<unsigned long>(repeats), elapsed_ns / repeats, elapsed_ns / (repeats * slots),
+           static_cast<double>(repeats) * slots * padded_dims / elapsed_ns, checksum);
+}
+
+struct Prompt
+{
+    std::string group;
+    std::vector<float> embedding;
+};
+
+bool readPrompts(const char *path, std::vector<Prompt> &prompts)
+{
+    FILE *file = fopen(path, "r");
+    if (file == nullptr)
+    {
+        fprintf(stderr, "Cannot open %s\n", path);
+        return false;
+    }
+    std::string line;
+    int c;
+    while ((c = fgetc(file)) != EOF)
+    {
+        if (c != '\n')
+        {
+            line += static_cast<char>(c);
+            continue;
+        }
+        const size_t tab = line.find('\t');
+        if (tab != std::string::npos)
+        {
+            Prompt prompt;
+            prompt.group = line.substr(0, tab);
+            const char *p = line.c_str() + tab + 1;
+            char *end;
+            for (float value = strtof(p, &end); end != p; value = strtof(p, &end))
+            {
+                prompt.embedding.push_back(value);
+                p = end;
+            }
+            prompts.push_back(prompt);
+        }
+        line.clear();
+    }
+    fclose(file);
+    return !prompts.empty();
+}
+
+void benchHitRate(const std::vector<Prompt> &prompts, const float threshold)
+{
+    const size_t dims = prompts[0].embedding.size();
+    const size_t padded_dims = cachePaddedDims(dims);
+    const size_t slots = SEMANTIC_CACHE_MAX_ENTRIES;
+    std::vector<CacheEntry> entries(slots);
+    std::vector<int8_t> vectors(slots * padded_dims);
+    std::vector<std::string> slot_groups(slots);
+    std::vector<int8_t> query(padded_dims);
+    std::vector<std::string> seen;
+    uint32_t sequence = 0;
+    size_t hits = 0;
+    size_t false_hits = 0;
+    size_t expected = 0; // 同じグループのプロンプトが前にあったもの
+    size_t skipped = 0;
+    unsigned long search_us = 0;
+
+    for (const Prompt &prompt : prompts)
+    {
+        if (prompt.embedding.size() != dims)
+        {
+            skipped++;
+            continue;
+        }
+        bool repeated = false;
+        for (const std::string &group : seen)
+        {
+            repeated = repeated || group == prompt.group;
+        }
+        if (repeated)
+        {
+            expected++;
+        }
+        else
+        {
+            seen.push_back(prompt.group);
+        }
+
+        const float query_norm = cacheQuantize(prompt.embedding.data(), dims, query.data(), padded_dims);
+        const unsigned long start_us = micros();
+        const CacheSearchResult found = cacheSearch(entries.data(), vectors.data(), slots, padded_dims,
+                                                    BENCH_CONTEXT_HASH, query.data(), query_norm);
+        search_us += micros() - start_us;
+        if (found.slot >= 0 && found.similarity >= threshold)
+        {
+            if (slot_groups[found.slot] == prompt.group)
+            {
+                hits++;
+            }
+            else
+            {
+                false_hits++;
+            }
+            entries[found.slot].sequence = ++sequence;
+            continue;
+        }
+        const size_t slot = cacheVictimSlot(entries.data(), slots);
+        entries[slot].context_hash = BENCH_CONTEXT_HASH;
+        entries[slot].sequence = ++sequence;
+        entries[slot].norm = query_norm;
+        memcpy(vectors.data() + slot * padded_dims, query.data(), padded_dims);
+        slot_groups[slot] = prompt.group;
+    }
+    const size_t looked_up = prompts.size() - skipped;
+    printf("{\"bench\":\"cache_hit_rate\",\"threshold\":%.2f,\"dims\":%lu,\"slots\":%lu,\"prompts\":%lu,"
+           "\"skipped\":%lu,\"hits\":%lu,\"false_hits\":%lu,\"expected_hits\":%lu,\"hit_rate\":%.3f,"
+           "\"recall\":%.3f,\"us_per_search\":%.2f}\n",
+           threshold, static_cast<unsigned long>(dims), static_cast<unsigned long>(slots),
+           static_cast<unsigned long>(looked_up), static_cast<unsigned long>(skipped),
+           static_cast<unsigned long>(hits), static_cast<unsigned long>(false_hits),
+           static_cast<unsigned long>(expected), looked_up > 0 ? static_cast<double>(hits) / looked_up : 0.0,
+           expected > 0 ? static_cast<double>(hits) / expected : 0.0,
+           looked_up > 0 ? static_cast<double>(search_us) / looked_up : 0.0);
+}
+
+} // namespace
+
+int main(int argc, char **argv)
+{
+    const CacheDotProductCheck check = cacheCheckDotProduct();
+    printf("{\"bench\":\"cache_dot_check\",\"kernel\":\"%s\",\"ok\":%s,\"scalar_ns\":%lu,\"kernel_ns\":%lu}\n",
+           check.kernel, check.ok ? "true" : "false", static_cast<unsigned long>(check.scalar_ns),
+           static_cast<unsigned long>(check.kernel_ns));
+    if (!check.ok)
+    {
+        return 1;
+    }
+    dot_kernel = check.kernel;
+    for (const size_t dims : BENCH_DIMS)
+    {
+        for (const size_t slots : BENCH_SLOTS)
+        {
+            benchSearch(dims, slots);
+        }
+    }
+    if (argc < 2)
+    {
+        fprintf(stderr, "No vector file given, skipping the hit rate (see embed_prompts.py)\n");
+        return 0;
+    }
+    std::vector<Prompt> prompts;
+    if (!readPrompts(argv[1], prompts))
+    {
+        return 1;
+    }
+    for (const float threshold : BENCH_THRESHOLDS)
+    {
+        benchHitRate(prompts, threshold);
+    }
+    return 0;
+}
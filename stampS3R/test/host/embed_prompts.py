@@ -0,0 +1,59 @@
+#!/usr/bin/env python3
+# embed_prompts.py
+# Python 3.8+（標準ライブラリのみ）
+#
+# cache_search_bench の類似度のベンチマークに使う、プロンプトのベクトルを用意する
+# corpus/cache_prompts.tsv（1行に「グループ<TAB>プロンプト」）の各プロンプトを
+# Ollamaの /api/embed でベクトルにして、1行に「グループ<TAB>値 値 ...」で書き出す
+#
+#   python3 embed_prompts.py --host 192.168.1.10 --model nomic-embed-text corpus/cache_prompts.tsv cache_prompts.vec
+
+import argparse
+import json
+import sys
+import urllib.request
+
+BATCH_SIZE = 16
+
+
+def read_prompts(path):
+    prompts = []
+    with open(path, encoding="utf-8") as f:
+        for line in f:
+            line = line.rstrip("\n")
+            if not line or line.startswith("#"):
+                continue
+            group, prompt = line.split("\t", 1)
+            prompts.append((group, prompt))
+    return prompts
+
+
+def embed(url, model, texts):
+    body = json.dumps({"model": model, "input": texts}).encode("utf-8")
+    request = urllib.request.Request(url, data=body, headers={"Content-Type": "application/json"})
+    with urllib.request.urlopen(request) as response:
+        return json.load(response)["embeddings"]
+
+
+def main():
+    parser = argparse.ArgumentParser(description="プロンプトのベクトルをOllamaで計算して保存する")
+    parser.add_argument("prompts", help="グループ<TAB>プロンプト の行のファイル")
+    parser.add_argument("output", help="書き出すファイル")
+    parser.add_argument("--host", default="localhost")
+    parser.add_argument("--port", type=int, default=11434)
+    parser.add_argument("--model", default="nomic-embed-text", help="ファームウェアの SEMANTIC_CACHE_EMBED_MODEL と同じにする")
+    args = parser.parse_args()
+
+    prompts = read_prompts(args.prompts)
+    url = "http://%s:%d/api/embed" % (args.host, args.port)
+    with open(args.output, "w", encoding="utf-8") as out:
+        for start in range(0, len(prompts), BATCH_SIZE):
+            batch = prompts[start:start + BATCH_SIZE]
+            vectors = embed(url, args.model, [prompt for _, prompt in batch])
+            for (group, _), vector in zip(batch, vectors):
+                out.write(group + "\t" + " ".join("%.7g" % value for value in vector) + "\n")
+    print("%d prompts -> %s" % (len(prompts), args.output), file=sys.stderr)
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,461 @@
+// Coreとのフレームとバックエンドの応答の解析・組み立て（src/protocol.cpp）のベンチマーク
+// 通信のキャプチャ（CAPTURE_MODE）と同じ形式のログを読み、記録ごとにファームウェアと同じ関数を通す
+//   - rx: Coreからのフレームを1文字ずつjsonFrameFeedに渡し、コマンドごとのフィルタでパースする（readJsonMessage）
+//   - res（/api/generate・/api/chatのストリームの1行）: parseStreamLineでパースする（handleStreamLine）
+//     出力はllm.utf-8.streamの返答に組み立てる（sendStreamDeltaとsendToM5）
+//   - res（/api/tagsの応答）: parseTagsとfindTagsModelで最後のモデルを探す（llm_setup）
+// ログごと・処理ごとに、1フレーム（1行）あたりの時間、サイクル数（x86のみ）、ヒープの確保の回数とバイト数を
+// 1行のJSONで標準出力に出す。ArduinoJsonの版と、ログがcorpus/の想定して作ったものか（synthetic）も添える
+// ヒープの確保はmalloc・calloc・reallocを置き換えて数える（Linuxのglibcのみ）
+// アリーナの中の確保は数えない。時間はホストのCPUのもので、実機の値は [PERF] の read_json_message などで見る
+// corpus/*.jsonl は実機の記録ではなく、日本語や絵文字の多い応答、モデルの多い/api/tags、base64の大きいフレームを
+// 想定して作ったもの。CAPTURE_MODEで記録したログ（USBシリアルの [CAP] の行のままでもよい）も渡せる
+//
+// ビルドと実行（stampS3R/test/hostで。ArduinoJsonは pio run で取得した、ファームウェアと同じ版を使う）
+//   g++ -std=gnu++11 -O2 -Wall -I shim -I ../../src -I ../../.pio/libdeps/m5stack-stamps3/ArduinoJson/src -o protocol_bench protocol_bench.cpp
+//   ./protocol_bench [ログ...]（省略するとcorpus/の4つ）
+
+#include "../../src/arena.cpp"
+#include "../../src/json_fields.cpp"
+#include "../../src/protocol.cpp"
+
+#include <string>
+#include <vector>
+
+// 数字はパーサーで変わるので、ファームウェアと同じArduinoJson（platformio.iniで^6.21に固定）でしか測らない
+#if ARDUINOJSON_VERSION_MAJOR != 6 || ARDUINOJSON_VERSION_MINOR < 21
+#error "protocol_bench must be built against ArduinoJson ^6.21, the version pinned in platformio.ini"
+#endif
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define BENCH_HAS_CYCLES 1
+#else
+#define BENCH_HAS_CYCLES 0
+#endif
+
+// ヒープの確保を数える
+namespace {
+
+uint64_t heap_allocations = 0;
+uint64_t heap_bytes = 0;
+
+} // namespace
+
+extern "C" {
+
+void *__libc_malloc(size_t size);
+void *__libc_calloc(size_t count, size_t size);
+void *__libc_realloc(void *ptr, size_t size);
+
+void *malloc(size_t size)
+{
+    heap_allocations++;
+    heap_bytes += size;
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t count, size_t size)
+{
+    heap_allocations++;
+    heap_bytes += count * size;
+    return __libc_calloc(count, size);
+}
+
+void *realloc(void *ptr, size_t size)
+{
+    heap_allocations++;
+    heap_bytes += size;
+    return __libc_realloc(ptr, size);
+}
+
+} // extern "C"
+
+namespace {
+
+const char *const DEFAULT_CORPORA[] = {"corpus/uart_frames.jsonl", "corpus/stream_generate_ja.jsonl",
+                                       "corpus/stream_chat_emoji.jsonl", "corpus/tags_large.jsonl"};
+// 測っているログがcorpus/の想定して作ったものか（引数で渡したキャプチャならfalse）
+bool corpus_synthetic = true;
+// 1つの処理をおよそこの時間になるまでくり返す
+constexpr uint64_t BENCH_MIN_NS = 200ULL * 1000 * 1000;
+
+// キャプチャの1行
+struct Record
+{
+    std::string channel; // rx・tx・req・status・res
+    std::string path;    // reqのみ（"POST /api/generate" など）
+    std::string data;
+};
+
+void collectRecordField(void *context, const JsonField &field)
+{
+    Record &record = *static_cast<Record *>(context);
+    if (strcmp(field.key, "c") == 0)
+    {
+        record.channel = field.value;
+    }
+    else if (strcmp(field.key, "p") == 0)
+    {
+        record.path = field.value;
+    }
+    else if (strcmp(field.key, "d") == 0)
+    {
+        record.data = field.value;
+    }
+}
+
+bool readRecords(const char *path, std::vector<Record> &records)
+{
+    FILE *file = fopen(path, "r");
+    if (file == nullptr)
+    {
+        fprintf(stderr, "Cannot open %s\n", path);
+        return false;
+    }
+    std::string line;
+    int c;
+    while ((c = fgetc(file)) != EOF)
+    {
+        if (c != '\n')
+        {
+            line += static_cast<char>(c);
+            continue;
+        }
+        // 行頭の [CAP] などはルートの { まで読み飛ばされる
+        if (!line.empty() && line[0] != '#')
+        {
+            Record record;
+            JsonFieldSplitter splitter;
+            jsonFieldsBegin(splitter);
+            jsonFieldsFeed(splitter, line.c_str(), line.size(), collectRecordField, &record);
+            if (jsonFieldsDone(splitter) && !record.channel.empty())
+            {
+                records.push_back(record);
+            }
+        }
+        line.clear();
+    }
+    fclose(file);
+    return true;
+}
+
+// ログから取り出した、処理ごとの入力
+struct Frames
+{
+    std::vector<std::string> rx;
+    std::vector<std::string> stream_lines;
+    std::vector<std::string> tags;
+};
+
+void splitRecords(const std::vector<Record> &records, Frames &frames)
+{
+    // resはその前のreqのパスで振り分ける
+    std::string request_path;
+    for (const Record &record : records)
+    {
+        if (record.channel == "rx")
+        {
+            frames.rx.push_back(record.data);
+        }
+        else if (record.channel == "req")
+        {
+            request_path = record.path;
+        }
+        else if (record.channel == "res")
+        {
+            if (request_path.find("/api/tags") != std::string::npos)
+            {
+                frames.tags.push_back(record.data);
+            }
+            else if (request_path.find("/api/generate") != std::string::npos ||
+                     request_path.find("/api/chat") != std::string::npos)
+            {
+                frames.stream_lines.push_back(record.data);
+            }
+        }
+    }
+}
+
+uint64_t nowNs()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch())
+        .count();
+}
+
+uint64_t readCycles()
+{
+#if BENCH_HAS_CYCLES
+    return __rdtsc();
+#else
+    return 0;
+#endif
+}
+
+struct BenchResult
+{
+    uint64_t repeats;
+    uint64_t ns;
+    uint64_t cycles;
+    uint64_t allocations;
+    uint64_t bytes;
+    uint32_t errors; // 1回目の通しでの失敗の数
+};
+
+// runは全フレームを1回通し、失敗の数を返す
+template <typename Run>
+BenchResult measure(Run run)
+{
+    BenchResult result = {};
+    const uint64_t allocations_before = heap_allocations;
+    const uint64_t bytes_before = heap_bytes;
+    const uint64_t start_cycles = readCycles();
+    const uint64_t start_ns = nowNs();
+    do
+    {
+        const uint32_t errors = run();
+        if (result.repeats++ == 0)
+        {
+            result.errors = errors;
+        }
+        result.ns = nowNs() - start_ns;
+    } while (result.ns < BENCH_MIN_NS);
+    result.cycles = readCycles() - start_cycles;
+    result.allocations = heap_allocations - allocations_before;
+    result.bytes = heap_bytes - bytes_before;
+    return result;
+}
+
+size_t totalBytes(const std::vector<std::string> &frames)
+{
+    size_t total = 0;
+    for (const std::string &frame : frames)
+    {
+        total += frame.size();
+    }
+    return total;
+}
+
+void printResult(const char *bench, const char *corpus, const size_t frames, const size_t bytes,
+                 const BenchResult &result)
+{
+    const double count = static_cast<double>(result.repeats) * frames;
+    char cycles[32];
+    if (BENCH_HAS_CYCLES)
+    {
+        snprintf(cycles, sizeof(cycles), "%.0f", result.cycles / count);
+    }
+    else
+    {
+        snprintf(cycles, sizeof(cycles), "null");
+    }
+    printf("{\"bench\":\"%s\",\"corpus\":\"%s\",\"synthetic\":%s,\"arduinojson\":\"%s\",\"frames\":%lu,\"bytes_per_frame\":%.0f,\"repeats\":%llu,"
+           "\"ns_per_frame\":%.1f,\"cycles_per_frame\":%s,\"allocs_per_frame\":%.2f,\"alloc_bytes_per_frame\":%.1f,"
+           "\"errors\":%lu}\n",
+           bench, corpus, corpus_synthetic ? "true" : "false", ARDUINOJSON_VERSION, static_cast<unsigned long>(frames), static_cast<double>(bytes) / frames,
+           static_cast<unsigned long long>(result.repeats), result.ns / count, cycles, result.allocations / count,
+           result.bytes / count, static_cast<unsigned long>(result.errors));
+}
+
+// main.cppのCOMMAND_LISTと同じ、コマンドごとのdataの範囲
+CommandData benchCommandData(const char *work_id, const char *action)
+{
+    if (strcmp(action, "setup") == 0)
+    {
+        return COMMAND_DATA_ALL;
+    }
+    if (strcmp(action, "inference") == 0)
+    {
+        // embedのinferenceはdataが文字列のこともある
+        return strncmp(work_id, "embed_", 6) == 0 ? COMMAND_DATA_ALL : COMMAND_DATA_STREAM;
+    }
+    return COMMAND_DATA_NONE;
+}
+
+StaticJsonDocument<256> command_filters[COMMAND_DATA_KINDS];
+
+// main.cppのselectCommandFilterと同じく、パースする前にwork_idとactionを読んでフィルタを選ぶ
+const JsonDocument *benchSelectCommandFilter(const char *frame)
+{
+    char work_id[32];
+    char action[32];
+    if (!jsonFrameFindString(frame, "work_id", work_id, sizeof(work_id)) ||
+        !jsonFrameFindString(frame, "action", action, sizeof(action)))
+    {
+        return &command_filters[COMMAND_DATA_ALL];
+    }
+    return &command_filters[benchCommandData(work_id, action)];
+}
+
+// readJsonMessageと同じく、フレームを1文字ずつ切り出してパースする
+void benchReadJsonMessage(const char *corpus, const std::vector<std::string> &rx)
+{
+    static JsonFrameScanner scanner;
+    static StaticJsonDocument<JSON_BUFFER_SIZE> doc;
+    for (size_t i = 0; i < COMMAND_DATA_KINDS; i++)
+    {
+        buildCommandFilter(command_filters[i], static_cast<CommandData>(i));
+    }
+    const BenchResult result = measure([&]() {
+        uint32_t errors = 0;
+        for (const std::string &frame : rx)
+        {
+            jsonFrameReset(scanner);
+            JsonFrameStatus status = JSON_FRAME_PENDING;
+            for (size_t i = 0; i < frame.size() && status == JSON_FRAME_PENDING; i++)
+            {
+                status = jsonFrameFeed(scanner, frame[i]);
+            }
+            if (status != JSON_FRAME_COMPLETE)
+            {
+                errors++;
+                continue;
+            }
+            char *text = jsonFrameText(scanner);
+            if (deserializeJson(doc, text, DeserializationOption::Filter(*benchSelectCommandFilter(text))))
+            {
+                errors++;
+            }
+        }
+        return errors;
+    });
+    printResult("read_json_message", corpus, rx.size(), totalBytes(rx), result);
+}
+
+// handleStreamLineと同じく、1行ごとにアリーナのドキュメントでパースする
+void benchStreamLine(const char *corpus, const std::vector<std::string> &lines)
+{
+    const BenchResult result = measure([&]() {
+        uint32_t errors = 0;
+        for (const std::string &line : lines)
+        {
+            ArenaJsonDocument doc(streamLineDocSize(line.size()));
+            StreamLine parsed;
+            if (parseStreamLine(doc, line.c_str(), line.size(), parsed))
+            {
+                errors++;
+            }
+        }
+        requestArenaReset();
+        return errors;
+    });
+    printResult("stream_line", corpus, lines.size(), totalBytes(lines), result);
+}
+
+// sendStreamDeltaと同じく、出力の1チャンクごとに返答を組み立てる（最後はfinishの空のフレーム）
+void benchSendToM5(const char *corpus, const std::vector<std::string> &lines)
+{
+    std::vector<std::string> deltas;
+    for (const std::string &line : lines)
+    {
+        ArenaJsonDocument doc(streamLineDocSize(line.size()));
+        StreamLine parsed;
+        if (!parseStreamLine(doc, line.c_str(), line.size(), parsed) && parsed.text != nullptr &&
+            parsed.text[0] != '\0')
+        {
+            deltas.push_back(parsed.text);
+        }
+    }
+    requestArenaReset();
+    deltas.push_back("");
+
+    static ResponseJson response_json;
+    const BenchResult result = measure([&]() {
+        uint32_t errors = 0;
+        for (size_t i = 0; i < deltas.size(); i++)
+        {
+            ResponseMsg_t response_msg;
+            response_msg.request_id = "llm_inference";
+            response_msg.work_id = "llm_12345";
+            response_msg.object = "llm.utf-8.stream";
+            response_msg.error.code = 0;
+            response_msg.error.message = "";
+            response_msg.inference_data.delta = deltas[i].c_str();
+            response_msg.inference_data.index = 0;
+            response_msg.inference_data.finish = i + 1 == deltas.size();
+            if (!buildResponseJson(response_json, response_msg))
+            {
+                errors++;
+            }
+        }
+        return errors;
+    });
+    printResult("send_to_m5", corpus, deltas.size(), totalBytes(deltas), result);
+}
+
+// llm_setupと同じく、/api/tagsの応答から指定のモデルを探す。一番後ろのモデルを探す（全部を見る）
+void benchTags(const char *corpus, const std::vector<std::string> &bodies)
+{
+    std::vector<std::string> targets;
+    for (const std::string &body : bodies)
+    {
+        StaticJsonDocument<TAGS_DOC_SIZE> doc;
+        std::string target;
+        if (!parseTags(doc, body.c_str(), body.size()))
+        {
+            for (JsonObjectConst model : doc["models"].as<JsonArrayConst>())
+            {
+                const char *name = model["name"].as<const char *>();
+                target = name != nullptr ? name : "";
+            }
+        }
+        targets.push_back(target);
+    }
+
+    const BenchResult result = measure([&]() {
+        uint32_t errors = 0;
+        for (size_t i = 0; i < bodies.size(); i++)
+        {
+            StaticJsonDocument<TAGS_DOC_SIZE> doc;
+            if (parseTags(doc, bodies[i].c_str(), bodies[i].size()) ||
+                findTagsModel(doc, targets[i].c_str()) != TAGS_MODEL_FOUND)
+            {
+                errors++;
+            }
+        }
+        return errors;
+    });
+    printResult("api_tags", corpus, bodies.size(), totalBytes(bodies), result);
+}
+
+} // namespace
+
+int main(int argc, char **argv)
+{
+    std::vector<const char *> paths;
+    for (int i = 1; i < argc; i++)
+    {
+        paths.push_back(argv[i]);
+    }
+    corpus_synthetic = paths.empty();
+    if (paths.empty())
+    {
+        paths.assign(DEFAULT_CORPORA, DEFAULT_CORPORA + sizeof(DEFAULT_CORPORA) / sizeof(DEFAULT_CORPORA[0]));
+    }
+    for (const char *path : paths)
+    {
+        std::vector<Record> records;
+        if (!readRecords(path, records))
+        {
+            return 1;
+        }
+        Frames frames;
+        splitRecords(records, frames);
+        const char *slash = strrchr(path, '/');
+        const char *corpus = slash != nullptr ? slash + 1 : path;
+        if (!frames.rx.empty())
+        {
+            benchReadJsonMessage(corpus, frames.rx);
+        }
+        if (!frames.stream_lines.empty())
+        {
+            benchStreamLine(corpus, frames.stream_lines);
+            benchSendToM5(corpus, frames.stream_lines);
+        }
+        if (!frames.tags.empty())
+        {
+            benchTags(corpus, frames.tags);
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,241 @@
+#ifndef HOST_ARDUINO_H
+#define HOST_ARDUINO_H
+
+// ホスト（Linux）でテスト・ベンチマークをビルドするための最小限のArduino.h
+// ハードウェアを使わないモジュールが使う分だけを標準ライブラリで置き換える
+// Serialの出力は標準エラーに出す（標準出力は結果のJSONに使う）
+
+#include <chrono>
+#include <cctype>
+#include <cmath>
+#include <cstdarg>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <thread>
+
+class String
+{
+public:
+    String() {}
+    String(const char *text) : value_(text != nullptr ? text : "") {}
+    String(const char *text, const size_t length) : value_(text, length) {}
+    explicit String(const char c) : value_(1, c) {}
+    explicit String(const int value) : value_(std::to_string(value)) {}
+    explicit String(const unsigned value) : value_(std::to_string(value)) {}
+    explicit String(const long value) : value_(std::to_string(value)) {}
+    explicit String(const unsigned long value) : value_(std::to_string(value)) {}
+
+    unsigned length() const
+    {
+        return value_.size();
+    }
+    const char *c_str() const
+    {
+        return value_.c_str();
+    }
+    bool reserve(const unsigned size)
+    {
+        value_.reserve(size);
+        return true;
+    }
+    bool concat(const char *text)
+    {
+        value_ += text;
+        return true;
+    }
+    bool concat(const char *text, const unsigned length)
+    {
+        value_.append(text, length);
+        return true;
+    }
+    bool concat(const String &text)
+    {
+        value_ += text.value_;
+        return true;
+    }
+    bool concat(const char c)
+    {
+        value_ += c;
+        return true;
+    }
+
+    String &operator=(const char *text)
+    {
+        value_ = text != nullptr ? text : "";
+        return *this;
+    }
+    String &operator+=(const String &text)
+    {
+        concat(text);
+        return *this;
+    }
+    String &operator+=(const char *text)
+    {
+        concat(text);
+        return *this;
+    }
+    String &operator+=(const char c)
+    {
+        concat(c);
+        return *this;
+    }
+
+    char operator[](const unsigned index) const
+    {
+        return index < value_.size() ? value_[index] : '\0';
+    }
+    char &operator[](const unsigned index)
+    {
+        return value_[index];
+    }
+    bool operator==(const String &other) const
+    {
+        return value_ == other.value_;
+    }
+    bool operator==(const char *other) const
+    {
+        return value_ == other;
+    }
+    bool operator!=(const String &other) const
+    {
+        return value_ != other.value_;
+    }
+    bool operator!=(const char *other) const
+    {
+        return value_ != other;
+    }
+
+    String substring(const unsigned from, const unsigned to) const
+    {
+        return from < to && from < value_.size() ? String(value_.substr(from, to - from).c_str()) : String();
+    }
+    String substring(const unsigned from) const
+    {
+        return substring(from, value_.size());
+    }
+    int indexOf(const char c, const unsigned from = 0) const
+    {
+        const size_t position = value_.find(c, from);
+        return position == std::string::npos ? -1 : static_cast<int>(position);
+    }
+    int indexOf(const char *text, const unsigned from = 0) const
+    {
+        const size_t position = value_.find(text, from);
+        return position == std::string::npos ? -1 : static_cast<int>(position);
+    }
+    bool startsWith(const String &prefix) const
+    {
+        return value_.compare(0, prefix.value_.size(), prefix.value_) == 0;
+    }
+    void remove(const unsigned index, const unsigned count = 0xFFFFFFFF)
+    {
+        if (index < value_.size())
+        {
+            value_.erase(index, count);
+        }
+    }
+    void trim()
+    {
+        const size_t first = value_.find_first_not_of(" \t\r\n");
+        const size_t last = value_.find_last_not_of(" \t\r\n");
+        value_ = first == std::string::npos ? std::string() : value_.substr(first, last - first + 1);
+    }
+    long toInt() const
+    {
+        return strtol(value_.c_str(), nullptr, 10);
+    }
+
+private:
+    std::string value_;
+};
+
+// Arduinoでは連結の途中の型。ARDUINOJSON_ENABLE_ARDUINO_STRINGのArduinoJsonがStringと一緒に参照する
+class StringSumHelper : public String
+{
+public:
+    StringSumHelper(const String &text) : String(text) {}
+};
+
+inline String operator+(const String &a, const String &b)
+{
+    String result(a);
+    result += b;
+    return result;
+}
+
+inline String operator+(const String &a, const char *b)
+{
+    String result(a);
+    result += b;
+    return result;
+}
+
+inline String operator+(const char *a, const String &b)
+{
+    String result(a);
+    result += b;
+    return result;
+}
+
+class HostSerial
+{
+public:
+    size_t print(const char *text)
+    {
+        return fputs(text, stderr) >= 0 ? strlen(text) : 0;
+    }
+    size_t print(const String &text)
+    {
+        return print(text.c_str());
+    }
+    size_t println(const char *text = "")
+    {
+        const size_t written = print(text);
+        fputc('\n', stderr);
+        return written + 1;
+    }
+    size_t println(const String &text)
+    {
+        return println(text.c_str());
+    }
+    size_t println(const long value)
+    {
+        return println(String(value));
+    }
+    size_t write(const char *data, const size_t length)
+    {
+        return fwrite(data, 1, length, stderr);
+    }
+    size_t printf(const char *format, ...) __attribute__((format(printf, 2, 3)))
+    {
+        va_list args;
+        va_start(args, format);
+        const int written = vfprintf(stderr, format, args);
+        va_end(args);
+        return written > 0 ? written : 0;
+    }
+};
+
+static HostSerial Serial __attribute__((unused));
+
+inline unsigned long micros()
+{
+    static const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    return static_cast<unsigned long>(
+        std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count());
+}
+
+inline unsigned long millis()
+{
+    return micros() / 1000;
+}
+
+inline void delay(const unsigned long ms)
+{
+    std::this_thread::sleep_for(std::chrono::milliseconds(ms));
+}
+
+#endif // HOST_ARDUINO_H
@@ -0,0 +1,15 @@
+#ifndef HOST_FASTLED_H
+#define HOST_FASTLED_H
+
+// common.hのLEDの宣言を通すための色の型だけ
+
+#include <Arduino.h>
+
+struct CRGB
+{
+    uint8_t r;
+    uint8_t g;
+    uint8_t b;
+};
+
+#endif // HOST_FASTLED_H
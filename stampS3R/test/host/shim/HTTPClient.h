@@ -0,0 +1,33 @@
+#ifndef HOST_HTTPCLIENT_H
+#define HOST_HTTPCLIENT_H
+
+// ホストでは使わない。どのリクエストも接続できなかったことにする（推論のストリームはhttp_streamを使う）
+
+#include "WiFi.h"
+
+class HTTPClient
+{
+public:
+    bool begin(const String &url)
+    {
+        return false;
+    }
+    void addHeader(const String &name, const String &value) {}
+    void setTimeout(const uint16_t timeout_ms) {}
+    void setConnectTimeout(const int32_t timeout_ms) {}
+    int GET()
+    {
+        return -1;
+    }
+    int POST(const String &body)
+    {
+        return -1;
+    }
+    String getString()
+    {
+        return String();
+    }
+    void end() {}
+};
+
+#endif // HOST_HTTPCLIENT_H
@@ -0,0 +1,8 @@
+#ifndef HOST_M5UNIFIED_H
+#define HOST_M5UNIFIED_H
+
+// ホストでは使わない（インクルードだけ通す）
+
+#include <Arduino.h>
+
+#endif // HOST_M5UNIFIED_H
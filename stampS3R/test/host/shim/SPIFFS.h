@@ -0,0 +1,8 @@
+#ifndef HOST_SPIFFS_H
+#define HOST_SPIFFS_H
+
+// ホストでは使わない（インクルードだけ通す）
+
+#include <Arduino.h>
+
+#endif // HOST_SPIFFS_H
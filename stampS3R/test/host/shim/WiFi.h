@@ -0,0 +1,184 @@
+#ifndef HOST_WIFI_H
+#define HOST_WIFI_H
+
+// ホスト（Linux）用のWiFiClient。POSIXのソケットでTCPをつなぐ
+// ホスト名は見ずに、いつもループバック（127.0.0.1）のそのポートにつなぐ（secrets.hのHOST_IPはプレースホルダのため）
+// WiFi（接続の管理）はinit_communicationをビルドするためだけのもので、何もしない
+
+#include <Arduino.h>
+#include <arpa/inet.h>
+#include <cerrno>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+class WiFiClient
+{
+public:
+    WiFiClient() : fd_(-1) {}
+    ~WiFiClient()
+    {
+        stop();
+    }
+    WiFiClient(const WiFiClient &) = delete;
+    WiFiClient &operator=(const WiFiClient &) = delete;
+
+    int connect(const char *host, const uint16_t port, const int32_t timeout_ms)
+    {
+        stop();
+        fd_ = socket(AF_INET, SOCK_STREAM, 0);
+        if (fd_ < 0)
+        {
+            return 0;
+        }
+        sockaddr_in address;
+        memset(&address, 0, sizeof(address));
+        address.sin_family = AF_INET;
+        address.sin_port = htons(port);
+        address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+        // タイムアウトつきで接続する
+        fcntl(fd_, F_SETFL, fcntl(fd_, F_GETFL) | O_NONBLOCK);
+        if (::connect(fd_, reinterpret_cast<sockaddr *>(&address), sizeof(address)) < 0 && errno != EINPROGRESS)
+        {
+            stop();
+            return 0;
+        }
+        pollfd target = {fd_, POLLOUT, 0};
+        int error = 0;
+        socklen_t error_length = sizeof(error);
+        if (poll(&target, 1, timeout_ms) != 1 || getsockopt(fd_, SOL_SOCKET, SO_ERROR, &error, &error_length) < 0 ||
+            error != 0)
+        {
+            stop();
+            return 0;
+        }
+        fcntl(fd_, F_SETFL, fcntl(fd_, F_GETFL) & ~O_NONBLOCK);
+        return 1;
+    }
+
+    int fd() const
+    {
+        return fd_;
+    }
+    int setNoDelay(const bool enable)
+    {
+        const int value = enable ? 1 : 0;
+        return setsockopt(fd_, IPPROTO_TCP, TCP_NODELAY, &value, sizeof(value));
+    }
+
+    // 受信済みでまだ読んでいないバイト数
+    int available()
+    {
+        int pending = 0;
+        if (fd_ < 0 || ioctl(fd_, FIONREAD, &pending) < 0)
+        {
+            return 0;
+        }
+        return pending;
+    }
+
+    // 受信済みの分だけ読む（待たない）。何もなければ-1
+    int read(uint8_t *buffer, const size_t size)
+    {
+        if (fd_ < 0)
+        {
+            return -1;
+        }
+        const ssize_t n = recv(fd_, buffer, size, MSG_DONTWAIT);
+        return n > 0 ? static_cast<int>(n) : -1;
+    }
+
+    size_t write(const uint8_t *data, const size_t length)
+    {
+        size_t written = 0;
+        while (fd_ >= 0 && written < length)
+        {
+            const ssize_t n = send(fd_, data + written, length - written, MSG_NOSIGNAL);
+            if (n <= 0)
+            {
+                break;
+            }
+            written += n;
+        }
+        return written;
+    }
+
+    // 相手が閉じていなければtrue（未読のデータがあれば閉じていてもtrue）
+    uint8_t connected()
+    {
+        if (fd_ < 0)
+        {
+            return 0;
+        }
+        uint8_t c;
+        const ssize_t n = recv(fd_, &c, 1, MSG_PEEK | MSG_DONTWAIT);
+        return n > 0 || (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) ? 1 : 0;
+    }
+
+    void stop()
+    {
+        if (fd_ >= 0)
+        {
+            close(fd_);
+            fd_ = -1;
+        }
+    }
+
+private:
+    int fd_;
+};
+
+struct IPAddress
+{
+    String toString() const
+    {
+        return "127.0.0.1";
+    }
+    operator String() const
+    {
+        return toString();
+    }
+};
+
+enum wifi_mode_t
+{
+    WIFI_MODE_STA,
+    WIFI_MODE_AP
+};
+
+enum wl_status_t
+{
+    WL_CONNECTED = 3
+};
+
+class WiFiClass
+{
+public:
+    void mode(const wifi_mode_t mode) {}
+    void begin(const char *ssid, const char *password) {}
+    wl_status_t status()
+    {
+        return WL_CONNECTED;
+    }
+    bool softAP(const char *ssid, const char *password)
+    {
+        return true;
+    }
+    IPAddress localIP()
+    {
+        return IPAddress();
+    }
+    IPAddress softAPIP()
+    {
+        return IPAddress();
+    }
+};
+
+static WiFiClass WiFi __attribute__((unused));
+
+#endif // HOST_WIFI_H
@@ -0,0 +1,11 @@
+#ifndef HOST_LWIP_SOCKETS_H
+#define HOST_LWIP_SOCKETS_H
+
+// ホストではlwIPの代わりにPOSIXのソケットを使う
+
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+
+#endif // HOST_LWIP_SOCKETS_H
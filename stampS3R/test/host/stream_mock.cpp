@@ -0,0 +1,489 @@
+// 推論ストリームの受信（src/http_stream.cpp・src/use_wifi.cpp）を、ループバックのモックサーバーで試す
+// モックサーバーは接続ごとに決めた応答（ヘッダとボディを区切って送る・途中で止める・切る）を返し、受けたリクエストを残す
+//   - chunked_decode: chunkedのボディを1バイトずつ・数バイトずつ・まとめて送り、httpStreamReadのデコード結果と
+//     終端（トレーラまで読んだら-1）を確かめる。Content-Lengthのボディも同じように読む
+//   - idle_timeout_resume: 1トークン送って止め、トークン間のタイムアウトで切ってから続きのリクエストで再開するか
+//     （再開のリクエストは/api/chatで、ここまでの出力をassistantの発話に入れる）
+//   - max_stream_resume: 毎回doneの前に切り、MAX_STREAM_RESUME回だけ再開して諦めるか
+//   - http_error_no_resume: サーバーからのエラー応答（500）では再開しないか
+// 結果はテストごとに1行のJSONで標準出力に出し、失敗があれば終了コード1で終わる
+// ストリームの1行のパースはファームウェアと同じArduinoJsonを使う（Stringはshim/Arduino.hのもの）
+// idle_timeout_resumeはタイムアウトを待つので数秒かかる
+//
+// ビルドと実行（stampS3R/test/hostで。ArduinoJsonは pio run で取得したものを使う）
+//   g++ -std=gnu++11 -O2 -Wall -pthread -I shim -I ../../src -I ../../.pio/libdeps/m5stack-stamps3/ArduinoJson/src -o stream_mock stream_mock.cpp
+//   ./stream_mock
+
+// shimのStringをArduinoのStringとしてArduinoJsonに読み書きさせる
+#define ARDUINOJSON_ENABLE_ARDUINO_STRING 1
+
+#include "../../src/arena.cpp"
+#include "../../src/backend_tls.cpp"
+#include "../../src/json_fields.cpp"
+#include "../../src/protocol.cpp"
+#include "../../src/http_stream.cpp"
+#include "../../src/use_wifi.cpp"
+
+#include <atomic>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// use_wifi.cppが呼ぶ他のモジュールの代わり
+// 推論はconfigなし（履歴・キャッシュ・読み上げなし）でしか流さないので、設定に関わるものは呼ばれない
+namespace {
+
+std::mutex frames_mutex;
+std::string sent_text;     // Coreへ送ったdeltaをつなげたもの
+uint32_t sent_finishes = 0; // finishのフレームの数
+uint32_t stream_resumes = 0;
+
+} // namespace
+
+String using_model_name = "";
+String current_work_id = "";
+const CRGB COLOR_RUNNING = {0, 0, 0};
+
+bool sendToM5(const ResponseMsg_t &response_msg)
+{
+    std::lock_guard<std::mutex> lock(frames_mutex);
+    sent_text += response_msg.inference_data.delta.c_str();
+    if (response_msg.inference_data.finish)
+    {
+        sent_finishes++;
+    }
+    return true;
+}
+
+void metricsRecordStreamResume()
+{
+    stream_resumes++;
+}
+
+void metricsRecordRequest(const MetricsRequestResult result) {}
+void metricsRecordStream(const uint32_t tokens, const uint32_t ttft_us, const uint32_t total_us) {}
+void metricsRecordBackendConnectFailure() {}
+void perfRecord(const PerfCounterId id, const uint32_t elapsed_us, const size_t bytes) {}
+void perfReportStream(const uint32_t tokens, const uint32_t ttft_us, const uint32_t total_us) {}
+void perfReport() {}
+void powerOnActivity() {}
+void metricsRecordWifiRetry() {}
+void blinkLED(const CRGB &color, const uint8_t &times, const uint16_t &interval_ms, const bool hold) {}
+void led_sayNext_initialize() {}
+void led_sayError_initialize() {}
+void captureRecord(const CaptureChannel channel, const char *data, const size_t length, const char *path) {}
+void captureRecord(const CaptureChannel channel, const String &data, const char *path) {}
+void tts_on_llm_delta(const String &llm_work_id, const String &delta, const bool finish) {}
+void applyLlmWorkOptions(const LlmWorkConfig &config, JsonDocument &request, const uint32_t generated_tokens) {}
+void chatHistoryFit(const LlmWorkConfig &config, const String &prompt) {}
+void chatHistoryAppendMessages(const LlmWorkConfig &config, JsonArray messages) {}
+size_t chatHistoryBytes(const LlmWorkConfig &config)
+{
+    return 0;
+}
+void chatHistoryRecordTurn(const LlmWorkConfig &config, const String &prompt, const String &answer,
+                           const uint32_t prompt_eval_count, const uint32_t eval_count)
+{
+}
+bool semanticCacheLookup(const LlmWorkConfig &config, const String &prompt, String &answer)
+{
+    return false;
+}
+void semanticCacheStore(const LlmWorkConfig &config, const String &answer) {}
+
+namespace {
+
+// 応答の一部。delay_ms待ってからdataを送る
+struct MockSegment
+{
+    std::string data;
+    uint32_t delay_ms;
+};
+
+// 1接続分の応答。送り終えたらholdなら相手が閉じるまで接続を開けたままにし、そうでなければ閉じる
+struct MockResponse
+{
+    std::vector<MockSegment> segments;
+    bool hold;
+};
+
+// 受けたリクエスト
+struct MockRequest
+{
+    std::string request_line;
+    std::string body;
+};
+
+// ループバックで待ち受け、i番目の接続にresponses[i]（足りなければ最後のもの）を返す
+class MockServer
+{
+public:
+    explicit MockServer(const std::vector<MockResponse> &responses) : responses_(responses), stop_(false)
+    {
+        listen_fd_ = socket(AF_INET, SOCK_STREAM, 0);
+        const int reuse = 1;
+        setsockopt(listen_fd_, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+        sockaddr_in address;
+        memset(&address, 0, sizeof(address));
+        address.sin_family = AF_INET;
+        address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        address.sin_port = 0;
+        bind(listen_fd_, reinterpret_cast<sockaddr *>(&address), sizeof(address));
+        listen(listen_fd_, 4);
+        socklen_t length = sizeof(address);
+        getsockname(listen_fd_, reinterpret_cast<sockaddr *>(&address), &length);
+        port_ = ntohs(address.sin_port);
+        thread_ = std::thread(&MockServer::run, this);
+    }
+
+    ~MockServer()
+    {
+        stop_ = true;
+        thread_.join();
+        close(listen_fd_);
+    }
+
+    uint16_t port() const
+    {
+        return port_;
+    }
+
+    std::vector<MockRequest> requests()
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return requests_;
+    }
+
+private:
+    void run()
+    {
+        size_t connection = 0;
+        while (!stop_)
+        {
+            pollfd listening = {listen_fd_, POLLIN, 0};
+            if (poll(&listening, 1, 20) != 1)
+            {
+                continue;
+            }
+            const int fd = accept(listen_fd_, nullptr, nullptr);
+            if (fd < 0)
+            {
+                continue;
+            }
+            const int no_delay = 1;
+            setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &no_delay, sizeof(no_delay));
+            serve(fd, responses_[connection < responses_.size() ? connection : responses_.size() - 1]);
+            connection++;
+            close(fd);
+        }
+    }
+
+    void serve(const int fd, const MockResponse &response)
+    {
+        MockRequest request;
+        if (!readRequest(fd, request))
+        {
+            return;
+        }
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            requests_.push_back(request);
+        }
+        for (const MockSegment &segment : response.segments)
+        {
+            std::this_thread::sleep_for(std::chrono::milliseconds(segment.delay_ms));
+            if (send(fd, segment.data.data(), segment.data.size(), MSG_NOSIGNAL) < 0)
+            {
+                return;
+            }
+        }
+        // 相手が閉じるまで何も送らない（止まったストリーム）
+        while (response.hold && !stop_)
+        {
+            pollfd client = {fd, POLLIN, 0};
+            char c;
+            if (poll(&client, 1, 20) == 1 && recv(fd, &c, 1, 0) <= 0)
+            {
+                return;
+            }
+        }
+    }
+
+    // ヘッダとContent-Length分のボディを読む
+    bool readRequest(const int fd, MockRequest &request)
+    {
+        std::string received;
+        size_t header_end = std::string::npos;
+        size_t content_length = 0;
+        while (header_end == std::string::npos || received.size() < header_end + 4 + content_length)
+        {
+            char buffer[1024];
+            const ssize_t n = recv(fd, buffer, sizeof(buffer), 0);
+            if (n <= 0)
+            {
+                return false;
+            }
+            received.append(buffer, n);
+            if (header_end == std::string::npos && (header_end = received.find("\r\n\r\n")) != std::string::npos)
+            {
+                const size_t field = received.find("Content-Length: ");
+                if (field != std::string::npos && field < header_end)
+                {
+                    content_length = strtoul(received.c_str() + field + 16, nullptr, 10);
+                }
+            }
+        }
+        request.request_line = received.substr(0, received.find("\r\n"));
+        request.body = received.substr(header_end + 4, content_length);
+        return true;
+    }
+
+    std::vector<MockResponse> responses_;
+    std::atomic<bool> stop_;
+    int listen_fd_;
+    uint16_t port_;
+    std::thread thread_;
+    std::mutex mutex_;
+    std::vector<MockRequest> requests_;
+};
+
+const char MOCK_MODEL[] = "mock";
+const char CHUNKED_HEADER[] = "HTTP/1.1 200 OK\r\nContent-Type: application/x-ndjson\r\nTransfer-Encoding: chunked\r\n\r\n";
+
+// chunkedの1チャンク
+std::string encodeChunk(const std::string &data, const char *extension = "")
+{
+    char size_line[32];
+    snprintf(size_line, sizeof(size_line), "%zX%s\r\n", data.size(), extension);
+    return size_line + data + "\r\n";
+}
+
+// bodyをsizesの大きさで順にchunkedにする（sizesを使い切ったら残りを1チャンクにする）
+// 2つ目のチャンクには拡張をつけ、サイズは大文字の16進数にする。最後にトレーラをつける
+std::string encodeChunked(const std::string &body, const std::vector<size_t> &sizes)
+{
+    std::string encoded;
+    size_t offset = 0;
+    for (size_t i = 0; offset < body.size(); i++)
+    {
+        const size_t size = i < sizes.size() && sizes[i] < body.size() - offset ? sizes[i] : body.size() - offset;
+        encoded += encodeChunk(body.substr(offset, size), i == 1 ? ";name=value" : "");
+        offset += size;
+    }
+    return encoded + "0\r\nX-Trailer: ignored\r\n\r\n";
+}
+
+// dataをsegment_sizeバイトずつに分けて送る（0ならまとめて送る）
+std::vector<MockSegment> splitSegments(const std::string &data, const size_t segment_size)
+{
+    std::vector<MockSegment> segments;
+    const size_t step = segment_size > 0 ? segment_size : data.size();
+    for (size_t offset = 0; offset < data.size(); offset += step)
+    {
+        segments.push_back({data.substr(offset, step), segment_size > 0 ? 1U : 0U});
+    }
+    return segments;
+}
+
+std::string streamLine(const char *text, const bool done)
+{
+    std::string line = std::string("{\"model\":\"") + MOCK_MODEL + "\",\"response\":\"" + text + "\",\"done\":" +
+                       (done ? "true,\"prompt_eval_count\":5,\"eval_count\":3,\"eval_duration\":30000000" : "false") + "}\n";
+    return line;
+}
+
+struct TestResult
+{
+    bool ok;
+    size_t connections;
+    unsigned long elapsed_ms;
+    const char *detail;
+};
+
+void printResult(const char *test, const TestResult &result)
+{
+    printf("{\"test\":\"%s\",\"ok\":%s,\"connections\":%lu,\"resumes\":%lu,\"elapsed_ms\":%lu,\"detail\":\"%s\"}\n", test,
+           result.ok ? "true" : "false", static_cast<unsigned long>(result.connections),
+           static_cast<unsigned long>(stream_resumes), result.elapsed_ms, result.detail);
+}
+
+// httpStreamReadで最後まで読む。終端まで読めたら（-1が返ったら）true
+// 0はタイムアウトのほか、chunkedの枠だけを読んだときにも返るので、時間で打ち切る
+bool readBody(HttpStream &http, std::string &body)
+{
+    uint8_t buffer[STREAM_READ_BUFFER_SIZE];
+    const unsigned long start = millis();
+    while (millis() - start < 5000)
+    {
+        const int n = httpStreamRead(http, buffer, sizeof(buffer), 1000);
+        if (n < 0)
+        {
+            return true;
+        }
+        body.append(reinterpret_cast<const char *>(buffer), n);
+    }
+    return false;
+}
+
+// 1つの応答をhttp_streamで受け取り、ボディが一致して終端を認識できたか
+bool receiveMockBody(const std::string &response, const size_t segment_size, const std::string &expected)
+{
+    // 送り終えても閉じないので、-1は終端を読んだときだけ返る
+    MockServer server({{splitSegments(response, segment_size), true}});
+    WiFiClient client;
+    HttpStream http;
+    std::string body;
+    const bool read = httpStreamConnect(http, client, "127.0.0.1", server.port(), 1000) &&
+                      httpStreamSendRequest(http, "POST", "/api/generate", "{}") &&
+                      httpStreamReadResponseHeader(http, 1000) == 200 && readBody(http, body);
+    httpStreamClose(http);
+    return read && body == expected;
+}
+
+TestResult testChunkedDecode()
+{
+    std::string body;
+    for (int i = 0; i < 6; i++)
+    {
+        body += streamLine("こんにちは、世界🌏", false);
+    }
+    body += streamLine("", true);
+    const std::vector<std::vector<size_t>> chunkings = {{1, 2, 3, 5, 8, 13}, {7, 300, 1}, {4096}};
+    const size_t segment_sizes[] = {1, 3, 17, 0};
+
+    const unsigned long start = millis();
+    size_t cases = 0;
+    for (const std::vector<size_t> &sizes : chunkings)
+    {
+        const std::string response = CHUNKED_HEADER + encodeChunked(body, sizes);
+        for (const size_t segment_size : segment_sizes)
+        {
+            cases++;
+            if (!receiveMockBody(response, segment_size, body))
+            {
+                return {false, cases, millis() - start, "chunked body mismatch"};
+            }
+        }
+    }
+    const std::string response = "HTTP/1.1 200 OK\r\nContent-Length: " + std::to_string(body.size()) + "\r\n\r\n" + body;
+    for (const size_t segment_size : segment_sizes)
+    {
+        cases++;
+        if (!receiveMockBody(response, segment_size, body))
+        {
+            return {false, cases, millis() - start, "content-length body mismatch"};
+        }
+    }
+    return {true, cases, millis() - start, ""};
+}
+
+LLM_Status runInference(MockServer &server)
+{
+    host_ollama_port = server.port();
+    OllamaInferenceCommand command;
+    command.model = MOCK_MODEL;
+    command.prompt = "hello";
+    command.work_id = "llm_1";
+    command.object = "";
+    command.config = nullptr;
+    sent_text.clear();
+    sent_finishes = 0;
+    stream_resumes = 0;
+    return llm_inference_streaming(command);
+}
+
+TestResult testIdleTimeoutResume()
+{
+    // 学習済みのトークン間隔（10ms）から、トークン間のタイムアウトは下限のMIN_TOKEN_IDLE_TIMEOUT_MSになる
+    updateCadence(findCadence(MOCK_MODEL), 10.0f, 100.0f);
+    const unsigned long idle_timeout = tokenIdleTimeout(findCadence(MOCK_MODEL), 0);
+    const std::string first = streamLine("こんにちは", false);
+    const std::string rest = streamLine("、世界", false) + streamLine("", true);
+    MockServer server({
+        {{{CHUNKED_HEADER, 0}, {encodeChunk(first), 0}}, true},
+        {{{CHUNKED_HEADER + encodeChunked(rest, {}), 0}}, true},
+    });
+
+    const unsigned long start = millis();
+    const LLM_Status status = runInference(server);
+    const unsigned long elapsed = millis() - start;
+    const std::vector<MockRequest> requests = server.requests();
+    if (status != LLM_OLLAMA_OK)
+    {
+        return {false, requests.size(), elapsed, "inference failed"};
+    }
+    if (requests.size() != 2 || stream_resumes != 1 || elapsed < idle_timeout)
+    {
+        return {false, requests.size(), elapsed, "not resumed once after the idle timeout"};
+    }
+    // 続きは/api/chatで、送った分をassistantの発話として渡す
+    if (requests[1].request_line.find("/api/chat") == std::string::npos ||
+        requests[1].body.find("\"assistant\"") == std::string::npos ||
+        requests[1].body.find("こんにちは") == std::string::npos)
+    {
+        return {false, requests.size(), elapsed, "resume request does not carry the output"};
+    }
+    if (sent_text != "こんにちは、世界" || sent_finishes != 1)
+    {
+        return {false, requests.size(), elapsed, "output sent to Core differs"};
+    }
+    return {true, requests.size(), elapsed, ""};
+}
+
+TestResult testMaxStreamResume()
+{
+    // ヘッダと1行を送ってdoneの前に切る
+    MockServer server({{{{CHUNKED_HEADER + encodeChunk(streamLine("a", false)), 0}}, false}});
+    const unsigned long start = millis();
+    const LLM_Status status = runInference(server);
+    const unsigned long elapsed = millis() - start;
+    const size_t connections = server.requests().size();
+    if (status != LLM_OLLAMA_NOT_OK)
+    {
+        return {false, connections, elapsed, "inference did not fail"};
+    }
+    if (connections != 1U + MAX_STREAM_RESUME || stream_resumes != MAX_STREAM_RESUME)
+    {
+        return {false, connections, elapsed, "resume count differs from MAX_STREAM_RESUME"};
+    }
+    return {true, connections, elapsed, ""};
+}
+
+TestResult testHttpErrorNoResume()
+{
+    MockServer server({{{{"HTTP/1.1 500 Internal Server Error\r\nContent-Length: 0\r\n\r\n", 0}}, false}});
+    const unsigned long start = millis();
+    const LLM_Status status = runInference(server);
+    const unsigned long elapsed = millis() - start;
+    const size_t connections = server.requests().size();
+    if (status != LLM_OLLAMA_NOT_OK || connections != 1 || stream_resumes != 0)
+    {
+        return {false, connections, elapsed, "server error was retried"};
+    }
+    return {true, connections, elapsed, ""};
+}
+
+} // namespace
+
+int main()
+{
+    bool ok = true;
+    const struct
+    {
+        const char *name;
+        TestResult (*run)();
+    } tests[] = {
+        {"chunked_decode", testChunkedDecode},
+        {"idle_timeout_resume", testIdleTimeoutResume},
+        {"max_stream_resume", testMaxStreamResume},
+        {"http_error_no_resume", testHttpErrorNoResume},
+    };
+    for (const auto &test : tests)
+    {
+        const TestResult result = test.run();
+        printResult(test.name, result);
+        ok = ok && result.ok;
+    }
+    return ok ? 0 : 1;
+}